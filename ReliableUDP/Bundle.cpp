@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include "Bundle.h"
+using namespace udpft;
+
+namespace
+{
+	struct Entry
+	{
+		std::string path;           // relative, '/' separated
+		std::filesystem::path file;
+		uint32_t size;
+	};
+
+	bool ByPath(const Entry& a, const Entry& b)
+	{
+		return a.path < b.path;
+	}
+
+	void Put(std::vector<char>& data, const void* value, size_t size)
+	{
+		const char* bytes = (const char*)value;
+		data.insert(data.end(), bytes, bytes + size);
+	}
+
+	// where a path of the bundle goes under directory, empty when it would go anywhere else
+	std::filesystem::path Target(const std::filesystem::path& directory, const std::string& name)
+	{
+		if (!bundle::IsContained(name)) return std::filesystem::path();
+		return directory / std::filesystem::path(name).lexically_normal();
+	}
+}
+
+bool bundle::IsContained(const std::string& name)
+{
+	std::filesystem::path path(name);
+	std::filesystem::path relative = path.lexically_normal();
+	if (relative.empty() || relative == "." || relative.is_absolute() || relative.has_root_name() || relative.has_root_directory())
+	{
+		return false;
+	}
+	// before normalizing too: "a/../b" would go through whatever a is
+	for (std::filesystem::path::iterator part = path.begin(); part != path.end(); ++part)
+	{
+		if (*part == "..") return false;
+	}
+	return true;
+}
+
+bool bundle::Pack(const std::string& directory, std::vector<char>& data)
+{
+	data.clear();
+	std::vector<Entry> entries;
+	std::error_code error;
+	std::filesystem::recursive_directory_iterator itor(directory, error), end;
+	for (; !error && itor != end; itor.increment(error))
+	{
+		Entry entry;
+		entry.file = itor->path();
+		entry.path = entry.file.lexically_relative(directory).generic_string();
+		if (itor->is_directory(error))
+		{
+			if (!std::filesystem::is_empty(entry.file, error)) continue;
+			entry.path += '/';
+			entry.size = 0;
+		}
+		else if (itor->is_regular_file(error))
+		{
+			uintmax_t size = itor->file_size(error);
+			if (error || size > UINT32_MAX) return false;
+			entry.size = (uint32_t)size;
+		}
+		else
+		{
+			continue;
+		}
+		entries.push_back(entry);
+	}
+	if (error) return false;
+	std::sort(entries.begin(), entries.end(), ByPath);
+
+	Header header = { Magic, (uint32_t)entries.size() };
+	Put(data, &header, sizeof(header));
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		EntryHeader entry = { entries[i].size, (uint32_t)entries[i].path.size() };
+		Put(data, &entry, sizeof(entry));
+		Put(data, entries[i].path.data(), entries[i].path.size());
+	}
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].size == 0) continue;
+		size_t offset = data.size();
+		data.resize(offset + entries[i].size);
+		std::ifstream file(entries[i].file, std::ios::binary);
+		file.read(data.data() + offset, entries[i].size);
+		if ((uint32_t)file.gcount() != entries[i].size) return false;
+	}
+	return true;
+}
+
+bool bundle::Unpack(const char* data, size_t size, const std::string& directory)
+{
+	Header header;
+	if (size < sizeof(header)) return false;
+	memcpy(&header, data, sizeof(header));
+	if (header.magic != Magic) return false;
+
+	// the whole manifest is checked before a single file is written
+	std::vector<std::filesystem::path> targets;
+	std::vector<EntryHeader> entries;
+	std::vector<bool> directories;
+	size_t position = sizeof(header);
+	uint64_t contents = 0;
+	for (uint32_t i = 0; i < header.entries; i++)
+	{
+		EntryHeader entry;
+		if (size - position < sizeof(entry)) return false;
+		memcpy(&entry, data + position, sizeof(entry));
+		position += sizeof(entry);
+		if (entry.pathLength == 0 || size - position < entry.pathLength) return false;
+		std::string name(data + position, entry.pathLength);
+		position += entry.pathLength;
+		std::filesystem::path target = Target(directory, name);
+		if (target.empty()) return false;
+		targets.push_back(target);
+		entries.push_back(entry);
+		directories.push_back(name.back() == '/');
+		contents += entry.size;
+	}
+	if (contents != size - position) return false;
+
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (directories[i])
+		{
+			std::filesystem::create_directories(targets[i], error);
+			if (error) return false;
+			continue;
+		}
+		std::filesystem::create_directories(targets[i].parent_path(), error);
+		// a hard link to the file is replaced, not written through
+		std::filesystem::remove(targets[i], error);
+		std::ofstream file(targets[i], std::ios::binary);
+		file.write(data + position, entries[i].size);
+		file.close();
+		if (file.fail()) return false;
+		position += entries[i].size;
+	}
+	return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace udpft
+{
+    // a directory moved as one file. a manifest of the files in it comes first,
+    // then their contents back to back, so a small file shares its chunk with
+    // the next instead of costing a transfer of its own. the files are in path
+    // order, the same directory always bundles the same: an old copy of it on the
+    // other end makes a good basis for a delta.
+    namespace bundle
+    {
+        const uint32_t Magic = 0x42544655; // "UFTB"
+
+        // manifest: magic and entry count, then per entry its size and the
+        // length of its path, then the path with '/' separators. a path ending
+        // in '/' is an empty directory, it has no contents.
+#pragma pack(push, 4)
+        struct Header {
+            uint32_t magic;
+            uint32_t entries;
+        };
+        struct EntryHeader {
+            uint32_t size;
+            uint32_t pathLength;
+        };
+#pragma pack(pop)
+
+        // name is a relative path that stays under whatever directory it is
+        // taken from: the directory itself, absolute paths and ".." are refused
+        bool IsContained(const std::string& name);
+
+        // bundle the files under directory, false when one can't be read
+        bool Pack(const std::string& directory, std::vector<char>& data);
+
+        // write the files of a bundle under directory. false on a malformed
+        // bundle, a path that would land outside directory, or a write error.
+        bool Unpack(const char* data, size_t size, const std::string& directory);
+    }
+}
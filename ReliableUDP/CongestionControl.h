@@ -0,0 +1,477 @@
+/*
+	Model based congestion control for the sending end of a connection
+*/
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include <assert.h>
+#include <random>
+
+namespace net
+{
+	// what the ack of one packet says about the path, see ReliabilitySystem::GetDeliverySamples
+	//  + rate is the bytes delivered between the packet's send and its ack over the time that took,
+	//    the longer of the send and ack intervals, so a burst of acks doesn't pass for a fast path
+	//  + a packet sent while the sender had nothing to send is app limited, its rate says how fast
+	//    the application was, not the path
+
+	struct DeliverySample
+	{
+		int size;							// bytes of the acked packet
+		float rate;							// bytes per second, 0 when the interval was too short to tell
+		float rtt;							// seconds from the packet's send to its ack
+		unsigned long long delivered;		// bytes acked up to and including this packet
+		unsigned long long prior_delivered;	// bytes acked when the packet was sent
+		bool app_limited;
+	};
+
+	// congestion controller of a sender
+	//  + fed the delivery samples and losses of its connection, it answers how fast to send and how much may be in flight
+	//  + the sender paces packets at GetPacingRate and holds back while GetCongestionWindow bytes are unacked
+
+	class CongestionControl
+	{
+	public:
+
+		virtual ~CongestionControl() {}
+
+		virtual void Reset() = 0;
+
+		// samples of the packets acked since the last call, bytes in flight once they are taken off
+
+		virtual void OnAcked( const DeliverySample * samples, int count, int bytesInFlight ) = 0;
+
+		virtual void OnLost( int packets ) = 0;
+
+		virtual void Update( float deltaTime ) = 0;
+
+		virtual float GetPacingRate() const = 0;		// bytes per second
+		virtual int GetCongestionWindow() const = 0;	// bytes
+	};
+
+	// running maximum over a window, after the three sample filter of Kathleen Nichols used by BBR.
+	// keeps the best, second best and third best samples of successive thirds of the window, O(1) per sample
+
+	class MaxFilter
+	{
+	public:
+
+		MaxFilter()
+		{
+			Reset( 0.0f, 0 );
+		}
+
+		void Reset( float value, unsigned int time )
+		{
+			for ( int i = 0; i < 3; ++i )
+			{
+				samples[i].value = value;
+				samples[i].time = time;
+			}
+		}
+
+		float Update( float value, unsigned int time, unsigned int window )
+		{
+			const Sample sample = { value, time };
+			if ( value >= samples[0].value || time - samples[2].time > window )
+			{
+				Reset( value, time );
+				return value;
+			}
+			if ( value >= samples[1].value )
+				samples[2] = samples[1] = sample;
+			else if ( value >= samples[2].value )
+				samples[2] = sample;
+
+			// the best sample aged out of the window, or the others went unreplaced for a quarter or half of it
+			const unsigned int age = time - samples[0].time;
+			if ( age > window )
+			{
+				samples[0] = samples[1];
+				samples[1] = samples[2];
+				samples[2] = sample;
+				if ( time - samples[0].time > window )
+				{
+					samples[0] = samples[1];
+					samples[1] = samples[2];
+					samples[2] = sample;
+				}
+			}
+			else if ( samples[1].time == samples[0].time && age > window / 4 )
+				samples[2] = samples[1] = sample;
+			else if ( samples[2].time == samples[1].time && age > window / 2 )
+				samples[2] = sample;
+			return samples[0].value;
+		}
+
+		float Get() const
+		{
+			return samples[0].value;
+		}
+
+	private:
+
+		struct Sample
+		{
+			float value;
+			unsigned int time;
+		};
+
+		Sample samples[3];
+	};
+
+	// BBR congestion control
+	//  + models the path by its bottleneck bandwidth, the most delivered per second over the last ten round trips,
+	//    and its propagation delay, the least round trip time over the last ten seconds
+	//  + paces at the bandwidth times a gain and keeps about two bandwidth delay products in flight, so the pipe
+	//    stays full without a standing queue at the bottleneck
+	//  + a little loss is not a signal, the parity covers it. a round that loses more than LossThreshold of its
+	//    packets overflowed a buffer shallower than the window, as in BBRv2 the window is capped below what was in
+	//    flight and the cap lifted again a quarter per round that doesn't
+	//  + startup doubles the rate every round until the bandwidth stops growing, drain then empties the queue that
+	//    built up. probe bandwidth cycles the gain around one to find more bandwidth and give it back if there is none,
+	//    probe rtt shrinks the window to a few packets for a moment every ten seconds to measure the delay afresh
+
+	class BbrCongestionControl : public CongestionControl
+	{
+	public:
+
+		enum Mode
+		{
+			Startup,
+			Drain,
+			ProbeBandwidth,
+			ProbeRtt
+		};
+
+		// packetSize is the size of a full packet on the wire, the window never goes below MinimumPackets of them
+
+		BbrCongestionControl( int packetSize = 1472 )
+			: generator( std::random_device{}() )
+		{
+			assert( packetSize > 0 );
+			this->packetSize = packetSize;
+			Reset();
+		}
+
+		void Reset()
+		{
+			mode = Startup;
+			clock = 0.0;
+			bandwidth.Reset( 0.0f, 0 );
+			minRtt = 0.0f;
+			minRttStamp = 0.0;
+			round = 0;
+			nextRoundDelivered = 0;
+			roundStart = false;
+			delivered = 0;
+			fullBandwidth = 0.0f;
+			fullBandwidthCount = 0;
+			filledPipe = false;
+			cycleIndex = 0;
+			cycleStamp = 0.0;
+			probeRttDone = 0.0;
+			probeRttRoundDone = false;
+			priorWindow = 0;
+			lostInRound = 0;
+			ackedInRound = 0;
+			inflightHigh = 0;
+			pacingGain = HighGain;
+			windowGain = HighGain;
+			pacingRate = HighGain * InitialPackets * packetSize / InitialRtt;
+			window = InitialPackets * packetSize;
+		}
+
+		void OnAcked( const DeliverySample * samples, int count, int bytesInFlight )
+		{
+			if ( count <= 0 )
+				return;
+			roundStart = false;
+			int acked = 0;
+			bool appLimited = false;
+			const bool rttExpired = clock > minRttStamp + MinRttWindow;
+			for ( int i = 0; i < count; ++i )
+			{
+				const DeliverySample & sample = samples[i];
+				acked += sample.size;
+				delivered = sample.delivered;
+				appLimited = sample.app_limited;
+
+				// a round trip ends with the ack of a packet sent after the round began
+				if ( sample.prior_delivered >= nextRoundDelivered )
+				{
+					nextRoundDelivered = sample.delivered;
+					round++;
+					roundStart = true;
+					CheckLoss();
+				}
+				ackedInRound++;
+
+				// an app limited rate only counts when it beats the estimate anyway
+				if ( sample.rate > 0.0f && ( !sample.app_limited || sample.rate >= bandwidth.Get() ) )
+					bandwidth.Update( sample.rate, round, BandwidthRounds );
+
+				if ( sample.rtt > 0.0f && ( minRtt == 0.0f || sample.rtt <= minRtt || clock > minRttStamp + MinRttWindow ) )
+				{
+					minRtt = sample.rtt;
+					minRttStamp = clock;
+				}
+			}
+
+			CheckFullPipe( appLimited );
+			CheckDrain( bytesInFlight );
+			UpdateCycle( bytesInFlight );
+			CheckProbeRtt( rttExpired, bytesInFlight );
+			SetPacingRate();
+			SetWindow( acked );
+		}
+
+		void OnLost( int packets )
+		{
+			lostInRound += packets;
+		}
+
+		void Update( float deltaTime )
+		{
+			clock += deltaTime;
+		}
+
+		float GetPacingRate() const
+		{
+			return pacingRate;
+		}
+
+		int GetCongestionWindow() const
+		{
+			return window;
+		}
+
+		Mode GetMode() const
+		{
+			return mode;
+		}
+
+		float GetBandwidth() const
+		{
+			return bandwidth.Get();
+		}
+
+		float GetMinRtt() const
+		{
+			return minRtt;
+		}
+
+	private:
+
+		// bytes the path holds at the estimated bandwidth and delay, times the gain
+
+		int GetTarget( float gain ) const
+		{
+			if ( minRtt == 0.0f || bandwidth.Get() == 0.0f )
+				return InitialPackets * packetSize;
+			const int minimum = MinimumPackets * packetSize;
+			const float target = gain * bandwidth.Get() * minRtt;
+			return target > minimum ? (int) target : minimum;
+		}
+
+		// at the end of a round, what it lost says whether a buffer overflowed. startup ends on it too,
+		// the bandwidth is what got through
+
+		void CheckLoss()
+		{
+			const int total = lostInRound + ackedInRound;
+			if ( total >= MinimumPackets && lostInRound > LossThreshold * total )
+			{
+				const int cap = (int) ( window * LossBeta );
+				inflightHigh = cap > MinimumPackets * packetSize ? cap : MinimumPackets * packetSize;
+				filledPipe = true;
+			}
+			else if ( inflightHigh > 0 )
+			{
+				inflightHigh += inflightHigh / 4;
+				if ( inflightHigh >= GetTarget( windowGain ) )
+					inflightHigh = 0;
+			}
+			lostInRound = 0;
+			ackedInRound = 0;
+		}
+
+		// the pipe is full once three rounds in a row have not grown the bandwidth by a quarter
+
+		void CheckFullPipe( bool appLimited )
+		{
+			if ( filledPipe || !roundStart || appLimited )
+				return;
+			if ( bandwidth.Get() >= fullBandwidth * 1.25f )
+			{
+				fullBandwidth = bandwidth.Get();
+				fullBandwidthCount = 0;
+				return;
+			}
+			if ( ++fullBandwidthCount >= 3 )
+				filledPipe = true;
+		}
+
+		void CheckDrain( int bytesInFlight )
+		{
+			if ( mode == Startup && filledPipe )
+			{
+				mode = Drain;
+				pacingGain = 1.0f / HighGain;
+				windowGain = HighGain;
+			}
+			if ( mode == Drain && bytesInFlight <= GetTarget( 1.0f ) )
+				EnterProbeBandwidth();
+		}
+
+		void EnterProbeBandwidth()
+		{
+			mode = ProbeBandwidth;
+			windowGain = 2.0f;
+			// any phase but the one that drains, so the senders sharing a path don't probe in step
+			cycleIndex = CycleLength - 1 - (int) ( generator() % ( CycleLength - 1 ) );
+			AdvanceCycle();
+		}
+
+		void AdvanceCycle()
+		{
+			cycleIndex = ( cycleIndex + 1 ) % CycleLength;
+			cycleStamp = clock;
+			static const float gains[CycleLength] = { 1.25f, 0.75f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
+			pacingGain = gains[cycleIndex];
+		}
+
+		// a phase lasts a round trip. probing up goes on until the extra is in flight,
+		// draining stops early once the queue it left is gone
+
+		void UpdateCycle( int bytesInFlight )
+		{
+			if ( mode != ProbeBandwidth )
+				return;
+			const bool elapsed = clock - cycleStamp > minRtt;
+			if ( pacingGain > 1.0f )
+			{
+				if ( elapsed && bytesInFlight >= GetTarget( pacingGain ) )
+					AdvanceCycle();
+			}
+			else if ( pacingGain < 1.0f )
+			{
+				if ( elapsed || bytesInFlight <= GetTarget( 1.0f ) )
+					AdvanceCycle();
+			}
+			else if ( elapsed )
+				AdvanceCycle();
+		}
+
+		void CheckProbeRtt( bool rttExpired, int bytesInFlight )
+		{
+			if ( mode != ProbeRtt && rttExpired )
+			{
+				mode = ProbeRtt;
+				pacingGain = 1.0f;
+				windowGain = 1.0f;
+				priorWindow = window;
+				probeRttDone = 0.0;
+			}
+			if ( mode != ProbeRtt )
+				return;
+			// the window stays at the minimum for ProbeRttTime and a round trip once what was in flight has drained
+			if ( probeRttDone == 0.0 && bytesInFlight <= MinimumPackets * packetSize )
+			{
+				probeRttDone = clock + ProbeRttTime;
+				probeRttRoundDone = false;
+				nextRoundDelivered = delivered;
+			}
+			else if ( probeRttDone != 0.0 )
+			{
+				if ( roundStart )
+					probeRttRoundDone = true;
+				if ( probeRttRoundDone && clock > probeRttDone )
+				{
+					minRttStamp = clock;
+					if ( window < priorWindow )
+						window = priorWindow;
+					if ( filledPipe )
+						EnterProbeBandwidth();
+					else
+					{
+						mode = Startup;
+						pacingGain = HighGain;
+						windowGain = HighGain;
+					}
+				}
+			}
+		}
+
+		// startup only ever speeds up, the first samples come from a window that was a guess
+
+		void SetPacingRate()
+		{
+			if ( bandwidth.Get() == 0.0f )
+				return;
+			const float rate = pacingGain * bandwidth.Get();
+			if ( filledPipe || rate > pacingRate )
+				pacingRate = rate;
+		}
+
+		// the window grows by what was acked up to its target, and only shrinks to it once the pipe is full
+
+		void SetWindow( int acked )
+		{
+			if ( mode == ProbeRtt )
+			{
+				window = MinimumPackets * packetSize;
+				return;
+			}
+			const int target = GetTarget( windowGain );
+			if ( filledPipe )
+				window = window + acked < target ? window + acked : target;
+			else if ( window < target || delivered < (unsigned long long) ( InitialPackets * packetSize ) )
+				window += acked;
+			if ( inflightHigh > 0 && window > inflightHigh )
+				window = inflightHigh;
+			if ( window < MinimumPackets * packetSize )
+				window = MinimumPackets * packetSize;
+		}
+
+		static constexpr float HighGain = 2.885f;		// 2 / ln 2, doubles the rate every round trip
+		static constexpr float InitialRtt = 0.1f;		// seconds assumed before the first sample
+		static constexpr double MinRttWindow = 10.0;	// seconds a min rtt holds before it is measured again
+		static constexpr double ProbeRttTime = 0.2;
+		static constexpr float LossThreshold = 0.1f;	// share of a round's packets lost that means a buffer overflowed
+		static constexpr float LossBeta = 0.7f;			// what is left of the window after such a round
+		enum { InitialPackets = 10 };
+		enum { MinimumPackets = 4 };
+		enum { BandwidthRounds = 10 };
+		enum { CycleLength = 8 };
+
+		int packetSize;
+		Mode mode;
+		double clock;						// seconds of updates
+		MaxFilter bandwidth;				// bytes per second, over rounds
+		float minRtt;						// seconds, 0 until the first sample
+		double minRttStamp;					// clock when min rtt was last measured
+		unsigned int round;					// round trips counted
+		unsigned long long nextRoundDelivered;	// delivered when the current round trip ends
+		bool roundStart;					// the last acks began a round trip
+		unsigned long long delivered;		// bytes acked so far
+		float fullBandwidth;				// bandwidth when it last grew by a quarter in startup
+		int fullBandwidthCount;				// rounds since
+		bool filledPipe;
+		int cycleIndex;
+		double cycleStamp;					// clock when the gain phase began
+		double probeRttDone;				// clock probe rtt may end at, 0 until in flight is down to the minimum
+		bool probeRttRoundDone;
+		int priorWindow;					// window before probe rtt, restored after it
+		int lostInRound;					// packets
+		int ackedInRound;					// packets
+		int inflightHigh;					// cap on the window after a lossy round, 0 for none
+		float pacingGain;
+		float windowGain;
+		float pacingRate;
+		int window;
+		std::minstd_rand generator;
+	};
+}
+
+#endif
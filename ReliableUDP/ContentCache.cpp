@@ -0,0 +1,118 @@
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "ContentCache.h"
+using namespace udpft;
+
+namespace
+{
+	struct Entry
+	{
+		std::string hash;
+		uint64_t size;
+		std::string path;
+	};
+
+	std::string Hex(const unsigned char hash[Sha256Size])
+	{
+		char text[2 * Sha256Size + 1];
+		for (int i = 0; i < Sha256Size; i++)
+		{
+			snprintf(text + 2 * i, 3, "%02x", hash[i]);
+		}
+		return std::string(text, 2 * Sha256Size);
+	}
+
+	void ReadIndex(const std::string& indexPath, std::vector<Entry>& entries)
+	{
+		entries.clear();
+		std::ifstream index(indexPath);
+		std::string line;
+		while (std::getline(index, line))
+		{
+			// hash, size, then the path to the end of the line: it may have spaces
+			std::istringstream fields(line);
+			Entry entry;
+			if (!(fields >> entry.hash >> entry.size) || entry.hash.size() != 2 * Sha256Size) continue;
+			std::getline(fields >> std::ws, entry.path);
+			if (!entry.path.empty()) entries.push_back(entry);
+		}
+	}
+
+	// the file at path is still what the index says it is
+	bool Holds(const std::string& path, const std::string& hash, uint64_t size)
+	{
+		std::error_code error;
+		if (std::filesystem::file_size(path, error) != size || error) return false;
+		std::vector<unsigned char> data((size_t)size);
+		std::ifstream file(path, std::ios::binary);
+		file.read((char*)data.data(), data.size());
+		if ((uint64_t)file.gcount() != size) return false;
+		unsigned char digest[Sha256Size];
+		Sha256(data.data(), data.size(), digest);
+		return Hex(digest) == hash;
+	}
+}
+
+ContentCache::ContentCache()
+{
+	indexPath = DefaultCacheIndex;
+}
+
+ContentCache::ContentCache(const std::string& index)
+{
+	indexPath = index;
+}
+
+std::string ContentCache::Find(const unsigned char hash[Sha256Size], uint64_t size) const
+{
+	std::vector<Entry> entries;
+	ReadIndex(indexPath, entries);
+	std::string wanted = Hex(hash);
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].hash == wanted && entries[i].size == size && Holds(entries[i].path, wanted, size))
+		{
+			return entries[i].path;
+		}
+	}
+	return std::string();
+}
+
+void ContentCache::Add(const unsigned char hash[Sha256Size], uint64_t size, const std::string& path)
+{
+	std::error_code error;
+	std::string absolute = std::filesystem::absolute(path, error).string();
+	if (error) return;
+	std::vector<Entry> entries;
+	ReadIndex(indexPath, entries);
+
+	// rewritten whole, through a temporary file so a crash leaves the old index
+	std::string tempPath = indexPath + ".tmp";
+	std::ofstream index(tempPath);
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (entries[i].path == absolute) continue;
+		index << entries[i].hash << ' ' << entries[i].size << ' ' << entries[i].path << '\n';
+	}
+	index << Hex(hash) << ' ' << size << ' ' << absolute << '\n';
+	index.close();
+	if (index.fail()) return;
+	std::filesystem::rename(tempPath, indexPath, error);
+}
+
+bool ContentCache::Link(const std::string& cached, const std::string& target)
+{
+	std::error_code error;
+	if (std::filesystem::equivalent(cached, target, error)) return true;
+	std::filesystem::remove(target, error);
+	error.clear();
+	std::filesystem::create_hard_link(cached, target, error);
+	if (!error) return true;
+	// another volume, or a file system without links
+	error.clear();
+	std::filesystem::copy_file(cached, target, std::filesystem::copy_options::overwrite_existing, error);
+	return !error;
+}
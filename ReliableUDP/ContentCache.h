@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "Sha256.h"
+
+namespace udpft
+{
+    const std::string DefaultCacheIndex = "received.index";
+
+    /*
+    * the files a receiver has, by the SHA-256 of their contents. the index is a
+    * text file, a line per file: the hash in hex, the size, the path. nothing in
+    * it is trusted, a file found is hashed again before it is used, so files
+    * moved or changed since only cost a normal transfer.
+    */
+    class ContentCache
+    {
+    public:
+        ContentCache();
+        explicit ContentCache(const std::string& index);
+
+        // path of a file with these contents, empty when there is none
+        std::string Find(const unsigned char hash[Sha256Size], uint64_t size) const;
+
+        // path holds these contents now, whatever the index said about it before
+        void Add(const unsigned char hash[Sha256Size], uint64_t size, const std::string& path);
+
+        // make target the same file as cached: a hard link, or a copy where
+        // the file system has none. target is replaced if it exists.
+        static bool Link(const std::string& cached, const std::string& target);
+
+    private:
+        std::string indexPath;
+    };
+}
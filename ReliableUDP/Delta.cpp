@@ -0,0 +1,206 @@
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
+#include "Delta.h"
+#include "Sha256.h"
+using namespace udpft;
+
+namespace
+{
+	void StrongHash(const unsigned char* data, size_t length, uint32_t strong[2])
+	{
+		unsigned char digest[Sha256Size];
+		Sha256(data, length, digest);
+		memcpy(strong, digest, 2 * sizeof(uint32_t));
+	}
+
+	/*
+	* rsync's rolling checksum: a is the sum of the bytes, b the sum of each byte
+	* times its distance from the end, both mod 2^16. sliding the window one
+	* byte on takes constant time.
+	*/
+	struct RollingChecksum
+	{
+		uint32_t a;
+		uint32_t b;
+		uint32_t length;
+
+		RollingChecksum(const unsigned char* data, uint32_t size)
+		{
+			a = 0;
+			b = 0;
+			length = size;
+			for (uint32_t i = 0; i < size; i++)
+			{
+				a += data[i];
+				b += (size - i) * data[i];
+			}
+		}
+
+		void Roll(unsigned char out, unsigned char in)
+		{
+			a += in - out;
+			b += a - length * out;
+		}
+
+		uint32_t Value() const
+		{
+			return (a & 0xffff) | (b << 16);
+		}
+	};
+
+	void PutInteger(std::vector<char>& delta, uint32_t value)
+	{
+		size_t end = delta.size();
+		delta.resize(end + sizeof(value));
+		memcpy(delta.data() + end, &value, sizeof(value));
+	}
+
+	void PutCopy(std::vector<char>& delta, uint32_t first, uint32_t count)
+	{
+		if (count == 0) return;
+		delta.push_back((char)delta::CopyTag);
+		PutInteger(delta, first);
+		PutInteger(delta, count);
+	}
+
+	void PutLiteral(std::vector<char>& delta, const unsigned char* data, size_t length)
+	{
+		if (length == 0) return;
+		delta.push_back((char)delta::LiteralTag);
+		PutInteger(delta, (uint32_t)length);
+		delta.insert(delta.end(), data, data + length);
+	}
+}
+
+uint32_t delta::BlockSize(size_t fileSize)
+{
+	uint32_t size = (uint32_t)sqrt((double)fileSize) & ~7u;
+	if (size < MinBlockSize) size = MinBlockSize;
+	if (size > MaxBlockSize) size = MaxBlockSize;
+	return size;
+}
+
+void delta::Signatures(const unsigned char* data, size_t length, uint32_t blockSize,
+	std::vector<BlockSignature>& signatures)
+{
+	signatures.resize(length / blockSize);
+	for (size_t i = 0; i < signatures.size(); i++)
+	{
+		const unsigned char* block = data + i * blockSize;
+		signatures[i].weak = RollingChecksum(block, blockSize).Value();
+		StrongHash(block, blockSize, signatures[i].strong);
+	}
+}
+
+void delta::Encode(const unsigned char* target, size_t length, uint32_t blockSize,
+	const std::vector<BlockSignature>& signatures, std::vector<char>& delta)
+{
+	delta.clear();
+	std::unordered_multimap<uint32_t, uint32_t> blocks; // weak checksum -> block
+	for (size_t i = 0; i < signatures.size(); i++)
+	{
+		blocks.insert(std::make_pair(signatures[i].weak, (uint32_t)i));
+	}
+
+	size_t literal = 0;         // start of the bytes no block matched yet
+	uint32_t copyFirst = 0;     // run of consecutive blocks matched, not written yet
+	uint32_t copyCount = 0;
+	size_t position = 0;
+	if (length < blockSize || blocks.empty())
+	{
+		PutLiteral(delta, target, length);
+		return;
+	}
+	RollingChecksum rolling(target, blockSize);
+	while (position + blockSize <= length)
+	{
+		// the strong hash only for the few offsets the weak checksum lets through
+		int match = -1;
+		bool hashed = false;
+		uint32_t strong[2];
+		typedef std::unordered_multimap<uint32_t, uint32_t>::const_iterator Iterator;
+		std::pair<Iterator, Iterator> candidates = blocks.equal_range(rolling.Value());
+		for (Iterator itor = candidates.first; itor != candidates.second && match < 0; ++itor)
+		{
+			if (!hashed)
+			{
+				StrongHash(target + position, blockSize, strong);
+				hashed = true;
+			}
+			const BlockSignature& signature = signatures[itor->second];
+			if (signature.strong[0] == strong[0] && signature.strong[1] == strong[1])
+			{
+				match = (int)itor->second;
+			}
+		}
+
+		if (match >= 0)
+		{
+			if (position > literal || copyFirst + copyCount != (uint32_t)match)
+			{
+				PutCopy(delta, copyFirst, copyCount);
+				PutLiteral(delta, target + literal, position - literal);
+				copyFirst = match;
+				copyCount = 0;
+			}
+			copyCount++;
+			position += blockSize;
+			literal = position;
+			if (position + blockSize <= length)
+			{
+				rolling = RollingChecksum(target + position, blockSize);
+			}
+			continue;
+		}
+		if (position + blockSize < length)
+		{
+			rolling.Roll(target[position], target[position + blockSize]);
+		}
+		position++;
+	}
+	PutCopy(delta, copyFirst, copyCount);
+	PutLiteral(delta, target + literal, length - literal);
+}
+
+size_t delta::MaxSize(size_t length, uint32_t blockSize)
+{
+	size_t headers = 1 + 2 * sizeof(uint32_t) + 1 + sizeof(uint32_t);
+	return length + headers * (length / blockSize + 1);
+}
+
+bool delta::Apply(const unsigned char* basis, size_t basisLength, uint32_t blockSize,
+	const unsigned char* delta, size_t deltaLength, std::vector<char>& target)
+{
+	target.clear();
+	size_t position = 0;
+	while (position < deltaLength)
+	{
+		unsigned char tag = delta[position++];
+		if (tag == CopyTag && position + 2 * sizeof(uint32_t) <= deltaLength)
+		{
+			uint32_t first, count;
+			memcpy(&first, delta + position, sizeof(first));
+			memcpy(&count, delta + position + sizeof(first), sizeof(count));
+			position += 2 * sizeof(uint32_t);
+			size_t offset = (size_t)first * blockSize;
+			size_t bytes = (size_t)count * blockSize;
+			if (offset > basisLength || bytes > basisLength - offset) return false;
+			target.insert(target.end(), basis + offset, basis + offset + bytes);
+		}
+		else if (tag == LiteralTag && position + sizeof(uint32_t) <= deltaLength)
+		{
+			uint32_t bytes;
+			memcpy(&bytes, delta + position, sizeof(bytes));
+			position += sizeof(bytes);
+			if (bytes > deltaLength - position) return false;
+			target.insert(target.end(), delta + position, delta + position + bytes);
+			position += bytes;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
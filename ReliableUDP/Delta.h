@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace udpft
+{
+    // rsync style delta of a file against an older copy on the other end.
+    // the old copy is cut into blocks, each described by a weak rolling checksum
+    // and a strong hash. the new file is then scanned at every byte offset for
+    // blocks the old copy has, what matches goes as a copy of blocks, the rest
+    // as literal bytes.
+    namespace delta
+    {
+        const int MinBlockSize = 512;
+        const int MaxBlockSize = 65536;
+
+        // delta instructions, each a tag then two or one uint32
+        const unsigned char CopyTag = 1;    // first block, block count
+        const unsigned char LiteralTag = 2; // length, then the bytes
+
+#pragma pack(push, 4)
+        struct BlockSignature {
+            uint32_t weak;
+            uint32_t strong[2];     // first 8 bytes of the SHA-256 of the block
+        };
+#pragma pack(pop)
+
+        // about the square root of the file size, as rsync does
+        uint32_t BlockSize(size_t fileSize);
+
+        // signatures of the whole blocks of data, a short last block has none
+        void Signatures(const unsigned char* data, size_t length, uint32_t blockSize,
+            std::vector<BlockSignature>& signatures);
+
+        // the delta turning the copy with these signatures into target
+        void Encode(const unsigned char* target, size_t length, uint32_t blockSize,
+            const std::vector<BlockSignature>& signatures, std::vector<char>& delta);
+
+        // the longest a delta of a target of length bytes gets: the target as
+        // literals, with a copy and a literal header for each block matched
+        size_t MaxSize(size_t length, uint32_t blockSize);
+
+        // rebuild the target from the old copy and a delta, false on a malformed delta
+        bool Apply(const unsigned char* basis, size_t basisLength, uint32_t blockSize,
+            const unsigned char* delta, size_t deltaLength, std::vector<char>& target);
+    }
+}
@@ -0,0 +1,189 @@
+#include <cstring>
+#include <vector>
+#include "FEC.h"
+using namespace udpft;
+
+namespace
+{
+	/*
+	* GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, built once.
+	* the full multiplication table keeps the inner loops to one lookup per byte.
+	*/
+	struct GaloisField
+	{
+		unsigned char exp[512];
+		unsigned char log[256];
+		unsigned char mul[256][256];
+
+		GaloisField()
+		{
+			int x = 1;
+			for (int i = 0; i < 255; i++)
+			{
+				exp[i] = (unsigned char)x;
+				log[x] = (unsigned char)i;
+				x <<= 1;
+				if (x & 0x100) x ^= 0x11d;
+			}
+			for (int i = 255; i < 512; i++)
+			{
+				exp[i] = exp[i - 255];
+			}
+			log[0] = 0;
+			for (int a = 0; a < 256; a++)
+			{
+				for (int b = 0; b < 256; b++)
+				{
+					mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+				}
+			}
+		}
+
+		unsigned char Inverse(unsigned char a) const
+		{
+			return exp[255 - log[a]];
+		}
+	};
+
+	const GaloisField& Field()
+	{
+		static const GaloisField field;
+		return field;
+	}
+
+	// parity += c * chunk, for a chunk of length bytes
+	void MultiplyAdd(unsigned char* parity, const unsigned char* chunk, size_t length, unsigned char c)
+	{
+		if (c == 0) return;
+		if (c == 1)
+		{
+			for (size_t i = 0; i < length; i++) parity[i] ^= chunk[i];
+			return;
+		}
+		const unsigned char* row = Field().mul[c];
+		for (size_t i = 0; i < length; i++) parity[i] ^= row[chunk[i]];
+	}
+}
+
+/*
+* Cauchy matrix 1 / (x_row ^ y_column) with x_row = FecGroupSize + row and y_column = column,
+* each column divided by its row 0 entry. scaling columns keeps every square
+* submatrix invertible, so any FecGroupSize chunks of a group are enough.
+*/
+unsigned char fec::Coefficient(int row, int column)
+{
+	const GaloisField& gf = Field();
+	unsigned char cauchy = gf.Inverse((unsigned char)((FecGroupSize + row) ^ column));
+	unsigned char first = (unsigned char)(FecGroupSize ^ column);
+	return gf.mul[cauchy][first];
+}
+
+void fec::EncodeParity(int row, const unsigned char* data, size_t length,
+	int count, size_t size, unsigned char* parity)
+{
+	memset(parity, 0, size);
+	for (int column = 0; column < count; column++)
+	{
+		size_t offset = column * size;
+		if (offset >= length) break;
+		size_t chunkLength = length - offset < size ? length - offset : size;
+		MultiplyAdd(parity, data + offset, chunkLength, Coefficient(row, column));
+	}
+}
+
+bool fec::Recover(unsigned char* data, const bool present[], int count, size_t size,
+	const unsigned char* const parity[], const int rows[], int parityCount)
+{
+	const GaloisField& gf = Field();
+	int missing[FecGroupSize];
+	int missingCount = 0;
+	for (int column = 0; column < count; column++)
+	{
+		if (!present[column]) missing[missingCount++] = column;
+	}
+	if (missingCount == 0) return true;
+	if (missingCount > parityCount || count > FecGroupSize) return false;
+
+	// the parity left once the chunks we have are taken out of it,
+	// written into the missing chunks for now
+	for (int r = 0; r < missingCount; r++)
+	{
+		unsigned char* syndrome = data + missing[r] * size;
+		memcpy(syndrome, parity[r], size);
+		for (int column = 0; column < count; column++)
+		{
+			if (present[column])
+			{
+				MultiplyAdd(syndrome, data + column * size, size, Coefficient(rows[r], column));
+			}
+		}
+	}
+	if (missingCount == 1)
+	{
+		// one chunk lost, no matrix to invert
+		unsigned char c = gf.Inverse(Coefficient(rows[0], missing[0]));
+		unsigned char* chunk = data + missing[0] * size;
+		for (size_t i = 0; i < size; i++) chunk[i] = gf.mul[c][chunk[i]];
+		return true;
+	}
+
+	// invert the coefficients of the missing chunks with Gauss-Jordan elimination
+	unsigned char matrix[MaxParityChunks][MaxParityChunks];
+	unsigned char inverse[MaxParityChunks][MaxParityChunks];
+	for (int r = 0; r < missingCount; r++)
+	{
+		for (int c = 0; c < missingCount; c++)
+		{
+			matrix[r][c] = Coefficient(rows[r], missing[c]);
+			inverse[r][c] = (r == c) ? 1 : 0;
+		}
+	}
+	for (int c = 0; c < missingCount; c++)
+	{
+		int pivot = c;
+		while (pivot < missingCount && matrix[pivot][c] == 0) pivot++;
+		if (pivot == missingCount) return false;
+		if (pivot != c)
+		{
+			for (int k = 0; k < missingCount; k++)
+			{
+				unsigned char t = matrix[c][k]; matrix[c][k] = matrix[pivot][k]; matrix[pivot][k] = t;
+				t = inverse[c][k]; inverse[c][k] = inverse[pivot][k]; inverse[pivot][k] = t;
+			}
+		}
+		unsigned char scale = gf.Inverse(matrix[c][c]);
+		for (int k = 0; k < missingCount; k++)
+		{
+			matrix[c][k] = gf.mul[scale][matrix[c][k]];
+			inverse[c][k] = gf.mul[scale][inverse[c][k]];
+		}
+		for (int r = 0; r < missingCount; r++)
+		{
+			unsigned char factor = matrix[r][c];
+			if (r == c || factor == 0) continue;
+			for (int k = 0; k < missingCount; k++)
+			{
+				matrix[r][k] ^= gf.mul[factor][matrix[c][k]];
+				inverse[r][k] ^= gf.mul[factor][inverse[c][k]];
+			}
+		}
+	}
+
+	// missing chunk c = sum over r of inverse[c][r] * syndrome r
+	std::vector<unsigned char> syndromes(missingCount * size);
+	unsigned char* scratch = syndromes.data();
+	for (int r = 0; r < missingCount; r++)
+	{
+		memcpy(scratch + r * size, data + missing[r] * size, size);
+	}
+	for (int c = 0; c < missingCount; c++)
+	{
+		unsigned char* chunk = data + missing[c] * size;
+		memset(chunk, 0, size);
+		for (int r = 0; r < missingCount; r++)
+		{
+			MultiplyAdd(chunk, scratch + r * size, size, inverse[c][r]);
+		}
+	}
+	return true;
+}
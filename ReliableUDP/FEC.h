@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace udpft
+{
+    // forward error correction over groups of file chunks.
+    // a group of up to FecGroupSize data chunks is followed by up to MaxParityChunks
+    // parity chunks, and any FecGroupSize of them rebuild the group.
+    // parity row 0 is the plain XOR of the data, the rows after it are
+    // Cauchy Reed-Solomon over GF(256), scaled so that row 0 stays XOR.
+    const int FecGroupSize = 8;
+    const int MaxParityChunks = 4;
+
+    namespace fec
+    {
+        // coefficient of data chunk column in parity chunk row
+        unsigned char Coefficient(int row, int column);
+
+        /*
+        * write parity chunk row of a group. data holds count chunks of size bytes back to back,
+        * only the first length bytes are given, the rest counts as zeros.
+        */
+        void EncodeParity(int row, const unsigned char* data, size_t length,
+            int count, size_t size, unsigned char* parity);
+
+        /*
+        * rebuild the chunks of a group that are not present. data holds count chunks of
+        * size bytes back to back, missing ones are written in place. parity[i] is parity
+        * chunk rows[i]. returns false when there is not enough parity for the missing chunks.
+        */
+        bool Recover(unsigned char* data, const bool present[], int count, size_t size,
+            const unsigned char* const parity[], const int rows[], int parityCount);
+    }
+}
@@ -1,9 +1,42 @@
+#include <set>
+#include <unordered_map>
 #include "FileTeleporter.h"
 using namespace udpft;
+
+namespace
+{
+	// names received into by the teleporters of this process. the file, its
+	// .part and its .journal are all named after the metadata in the one
+	// directory, two transfers of a name at once would write and remove each
+	// other's files. a second one waits until the first is done.
+	std::mutex namesLock;
+	std::set<std::string> receivedNames;
+
+	std::string NameKey(const std::string& name)
+	{
+		std::string key = std::filesystem::path(name).lexically_normal().generic_string();
+#if defined(_WIN32)
+		// one file on a case insensitive file system
+		for (size_t i = 0; i < key.size(); i++) key[i] = (char)tolower((unsigned char)key[i]);
+#endif
+		return key;
+	}
+
+	// the messages that restate a state, the rest carry chunks or go stale once lost
+	bool IsControl(uint32_t id)
+	{
+		switch (id)
+		{
+		case MDID: case DLID: case ENDID: case OKID: case DISID:
+		case RSID: case RMID: case SGID: case HVID: case LSID:
+			return true;
+		default:
+			return false;
+		}
+	}
+}
 FileTeleporter::FileTeleporter()
 {
-	rcMs = {};
-	fc = {};
 	sender = false;
 	state = CRACKED;
 	fileSize = 0;
@@ -12,13 +45,61 @@ FileTeleporter::FileTeleporter()
 	fileName = DefaultFileName;
 	chunkIndex = 0;
 	resent = false;
+	unackedChunks = 0;
+	ackDue = false;
+	stray = false;
+	restated = CRACKED;
+	loadedControl = false;
+	loadedChunk = -1;
+	loadedCount = 0;
+	lossRate = 0;
+	parityChunks = 0;
+	loadedParity = -1;
+	transferMode = ChunkTransfer;
+	nextSymbol = 0;
+	fountainPackets = 0;
+	maxPacketSize = PacketSize;
+	chunkSize = FileDataChunkSize;
+	probing = false;
+	loadedProbe = 0;
+	resuming = false;
+	resumePiece = 0;
+	deltaTransfer = false;
+	targetSize = 0;
+	blockSize = 0;
+	signatureCount = 0;
+	signaturePiece = 0;
+	compression = false;
+	sparseFile = false;
+	maxBufferedSize = DefaultMaxBufferedSize;
+	memoryBudget = NULL;
+	memoryHeld = 0;
+	spooled = false;
+	cached = false;
+	claimed = false;
+	bundled = false;
+	memset(contentHash, 0, sizeof(contentHash));
+	nextCompressGroup = 0;
+	compressionStopped = false;
+	timers = &ownTimers;
+	lastUpdateTime = chrono::steady_clock::now();
+	ackTimer.SetCallback([this]() { ackDelayed(); });
+	checkpointTimer.SetCallback([this]() { checkpointDue(); });
+	disconnectTimer.SetCallback([this]() { disconnected(); });
 }
 FileTeleporter::~FileTeleporter()
 {
+	if (!sender && state == RECEIVING)
+	{
+		// keep what came in for the next session
+		checkpoint();
+	}
 	Close();
+	releaseName();
 }
 void FileTeleporter::Close()
 {
+	stopCompression();
 	if (inputFile.is_open())
 	{
 		inputFile.close();
@@ -27,9 +108,20 @@ void FileTeleporter::Close()
 	{
 		outputFile.close();
 	}
+	if (spoolFile.is_open())
+	{
+		spoolFile.close();
+	}
 	ackOfChunks.clear();
+	chunkInFlight.clear();
+	sequenceChunks.clear();
+	paritySent.clear();
+	parityAcked.clear();
+	parityQueue.clear();
+	sequenceParity.clear();
+	parityGroups.clear();
 	chunkReceived.clear();
-	fileData.clear();
+	releaseMemory();
 	if (sender) 
 	{
 		state = CLOSED;
@@ -44,9 +136,9 @@ string FileTeleporter::GetFileName() const
 {
 	return fileName;
 }
-uint32_t FileTeleporter::GetFileSize() const
+uint64_t FileTeleporter::GetFileSize() const
 {
-	return fileSize;
+	return deltaTransfer ? targetSize : fileSize;
 }
 State FileTeleporter::GetState() const
 {
@@ -55,244 +147,645 @@ State FileTeleporter::GetState() const
 
 bool FileTeleporter::Initialize(const string& filePath, bool isSender)
 {
+	// the workers read the file data this is about to replace
+	stopCompression();
+	releaseName();
+	if (spoolFile.is_open()) spoolFile.close();
+	spooled = false;
 	sender = isSender;
 	if (sender)
 	{
-		// set file name
-		fileName = filesystem::path(filePath).filename().string();
+		// set file name, a directory given with a trailing separator is named by its last part
+		filesystem::path path(filePath);
+		if (!path.has_filename()) path = path.parent_path();
+		fileName = path.filename().string();
 
 		if (fileName.length() > MaxFileNameLength - 1)
 		{
 			cerr << "Error: File name out of length limit: " << filePath << endl;
 			return false;
 		}
-		// open the file 
-		inputFile.open(filePath, ios::binary | ios::ate);
-		if (!inputFile.is_open())
+		error_code error;
+		bundled = filesystem::is_directory(filePath, error);
+		if (bundled)
 		{
-			cerr << "Error opening file for reading: " << fileName << endl;
-			return false;
+			// a directory goes as one bundle of all its files
+			if (!bundle::Pack(filePath, fileData))
+			{
+				cerr << "Error reading the directory: " << filePath << endl;
+				return false;
+			}
+			if (fileData.size() > maxBufferedSize)
+			{
+				// the receiver unpacks it from memory, it would refuse it
+				cerr << "Error: the directory bundles to more than " << maxBufferedSize << " bytes: " << filePath << endl;
+				fileData.clear();
+				return false;
+			}
+			fileSize = fileData.size();
+			// the bundle is in memory already, all of it data
+			sparse::Extent whole = { 0, fileSize };
+			dataExtents.assign(1, whole);
+			sparseFile = false;
+		}
+		else
+		{
+			// open the file 
+			inputFile.open(filePath, ios::binary | ios::ate);
+			if (!inputFile.is_open())
+			{
+				cerr << "Error opening file for reading: " << fileName << endl;
+				return false;
+			}
+			fileSize = (uint64_t)inputFile.tellg();
+			inputFile.seekg(0,ios::beg);
+			if ((fileSize + FileDataChunkSize - 1) / FileDataChunkSize > MaxTotalChunks)
+			{
+				cerr << "Error: File too large to send: " << filePath << endl;
+				return false;
+			}
+			// where the file has data, holes between
+			sparse::DataExtents(filePath, fileSize, dataExtents);
+			uint64_t dataSize = 0;
+			for (size_t i = 0; i < dataExtents.size(); i++)
+			{
+				dataSize += dataExtents[i].length;
+			}
+			sparseFile = dataSize < fileSize;
+			spooled = sparseFile || fileSize > maxBufferedSize;
+			if (spooled && transferMode == FountainTransfer)
+			{
+				// the symbols mix chunks from all over the file, it would have to be in memory
+				std::cout << " The file goes in chunks, the fountain needs it in memory" << endl;
+				transferMode = ChunkTransfer;
+			}
 		}
-		fileSize = inputFile.tellg();
-		inputFile.seekg(0,ios::beg);
-		totalChunks = (fileSize + FileDataChunkSize - 1) / FileDataChunkSize;
-		ackOfChunks.assign(totalChunks, false);
+		setChunkSize(FileDataChunkSize);
+		nextSymbol = 0;
+		fountainPackets = 0;
+		// chunks bigger than the base size only once the path is known to carry them.
+		// the fountain has no answer to wait for and keeps to the base size.
+		pathMtu.Reset(PacketSize, transferMode == ChunkTransfer ? maxPacketSize : PacketSize);
+		probing = true;
+		loadedProbe = 0;
+		deltaTransfer = false;
+		targetSize = fileSize;
+		blockSize = 0;
+		signatures.clear();
+		signatureReceived.clear();
+		signatureCount = 0;
+		wholeFile.clear();
 
-		// read file to a buffer.
-		fileData.assign(fileSize,0);
-		inputFile.read(fileData.data(), fileSize);
-		int bytesRead = inputFile.gcount();
-		if (bytesRead != fileSize)
+		if (spooled)
 		{
-			cerr << "Error reading the file: " << fileName << endl;
-			return false;
+			// read a chunk at a time as it goes out
+			inputFile.close();
+			fileData.clear();
+			spoolFile.open(filePath, ios::binary | ios::in);
+			if (!spoolFile.is_open())
+			{
+				cerr << "Error opening file for reading: " << fileName << endl;
+				return false;
+			}
 		}
-		inputFile.close();
-		if (inputFile.fail())
+		else if (!bundled)
+		{
+			// read file to a buffer, only where it has data: holes stay zeros.
+			fileData.assign(fileSize,0);
+			for (size_t i = 0; i < dataExtents.size(); i++)
+			{
+				inputFile.seekg(dataExtents[i].offset, ios::beg);
+				inputFile.read(fileData.data() + dataExtents[i].offset, dataExtents[i].length);
+				if ((uint64_t)inputFile.gcount() != dataExtents[i].length)
+				{
+					cerr << "Error reading the file: " << fileName << endl;
+					return false;
+				}
+			}
+			inputFile.close();
+			if (inputFile.fail())
+			{
+				cerr << "Error closing the file: " << filePath << endl;
+				return false;
+			}
+		}
+		// Calculate CRC32 of the file, and its SHA-256 for the receiver's cache.
+		// a spooled file isn't read through twice, it goes without one
+		if (!calculateFileCRC(crc))
 		{
-			cerr << "Error closing the file: " << filePath << endl;
+			cerr << "Error reading the file: " << filePath << endl;
 			return false;
 		}
-		// Calculate CRC32 of the file
-		crc = calculateFileCRC();
+		if (spooled)
+			memset(contentHash, 0, sizeof(contentHash));
+		else
+			Sha256((const unsigned char*)fileData.data(), fileData.size(), contentHash);
 		state = WAVING;
 		std::cout<< "Waving the file: " << filePath << endl;
 	}
 	else // receiver 
 	{
-		rcMs = {};
-		fc = {};
+		if (state == RECEIVING)
+		{
+			// the transfer was cut off, keep what came in for the next session
+			checkpoint();
+		}
 		fileSize = 0;
 		crc = 0;
 		totalChunks = 0;
 		fileName = DefaultFileName;
 		resent = false;
-		fileData.clear();
+		transferMode = ChunkTransfer;
+		chunkSize = FileDataChunkSize;
+		chunkIndex = 0;
+		unackedChunks = 0;
+		ackDue = false;
+		droppedChunks.clear();
+		stray = false;
+		parityGroups.clear();
+		releaseMemory();
 		chunkReceived.clear();
+		unsavedChunks.clear();
+		resuming = false;
+		resumePiece = 0;
+		deltaTransfer = false;
+		targetSize = 0;
+		blockSize = 0;
+		signatures.clear();
+		signaturePiece = 0;
+		sparseFile = false;
+		cached = false;
+		bundled = false;
 		state = LISTENING;
 		std::cout << "File receiver listening" << endl;
 	}
 	return true;
 }
 
-void FileTeleporter::LoadPacket(unsigned char packet[PacketSize])
+/*
+* write the next message into packet and return its length,
+* only the bytes that carry something go on the wire.
+* returns 0 when there is nothing to send this time.
+* chunks go as fast as the caller asks for them, the messages that
+* only say the state again go once an update however often it asks.
+*/
+int FileTeleporter::LoadPacket(unsigned char packet[JumboPacketSize])
 {
+	int size = 0;
+	loadedChunk = -1;
+	loadedCount = 0;
+	loadedParity = -1;
+	if (loadedProbe > 0)
+	{
+		// the last probe never made it onto the wire, too big for the first hop
+		pathMtu.ProbeFailed(loadedProbe);
+		loadedProbe = 0;
+	}
 	if (sender) // client
 	{
 		switch (state) 
 		{
 		case WAVING:
+			if (probing)
+			{
+				if (!pathMtu.IsComplete())
+				{
+					// probe the path first, no MDID until the chunk size is known
+					int probe = pathMtu.NextProbe();
+					if (probe > 0)
+					{
+						size = packProbe(packet, probe);
+						loadedProbe = probe;
+					}
+					break;
+				}
+				// propose the largest chunk the path carries
+				probing = false;
+				setChunkSize(pathMtu.GetPathMtu() - offsetof(Message, content) - offsetof(FileChunk, data));
+			}
+			if (restated == state) break;
+			restated = state;
+			if (deltaTransfer)
+			{
+				// DLID, the delta is ready and its size wants confirming
+				DeltaHeader header = { (uint32_t)fileSize, blockSize };
+				size = packMessage(packet, DLID, &header, sizeof(header));
+				break;
+			}
 			// MDID
-			packMetaData(packet);
+			size = packMetaData(packet);
+			if (transferMode == FountainTransfer)
+			{
+				// no OKID to wait for, stream right away
+				state = SENDING;
+				std::cout << " Streaming the file" << endl;
+			}
 			break;
 		case SENDING:
-			if (ackOfChunks.empty() || (chunkIndex == totalChunks && ackOfChunks.back()))
+			if (transferMode == FountainTransfer)
+			{
+				// SYID, with the MDID again now and then for a receiver that missed it
+				if (++fountainPackets % MetadataInterval == 0)
+					size = packMetaData(packet);
+				else
+					size = packSymbol(packet);
+			}
+			else if (ackOfChunks.empty() || chunkIndex == (uint32_t)totalChunks)
 			{
 				// ENDID 
-				packMessage(packet, ENDID, &crc, sizeof(crc));
+				if (restated == state) break;
+				restated = state;
+				size = packMessage(packet, ENDID, &crc, sizeof(crc));
 			}
 			else
 			{
-				// FCID				
-				packMessage(packet, FCID, &fc, sizeof(fc));
+				// PCID, parity of groups already sent goes first
+				while (!parityQueue.empty() && size == 0)
+				{
+					uint32_t group = parityQueue.front() >> 8;
+					int row = parityQueue.front() & 0xff;
+					parityQueue.pop_front();
+					if (group >= (uint32_t)chunkIndex / FecGroupSize)
+					{
+						size = packParity(packet, group, row);
+						loadedParity = group;
+					}
+				}
+				// FCID, the next chunk of the window that needs to go out,
+				// or ZCID when it starts a run the workers compressed,
+				// or ZRID/RPID when the receiver can make it up itself
+				int index = size == 0 ? nextChunkToSend() : -1;
+				if (index >= 0 && chunkSources[index] != PlainChunk)
+				{
+					// no parity for these, a lost one is simply sent again
+					size = packCopies(packet, index);
+				}
+				else if (index >= 0)
+				{
+					const CompressedRun* run = compressedRun(index);
+					size = run ? packCompressed(packet, *run) : packChunk(packet, index);
+					if (size == 0) break; // the file can't be read anymore
+					loadedChunk = index;
+					loadedCount = run ? run->count : 1;
+					uint32_t group = index / FecGroupSize;
+					int last = index + loadedCount - 1;
+					if (!paritySent[group] && last == (int)group * FecGroupSize + groupChunks(group) - 1)
+					{
+						// the group is out, its parity follows
+						paritySent[group] = true;
+						for (int row = 0; row < parityChunks; row++)
+						{
+							parityQueue.push_back(group << 8 | row);
+						}
+					}
+				}
 			}
 			break;
-		case CRACKED:
-			break;
 		default:
-			return;
+			break;
 		}
 	}
 	else // server 
 	{
 		switch (state)
 		{
+		case LISTENING:
+			// LSID, chunks came for a transfer we don't have. their transport
+			// acks say nothing of them, the sender starts over from the metadata
+			if (!stray || restated == state) break;
+			restated = state;
+			stray = false;
+			size = packMessage(packet, LSID, NULL, 0);
+			break;
 		case READY:
+			if (transferMode == FountainTransfer)
+			{
+				// no feedback until the file is done
+				break;
+			}
+			if (restated == state) break;
+			restated = state;
 			if (resent)
 			{
 				// RSID request file resent
-				packMessage(packet, RSID, &crc,sizeof(crc));
+				size = packMessage(packet, RSID, &crc,sizeof(crc));
 			}
-			else
+			else if ((size = packResumeMap(packet)) == 0 && (size = packSignatures(packet)) == 0)
 			{
 				// OKID
-				// OK for receving file chunks.
-				packMessage(packet, OKID, &crc, sizeof(crc));
+				// OK for receving file chunks, of the size we took.
+				TransferAccept accept = { crc, (uint32_t)chunkSize,
+					(uint32_t)signatures.size(), blockSize, deltaTransfer ? (uint32_t)fileSize : 0 };
+				size = packMessage(packet, OKID, &accept, sizeof(accept));
+				// the map and the signatures go again before the next OKID
+				resumePiece = 0;
+				signaturePiece = 0;
 			}
 			break;
 		case RECEIVING:
-			// ACKID
-			// ACK for a chunk
-			packMessage(packet, ACKID, &chunkIndex, sizeof(chunkIndex));
+			// ACKID, carries the transport acks of the chunks back
+			// only when the ack policy asks for one
+			if (ackDue && transferMode == ChunkTransfer)
+			{
+				size = packAck(packet);
+			}
 			break;
 		case DISCONNECTING:
-			// DISID
-			packMessage(packet, DISID, &crc, sizeof(crc));
+			// DISID, or HVID when the file came out of the cache
+			if (restated == state) break;
+			restated = state;
+			size = packMessage(packet, cached ? HVID : DISID, &crc, sizeof(crc));
 			break;
-		case CRACKED:
 		default:
-			memset(packet,0,sizeof(packet));
-			return;
+			break;
 		}
 	}
-}
-void FileTeleporter::ProcessPacket(unsigned char packet[PacketSize])
-{
-	memset(&rcMs, 0, sizeof(rcMs));
-	memcpy(&rcMs, packet, sizeof(rcMs));
-}
-
-// call update after received a new message
-void FileTeleporter::Update()
-{
-	if (state == CRACKED) return;
-
-	/***************** File Receiver *****************/
 
-	if (state == DISCONNECTING)
+	loadedControl = size > 0 && IsControl(MessageId(packet));
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	if (size == 0)
 	{
-		// back to ready after being in disconnecting state for 1s
-		double duration = chrono::duration<double, milli>(
-			chrono::steady_clock::now() - disconnectTime).count();
-		if (duration > DISCONNECT_DURATION)
+		// nothing to say, a bare id now and then keeps the connection alive
+		if (chrono::duration<double, milli>(now - lastLoadTime).count() < KEEPALIVE_INTERVAL)
 		{
-			Initialize(DefaultFileName, false);
+			return 0;
 		}
+		size = packMessage(packet, NOID, NULL, 0);
+	}
+	lastLoadTime = now;
+	return size;
+}
+/*
+* dispatch one received message. called for every datagram, in arrival order,
+* so no message is lost to the next one arriving in the same tick.
+* the message is parsed in place, chunk data goes straight into fileData.
+*/
+void FileTeleporter::ProcessPacket(const unsigned char* packet, int size)
+{
+	if (state == CRACKED || size < (int)offsetof(Message, content)) return;
+	const unsigned char* content = MessageContent(packet);
+	size_t contentSize = size - offsetof(Message, content);
+
+	uint32_t id = MessageId(packet);
+	if (state == LISTENING && (id == FCID || id == ZCID || id == ZRID || id == RPID || id == PCID || id == ENDID))
+	{
+		// for a transfer we know nothing of, from before we restarted or
+		// from a sender that missed our DISID
+		stray = true;
+		return;
 	}
-	switch (rcMs.id)
+
+	switch (id)
 	{
+
+	/***************** File Receiver *****************/
+
 	case MDID: // parse metadata
-		if (state == LISTENING)
+		if (state == LISTENING && contentSize >= sizeof(FileMetadata))
 		{
-			storeMetadata();
-			fileData.assign(fileSize, 0);
+			if (!storeMetadata(content))
+			{
+				cerr << "Malformed metadata, the transfer is refused" << endl;
+				state = CRACKED;
+				break;
+			}
+			if (!claimName())
+			{
+				// being received from another sender, this one keeps waving until it is done
+				break;
+			}
+			if (!bundled && !spooled && findCached())
+			{
+				break;
+			}
+			if (!spooled && !holdMemory(fileSize))
+			{
+				// the other transfers hold the memory. one put together in memory
+				// waits for them, the sender keeps waving; a file goes to disk
+				if (bundled || transferMode == FountainTransfer) break;
+				std::cout << " The memory is taken, " << fileName << " goes to disk" << endl;
+				spooled = true;
+			}
+			if (!spooled) fileData.assign(fileSize, 0);
+			if (transferMode == ChunkTransfer && loadJournal())
+			{
+				std::cout << "Resuming the file from chunk " << chunkIndex << endl;
+			}
+			else if (spooled && !createSpool())
+			{
+				cerr << "Error opening file for writing: " << fileName << PartialExtension << endl;
+				state = CRACKED;
+				break;
+			}
+			else if (transferMode == ChunkTransfer && !spooled)
+			{
+				// an older copy of the file here turns the transfer into a delta of it
+				loadBasis();
+			}
+			timers->Arm(checkpointTimer, (float)(CHECKPOINT_INTERVAL / 1000));
 			state = READY;
 			std::cout << "Receiver is ready" << endl;		
+			if (transferMode == FountainTransfer && totalChunks == 0)
+			{
+				finishFile();
+			}
 		}
 		break;
 
 	case FCID: // file chunk, store file data
 		if (state == READY)
 		{
-			storeChunk();
+			state = RECEIVING;
+			resent = false;
+			std::cout << " Receiving the file" << endl;
+		}
+		if (state == RECEIVING && contentSize >= offsetof(FileChunk, data))
+		{
+			uint32_t index = ChunkIndex(content);
+			if (!storeChunk(content, contentSize))
+			{
+				// already have it, the sender missed our ack
+				ackDue = true;
+				break;
+			}
+			chunkArrived(index);
+			recoverGroup(index / FecGroupSize);
+		}
+		break;
+
+	case ZCID: // compressed chunks, unpacked and stored like the plain ones
+		if (state == READY)
+		{
 			state = RECEIVING;
 			resent = false;
 			std::cout << " Receiving the file" << endl;
 		}
 		if (state == RECEIVING)
 		{
-			storeChunk();
+			storeCompressed(content, contentSize);
 		}
 		break;
 
-	case ENDID:
-		if ((state == READY && fileSize == 0) ||(state == RECEIVING && chunkReceived.back()))
+	case ZRID: // zero chunks, and chunks we have the bytes of already
+	case RPID:
+		if (state == READY)
 		{
-			uint32_t finalCRC = calculateFileCRC();
-			if (finalCRC != crc)
-			{
-				resent = true;
-				cerr << " File verification failed:" << fileName << endl;
-				cerr << " Original File CRC: " << crc << endl;
-				cerr << " Received File CRC: " << finalCRC << endl;
+			state = RECEIVING;
+			resent = false;
+			std::cout << " Receiving the file" << endl;
+		}
+		if (state == RECEIVING)
+		{
+			storeCopies(content, contentSize, id == ZRID);
+		}
+		break;
 
-				// not equal to CRC, be prepare for receiving the file from the head.
-				chunkReceived.assign(totalChunks, false);				
-				fileData.assign(fileSize, 0);
+	case PCID: // parity chunk, may rebuild lost chunks of its group
+		if (state == READY)
+		{
+			state = RECEIVING;
+			resent = false;
+			std::cout << " Receiving the file" << endl;
+		}
+		if (state == RECEIVING)
+		{
+			storeParity(content, contentSize);
+		}
+		break;
 
-				state = READY;
-				std::cout << " Ready for retransmission" << endl;
-			}
-			else
-			{
-				writeFile();
-				if (state == CRACKED) return;
-				printf("%s Received\n", fileName.c_str());
-				printf("Received file size: %u bytes\n", fileSize);
-				printf("Original CRC claim: 0x%08X\n", crc);
-				state = DISCONNECTING;
-				std::cout << " Disonnecting " << endl;
-				// record current time
-				disconnectTime = chrono::high_resolution_clock::now();
-			}
+	case DLID: // the chunks will be a delta against our old copy
+		if (state == READY)
+		{
+			storeDeltaHeader(content, contentSize);
+		}
+		break;
+
+	case ENDID:
+		// from READY too when every chunk was kept from an earlier session
+		if ((state == READY || state == RECEIVING) && chunkIndex == (uint32_t)totalChunks)
+		{
+			finishFile();
+		}
+		else if (state == RECEIVING && transferMode == ChunkTransfer)
+		{
+			// the sender has acks for everything, some of them for chunks that never made it
+			reportMissing();
+		}
+		break;
+
+	case SYID: // fountain symbol, the file is done once every chunk is decoded
+		if (state == READY && transferMode == FountainTransfer)
+		{
+			state = RECEIVING;
+			std::cout << " Receiving the file" << endl;
+		}
+		if (state == RECEIVING && transferMode == FountainTransfer)
+		{
+			storeSymbol(content, contentSize);
 		}
 		break;
 
 /********************* File SENDER ***************/
 
 	case OKID:
-		if (state == WAVING)
+		if (state == WAVING && !probing)
 		{
-			chunkIndex = 0;			
+			// an answer without a chunk size is from a receiver that only takes the base size
+			uint32_t accepted = contentSize >= offsetof(TransferAccept, basisBlocks)
+				? ReadU32(content + offsetof(TransferAccept, chunkSize)) : FileDataChunkSize;
+			if (accepted < (uint32_t)chunkSize && accepted > 0)
+			{
+				// smaller than proposed, propose what the receiver takes
+				setChunkSize(accepted);
+				break;
+			}
+			if (accepted != (uint32_t)chunkSize) break;
+			if (contentSize >= sizeof(TransferAccept) && transferMode == ChunkTransfer)
+			{
+				uint32_t basisBlocks = ReadU32(content + offsetof(TransferAccept, basisBlocks));
+				if (basisBlocks > 0 && !deltaTransfer && !spooled)
+				{
+					// the receiver has an old copy, the delta is made once all its signatures are in.
+					// a spooled file isn't in memory to encode, the old copy goes unused then
+					if (basisBlocks == signatureCount && signatures.size() == basisBlocks
+						&& ReadU32(content + offsetof(TransferAccept, blockSize)) == blockSize)
+					{
+						buildDelta();
+					}
+					break;
+				}
+				if (deltaTransfer && ReadU32(content + offsetof(TransferAccept, deltaSize)) != (uint32_t)fileSize)
+				{
+					break;
+				}
+			}
 			state = SENDING;
-			readChunk();
-			std::cout << " Sending the file" << endl;
+			std::cout << " Sending the file, " << chunkSize << " byte chunks" << endl;
+			findCopies();
+			startCompression();
 		}
 		break;
 	case ACKID:
-		if (state == SENDING)
+		// chunks are acked by the transport header it came with, and taken
+		// back by the runs in it the receiver couldn't store
+		if (state == SENDING && transferMode == ChunkTransfer)
 		{
-			// read the index in the message.
-			uint32_t ackedChunkIndex = 0;
-			memcpy(&ackedChunkIndex, rcMs.content, sizeof(ackedChunkIndex));
-			if (ackedChunkIndex == chunkIndex)
+			for (size_t offset = 0; offset + sizeof(DroppedRun) <= contentSize; offset += sizeof(DroppedRun))
 			{
-				ackOfChunks[chunkIndex++] = true;
-				readChunk();
+				resendChunks(ReadU32(content + offset + offsetof(DroppedRun, firstChunk)),
+					ReadU32(content + offset + offsetof(DroppedRun, chunkCount)));
 			}
 		}
 		break;
+	case LSID: // the receiver lost the transfer, or never had it
+		if (state == SENDING && transferMode == ChunkTransfer)
+		{
+			std::cout << " The receiver is listening, waving the file again" << endl;
+			restart();
+		}
+		break;
+	case SGID: // signatures of the receiver's old copy
+		if (state == WAVING && transferMode == ChunkTransfer && !deltaTransfer && !spooled)
+		{
+			storeSignatures(content, contentSize);
+		}
+		break;
+	case RMID: // chunks the receiver already has, they count as acked
+		if ((state == WAVING || state == SENDING) && transferMode == ChunkTransfer)
+		{
+			storeResumeMap(content, contentSize);
+		}
+		break;
 	case DISID:
-		if (ackOfChunks.empty() || (state == SENDING && ackOfChunks.back()))
+		if (ackOfChunks.empty() || (state == SENDING &&
+			(chunkIndex == (uint32_t)totalChunks || transferMode == FountainTransfer)))
+		{
+			Close();
+		}
+		break;
+	case HVID: // the receiver has the file already
+		if ((state == WAVING || state == SENDING) && contentSize >= sizeof(crc) && ReadU32(content) == crc)
 		{
+			std::cout << " The receiver has the file already" << endl;
 			Close();
 		}
 		break;
 	case RSID:
-		if (state == SENDING)
+		if (state == SENDING && deltaTransfer)
+		{
+			// the delta didn't rebuild the file, the receiver wants all of it now
+			dropDelta();
+		}
+		else if (state == SENDING)
 		{
 			chunkIndex = 0;
 			ackOfChunks.assign(totalChunks,false);
+			chunkInFlight.assign(totalChunks, false);
+			sequenceChunks.clear();
+			paritySent.assign(paritySent.size(), false);
+			parityAcked.assign(parityAcked.size(), 0);
+			parityQueue.clear();
+			sequenceParity.clear();
 		}
 		break;
 	default:
@@ -300,13 +793,155 @@ void FileTeleporter::Update()
 	}
 }
 
-uint32_t FileTeleporter::calculateFileCRC()
+// call update once per tick, messages are handled by ProcessPacket as they arrive
+void FileTeleporter::Update()
+{
+	restated = CRACKED;
+	if (timers != &ownTimers) return;
+	// a wheel of our own follows the clock, a shared one is its owner's to advance
+	chrono::steady_clock::time_point now = chrono::steady_clock::now();
+	ownTimers.Advance(chrono::duration<float>(now - lastUpdateTime).count());
+	lastUpdateTime = now;
+}
+
+void FileTeleporter::SetTimerWheel(net::TimerWheel* wheel)
+{
+	ackTimer.Cancel();
+	missingTimer.Cancel();
+	checkpointTimer.Cancel();
+	disconnectTimer.Cancel();
+	timers = wheel ? wheel : &ownTimers;
+}
+
+void FileTeleporter::SetWakeCallback(const std::function<void()>& callback)
+{
+	wake = callback;
+}
+
+/***************** File Receiver timers *****************/
+
+// don't hold back an ack for longer than ACK_DELAY
+void FileTeleporter::ackDelayed()
+{
+	if (state == RECEIVING && unackedChunks > 0)
+	{
+		ackDue = true;
+		if (wake) wake();
+	}
+}
+
+// save the new chunks now and then, a crash loses at most the last few
+void FileTeleporter::checkpointDue()
+{
+	if (state == RECEIVING && !unsavedChunks.empty())
+	{
+		checkpoint();
+	}
+	else if (state == READY || state == RECEIVING)
+	{
+		timers->Arm(checkpointTimer, (float)(CHECKPOINT_INTERVAL / 1000));
+	}
+}
+
+// back to listening after being in disconnecting state for DISCONNECT_DURATION
+void FileTeleporter::disconnected()
+{
+	if (state == DISCONNECTING)
+	{
+		Initialize(DefaultFileName, false);
+	}
+}
+
+bool FileTeleporter::calculateFileCRC(uint32_t& value)
+{
+	if (!spooled)
+	{
+		value = CRC::Calculate(fileData.data(), fileData.size(), CRC::CRC_32());
+		return true;
+	}
+
+	// a spooled file is read where it has data, a block at a time. the holes
+	// between add their zeros to the crc without being read
+	const size_t SpoolBlock = 1 << 20;
+	static const CRC::Table<uint32_t, 32> table(CRC::CRC_32());
+	vector<sparse::Extent> extents;
+	if (sender)
+	{
+		extents = dataExtents;
+	}
+	else
+	{
+		spoolFile.flush();
+		sparse::DataExtents(fileName + PartialExtension, fileSize, extents);
+	}
+	vector<char> block(SpoolBlock);
+	value = 0;
+	uint64_t position = 0;
+	for (size_t i = 0; i < extents.size(); i++)
+	{
+		value = sparse::ZerosCrc(value, extents[i].offset - position);
+		uint64_t end = extents[i].offset + extents[i].length;
+		for (position = extents[i].offset; position < end;)
+		{
+			size_t length = end - position < SpoolBlock ? (size_t)(end - position) : SpoolBlock;
+			if (!readData(position, block.data(), length)) return false;
+			value = CRC::Calculate(block.data(), length, table, value);
+			position += length;
+		}
+	}
+	value = sparse::ZerosCrc(value, fileSize - position);
+	return true;
+}
+
+/*
+* the partial file of a spooled transfer, made new: a hole of the file's size
+* the chunks are written into as they come.
+*/
+bool FileTeleporter::createSpool()
+{
+	string partPath = fileName + PartialExtension;
+	if (spoolFile.is_open()) spoolFile.close();
+	if (!sparse::Create(partPath, fileSize)) return false;
+	spoolFile.open(partPath, ios::binary | ios::in | ios::out);
+	return spoolFile.is_open();
+}
+
+bool FileTeleporter::readData(uint64_t offset, char* data, size_t length)
 {
-	return CRC::Calculate(fileData.data(), fileData.size(), CRC::CRC_32());
+	spoolFile.clear();
+	spoolFile.seekg((streamoff)offset, ios::beg);
+	spoolFile.read(data, length);
+	return spoolFile.gcount() == (streamsize)length;
+}
+
+bool FileTeleporter::writeData(uint64_t offset, const char* data, size_t length)
+{
+	spoolFile.clear();
+	spoolFile.seekp((streamoff)offset, ios::beg);
+	spoolFile.write(data, length);
+	if (spoolFile.good()) return true;
+	cerr << "Error writing the file: " << fileName << PartialExtension << endl;
+	state = CRACKED;
+	return false;
 }
 
 void FileTeleporter::writeFile()
 {
+	// a file linked into the cache is replaced, not written through
+	error_code error;
+	filesystem::remove(fileName, error);
+	if (spooled)
+	{
+		// the partial file is the file, holes and all
+		spoolFile.close();
+		filesystem::rename(fileName + PartialExtension, fileName, error);
+		if (error)
+		{
+			cerr << "Error writing the file: " << fileName << std::endl;
+			state = CRACKED;
+		}
+		return;
+	}
 	outputFile.open(fileName, ios::binary);
 	if (!outputFile.is_open())
 	{
@@ -329,82 +964,1477 @@ void FileTeleporter::writeFile()
 		return;
 	}
 }
-void FileTeleporter::packMessage(unsigned char packet[PacketSize],
+/*
+* write the Message in place: id then content, returns the message length.
+*/
+int FileTeleporter::packMessage(unsigned char packet[JumboPacketSize],
 	uint32_t id, const void* content, size_t size)
 {
-	Message ms = {};
-	ms.id = id;
-	memset(ms.content, 0, ContentSize);
-	memcpy(ms.content, content, size);
-	memset(packet, 0, PacketSize);
-	memcpy(packet, &ms, sizeof(ms));
+	memcpy(packet + offsetof(Message, id), &id, sizeof(id));
+	if (size > 0)
+	{
+		memcpy(packet + offsetof(Message, content), content, size);
+	}
+	return (int)(offsetof(Message, content) + size);
 }
 /*
 * copy metadata to a Message with ID 0.
 * Pack the Message into the packet.
 */
-void FileTeleporter::packMetaData(unsigned char packet[PacketSize])
+int FileTeleporter::packMetaData(unsigned char packet[JumboPacketSize])
 {
 	// Prepare metadata
 	FileMetadata metadata = {};
 	memcpy(metadata.fileName, fileName.c_str(), MaxFileNameLength - 1);
 	metadata.fileName[MaxFileNameLength - 1] = '\0';
-	metadata.fileSize = fileSize;
-	metadata.totalChunks = (fileSize + FileDataChunkSize - 1) / FileDataChunkSize;
+	metadata.fileSize = (uint32_t)fileSize;
+	metadata.fileSizeHigh = (uint32_t)(fileSize >> 32);
+	metadata.totalChunks = totalChunks;
 	metadata.crc32 = crc;
+	metadata.transferMode = transferMode;
+	metadata.chunkSize = chunkSize;
+	metadata.holes = sparseFile;
+	memcpy(metadata.sha256, contentHash, sizeof(contentHash));
+	metadata.bundle = bundled;
 
-	packMessage(packet, MDID, &metadata, sizeof(metadata));
+	return packMessage(packet, MDID, &metadata, sizeof(metadata));
 }
 
-void FileTeleporter::readChunk()
+/*
+* write a FileChunk message for the chunk straight from the file buffer,
+* the only copy of the file data on its way to the socket. a spooled
+* file is read into the message instead, 0 when it can't be.
+*/
+int FileTeleporter::packChunk(unsigned char packet[JumboPacketSize], uint32_t index)
 {
-	fc.chunkIndex = chunkIndex;
-	size_t offset = chunkIndex * FileDataChunkSize;
-	size_t chunkSize = (((FileDataChunkSize) < (fileSize - offset))
-		? (FileDataChunkSize) : (fileSize - offset));
-	// Copy from memory buffer instead of re-reading file
-	memcpy(fc.data, fileData.data() + offset, chunkSize);
-	// Fill remaining space with zeros if needed
-	if (chunkSize < FileDataChunkSize) {
-		memset(fc.data + chunkSize, 0, FileDataChunkSize - chunkSize);
+	const uint32_t id = FCID;
+	unsigned char* chunk = packet + offsetof(Message, content);
+	uint64_t offset = (uint64_t)index * chunkSize;
+	size_t length = (((uint64_t)chunkSize < (fileSize - offset))
+		? (size_t)chunkSize : (size_t)(fileSize - offset));
+	memcpy(packet + offsetof(Message, id), &id, sizeof(id));
+	memcpy(chunk + offsetof(FileChunk, chunkIndex), &index, sizeof(index));
+	if (!spooled)
+	{
+		memcpy(chunk + offsetof(FileChunk, data), fileData.data() + offset, length);
 	}
+	else if (!readData(offset, (char*)chunk + offsetof(FileChunk, data), length))
+	{
+		cerr << "Error reading the file: " << fileName << endl;
+		state = CRACKED;
+		return 0;
+	}
+	// the last chunk goes out short, no zero padding
+	return (int)(offsetof(Message, content) + offsetof(FileChunk, data) + length);
 }
-void FileTeleporter::storeMetadata()
-{
-	FileMetadata fm = {};
-	// deserialize packet to FileMetadata
-	memcpy(&fm, rcMs.content, sizeof(fm));
-
-	// store metadata, open output file and start to receive the file.
-	fileName = fm.fileName;
-	fileSize = fm.fileSize;
-	totalChunks = fm.totalChunks;
-	crc = fm.crc32;
-	chunkReceived.assign(totalChunks, false);
-}
-void FileTeleporter::storeChunk()
+/*
+* the first chunk of the window that is neither acked nor in flight,
+* -1 when the whole window is waiting for acks. a repeated chunk waits
+* until the receiver has the one it repeats.
+*/
+int FileTeleporter::nextChunkToSend()
 {
-	memset(&fc, 0, sizeof(fc));
-	memcpy(&fc, rcMs.content, sizeof(fc));
-	chunkIndex = fc.chunkIndex;	
-	// write to file data buffer
-	// don't rewrite data having been already written
-	if (!chunkReceived[chunkIndex])
+	uint32_t end = chunkIndex + SendWindow;
+	if (end > (uint32_t)totalChunks) end = totalChunks;
+	for (uint32_t index = chunkIndex; index < end; index++)
 	{
-		// Ensure vector is properly sized before writing
-		size_t offset = fc.chunkIndex * FileDataChunkSize;
-		size_t remaining = fileSize - offset;
-
-		// Only write valid bytes in the final chunk 
-		size_t copySize = (((FileDataChunkSize) < (remaining)) ?
-			(FileDataChunkSize) : (remaining));
+		uint32_t source = chunkSources[index];
+		if (!ackOfChunks[index] && !chunkInFlight[index]
+			&& (source == PlainChunk || source == ZeroChunk || ackOfChunks[source]))
+		{
+			return index;
+		}
+	}
+	return -1;
+}
+/*
+* write an ACKID. the packet is sent so the transport acks of everything
+* received so far get back to the sender, with the runs we dropped that fit.
+*/
+int FileTeleporter::packAck(unsigned char packet[JumboPacketSize])
+{
+	DroppedRun runs[MaxDroppedRuns];
+	int count = droppedChunks.size() < (size_t)MaxDroppedRuns ? (int)droppedChunks.size() : MaxDroppedRuns;
+	for (int i = 0; i < count; i++)
+	{
+		runs[i].firstChunk = droppedChunks[i].first;
+		runs[i].chunkCount = droppedChunks[i].count;
+	}
+	droppedChunks.erase(droppedChunks.begin(), droppedChunks.begin() + count);
+	// the rest go with the next one
+	ackDue = !droppedChunks.empty();
+	unackedChunks = 0;
+	return packMessage(packet, ACKID, runs, count * sizeof(DroppedRun));
+}
+
+/*
+* a chunk whose message arrived but couldn't be stored. its transport ack is
+* on the way, the next ACKID takes it back.
+*/
+void FileTeleporter::dropChunk(uint32_t index)
+{
+	if (!droppedChunks.empty() && droppedChunks.back().first + droppedChunks.back().count == index)
+	{
+		droppedChunks.back().count++;
+	}
+	else
+	{
+		ChunkRun run = { index, 1 };
+		droppedChunks.push_back(run);
+	}
+	ackDue = true;
+}
+
+/*
+* the ENDID came while chunks are missing: the sender took an ack for one it
+* never got a word about. report them all, but not again before MISSING_INTERVAL,
+* the sender keeps restating its ENDID until the chunks are on their way.
+*/
+void FileTeleporter::reportMissing()
+{
+	if (missingTimer.IsArmed()) return;
+	timers->Arm(missingTimer, (float)(MISSING_INTERVAL / 1000));
+	droppedChunks.clear();
+	for (uint32_t index = chunkIndex; index < (uint32_t)totalChunks; index++)
+	{
+		if (chunkReceived[index]) continue;
+		if (droppedChunks.size() == (size_t)MaxDroppedRuns
+			&& droppedChunks.back().first + droppedChunks.back().count != index) break;
+		dropChunk(index);
+	}
+}
+/*
+* false when the metadata describes no file we could hold: sizes are checked
+* as they came, unsigned, before anything is sized by them.
+*/
+bool FileTeleporter::storeMetadata(const unsigned char* fm)
+{
+	// read the metadata fields in place
+	const char* name = (const char*)fm + offsetof(FileMetadata, fileName);
+	size_t nameLength = 0;
+	while (nameLength < MaxFileNameLength && name[nameLength] != '\0') nameLength++;
+
+	// store metadata, open output file and start to receive the file.
+	fileName.assign(name, nameLength);
+	// every file of the transfer is named after it: the file, its journal, the
+	// old copy read for a delta, the cache link. none may land outside of here.
+	if (!bundle::IsContained(fileName)) return false;
+	fileSize = ReadU32(fm + offsetof(FileMetadata, fileSize))
+		| (uint64_t)ReadU32(fm + offsetof(FileMetadata, fileSizeHigh)) << 32;
+	crc = ReadU32(fm + offsetof(FileMetadata, crc32));
+	transferMode = ReadU32(fm + offsetof(FileMetadata, transferMode)) == FountainTransfer
+		? FountainTransfer : ChunkTransfer;
+
+	// take the proposed chunk size if our datagrams hold it, else the most they hold.
+	// the sender comes back with the smaller size before sending any chunk.
+	int largest = maxPacketSize - offsetof(Message, content) - offsetof(FileChunk, data);
+	uint32_t proposed = ReadU32(fm + offsetof(FileMetadata, chunkSize));
+	if (proposed == 0) proposed = FileDataChunkSize;
+	if (proposed > (uint32_t)largest) proposed = largest;
+	chunkSize = (int)proposed;
+	sparseFile = ReadU32(fm + offsetof(FileMetadata, holes)) != 0;
+	memcpy(contentHash, fm + offsetof(FileMetadata, sha256), sizeof(contentHash));
+	bundled = ReadU32(fm + offsetof(FileMetadata, bundle)) != 0;
+	uint64_t chunks = (fileSize + chunkSize - 1) / chunkSize;
+	if (chunks > MaxTotalChunks) return false;
+	totalChunks = (int)chunks;
+	// a file with holes, or past the size we hold in memory, is written straight into
+	// the partial file. a bundle is unpacked from memory, the fountain decodes in it
+	spooled = sparseFile || fileSize > maxBufferedSize;
+	if (spooled && (bundled || transferMode == FountainTransfer))
+	{
+		cerr << "Error: " << fileName << " is bigger than the " << maxBufferedSize << " bytes held in memory" << endl;
+		return false;
+	}
+	chunkReceived.assign(totalChunks, false);
+	if (transferMode == FountainTransfer)
+	{
+		fountainDecoder.Reset(totalChunks, chunkSize);
+	}
+	return true;
+}
+bool FileTeleporter::claimName()
+{
+	if (claimed) return true;
+	std::lock_guard<std::mutex> lock(namesLock);
+	claimed = receivedNames.insert(NameKey(fileName)).second;
+	return claimed;
+}
+void FileTeleporter::releaseName()
+{
+	if (!claimed) return;
+	std::lock_guard<std::mutex> lock(namesLock);
+	receivedNames.erase(NameKey(fileName));
+	claimed = false;
+}
+bool FileTeleporter::storeChunk(const unsigned char* chunk, size_t size)
+{
+	if (size < offsetof(FileChunk, data)) return false;
+	return storeChunkData(ChunkIndex(chunk), ChunkData(chunk), size - offsetof(FileChunk, data));
+}
+bool FileTeleporter::storeChunkData(uint32_t index, const unsigned char* data, size_t size)
+{
+	// don't rewrite data having been already written
+	if (index >= (uint32_t)totalChunks || chunkReceived[index]) return false;
+
+	uint64_t offset = (uint64_t)index * chunkSize;
+	uint64_t remaining = fileSize - offset;
+
+	// Only write valid bytes in the final chunk 
+	size_t copySize = (((uint64_t)chunkSize < (remaining)) ?
+		(size_t)chunkSize : (size_t)(remaining));
+	if (copySize > size) return false;
+
+	if (!spooled)
+	{
+		// write to file data buffer straight from the received datagram
+		memcpy(fileData.data() + offset, data, copySize);
+	}
+	else if (!sparseFile || !sparse::IsZero(data, copySize))
+	{
+		// into the partial file, made a hole: zeros of a sparse file need no writing
+		if (!writeData(offset, (const char*)data, copySize)) return false;
+	}
+	chunkReceived[index] = true;
+	return true;
+}
+void FileTeleporter::ackChunk(uint32_t index)
+{
+	ackOfChunks[index] = true;
+	chunkInFlight[index] = false;
+	// slide the window past everything acked
+	while (chunkIndex < (uint32_t)totalChunks && ackOfChunks[chunkIndex])
+	{
+		chunkIndex++;
+	}
+}
+
+/*
+* the receiver dropped these chunks, whatever acked them. they go out again,
+* plain: a compressed run it couldn't inflate would only be dropped again.
+*/
+void FileTeleporter::resendChunks(uint32_t first, uint32_t count)
+{
+	if (count == 0 || first >= (uint32_t)totalChunks || count > (uint32_t)totalChunks - first) return;
+	uint32_t end = first + count;
+	// the ack of a message still in flight would credit them again
+	for (map<unsigned int, ChunkRun>::iterator itor = sequenceChunks.begin(); itor != sequenceChunks.end();)
+	{
+		if (itor->second.first < end && itor->second.first + itor->second.count > first)
+		{
+			for (int c = 0; c < itor->second.count; c++)
+			{
+				chunkInFlight[itor->second.first + c] = false;
+			}
+			itor = sequenceChunks.erase(itor);
+		}
+		else
+		{
+			++itor;
+		}
+	}
+	{
+		lock_guard<mutex> lock(compressionLock);
+		for (uint32_t group = first / FecGroupSize; group <= (end - 1) / FecGroupSize; group++)
+		{
+			if (group >= groupCompressed.size() || !groupCompressed[group]) continue;
+			vector<CompressedRun>& runs = compressedGroups[group];
+			for (size_t i = 0; i < runs.size();)
+			{
+				if (runs[i].first < end && runs[i].first + runs[i].count > first)
+					runs.erase(runs.begin() + i);
+				else
+					i++;
+			}
+		}
+	}
+	for (uint32_t index = first; index < end; index++)
+	{
+		ackOfChunks[index] = false;
+		chunkInFlight[index] = false;
+	}
+	if (first < chunkIndex) chunkIndex = first;
+}
+
+/*
+* the receiver has no transfer going, everything acked so far went nowhere.
+* wave the file again from the metadata, at the chunk size the path was probed for.
+*/
+void FileTeleporter::restart()
+{
+	if (deltaTransfer)
+	{
+		// a delta against an old copy the receiver may not have anymore
+		dropDelta();
+	}
+	setChunkSize(chunkSize);
+	state = WAVING;
+	restated = CRACKED;
+}
+
+void FileTeleporter::OnPacketSent(unsigned int sequence)
+{
+	if (loadedProbe > 0)
+	{
+		pathMtu.ProbeSent(sequence, loadedProbe);
+		loadedProbe = 0;
+	}
+	if (loadedParity >= 0 && loadedParity < (int)parityAcked.size())
+	{
+		sequenceParity[sequence] = loadedParity;
+	}
+	loadedParity = -1;
+	if (loadedChunk < 0 || loadedChunk + loadedCount > (int)chunkInFlight.size()) return;
+	for (int i = 0; i < loadedCount; i++)
+	{
+		chunkInFlight[loadedChunk + i] = true;
+	}
+	ChunkRun run = { (uint32_t)loadedChunk, loadedCount };
+	sequenceChunks[sequence] = run;
+	loadedChunk = -1;
+}
+
+bool FileTeleporter::IsLoadedReliable() const
+{
+	return loadedChunk >= 0;
+}
+
+bool FileTeleporter::IsLoadedControl() const
+{
+	return loadedControl;
+}
+
+void FileTeleporter::OnPacketsAcked(const unsigned int* sequences, int count)
+{
+	pathMtu.ProcessAcks(sequences, count);
+	for (int i = 0; i < count; i++)
+	{
+		map<unsigned int, uint32_t>::iterator parity = sequenceParity.find(sequences[i]);
+		if (parity != sequenceParity.end())
+		{
+			parityAcked[parity->second]++;
+			checkGroup(parity->second);
+			sequenceParity.erase(parity);
+			continue;
+		}
+		map<unsigned int, ChunkRun>::iterator itor = sequenceChunks.find(sequences[i]);
+		if (itor == sequenceChunks.end()) continue;
+		for (int c = 0; c < itor->second.count; c++)
+		{
+			ackChunk(itor->second.first + c);
+		}
+		// a run of zero or repeated chunks may cross groups
+		uint32_t lastGroup = (itor->second.first + itor->second.count - 1) / FecGroupSize;
+		for (uint32_t group = itor->second.first / FecGroupSize; group <= lastGroup; group++)
+		{
+			checkGroup(group);
+		}
+		sequenceChunks.erase(itor);
+	}
+}
+
+void FileTeleporter::OnPacketsLost(const unsigned int* sequences, int count)
+{
+	pathMtu.ProcessLost(sequences, count);
+	for (int i = 0; i < count; i++)
+	{
+		// lost parity is not sent again, the chunks it covered are
+		sequenceParity.erase(sequences[i]);
+		map<unsigned int, ChunkRun>::iterator itor = sequenceChunks.find(sequences[i]);
+		if (itor == sequenceChunks.end()) continue;
+		// back in the window to be sent again
+		for (int c = 0; c < itor->second.count; c++)
+		{
+			chunkInFlight[itor->second.first + c] = false;
+		}
+		sequenceChunks.erase(itor);
+	}
+}
+
+void FileTeleporter::SetLossRate(double rate)
+{
+	lossRate += (rate - lossRate) * LossSmoothing;
+	double expected = ParityPerLoss * FecGroupSize * lossRate;
+	int chunks = (int)expected + (expected > (int)expected ? 1 : 0);
+	parityChunks = chunks < MaxParityChunks ? chunks : MaxParityChunks;
+}
+
+int FileTeleporter::groupChunks(uint32_t group) const
+{
+	int chunks = totalChunks - (int)group * FecGroupSize;
+	return chunks < FecGroupSize ? chunks : FecGroupSize;
+}
+
+/*
+* write parity chunk row of a group straight from the file buffer,
+* or from the group read back of a spooled file.
+*/
+int FileTeleporter::packParity(unsigned char packet[JumboPacketSize], uint32_t group, int row)
+{
+	const uint32_t id = PCID;
+	const uint32_t index = group << 8 | row;
+	unsigned char* chunk = packet + offsetof(Message, content);
+	uint64_t offset = (uint64_t)group * FecGroupSize * chunkSize;
+	uint64_t length = fileSize - offset;
+	if (length > (uint64_t)groupChunks(group) * chunkSize) length = (uint64_t)groupChunks(group) * chunkSize;
+	const char* data = fileData.data() + (spooled ? 0 : offset);
+	if (spooled)
+	{
+		spoolScratch.resize((size_t)length);
+		if (!readData(offset, spoolScratch.data(), (size_t)length)) return 0;
+		data = spoolScratch.data();
+	}
+	memcpy(packet + offsetof(Message, id), &id, sizeof(id));
+	memcpy(chunk + offsetof(FileChunk, chunkIndex), &index, sizeof(index));
+	fec::EncodeParity(row, (const unsigned char*)data, (size_t)length,
+		groupChunks(group), chunkSize, chunk + offsetof(FileChunk, data));
+	return (int)(offsetof(Message, content) + offsetof(FileChunk, data) + chunkSize);
+}
+
+/*
+* a group is delivered once the receiver holds as many of its chunks
+* and parity chunks as it has data chunks, it rebuilds the rest itself.
+*/
+void FileTeleporter::checkGroup(uint32_t group)
+{
+	int first = group * FecGroupSize;
+	int chunks = groupChunks(group);
+	int acked = parityAcked[group];
+	if (acked == 0) return;
+	for (int i = 0; i < chunks; i++)
+	{
+		if (ackOfChunks[first + i]) acked++;
+	}
+	if (acked < chunks) return;
+	for (int i = 0; i < chunks; i++)
+	{
+		if (!ackOfChunks[first + i]) ackChunk(first + i);
+	}
+}
+
+/*
+* the ack policy of the receiver, for a chunk received or rebuilt.
+*/
+void FileTeleporter::chunkArrived(uint32_t index)
+{
+	unsavedChunks.push_back(index);
+	bool inOrder = (index == chunkIndex);
+	while (chunkIndex < (uint32_t)totalChunks && chunkReceived[chunkIndex])
+	{
+		chunkIndex++;
+	}
+	if (!inOrder || chunkIndex != index + 1 || chunkIndex == (uint32_t)totalChunks)
+	{
+		// a gap opened or closed, or the file is complete: ack right away
+		ackDue = true;
+	}
+	else if (++unackedChunks >= AckEvery)
+	{
+		ackDue = true;
+	}
+	else if (unackedChunks == 1)
+	{
+		timers->Arm(ackTimer, (float)(ACK_DELAY / 1000));
+	}
+	if ((int)unsavedChunks.size() >= CheckpointChunks)
+	{
+		// on the next tick, not in the middle of handling the packet
+		timers->Arm(checkpointTimer, 0);
+	}
+}
+
+void FileTeleporter::storeParity(const unsigned char* chunk, size_t size)
+{
+	if (size < offsetof(FileChunk, data) + chunkSize) return;
+	uint32_t group = ChunkIndex(chunk) >> 8;
+	int row = ChunkIndex(chunk) & 0xff;
+	if (row >= MaxParityChunks || (int)group * FecGroupSize >= totalChunks) return;
+
+	int first = group * FecGroupSize;
+	int chunks = groupChunks(group);
+	int missing = 0;
+	for (int i = 0; i < chunks; i++)
+	{
+		if (!chunkReceived[first + i]) missing++;
+	}
+	if (missing == 0) return;
+
+	map<uint32_t, ParityGroup>::iterator itor = parityGroups.find(group);
+	if (itor == parityGroups.end())
+	{
+		itor = parityGroups.insert(make_pair(group, ParityGroup())).first;
+		itor->second.count = 0;
+	}
+	ParityGroup& parity = itor->second;
+	for (int i = 0; i < parity.count; i++)
+	{
+		if (parity.rows[i] == row) return;
+	}
+	parity.rows[parity.count] = row;
+	memcpy(parity.data[parity.count], ChunkData(chunk), chunkSize);
+	parity.count++;
+	recoverGroup(group);
+}
+
+/*
+* rebuild the missing chunks of a group once there is enough parity for them.
+*/
+void FileTeleporter::recoverGroup(uint32_t group)
+{
+	map<uint32_t, ParityGroup>::iterator itor = parityGroups.find(group);
+	if (itor == parityGroups.end()) return;
+	ParityGroup& parity = itor->second;
+
+	int first = group * FecGroupSize;
+	int chunks = groupChunks(group);
+	bool present[FecGroupSize];
+	int missing = 0;
+	for (int i = 0; i < chunks; i++)
+	{
+		present[i] = chunkReceived[first + i];
+		if (!present[i]) missing++;
+	}
+	if (missing > parity.count) return;
+	if (missing > 0)
+	{
+		// the group zero padded to whole chunks, as the sender encoded it
+		uint64_t offset = (uint64_t)first * chunkSize;
+		size_t length = (size_t)chunks * chunkSize;
+		if (fileSize - offset < length) length = (size_t)(fileSize - offset);
+		vector<unsigned char> data((size_t)chunks * chunkSize, 0);
+		if (!spooled)
+		{
+			memcpy(data.data(), fileData.data() + offset, length);
+		}
+		else if (!readData(offset, (char*)data.data(), length))
+		{
+			parityGroups.erase(itor);
+			return;
+		}
+
+		const unsigned char* rows[MaxParityChunks];
+		for (int i = 0; i < parity.count; i++) rows[i] = parity.data[i];
+		if (fec::Recover(data.data(), present, chunks, chunkSize, rows, parity.rows, parity.count))
+		{
+			if (!spooled) memcpy(fileData.data() + offset, data.data(), length);
+			for (int i = 0; i < chunks; i++)
+			{
+				if (present[i]) continue;
+				// a spooled file gets the rebuilt chunks written into it
+				size_t chunkOffset = (size_t)i * chunkSize;
+				if (spooled && !storeChunkData(first + i, data.data() + chunkOffset, length - chunkOffset)) continue;
+				chunkReceived[first + i] = true;
+				chunkArrived(first + i);
+			}
+		}
+	}
+	parityGroups.erase(itor);
+}
+
+void FileTeleporter::SetTransferMode(TransferMode mode)
+{
+	transferMode = mode;
+}
+
+TransferMode FileTeleporter::GetTransferMode() const
+{
+	return transferMode;
+}
+
+/*
+* write the next fountain symbol straight from the file buffer.
+*/
+int FileTeleporter::packSymbol(unsigned char packet[JumboPacketSize])
+{
+	const uint32_t id = SYID;
+	const uint32_t seed = nextSymbol++;
+	unsigned char* symbol = packet + offsetof(Message, content);
+	memcpy(packet + offsetof(Message, id), &id, sizeof(id));
+	memcpy(symbol + offsetof(FileChunk, chunkIndex), &seed, sizeof(seed));
+	fountainCode.Encode(seed, (const unsigned char*)fileData.data(), fileSize,
+		chunkSize, symbol + offsetof(FileChunk, data));
+	return (int)(offsetof(Message, content) + offsetof(FileChunk, data) + chunkSize);
+}
+
+void FileTeleporter::storeSymbol(const unsigned char* symbol, size_t size)
+{
+	if (size < offsetof(FileChunk, data) + chunkSize) return;
+	fountainDecoder.AddSymbol(ChunkIndex(symbol), ChunkData(symbol),
+		(unsigned char*)fileData.data(), fileSize, chunkReceived);
+	if (fountainDecoder.GetKnownChunks() == totalChunks)
+	{
+		finishFile();
+	}
+}
+
+/*
+* every chunk is in, verify the file and write it out.
+*/
+void FileTeleporter::finishFile()
+{
+	if (deltaTransfer && !applyDelta())
+	{
+		cerr << " Delta doesn't apply to the old copy:" << fileName << endl;
+	}
+	uint32_t finalCRC = 0;
+	if (!calculateFileCRC(finalCRC))
+	{
+		cerr << "Error reading the file: " << fileName << PartialExtension << endl;
+		state = CRACKED;
+		return;
+	}
+	if (finalCRC != crc)
+	{
+		// the fountain keeps streaming, only chunk transfers ask for a resend
+		resent = (transferMode == ChunkTransfer);
+		cerr << " File verification failed:" << fileName << endl;
+		cerr << " Original File CRC: " << crc << endl;
+		cerr << " Received File CRC: " << finalCRC << endl;
+
+		// not equal to CRC, be prepare for receiving the file from the head.
+		chunkReceived.assign(totalChunks, false);				
+		if (!spooled) fileData.assign(fileSize, 0);
+		parityGroups.clear();
+		chunkIndex = 0;
+		unackedChunks = 0;
+		ackDue = false;
+		droppedChunks.clear();
+		unsavedChunks.clear();
+		resuming = false;
+		if (spooled) spoolFile.close();
+		removeJournal();
+		if (spooled && !createSpool())
+		{
+			cerr << "Error opening file for writing: " << fileName << PartialExtension << endl;
+			state = CRACKED;
+			return;
+		}
+		if (transferMode == FountainTransfer)
+		{
+			fountainDecoder.Reset(totalChunks, chunkSize);
+		}
+
+		state = READY;
+		std::cout << " Ready for retransmission" << endl;
+	}
+	else
+	{
+		if (bundled && !bundle::Unpack(fileData.data(), fileData.size(), fileName))
+		{
+			cerr << "Error unpacking the directory: " << fileName << endl;
+			state = CRACKED;
+		}
+		else if (!bundled)
+		{
+			writeFile();
+		}
+		if (state == CRACKED) return;
+		unsavedChunks.clear();
+		removeJournal();
+		if (!bundled && !spooled)
+		{
+			// known by what we hashed, not by what the sender claimed
+			Sha256((const unsigned char*)fileData.data(), fileData.size(), contentHash);
+			receiveCache.Add(contentHash, fileSize, fileName);
+		}
+		// it is on disk, the memory goes to the other transfers
+		releaseMemory();
+		printf("%s Received\n", fileName.c_str());
+		printf("Received file size: %llu bytes\n", (unsigned long long)fileSize);
+		printf("Original CRC claim: 0x%08X\n", crc);
+		state = DISCONNECTING;
+		std::cout << " Disonnecting " << endl;
+		timers->Arm(disconnectTimer, (float)(DISCONNECT_DURATION / 1000));
+	}
+}
+
+void FileTeleporter::SetMaxPacketSize(int size)
+{
+	if (size > JumboPacketSize) size = JumboPacketSize;
+	if (size < PacketSize) size = PacketSize;
+	maxPacketSize = size;
+}
+
+int FileTeleporter::GetChunkSize() const
+{
+	return chunkSize;
+}
+
+/*
+* cut the file into chunks of size bytes, everything counted in chunks starts over.
+*/
+void FileTeleporter::setChunkSize(int size)
+{
+	stopCompression();
+	chunkSize = size;
+	totalChunks = (int)((fileSize + chunkSize - 1) / chunkSize);
+	ackOfChunks.assign(totalChunks, false);
+	chunkInFlight.assign(totalChunks, false);
+	chunkSources.assign(totalChunks, PlainChunk);
+	sequenceChunks.clear();
+	chunkIndex = 0;
+	paritySent.assign((totalChunks + FecGroupSize - 1) / FecGroupSize, false);
+	parityAcked.assign(paritySent.size(), 0);
+	parityQueue.clear();
+	sequenceParity.clear();
+	fountainCode.Reset(transferMode == FountainTransfer ? totalChunks : 0);
+}
+
+/*
+* a path mtu probe: a NOID padded with zeros to size bytes.
+* the receiver drops it, the transport ack says the size got through.
+*/
+int FileTeleporter::packProbe(unsigned char packet[JumboPacketSize], int size)
+{
+	int header = packMessage(packet, NOID, NULL, 0);
+	memset(packet + header, 0, size - header);
+	return size;
+}
+
+/*
+* pick up the partial file of an earlier session. the journal must be for this
+* file, and its chunk size one we can still agree on: the OKID answers with it.
+* a journal that doesn't fit is thrown away with its partial file.
+*/
+bool FileTeleporter::loadJournal()
+{
+	ifstream journal(fileName + JournalExtension, ios::binary);
+	if (!journal.is_open()) 
+	{
+		removeJournal();
+		return false;
+	}
+	JournalHeader header = {};
+	journal.read((char*)&header, sizeof(header));
+	bool valid = journal.gcount() == sizeof(header) && header.magic == JournalMagic
+		&& header.fileSize == (uint32_t)fileSize && header.fileSizeHigh == (uint32_t)(fileSize >> 32) && header.crc32 == crc
+		&& header.chunkSize > 0 && header.chunkSize <= (uint32_t)chunkSize
+		&& header.totalChunks == (fileSize + header.chunkSize - 1) / header.chunkSize;
+	vector<unsigned char> bits;
+	if (valid)
+	{
+		bits.assign((header.totalChunks + 7) / 8, 0);
+		journal.read((char*)bits.data(), bits.size());
+		valid = journal.gcount() == (streamsize)bits.size();
+	}
+	journal.close();
+	if (valid && spooled)
+	{
+		// the chunks go on being written into the partial file as it is
+		error_code error;
+		valid = filesystem::file_size(fileName + PartialExtension, error) == fileSize && !error;
+		if (valid) spoolFile.open(fileName + PartialExtension, ios::binary | ios::in | ios::out);
+		valid = valid && spoolFile.is_open();
+	}
+	else if (valid)
+	{
+		ifstream part(fileName + PartialExtension, ios::binary);
+		part.read(fileData.data(), fileSize);
+		valid = part.gcount() == (streamsize)fileSize;
+	}
+	if (!valid)
+	{
+		removeJournal();
+		return false;
+	}
+
+	chunkSize = header.chunkSize;
+	totalChunks = header.totalChunks;
+	chunkReceived.assign(totalChunks, false);
+	for (int i = 0; i < totalChunks; i++)
+	{
+		chunkReceived[i] = (bits[i / 8] >> (i % 8) & 1) != 0;
+	}
+	chunkIndex = 0;
+	while (chunkIndex < (uint32_t)totalChunks && chunkReceived[chunkIndex])
+	{
+		chunkIndex++;
+	}
+	resuming = true;
+	resumePiece = 0;
+	return true;
+}
+
+/*
+* write the new chunks into the partial file, then the journal. the journal goes
+* last and is renamed over the old one, so it never claims a chunk the partial
+* file doesn't hold.
+*/
+void FileTeleporter::checkpoint()
+{
+	timers->Arm(checkpointTimer, (float)(CHECKPOINT_INTERVAL / 1000));
+	// a delta is only good against this old copy, it isn't kept
+	if (transferMode != ChunkTransfer || deltaTransfer || chunkReceived.empty()) return;
+
+	string partPath = fileName + PartialExtension;
+	if (!unsavedChunks.empty() && spooled)
+	{
+		// the chunks are in the partial file already, only not on disk yet
+		spoolFile.flush();
+		if (!spoolFile.good())
+		{
+			cerr << "Error writing the file: " << partPath << endl;
+			return;
+		}
+		unsavedChunks.clear();
+	}
+	else if (!unsavedChunks.empty())
+	{
+		fstream part(partPath, ios::binary | ios::in | ios::out);
+		if (!part.is_open())
+		{
+			// first checkpoint of the file, sized up front
+			ofstream(partPath, ios::binary).close();
+			error_code error;
+			filesystem::resize_file(partPath, fileSize, error);
+			part.open(partPath, ios::binary | ios::in | ios::out);
+		}
+		if (!part.is_open())
+		{
+			cerr << "Error opening file for writing: " << partPath << endl;
+			return;
+		}
+		for (size_t i = 0; i < unsavedChunks.size(); i++)
+		{
+			size_t offset = (size_t)unsavedChunks[i] * chunkSize;
+			size_t length = fileSize - offset < (size_t)chunkSize ? (size_t)(fileSize - offset) : chunkSize;
+			part.seekp(offset);
+			part.write(fileData.data() + offset, length);
+		}
+		part.close();
+		if (part.fail())
+		{
+			cerr << "Error writing the file: " << partPath << endl;
+			return;
+		}
+		unsavedChunks.clear();
+	}
+
+	JournalHeader header = { JournalMagic, (uint32_t)fileSize, crc, (uint32_t)chunkSize, (uint32_t)totalChunks,
+		(uint32_t)(fileSize >> 32) };
+	vector<unsigned char> bits((totalChunks + 7) / 8, 0);
+	for (int i = 0; i < totalChunks; i++)
+	{
+		if (chunkReceived[i]) bits[i / 8] |= 1 << (i % 8);
+	}
+	string journalPath = fileName + JournalExtension;
+	string tempPath = journalPath + ".tmp";
+	ofstream journal(tempPath, ios::binary);
+	journal.write((const char*)&header, sizeof(header));
+	journal.write((const char*)bits.data(), bits.size());
+	journal.close();
+	if (journal.fail())
+	{
+		cerr << "Error writing the file: " << tempPath << endl;
+		return;
+	}
+	error_code error;
+	filesystem::rename(tempPath, journalPath, error);
+}
+
+void FileTeleporter::removeJournal()
+{
+	error_code error;
+	filesystem::remove(fileName + JournalExtension, error);
+	filesystem::remove(fileName + PartialExtension, error);
+}
+
+/*
+* write the next piece of the resume map that has any chunk in it,
+* 0 once the whole map went out.
+*/
+int FileTeleporter::packResumeMap(unsigned char packet[JumboPacketSize])
+{
+	if (!resuming) return 0;
+	while (resumePiece * (uint32_t)ResumeMapChunks < (uint32_t)totalChunks)
+	{
+		ResumeMap piece = {};
+		piece.chunkSize = chunkSize;
+		piece.firstChunk = resumePiece++ * ResumeMapChunks;
+		int count = totalChunks - piece.firstChunk;
+		if (count > ResumeMapChunks) count = ResumeMapChunks;
+		bool any = false;
+		for (int i = 0; i < count; i++)
+		{
+			if (!chunkReceived[piece.firstChunk + i]) continue;
+			piece.bits[i / 8] |= 1 << (i % 8);
+			any = true;
+		}
+		if (any)
+		{
+			return packMessage(packet, RMID, &piece, offsetof(ResumeMap, bits) + (count + 7) / 8);
+		}
+	}
+	return 0;
+}
+
+void FileTeleporter::storeResumeMap(const unsigned char* piece, size_t size)
+{
+	if (size < offsetof(ResumeMap, bits)) return;
+	// made for another chunk size, wait for the OKID to settle on the receiver's
+	if (ReadU32(piece + offsetof(ResumeMap, chunkSize)) != (uint32_t)chunkSize) return;
+	uint32_t first = ReadU32(piece + offsetof(ResumeMap, firstChunk));
+	const unsigned char* bits = piece + offsetof(ResumeMap, bits);
+	size_t count = (size - offsetof(ResumeMap, bits)) * 8;
+	for (size_t i = 0; i < count && first + i < (uint32_t)totalChunks; i++)
+	{
+		if ((bits[i / 8] >> (i % 8) & 1) && !ackOfChunks[first + i])
+		{
+			ackChunk(first + i);
+		}
+	}
+}
+
+/*
+* read the old copy of the file, if there is one, and sign its blocks.
+*/
+void FileTeleporter::loadBasis()
+{
+	basisData.clear();
+	signatures.clear();
+	signaturePiece = 0;
+	error_code error;
+	// besides the file: the old copy, the delta, and the file rebuilt from both
+	uint64_t deltaSize = delta::MaxSize((size_t)fileSize, delta::BlockSize((size_t)fileSize));
+	if (bundled)
+	{
+		// an old copy of the directory, bundled the way the sender bundles it
+		if (!filesystem::is_directory(fileName, error) || !bundle::Pack(fileName, basisData)
+			|| basisData.size() > maxBufferedSize || !holdMemory(2 * fileSize + basisData.size() + deltaSize))
+		{
+			vector<char>().swap(basisData);
+			return;
+		}
+	}
+	else
+	{
+		if (!filesystem::is_regular_file(fileName, error)) return;
+		ifstream basis(fileName, ios::binary | ios::ate);
+		if (!basis.is_open()) return;
+		streamsize basisSize = basis.tellg();
+		// an old copy too big to hold goes unused, the file comes whole
+		if ((uint64_t)basisSize > maxBufferedSize || !holdMemory(2 * fileSize + basisSize + deltaSize)) return;
+		basis.seekg(0, ios::beg);
+		basisData.assign((size_t)basisSize, 0);
+		basis.read(basisData.data(), basisSize);
+		if (basis.gcount() != basisSize)
+		{
+			vector<char>().swap(basisData);
+			holdMemory(fileSize);
+			return;
+		}
+	}
+	blockSize = delta::BlockSize(fileSize);
+	delta::Signatures((const unsigned char*)basisData.data(), basisData.size(), blockSize, signatures);
+	if (signatures.empty())
+	{
+		// smaller than a block, nothing to copy from it
+		vector<char>().swap(basisData);
+		holdMemory(fileSize);
+		return;
+	}
+	std::cout << " Found an old copy, " << signatures.size() << " blocks of " << blockSize << " bytes" << endl;
+}
+
+/*
+* write the next run of signatures, 0 once all of them went out or there is no old copy.
+*/
+int FileTeleporter::packSignatures(unsigned char packet[JumboPacketSize])
+{
+	const uint32_t perMessage = sizeof(BlockSignatures::signatures) / sizeof(delta::BlockSignature);
+	if (deltaTransfer || signaturePiece * perMessage >= signatures.size()) return 0;
+	BlockSignatures message;
+	message.blockSize = blockSize;
+	message.basisBlocks = (uint32_t)signatures.size();
+	message.firstBlock = signaturePiece++ * perMessage;
+	uint32_t count = message.basisBlocks - message.firstBlock;
+	if (count > perMessage) count = perMessage;
+	memcpy(message.signatures, signatures.data() + message.firstBlock, count * sizeof(delta::BlockSignature));
+	return packMessage(packet, SGID, &message,
+		offsetof(BlockSignatures, signatures) + count * sizeof(delta::BlockSignature));
+}
+
+void FileTeleporter::storeSignatures(const unsigned char* message, size_t size)
+{
+	if (size < offsetof(BlockSignatures, signatures)) return;
+	uint32_t signedBlockSize = ReadU32(message + offsetof(BlockSignatures, blockSize));
+	uint32_t basisBlocks = ReadU32(message + offsetof(BlockSignatures, basisBlocks));
+	uint32_t first = ReadU32(message + offsetof(BlockSignatures, firstBlock));
+	if (signedBlockSize != blockSize || basisBlocks != signatures.size())
+	{
+		// signatures of another old copy, start over
+		blockSize = signedBlockSize;
+		signatures.assign(basisBlocks, delta::BlockSignature());
+		signatureReceived.assign(basisBlocks, false);
+		signatureCount = 0;
+	}
+	size_t count = (size - offsetof(BlockSignatures, signatures)) / sizeof(delta::BlockSignature);
+	const unsigned char* entries = message + offsetof(BlockSignatures, signatures);
+	for (size_t i = 0; i < count && first + i < basisBlocks; i++)
+	{
+		if (signatureReceived[first + i]) continue;
+		memcpy(&signatures[first + i], entries + i * sizeof(delta::BlockSignature), sizeof(delta::BlockSignature));
+		signatureReceived[first + i] = true;
+		signatureCount++;
+	}
+}
+
+/*
+* swap the file for its delta against the receiver's old copy. the chunks, the
+* parity and the window all run over the delta from here on.
+*/
+void FileTeleporter::buildDelta()
+{
+	vector<char> deltaData;
+	delta::Encode((const unsigned char*)fileData.data(), fileSize, blockSize, signatures, deltaData);
+	wholeFile.swap(fileData);
+	fileData.swap(deltaData);
+	targetSize = fileSize;
+	fileSize = fileData.size();
+	deltaTransfer = true;
+	setChunkSize(chunkSize);
+	std::cout << " Sending a delta of " << fileSize << " bytes for " << targetSize << endl;
+}
+
+void FileTeleporter::dropDelta()
+{
+	stopCompression();
+	fileData.swap(wholeFile);
+	wholeFile.clear();
+	fileSize = targetSize;
+	deltaTransfer = false;
+	setChunkSize(chunkSize);
+	findCopies();
+	startCompression();
+}
+
+void FileTeleporter::storeDeltaHeader(const unsigned char* header, size_t size)
+{
+	if (size < sizeof(DeltaHeader) || basisData.empty() || deltaTransfer) return;
+	if (ReadU32(header + offsetof(DeltaHeader, blockSize)) != blockSize) return;
+	uint32_t deltaSize = ReadU32(header + offsetof(DeltaHeader, deltaSize));
+	if (deltaSize > delta::MaxSize(fileSize, blockSize) || deltaSize > (uint32_t)INT_MAX)
+	{
+		cerr << "Malformed delta header, no delta of the file is that long" << endl;
+		state = CRACKED;
+		return;
+	}
+	targetSize = fileSize;
+	fileSize = deltaSize;
+	totalChunks = (int)((fileSize + chunkSize - 1) / chunkSize);
+	chunkReceived.assign(totalChunks, false);
+	fileData.assign(fileSize, 0);
+	chunkIndex = 0;
+	deltaTransfer = true;
+}
+
+/*
+* rebuild the file from the old copy and the delta received. fileData and
+* fileSize are the file's again afterwards, zeros if the delta was bad.
+*/
+bool FileTeleporter::applyDelta()
+{
+	vector<char> target;
+	bool applied = delta::Apply((const unsigned char*)basisData.data(), basisData.size(), blockSize,
+		(const unsigned char*)fileData.data(), fileSize, target) && target.size() == (size_t)targetSize;
+	if (!applied) target.assign(targetSize, 0);
+	fileData.swap(target);
+	fileSize = targetSize;
+	totalChunks = (int)((fileSize + chunkSize - 1) / chunkSize);
+	deltaTransfer = false;
+	vector<char>().swap(basisData);
+	signatures.clear();
+	holdMemory(fileSize);
+	return applied;
+}
+
+void FileTeleporter::SetMaxBufferedSize(uint64_t size)
+{
+	maxBufferedSize = size < (uint64_t)INT_MAX ? size : (uint64_t)INT_MAX;
+}
+
+uint64_t FileTeleporter::GetMaxBufferedSize() const
+{
+	return maxBufferedSize;
+}
+
+void FileTeleporter::SetMemoryBudget(MemoryBudget* budget)
+{
+	memoryBudget = budget;
+}
+
+/*
+* hold bytes of memory in all for the transfer, taking more from the budget or
+* giving some back. false, with what was held kept, when the budget lacks them.
+*/
+bool FileTeleporter::holdMemory(uint64_t bytes)
+{
+	if (memoryBudget == NULL) return true;
+	if (bytes > memoryHeld && !memoryBudget->Take(bytes - memoryHeld)) return false;
+	if (bytes < memoryHeld) memoryBudget->Give(memoryHeld - bytes);
+	memoryHeld = bytes;
+	return true;
+}
+
+/*
+* let go of the file and the old copy, the memory goes back to the budget.
+*/
+void FileTeleporter::releaseMemory()
+{
+	vector<char>().swap(fileData);
+	vector<char>().swap(basisData);
+	holdMemory(0);
+}
+
+void FileTeleporter::SetCompression(bool enabled)
+{
+	compression = enabled;
+}
+
+bool FileTeleporter::GetCompression() const
+{
+	return compression;
+}
+
+/*
+* compress the groups on worker threads, in order, ahead of the window.
+* a group takes the workers microseconds, far less than sending it does.
+*/
+void FileTeleporter::startCompression()
+{
+	stopCompression();
+	// the workers read the file from memory, a spooled one goes plain
+	if (!compression || spooled || transferMode != ChunkTransfer || totalChunks == 0) return;
+	uint32_t groups = (totalChunks + FecGroupSize - 1) / FecGroupSize;
+	compressedGroups.assign(groups, vector<CompressedRun>());
+	groupCompressed.assign(groups, false);
+	nextCompressGroup = 0;
+	compressionStopped = false;
+	unsigned int threads = thread::hardware_concurrency();
+	threads = threads > 1 ? threads - 1 : 1;
+	if (threads > groups) threads = groups;
+	for (unsigned int i = 0; i < threads; i++)
+	{
+		compressionWorkers.push_back(thread(&FileTeleporter::compressWorker, this));
+	}
+}
+
+void FileTeleporter::stopCompression()
+{
+	{
+		lock_guard<mutex> lock(compressionLock);
+		compressionStopped = true;
+	}
+	groupDone.notify_all();
+	for (size_t i = 0; i < compressionWorkers.size(); i++)
+	{
+		compressionWorkers[i].join();
+	}
+	compressionWorkers.clear();
+	compressedGroups.clear();
+	groupCompressed.clear();
+}
+
+void FileTeleporter::compressWorker()
+{
+	vector<unsigned char> scratch(chunkSize);
+	while (!compressionStopped)
+	{
+		uint32_t group = nextCompressGroup++;
+		if (group >= compressedGroups.size()) return;
+		uint32_t first = group * FecGroupSize;
+		int chunks = groupChunks(group);
+		vector<CompressedRun> runs;
+
+		// a group whose first chunk doesn't shrink by an eighth is taken
+		// for incompressible and goes plain
+		size_t offset = (size_t)first * chunkSize;
+		size_t sample = fileSize - offset < (size_t)chunkSize ? (size_t)(fileSize - offset) : chunkSize;
+		if (lz::Compress((const unsigned char*)fileData.data() + offset, sample,
+			scratch.data(), sample - sample / 8) != 0)
+		{
+			compressRuns(first, chunks, scratch, runs);
+		}
+
+		{
+			lock_guard<mutex> lock(compressionLock);
+			compressedGroups[group].swap(runs);
+			groupCompressed[group] = true;
+		}
+		groupDone.notify_all();
+	}
+}
+
+/*
+* the longest runs that still fit in one message once compressed: the whole
+* group if it can, else each half of it, down to single chunks. a single
+* chunk that doesn't get any smaller stays plain.
+*/
+void FileTeleporter::compressRuns(uint32_t first, int count,
+	vector<unsigned char>& scratch, vector<CompressedRun>& runs)
+{
+	size_t offset = (size_t)first * chunkSize;
+	size_t length = (size_t)(fileSize - offset);
+	if (length > (size_t)count * chunkSize) length = (size_t)count * chunkSize;
+	size_t capacity = chunkSize - offsetof(CompressedChunks, data) + offsetof(FileChunk, data);
+	size_t compressed = lz::Compress((const unsigned char*)fileData.data() + offset, length,
+		scratch.data(), capacity);
+	if (compressed > 0 && (count > 1 || compressed < length))
+	{
+		CompressedRun run;
+		run.first = first;
+		run.count = count;
+		run.data.assign(scratch.begin(), scratch.begin() + compressed);
+		runs.push_back(run);
+	}
+	else if (count > 1)
+	{
+		compressRuns(first, count / 2, scratch, runs);
+		compressRuns(first + count / 2, count - count / 2, scratch, runs);
+	}
+}
+
+/*
+* the compressed run starting at index, if none of its chunks went out since:
+* a run is only ever sent whole. waits for the workers to get to its group,
+* in the rare case they haven't yet.
+*/
+const FileTeleporter::CompressedRun* FileTeleporter::compressedRun(uint32_t index)
+{
+	uint32_t group = index / FecGroupSize;
+	unique_lock<mutex> lock(compressionLock);
+	if (group >= groupCompressed.size()) return NULL;
+	groupDone.wait(lock, [&] { return groupCompressed[group] || compressionStopped; });
+	if (!groupCompressed[group]) return NULL;
+	const vector<CompressedRun>& runs = compressedGroups[group];
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		if (runs[i].first != index) continue;
+		for (int c = 0; c < runs[i].count; c++)
+		{
+			if (ackOfChunks[index + c] || chunkInFlight[index + c]) return NULL;
+		}
+		return &runs[i];
+	}
+	return NULL;
+}
+
+int FileTeleporter::packCompressed(unsigned char packet[JumboPacketSize], const CompressedRun& run)
+{
+	const uint32_t id = ZCID;
+	const uint32_t count = run.count;
+	unsigned char* chunks = packet + offsetof(Message, content);
+	memcpy(packet + offsetof(Message, id), &id, sizeof(id));
+	memcpy(chunks + offsetof(CompressedChunks, firstChunk), &run.first, sizeof(run.first));
+	memcpy(chunks + offsetof(CompressedChunks, chunkCount), &count, sizeof(count));
+	memcpy(chunks + offsetof(CompressedChunks, data), run.data.data(), run.data.size());
+	return (int)(offsetof(Message, content) + offsetof(CompressedChunks, data) + run.data.size());
+}
+
+/*
+* unpack a run of chunks and store the ones we don't have yet.
+*/
+void FileTeleporter::storeCompressed(const unsigned char* chunks, size_t size)
+{
+	if (size < offsetof(CompressedChunks, data)) return;
+	uint32_t first = ReadU32(chunks + offsetof(CompressedChunks, firstChunk));
+	uint32_t count = ReadU32(chunks + offsetof(CompressedChunks, chunkCount));
+	if (count == 0 || count > FecGroupSize || first >= (uint32_t)totalChunks
+		|| count > (uint32_t)totalChunks - first) return;
+
+	size_t offset = (size_t)first * chunkSize;
+	size_t length = (size_t)(fileSize - offset);
+	if (length > (size_t)count * chunkSize) length = (size_t)count * chunkSize;
+	inflated.resize(length);
+	if (!lz::Decompress(chunks + offsetof(CompressedChunks, data), size - offsetof(CompressedChunks, data),
+		inflated.data(), length))
+	{
+		// acked all the same, the sender hears from us which of them we lack
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (!chunkReceived[first + i]) dropChunk(first + i);
+		}
+		return;
+	}
+
+	bool stored = false;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		size_t chunkOffset = (size_t)i * chunkSize;
+		if (!storeChunkData(first + i, inflated.data() + chunkOffset, length - chunkOffset)) continue;
+		chunkArrived(first + i);
+		stored = true;
+	}
+	if (!stored)
+	{
+		// already have them all, the sender missed our ack
+		ackDue = true;
+		return;
+	}
+	recoverGroup(first / FecGroupSize);
+}
+
+/*
+* sort the chunks into zeros, repeats of an earlier chunk and the rest.
+* the holes of a sparse file are zero chunks too, they go out as ZRID.
+* a repeat points at the first chunk with its bytes, which goes out itself.
+* the crc only finds candidates, the bytes are compared before one is taken.
+* a spooled file isn't read through for them, only its holes and the chunks
+* at the edges of its data are looked at.
+*/
+void FileTeleporter::findCopies()
+{
+	chunkSources.assign(totalChunks, PlainChunk);
+	if (transferMode != ChunkTransfer) return;
+	unordered_multimap<uint32_t, uint32_t> firsts; // crc -> first chunk with those bytes
+	const unsigned char* data = (const unsigned char*)fileData.data();
+	size_t extent = 0;
+	for (int index = 0; index < totalChunks; index++)
+	{
+		uint64_t offset = (uint64_t)index * chunkSize;
+		size_t length = fileSize - offset < (uint64_t)chunkSize ? (size_t)(fileSize - offset) : chunkSize;
+		// a chunk in a hole of the file is zeros without looking, a delta has no holes
+		while (extent < dataExtents.size() && dataExtents[extent].offset + dataExtents[extent].length <= offset)
+		{
+			extent++;
+		}
+		bool inHole = !deltaTransfer && (extent == dataExtents.size() || dataExtents[extent].offset >= offset + length);
+		if (inHole || (!spooled && sparse::IsZero(data + offset, length)))
+		{
+			chunkSources[index] = ZeroChunk;
+			continue;
+		}
+		if (spooled)
+		{
+			// extents go by file system blocks, the chunks in their first and last block may be zeros still
+			const sparse::Extent& around = dataExtents[extent];
+			if (offset < around.offset + sparse::BlockSize || offset + length + sparse::BlockSize > around.offset + around.length)
+			{
+				spoolScratch.resize(length);
+				if (readData(offset, spoolScratch.data(), length)
+					&& sparse::IsZero((const unsigned char*)spoolScratch.data(), length))
+				{
+					chunkSources[index] = ZeroChunk;
+				}
+			}
+			continue;
+		}
+		// only whole chunks repeat, the short last one always goes out itself
+		if (length < (size_t)chunkSize) continue;
+		uint32_t hash = CRC::Calculate(data + offset, length, CRC::CRC_32());
+		typedef unordered_multimap<uint32_t, uint32_t>::const_iterator Iterator;
+		pair<Iterator, Iterator> candidates = firsts.equal_range(hash);
+		for (Iterator itor = candidates.first; itor != candidates.second; ++itor)
+		{
+			if (memcmp(data + offset, data + (size_t)itor->second * chunkSize, length) == 0)
+			{
+				chunkSources[index] = itor->second;
+				break;
+			}
+		}
+		if (chunkSources[index] == PlainChunk)
+		{
+			firsts.insert(make_pair(hash, (uint32_t)index));
+		}
+	}
+}
+
+/*
+* ZRID for the zero chunks from index on, or RPID for the chunks from index on
+* that repeat consecutive chunks the receiver has. the run may go past the
+* window, it costs the same few bytes however long it is.
+*/
+int FileTeleporter::packCopies(unsigned char packet[JumboPacketSize], uint32_t index)
+{
+	uint32_t source = chunkSources[index];
+	uint32_t count = 1;
+	while (index + count < (uint32_t)totalChunks
+		&& !ackOfChunks[index + count] && !chunkInFlight[index + count])
+	{
+		uint32_t next = chunkSources[index + count];
+		if (source == ZeroChunk ? next != ZeroChunk : next != source + count || !ackOfChunks[next]) break;
+		count++;
+	}
+	ChunkCopies copies = { index, count, source == ZeroChunk ? 0 : source };
+	loadedChunk = index;
+	loadedCount = count;
+	return packMessage(packet, source == ZeroChunk ? ZRID : RPID, &copies, sizeof(copies));
+}
+
+/*
+* fill in a run of zero chunks, or copy a run of chunks from ones we have.
+* the sender only repeats chunks we acked, a repeat of one we don't have is dropped
+* and the sender told.
+*/
+void FileTeleporter::storeCopies(const unsigned char* copies, size_t size, bool zeros)
+{
+	if (size < sizeof(ChunkCopies)) return;
+	uint32_t first = ReadU32(copies + offsetof(ChunkCopies, firstChunk));
+	uint32_t count = ReadU32(copies + offsetof(ChunkCopies, chunkCount));
+	uint32_t source = ReadU32(copies + offsetof(ChunkCopies, sourceChunk));
+	if (count == 0 || first >= (uint32_t)totalChunks || count > (uint32_t)totalChunks - first) return;
+	if (!zeros && (source >= first || count > first - source)) return;
 
-		if (offset + copySize > fileData.size())
+	bool stored = false;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t index = first + i;
+		if (chunkReceived[index]) continue;
+		uint64_t offset = (uint64_t)index * chunkSize;
+		size_t length = fileSize - offset < (uint64_t)chunkSize ? (size_t)(fileSize - offset) : chunkSize;
+		if (zeros)
+		{
+			// the partial file of a spooled one is a hole wherever nothing of it was written
+			if (!spooled) memset(fileData.data() + offset, 0, length);
+			chunkReceived[index] = true;
+		}
+		else if (!chunkReceived[source + i])
+		{
+			// a repeat of a chunk we dropped. the sender hears of both, it may
+			// have missed the ack that took the source back
+			dropChunk(index);
+			dropChunk(source + i);
+			continue;
+		}
+		else if (spooled)
+		{
+			spoolScratch.resize(chunkSize);
+			if (!readData((uint64_t)(source + i) * chunkSize, spoolScratch.data(), chunkSize)
+				|| !storeChunkData(index, (const unsigned char*)spoolScratch.data(), chunkSize)) continue;
+		}
+		else if (!storeChunkData(index,
+			(const unsigned char*)fileData.data() + (size_t)(source + i) * chunkSize, chunkSize))
 		{
-			fileData.resize(offset + copySize);
+			continue;
 		}
-		memcpy(fileData.data() + offset, fc.data, copySize);
-		// to sent an ack with chunkIndex.
-		chunkReceived[chunkIndex] = true;
+		chunkArrived(index);
+		stored = true;
+	}
+	if (!stored)
+	{
+		// already have them all, the sender missed our ack, or none could be stored
+		ackDue = true;
+		return;
 	}
+	for (uint32_t group = first / FecGroupSize; group <= (first + count - 1) / FecGroupSize; group++)
+	{
+		recoverGroup(group);
+	}
+}
+
+/*
+* a file with the contents the sender offers is in the cache: link it to the
+* name the sender gave, there is nothing to receive. the sender hears so by HVID.
+*/
+bool FileTeleporter::findCached()
+{
+	string path = receiveCache.Find(contentHash, fileSize);
+	if (path.empty() || !ContentCache::Link(path, fileName)) return false;
+	std::cout << fileName << " has the contents of " << path << ", nothing to receive" << endl;
+	cached = true;
+	removeJournal();
+	receiveCache.Add(contentHash, fileSize, fileName);
+	state = DISCONNECTING;
+	timers->Arm(disconnectTimer, (float)(DISCONNECT_DURATION / 1000));
+	return true;
 }
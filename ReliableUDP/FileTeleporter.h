@@ -4,20 +4,43 @@
 #include <fstream>
 #include <filesystem>
 #include <vector>
+#include <map>
+#include <deque>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <cstring>
+#include <cstddef>
+#include <climits>
 #include "CRC.h"
+#include "FEC.h"
+#include "Fountain.h"
+#include "PathMtu.h"
+#include "Delta.h"
+#include "LZ.h"
+#include "Sparse.h"
+#include "ContentCache.h"
+#include "Bundle.h"
+#include "TimerWheel.h"
+#include "MemoryBudget.h"
 using namespace std;
 
 namespace udpft
 {
-    const int PacketSize = 1400;
+    const int PacketSize = 1400;        // base message size, gets through any path.
+    const int JumboPacketSize = 8947;   // largest message: a 9000 byte jumbo frame less ip, udp, connection and channel headers.
     const int MaxFileNameLength = 128;
     const int ContentSize = PacketSize - sizeof(uint32_t);
     const int FileDataChunkSize = PacketSize - 2 * sizeof(uint32_t);
+    const int JumboChunkSize = JumboPacketSize - 2 * sizeof(uint32_t);
 
     const string DefaultFileName = "default";
 
     // ID for different types of message 
+    const uint32_t NOID = 0; // nothing to say, only keeps the connection alive
     const uint32_t MDID = 1;
     const uint32_t FCID = 2;
     const uint32_t ENDID = 3;
@@ -25,8 +48,54 @@ namespace udpft
     const uint32_t ACKID = 5;
     const uint32_t DISID = 6;
     const uint32_t RSID = 7;
+    const uint32_t PCID = 8; // parity chunk of a group, its chunkIndex holds group << 8 | row
+    const uint32_t SYID = 9; // fountain symbol, its chunkIndex holds the symbol seed
+    const uint32_t RMID = 10; // resume map, chunks the receiver kept from an earlier session
+    const uint32_t SGID = 11; // block signatures of the receiver's old copy of the file
+    const uint32_t DLID = 12; // the sender moves a delta against the old copy instead of the file
+    const uint32_t ZCID = 13; // consecutive chunks of a group compressed into one message
+    const uint32_t ZRID = 14; // a run of all-zero chunks, the receiver fills them in itself
+    const uint32_t RPID = 15; // a run of chunks repeating chunks the receiver already has
+    const uint32_t HVID = 16; // the receiver has a file with the same contents, nothing to send
+    const uint32_t LSID = 17; // the receiver is listening, it has no transfer for the chunks coming in
+
+    // how the chunks get across. in fountain mode the sender streams symbols
+    // without waiting for acks, the receiver's DISID is the only feedback.
+    enum TransferMode {
+        ChunkTransfer = 0,
+        FountainTransfer,
+    };
+    const int MetadataInterval = 32; // fountain mode repeats the metadata after this many packets.
 
     const double DISCONNECT_DURATION = 1000; // milliseconds for saying goodbye to the sender.
+
+    // chunk window and acknowledgement policy. chunks are acked by the transport,
+    // the receiver's ACKID only gives it a packet to carry the acks back.
+    const int SendWindow = 64;              // chunks the sender may have in flight past the first unacked one.
+    const int AckEvery = 4;                 // the receiver acks after this many new in-order chunks,
+    const double ACK_DELAY = 20;            // or this many milliseconds after the first of them.
+    const double KEEPALIVE_INTERVAL = 100;  // milliseconds between messages when there is nothing to say.
+    const double MISSING_INTERVAL = 250;    // milliseconds between reports of the chunks an ENDID finds missing.
+
+    // parity chunks per group follow the measured loss: about twice the chunks a group
+    // is expected to lose, none on a clean link. see FEC.h.
+    const double ParityPerLoss = 2.0;
+    const double LossSmoothing = 0.25;      // weight of a new loss sample.
+
+    // the receiver keeps a partial file next to a journal of the chunks in it, so a
+    // transfer cut off halfway resumes where it stopped. see ResumeMap.
+    const string PartialExtension = ".part";
+    const string JournalExtension = ".journal";
+    const uint32_t JournalMagic = 0x4A505455; // "UTPJ"
+    const int CheckpointChunks = 256;       // the journal is written after this many new chunks,
+    const double CHECKPOINT_INTERVAL = 1000; // or this many milliseconds after the last write.
+
+    // a file with holes, or one larger than a teleporter holds in memory, is spooled:
+    // the sender reads each chunk from the file as it goes out, the receiver writes it
+    // into the partial file as it comes in, and neither keeps the file in fileData.
+    // a fountain or a bundle past the limit can't be spooled, the receiver refuses it.
+    const uint64_t DefaultMaxBufferedSize = 64 << 20;
+    const uint64_t MaxTotalChunks = (1u << 24) * FecGroupSize; // a parity chunk names its group in 24 bits
     enum State {
         CRACKED = 0,
         // for a receiver 
@@ -46,8 +115,85 @@ namespace udpft
         uint32_t fileSize;
         uint32_t totalChunks;
         uint32_t crc32;
+        uint32_t transferMode;
+        uint32_t chunkSize;         // proposed by the sender, see ChunkSizeAccept
+        uint32_t holes;             // the file has holes, the receiver leaves its zeros as holes too
+        unsigned char sha256[Sha256Size]; // of the contents, the receiver may have them already
+        uint32_t bundle;            // the file is a directory bundled by bundle::Pack
+        uint32_t fileSizeHigh;      // upper half of the size of a file past 4 GB
+    };
+
+    // OKID content. the receiver's answer to the proposed chunk size, at most the proposal.
+    // the sender starts once the answer matches its proposal, and once a receiver
+    // holding an old copy of the file has the size of the delta it is sent.
+    struct TransferAccept {
+        uint32_t crc32;
+        uint32_t chunkSize;
+        uint32_t basisBlocks;       // blocks of the receiver's old copy, 0 for none
+        uint32_t blockSize;
+        uint32_t deltaSize;         // of the delta announced by DLID, 0 before
+    };
+
+    // SGID content. a run of the signatures of the receiver's old copy.
+    struct BlockSignatures {
+        uint32_t blockSize;
+        uint32_t basisBlocks;
+        uint32_t firstBlock;
+        delta::BlockSignature signatures[(ContentSize - 3 * sizeof(uint32_t)) / sizeof(delta::BlockSignature)];
+    };
+
+    // DLID content. the chunks that follow make up a delta of this size, not the file.
+    struct DeltaHeader {
+        uint32_t deltaSize;
+        uint32_t blockSize;
     };
 
+    // ACKID content, none when nothing was dropped. runs of chunks whose messages arrived,
+    // and so were acked by the transport, but couldn't be stored: a repeat of a chunk the
+    // receiver doesn't have, a compressed run that doesn't inflate. the sender sends them again.
+    struct DroppedRun {
+        uint32_t firstChunk;
+        uint32_t chunkCount;
+    };
+    const int MaxDroppedRuns = ContentSize / sizeof(DroppedRun);
+
+    // RMID content. a piece of the receiver's chunk bitmap, bit i of bits is
+    // chunk firstChunk + i. only means something at the chunk size it was made for.
+    struct ResumeMap {
+        uint32_t chunkSize;
+        uint32_t firstChunk;
+        unsigned char bits[ContentSize - 2 * sizeof(uint32_t)];
+    };
+    const int ResumeMapChunks = 8 * sizeof(ResumeMap::bits);
+
+    // head of the journal file, the chunk bitmap follows it.
+    // name, size and crc together identify the file.
+    struct JournalHeader {
+        uint32_t magic;
+        uint32_t fileSize;
+        uint32_t crc32;
+        uint32_t chunkSize;
+        uint32_t totalChunks;
+        uint32_t fileSizeHigh;
+    };
+
+    // ZCID content. chunkCount chunks from firstChunk, compressed together, see LZ.h.
+    struct CompressedChunks {
+        uint32_t firstChunk;
+        uint32_t chunkCount;
+        unsigned char data[ContentSize - 2 * sizeof(uint32_t)];
+    };
+
+    // ZRID and RPID content. chunkCount chunks from firstChunk are zeros, or the
+    // same bytes as as many chunks from sourceChunk, which ZRID leaves 0.
+    struct ChunkCopies {
+        uint32_t firstChunk;
+        uint32_t chunkCount;
+        uint32_t sourceChunk;
+    };
+    const uint32_t PlainChunk = 0xffffffff; // chunkSources entry of a chunk that goes out itself
+    const uint32_t ZeroChunk = 0xfffffffe;  // and of one that is all zeros
+
     struct FileChunk {
         uint32_t chunkIndex;
         unsigned char data[FileDataChunkSize];
@@ -59,6 +205,31 @@ namespace udpft
     };
 #pragma pack(pop)
 
+    // in-place parsers for received datagrams. they read single fields
+    // instead of copying whole Message/FileChunk/FileMetadata structs.
+    inline uint32_t ReadU32(const unsigned char* field)
+    {
+        uint32_t value;
+        memcpy(&value, field, sizeof(value));
+        return value;
+    }
+    inline uint32_t MessageId(const unsigned char* message)
+    {
+        return ReadU32(message + offsetof(Message, id));
+    }
+    inline const unsigned char* MessageContent(const unsigned char* message)
+    {
+        return message + offsetof(Message, content);
+    }
+    inline uint32_t ChunkIndex(const unsigned char* chunk)
+    {
+        return ReadU32(chunk + offsetof(FileChunk, chunkIndex));
+    }
+    inline const unsigned char* ChunkData(const unsigned char* chunk)
+    {
+        return chunk + offsetof(FileChunk, data);
+    }
+
     class FileTeleporter {
 
     private:
@@ -69,32 +240,189 @@ namespace udpft
         vector<char> fileData;      // for the receiver, store the file data.
         vector<bool> chunkReceived; // for the receiver, check if a chunk is received.
         vector<bool> ackOfChunks;   // for the sender, check if received a file chunk ack.
-        Message rcMs;               // store the received message.
-        FileChunk fc;
+        vector<bool> chunkInFlight; // for the sender, a packet carrying the chunk awaits its transport ack.
+        struct ChunkRun {
+            uint32_t first;
+            int count;
+        };
+        map<unsigned int, ChunkRun> sequenceChunks; // for the sender, transport sequence -> chunks it carried.
+        int loadedChunk;            // first chunk written by the last LoadPacket, -1 for none.
+        int loadedCount;            // chunks in that message, more than one when compressed together.
+
+        /***** forward error correction *****/
+        struct ParityGroup {        // for the receiver, parity kept until its group is complete.
+            int count;
+            int rows[MaxParityChunks];
+            unsigned char data[MaxParityChunks][JumboChunkSize];
+        };
+        map<uint32_t, ParityGroup> parityGroups;
+        double lossRate;            // for the sender, smoothed loss of the link.
+        int parityChunks;           // for the sender, parity chunks sent after each group.
+        vector<bool> paritySent;    // for the sender, the parity of a group was queued.
+        vector<unsigned char> parityAcked; // for the sender, parity chunks of a group acked.
+        deque<uint32_t> parityQueue;       // for the sender, group << 8 | row waiting to go out.
+        map<unsigned int, uint32_t> sequenceParity; // for the sender, transport sequence -> group of a parity chunk.
+        int loadedParity;           // group of the parity written by the last LoadPacket, -1 for none.
+
+        /***** fountain mode *****/
+        TransferMode transferMode;
+        LtCode fountainCode;        // for the sender
+        LtDecoder fountainDecoder;  // for the receiver
+        uint32_t nextSymbol;        // for the sender, seed of the next symbol.
+        uint32_t fountainPackets;   // for the sender, packets streamed so far.
+
+        /***** negotiated packet size *****/
+        int maxPacketSize;          // largest message the connection carries
+        int chunkSize;              // file data per chunk for this session
+        PathMtu pathMtu;            // for the sender, probes the path while waving
+        bool probing;               // for the sender, no chunk size proposed yet
+        int loadedProbe;            // size of the probe written by the last LoadPacket, 0 for none.
+
+        /***** resume journal *****/
+        vector<uint32_t> unsavedChunks;     // for the receiver, chunks not in the partial file yet.
+        net::Timer checkpointTimer;         // for the receiver, the next checkpoint is due.
+        bool resuming;                      // for the receiver, chunks were kept from an earlier session.
+        uint32_t resumePiece;               // for the receiver, next piece of the resume map to send.
+
+        /***** delta against the receiver's old copy *****/
+        bool deltaTransfer;                 // the chunks carry a delta, fileData and fileSize are the delta's.
+        uint64_t targetSize;                // size of the file itself while its delta is moved.
+        uint32_t blockSize;                 // of the signatures
+        vector<delta::BlockSignature> signatures; // receiver: of its old copy. sender: as they come in.
+        vector<bool> signatureReceived;     // for the sender
+        uint32_t signatureCount;            // for the sender, distinct signatures received.
+        uint32_t signaturePiece;            // for the receiver, next signature message to send.
+        vector<char> basisData;             // for the receiver, the old copy.
+        vector<char> wholeFile;             // for the sender, the file while fileData holds its delta.
+
+        /***** compression *****/
+        struct CompressedRun {              // for the sender, chunks of a group that go in one ZCID
+            uint32_t first;
+            int count;
+            vector<unsigned char> data;
+        };
+        bool compression;                   // for the sender, compress the chunks where it pays.
+        vector<vector<CompressedRun>> compressedGroups; // for the sender, filled in by the workers.
+        vector<bool> groupCompressed;       // for the sender, the workers are done with the group.
+        mutex compressionLock;              // guards groupCompressed and the runs of unfinished groups.
+        condition_variable groupDone;
+        vector<thread> compressionWorkers;
+        atomic<uint32_t> nextCompressGroup;
+        atomic<bool> compressionStopped;
+        vector<unsigned char> inflated;     // for the receiver, a compressed run unpacked.
+
+        /***** zero and repeated chunks *****/
+        vector<uint32_t> chunkSources;      // for the sender, PlainChunk, ZeroChunk or the first chunk with the same bytes.
+        vector<sparse::Extent> dataExtents; // for the sender, where the file has data, holes between.
+        bool sparseFile;                    // the file has holes: the sender found some, the receiver was told.
+
+        /***** spooled files, see DefaultMaxBufferedSize *****/
+        uint64_t maxBufferedSize;           // largest file held in fileData, and old copy in basisData.
+        MemoryBudget* memoryBudget;         // for the receiver, shared with others for what they hold. NULL for none.
+        uint64_t memoryHeld;                // taken from it for fileData, basisData and the delta.
+        bool spooled;                       // the file is read and written on disk a chunk at a time.
+        fstream spoolFile;                  // the sender's file, or the receiver's partial file.
+        vector<char> spoolScratch;          // a group or a chunk read back from it.
+
+        /***** receive cache *****/
+        unsigned char contentHash[Sha256Size]; // SHA-256 of the file
+        ContentCache receiveCache;          // for the receiver, files it has by their contents.
+        bool cached;                        // for the receiver, the file was found in the cache.
+        bool claimed;                       // for the receiver, fileName is ours until the teleporter is reset.
+        bool bundled;                       // the file is a directory, fileData its bundle.
 
         State state; 
         bool sender;
         
         /***** metadata of the transfering file *****/
         string fileName;
-        int fileSize;
+        uint64_t fileSize;
         int totalChunks;
         uint32_t crc;
 
         /*************/
         bool resent;
-        uint32_t chunkIndex;                // for sending or writing a file chunk
-        std::chrono::steady_clock::time_point disconnectTime;
+        uint32_t chunkIndex;                // first chunk not acked (sender) or not received (receiver)
+        net::Timer disconnectTimer;         // for the receiver, DISCONNECTING is over.
+
+        /***** ack policy of the receiver *****/
+        int unackedChunks;                  // new chunks since the last ack
+        bool ackDue;                        // an ack goes out with the next packet
+        net::Timer ackTimer;                // ACK_DELAY after the first unacked chunk
+        vector<ChunkRun> droppedChunks;     // arrived but not stored, they go with the next ack
+        net::Timer missingTimer;            // holds the next report of missing chunks back
+        bool stray;                         // chunks came while listening, the sender hears so
+        std::chrono::steady_clock::time_point lastLoadTime; // for keeping the connection alive
+        State restated;                     // the state a message restated since the last Update, CRACKED for none
+        bool loadedControl;                 // the last LoadPacket restated a state, see IsLoadedControl
+
+        /***** timers *****/
+        net::TimerWheel ownTimers;          // used when no wheel is shared
+        net::TimerWheel* timers;            // the wheel the timers above are armed on
+        std::function<void()> wake;         // see SetWakeCallback
+        std::chrono::steady_clock::time_point lastUpdateTime; // own wheel advanced up to here
         
         
-        inline uint32_t calculateFileCRC();
+        void ackDelayed();
+        void checkpointDue();
+        void disconnected();
+        inline bool calculateFileCRC(uint32_t& value);
         inline void writeFile();
-        inline void packMessage(unsigned char packet[PacketSize], 
+        bool createSpool(); // for receiver
+        bool readData(uint64_t offset, char* data, size_t length);
+        bool writeData(uint64_t offset, const char* data, size_t length); // for receiver
+        inline int packMessage(unsigned char packet[JumboPacketSize], 
             uint32_t id, const void* content, size_t size);
-        void packMetaData(unsigned char packet[PacketSize]);
-        void readChunk();
-        void storeMetadata(); // for receiver 
-        void storeChunk();
+        int packMetaData(unsigned char packet[JumboPacketSize]);
+        int packChunk(unsigned char packet[JumboPacketSize], uint32_t index);
+        int packAck(unsigned char packet[JumboPacketSize]);
+        int nextChunkToSend();
+        int groupChunks(uint32_t group) const;
+        int packParity(unsigned char packet[JumboPacketSize], uint32_t group, int row);
+        void storeParity(const unsigned char* chunk, size_t size); // for receiver
+        void recoverGroup(uint32_t group);
+        void chunkArrived(uint32_t index);
+        void checkGroup(uint32_t group); // for sender
+        int packSymbol(unsigned char packet[JumboPacketSize]);
+        void storeSymbol(const unsigned char* symbol, size_t size); // for receiver
+        void finishFile(); // for receiver
+        bool storeMetadata(const unsigned char* fm); // for receiver 
+        bool storeChunk(const unsigned char* chunk, size_t size);
+        void ackChunk(uint32_t index); // for sender
+        void resendChunks(uint32_t first, uint32_t count);
+        void restart();
+        void dropChunk(uint32_t index); // for receiver
+        void reportMissing();
+        void setChunkSize(int size); // for sender
+        int packProbe(unsigned char packet[JumboPacketSize], int size);
+        bool loadJournal(); // for receiver
+        void checkpoint();
+        void removeJournal();
+        int packResumeMap(unsigned char packet[JumboPacketSize]);
+        void storeResumeMap(const unsigned char* map, size_t size); // for sender
+        void loadBasis(); // for receiver
+        int packSignatures(unsigned char packet[JumboPacketSize]);
+        void storeDeltaHeader(const unsigned char* header, size_t size);
+        bool applyDelta();
+        void storeSignatures(const unsigned char* message, size_t size); // for sender
+        void buildDelta();
+        void dropDelta();
+        void startCompression(); // for sender
+        void stopCompression();
+        void compressWorker();
+        void compressRuns(uint32_t first, int count, vector<unsigned char>& scratch, vector<CompressedRun>& runs);
+        const CompressedRun* compressedRun(uint32_t index);
+        int packCompressed(unsigned char packet[JumboPacketSize], const CompressedRun& run);
+        void storeCompressed(const unsigned char* chunks, size_t size); // for receiver
+        bool storeChunkData(uint32_t index, const unsigned char* data, size_t size);
+        void findCopies(); // for sender
+        int packCopies(unsigned char packet[JumboPacketSize], uint32_t index);
+        void storeCopies(const unsigned char* copies, size_t size, bool zeros); // for receiver
+        bool findCached(); // for receiver
+        bool claimName(); // for receiver
+        void releaseName();
+        bool holdMemory(uint64_t bytes); // for receiver
+        void releaseMemory();
 
     public:
 
@@ -104,13 +432,71 @@ namespace udpft
 
         uint32_t GetFileCRC() const;
         string GetFileName() const;
-        uint32_t GetFileSize() const;
+        uint64_t GetFileSize() const;
         
         State GetState() const;
         bool Initialize(const string& filePath, bool isSender);
-        void LoadPacket(unsigned char packet[PacketSize]);
-        void ProcessPacket(unsigned char packet[PacketSize]);
+        int LoadPacket(unsigned char packet[JumboPacketSize]); // returns the message length
+        void ProcessPacket(const unsigned char* packet, int size);
+        // advances the timers when no wheel is shared. call it once a frame either way,
+        // LoadPacket restates a state (MDID, OKID, ENDID, ...) at most once in between
         void Update();
 
+        // transport feedback for the sender. OnPacketSent gives the sequence the
+        // last loaded packet went out with, acked and lost come from the
+        // connection's reliability system.
+        void OnPacketSent(unsigned int sequence);
+        void OnPacketsAcked(const unsigned int* sequences, int count);
+        void OnPacketsLost(const unsigned int* sequences, int count);
+
+        // the message LoadPacket gave last carries chunks. a transport that keeps
+        // such messages and sends them again reports them acked under the sequence
+        // they first went with, never lost, and the teleporter leaves their loss to
+        // it. the other messages restate a state or are parity, symbols and probes,
+        // stale by the time they would be resent: their loss is the teleporter's.
+        bool IsLoadedReliable() const;
+
+        // the message LoadPacket gave last restates the state of the transfer: MDID,
+        // OKID, ENDID, DISID and the like. they are few, small, and mean something only
+        // in the order they were sent, a transport with channels keeps them in order
+        // on one of their own, apart from the chunks. kept, they are acked as above.
+        bool IsLoadedControl() const;
+
+        // the sender's choice, set before Initialize. the receiver takes it from the metadata.
+        void SetTransferMode(TransferMode mode);
+        TransferMode GetTransferMode() const;
+
+        // largest message the connection can carry. above PacketSize the sender probes
+        // the path for it and both ends agree on a chunk size. set before Initialize.
+        void SetMaxPacketSize(int size);
+        int GetChunkSize() const;
+
+        // the sender's choice, set before Initialize. chunks that compress go
+        // as ZCID, several to a message where they fit. the receiver needs no setting.
+        void SetCompression(bool enabled);
+        bool GetCompression() const;
+
+        // largest file the teleporter keeps in memory, larger ones are spooled or refused.
+        // at most INT_MAX, set before Initialize.
+        void SetMaxBufferedSize(uint64_t size);
+        uint64_t GetMaxBufferedSize() const;
+
+        // shared by the receivers of a server, the memory they hold for their files
+        // together. a file past what is left goes to disk as if past the limit above,
+        // a fountain or a bundle waits for the memory. NULL for none, set before Initialize.
+        void SetMemoryBudget(MemoryBudget* budget);
+
+        // loss rate measured by the transport since the last call, sets the parity per group.
+        void SetLossRate(double rate);
+
+        // the wheel the timers of the transfer go on. with one shared by many teleporters
+        // its owner advances it and Update has nothing to do; without, the teleporter
+        // keeps its own and advances it by the clock in Update. set before Initialize.
+        void SetTimerWheel(net::TimerWheel* wheel);
+
+        // called when a timer leaves the transfer with something to send, for an
+        // owner that calls LoadPacket only for the transfers with something going on.
+        void SetWakeCallback(const std::function<void()>& callback);
+
     };
 }
\ No newline at end of file
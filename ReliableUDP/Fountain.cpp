@@ -0,0 +1,234 @@
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "Fountain.h"
+using namespace udpft;
+
+namespace
+{
+	// robust soliton parameters
+	const double SolitonC = 0.1;
+	const double SolitonDelta = 0.5;
+
+	// xorshift32, seeded from the symbol so both ends draw the same numbers
+	struct SymbolRandom
+	{
+		uint32_t state;
+
+		explicit SymbolRandom(uint32_t seed)
+		{
+			state = seed * 0x9E3779B9u ^ 0x85EBCA6Bu;
+			if (state == 0) state = 1;
+		}
+
+		uint32_t Next()
+		{
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
+	};
+
+	// chunk += data of chunk index, zero past length
+	void XorChunk(unsigned char* chunk, const unsigned char* data, size_t length, size_t size, uint32_t index)
+	{
+		size_t offset = index * size;
+		if (offset >= length) return;
+		size_t chunkLength = length - offset < size ? length - offset : size;
+		const unsigned char* source = data + offset;
+		for (size_t i = 0; i < chunkLength; i++) chunk[i] ^= source[i];
+	}
+}
+
+LtCode::LtCode()
+{
+	chunkCount = 0;
+}
+
+void LtCode::Reset(int count)
+{
+	chunkCount = count;
+	degreeCdf.assign(count, 0.0);
+	if (count <= 0) return;
+
+	// ideal soliton plus the spike of the robust one at chunkCount / R
+	double k = count;
+	double r = SolitonC * log(k / SolitonDelta) * sqrt(k);
+	int spike = r > 0 ? (int)(k / r) : count;
+	if (spike < 1) spike = 1;
+	if (spike > count) spike = count;
+	double sum = 0;
+	for (int d = 1; d <= count; d++)
+	{
+		double rho = d == 1 ? 1.0 / k : 1.0 / ((double)d * (d - 1));
+		double tau = 0;
+		if (d < spike) tau = r / (d * k);
+		else if (d == spike) tau = r * log(r / SolitonDelta) / k;
+		if (tau < 0) tau = 0;
+		sum += rho + tau;
+		degreeCdf[d - 1] = sum;
+	}
+	for (int d = 0; d < count; d++)
+	{
+		degreeCdf[d] /= sum;
+	}
+}
+
+int LtCode::GetChunkCount() const
+{
+	return chunkCount;
+}
+
+void LtCode::Neighbours(uint32_t seed, std::vector<uint32_t>& chunks) const
+{
+	chunks.clear();
+	if (chunkCount <= 0) return;
+	if (seed < (uint32_t)chunkCount)
+	{
+		// the chunks go out as they are first
+		chunks.push_back(seed);
+		return;
+	}
+	SymbolRandom random(seed);
+	double u = (random.Next() >> 8) / 16777216.0;
+	size_t degree = std::upper_bound(degreeCdf.begin(), degreeCdf.end(), u) - degreeCdf.begin() + 1;
+	if (degree > (size_t)chunkCount) degree = chunkCount;
+
+	// distinct chunks, topped up after dropping repeats
+	while (chunks.size() < degree)
+	{
+		while (chunks.size() < degree)
+		{
+			chunks.push_back(random.Next() % chunkCount);
+		}
+		std::sort(chunks.begin(), chunks.end());
+		chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+	}
+}
+
+void LtCode::Encode(uint32_t seed, const unsigned char* data, size_t length,
+	size_t size, unsigned char* symbol) const
+{
+	std::vector<uint32_t> chunks;
+	Neighbours(seed, chunks);
+	memset(symbol, 0, size);
+	for (size_t i = 0; i < chunks.size(); i++)
+	{
+		XorChunk(symbol, data, length, size, chunks[i]);
+	}
+}
+
+LtDecoder::LtDecoder()
+{
+	size = 0;
+	knownChunks = 0;
+	waitingSymbols = 0;
+}
+
+void LtDecoder::Reset(int chunkCount, size_t chunkSize)
+{
+	code.Reset(chunkCount);
+	size = chunkSize;
+	knownChunks = 0;
+	waitingSymbols = 0;
+	symbols.clear();
+	freeSymbols.clear();
+	chunkSymbols.assign(chunkCount, std::vector<int>());
+	value.assign(chunkSize, 0);
+}
+
+int LtDecoder::AddSymbol(uint32_t seed, const unsigned char* symbol,
+	unsigned char* data, size_t length, std::vector<bool>& known)
+{
+	int chunkCount = code.GetChunkCount();
+	if (knownChunks == chunkCount) return 0;
+
+	int slot;
+	if (freeSymbols.empty())
+	{
+		slot = (int)symbols.size();
+		symbols.push_back(Symbol());
+	}
+	else
+	{
+		slot = freeSymbols.back();
+		freeSymbols.pop_back();
+	}
+	Symbol& s = symbols[slot];
+	s.data.assign(symbol, symbol + size);
+	s.chunks.clear();
+
+	// take out the chunks we already have
+	code.Neighbours(seed, neighbours);
+	for (size_t i = 0; i < neighbours.size(); i++)
+	{
+		if (known[neighbours[i]])
+			XorChunk(s.data.data(), data, length, size, neighbours[i]);
+		else
+			s.chunks.push_back(neighbours[i]);
+	}
+	if (s.chunks.size() != 1)
+	{
+		if (s.chunks.empty())
+		{
+			freeSymbols.push_back(slot);
+			return 0;
+		}
+		for (size_t i = 0; i < s.chunks.size(); i++)
+		{
+			chunkSymbols[s.chunks[i]].push_back(slot);
+		}
+		waitingSymbols++;
+		return 0;
+	}
+
+	// peel: every symbol left with one unknown chunk gives that chunk
+	int recovered = 0;
+	std::vector<int> ripple(1, slot);
+	waitingSymbols++;
+	while (!ripple.empty())
+	{
+		Symbol& r = symbols[ripple.back()];
+		freeSymbols.push_back(ripple.back());
+		ripple.pop_back();
+		waitingSymbols--;
+		if (r.chunks.size() != 1) continue;
+
+		uint32_t chunk = r.chunks[0];
+		r.chunks.clear();
+		memcpy(value.data(), r.data.data(), size);
+		size_t offset = chunk * size;
+		if (offset < length)
+		{
+			memcpy(data + offset, value.data(), length - offset < size ? length - offset : size);
+		}
+		known[chunk] = true;
+		knownChunks++;
+		recovered++;
+
+		std::vector<int>& waiting = chunkSymbols[chunk];
+		for (size_t i = 0; i < waiting.size(); i++)
+		{
+			Symbol& w = symbols[waiting[i]];
+			std::vector<uint32_t>::iterator itor = std::find(w.chunks.begin(), w.chunks.end(), chunk);
+			if (itor == w.chunks.end()) continue;
+			*itor = w.chunks.back();
+			w.chunks.pop_back();
+			for (size_t b = 0; b < size; b++) w.data[b] ^= value[b];
+			if (w.chunks.size() == 1) ripple.push_back(waiting[i]);
+		}
+		waiting.clear();
+	}
+	return recovered;
+}
+
+int LtDecoder::GetKnownChunks() const
+{
+	return knownChunks;
+}
+
+int LtDecoder::GetWaitingSymbols() const
+{
+	return waitingSymbols;
+}
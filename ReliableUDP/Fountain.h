@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace udpft
+{
+    // LT fountain code over the chunks of a file. symbol seeds below the chunk count
+    // are the chunks themselves, every seed after that is the XOR of a few chunks
+    // picked with a robust soliton degree distribution. slightly more symbols than
+    // there are chunks, any of them, decode the file.
+    class LtCode
+    {
+    public:
+        LtCode();
+        void Reset(int chunkCount);
+        int GetChunkCount() const;
+
+        // the chunks symbol seed is made of, the same on both ends
+        void Neighbours(uint32_t seed, std::vector<uint32_t>& chunks) const;
+
+        /*
+        * write symbol seed. data holds the chunks of size bytes back to back,
+        * only the first length bytes are given, the rest counts as zeros.
+        */
+        void Encode(uint32_t seed, const unsigned char* data, size_t length,
+            size_t size, unsigned char* symbol) const;
+
+    private:
+        int chunkCount;
+        std::vector<double> degreeCdf; // probability of a degree up to index + 1
+    };
+
+    // peeling decoder. a symbol waits until all but one of its chunks are known,
+    // then it gives the last one, which may free other waiting symbols in turn.
+    class LtDecoder
+    {
+    public:
+        LtDecoder();
+        void Reset(int chunkCount, size_t size);
+
+        /*
+        * add a received symbol. recovered chunks are written to data, laid out
+        * as for LtCode::Encode, and flagged in known. returns the chunks recovered.
+        */
+        int AddSymbol(uint32_t seed, const unsigned char* symbol,
+            unsigned char* data, size_t length, std::vector<bool>& known);
+        int GetKnownChunks() const;
+        int GetWaitingSymbols() const;
+
+    private:
+        struct Symbol {
+            std::vector<uint32_t> chunks;   // chunks not known yet
+            std::vector<unsigned char> data;
+        };
+
+        LtCode code;
+        size_t size;
+        int knownChunks;
+        int waitingSymbols;
+        std::vector<Symbol> symbols;
+        std::vector<int> freeSymbols;
+        std::vector<std::vector<int>> chunkSymbols; // waiting symbols each chunk is part of
+        std::vector<uint32_t> neighbours;
+        std::vector<unsigned char> value;
+    };
+}
@@ -0,0 +1,138 @@
+#include <cstdint>
+#include <cstring>
+#include "LZ.h"
+using namespace udpft;
+
+namespace
+{
+	const size_t MinMatch = 4;
+	const size_t MaxOffset = 65535;
+	const int HashBits = 12;
+
+	inline uint32_t Read32(const unsigned char* p)
+	{
+		uint32_t value;
+		memcpy(&value, p, sizeof(value));
+		return value;
+	}
+
+	inline uint32_t Hash(uint32_t value)
+	{
+		return (value * 2654435761u) >> (32 - HashBits);
+	}
+
+	// a length past the 15 of its nibble, in 255 steps
+	bool PutLength(unsigned char*& out, const unsigned char* end, size_t length)
+	{
+		while (length >= 255)
+		{
+			if (out >= end) return false;
+			*out++ = 255;
+			length -= 255;
+		}
+		if (out >= end) return false;
+		*out++ = (unsigned char)length;
+		return true;
+	}
+
+	// one sequence: literals, then a match unless offset is 0
+	bool PutSequence(unsigned char*& out, const unsigned char* end,
+		const unsigned char* literals, size_t literalLength, size_t offset, size_t matchLength)
+	{
+		if (out >= end) return false;
+		unsigned char* token = out++;
+		size_t matchCode = offset ? matchLength - MinMatch : 0;
+		*token = (unsigned char)((literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15));
+		if (literalLength >= 15 && !PutLength(out, end, literalLength - 15)) return false;
+		if ((size_t)(end - out) < literalLength) return false;
+		memcpy(out, literals, literalLength);
+		out += literalLength;
+		if (offset == 0) return true;
+		if (end - out < 2) return false;
+		*out++ = (unsigned char)offset;
+		*out++ = (unsigned char)(offset >> 8);
+		return matchCode < 15 || PutLength(out, end, matchCode - 15);
+	}
+
+	bool GetLength(const unsigned char*& in, const unsigned char* end, size_t& length)
+	{
+		unsigned char byte;
+		do
+		{
+			if (in >= end) return false;
+			byte = *in++;
+			length += byte;
+		} while (byte == 255);
+		return true;
+	}
+}
+
+size_t lz::Compress(const unsigned char* source, size_t length,
+	unsigned char* destination, size_t capacity)
+{
+	uint32_t table[1 << HashBits] = {}; // position + 1 of the last 4 bytes with a hash
+	unsigned char* out = destination;
+	const unsigned char* end = destination + capacity;
+	size_t anchor = 0;
+	size_t position = 0;
+	while (position + MinMatch <= length)
+	{
+		uint32_t value = Read32(source + position);
+		uint32_t& slot = table[Hash(value)];
+		size_t candidate = slot;
+		slot = (uint32_t)position + 1;
+		if (candidate == 0 || position + 1 - candidate > MaxOffset || Read32(source + candidate - 1) != value)
+		{
+			// the longer nothing matched, the bigger the steps: data that doesn't
+			// compress is skipped over quickly
+			position += 1 + ((position - anchor) >> 6);
+			continue;
+		}
+		candidate--;
+		size_t matchLength = MinMatch;
+		while (position + matchLength < length && source[candidate + matchLength] == source[position + matchLength])
+		{
+			matchLength++;
+		}
+		if (!PutSequence(out, end, source + anchor, position - anchor, position - candidate, matchLength)) return 0;
+		position += matchLength;
+		anchor = position;
+	}
+	if (!PutSequence(out, end, source + anchor, length - anchor, 0, 0)) return 0;
+	return out - destination;
+}
+
+bool lz::Decompress(const unsigned char* source, size_t size,
+	unsigned char* destination, size_t length)
+{
+	const unsigned char* in = source;
+	const unsigned char* inEnd = source + size;
+	size_t written = 0;
+	while (in < inEnd)
+	{
+		unsigned char token = *in++;
+		size_t literalLength = token >> 4;
+		if (literalLength == 15 && !GetLength(in, inEnd, literalLength)) return false;
+		if ((size_t)(inEnd - in) < literalLength || length - written < literalLength) return false;
+		memcpy(destination + written, in, literalLength);
+		in += literalLength;
+		written += literalLength;
+		if (in == inEnd) break; // the last sequence has no match
+
+		if (inEnd - in < 2) return false;
+		size_t offset = in[0] | (size_t)in[1] << 8;
+		in += 2;
+		size_t matchLength = token & 15;
+		if (matchLength == 15 && !GetLength(in, inEnd, matchLength)) return false;
+		matchLength += MinMatch;
+		if (offset == 0 || offset > written || length - written < matchLength) return false;
+		// byte by byte, a match may overlap the bytes it produces
+		unsigned char* match = destination + written - offset;
+		for (size_t i = 0; i < matchLength; i++)
+		{
+			destination[written + i] = match[i];
+		}
+		written += matchLength;
+	}
+	return written == length;
+}
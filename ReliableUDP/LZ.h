@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+
+namespace udpft
+{
+    // byte oriented LZ77 in the style of LZ4 blocks: a token with literal and
+    // match lengths, the literals, then a 2 byte offset back into the output.
+    // fast to both ends, meant for text like logs and CSV.
+    namespace lz
+    {
+        /*
+        * compress length bytes of source into at most capacity bytes.
+        * returns the compressed length, 0 when it doesn't fit: that is how
+        * incompressible data shows, and it gives up as soon as it knows.
+        */
+        size_t Compress(const unsigned char* source, size_t length,
+            unsigned char* destination, size_t capacity);
+
+        // exactly length bytes out of a compressed block, false if it is malformed
+        bool Decompress(const unsigned char* source, size_t size,
+            unsigned char* destination, size_t length);
+    }
+}
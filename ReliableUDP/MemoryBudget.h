@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+
+namespace udpft
+{
+    const uint64_t DefaultMemoryBudget = 1ull << 30;
+
+    /*
+    * the memory the receivers of a server hold for their files, all of them
+    * together. a receiver takes what its file needs before it holds it and gives
+    * it back when done; one that can't have it writes the file to disk instead,
+    * or waits when the file can only be put together in memory.
+    */
+    class MemoryBudget
+    {
+    public:
+        explicit MemoryBudget(uint64_t limit = DefaultMemoryBudget) : limit(limit), taken(0) {}
+
+        // false, and nothing taken, when that would go past the limit
+        bool Take(uint64_t bytes)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (bytes > limit - taken) return false;
+            taken += bytes;
+            return true;
+        }
+
+        void Give(uint64_t bytes)
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            taken -= bytes < taken ? bytes : taken;
+        }
+
+        uint64_t GetLimit() const { return limit; }
+
+        uint64_t GetTaken() const
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            return taken;
+        }
+
+    private:
+        uint64_t limit;
+        uint64_t taken;
+        mutable std::mutex lock;
+    };
+}
@@ -15,7 +15,8 @@
 #define PLATFORM_WINDOWS  1
 #define PLATFORM_MAC      2
 #define PLATFORM_UNIX     3
-const int PacketSizeHack = 384;
+const int BasePacketSize = 1472;	// datagram size assumed to get through any path: a 1500 byte ethernet mtu minus ip and udp headers
+const int MaxPacketSize = 8972;		// largest datagram sent or received: a 9000 byte jumbo frame minus ip and udp headers, see PathMtu
 
 
 #if defined(_WIN32)
@@ -29,12 +30,14 @@ const int PacketSizeHack = 384;
 #if PLATFORM == PLATFORM_WINDOWS
 
 	#include <winsock2.h>
+	#include <ws2tcpip.h>
 	#pragma comment( lib, "wsock32.lib" )
 
 #elif PLATFORM == PLATFORM_MAC || PLATFORM == PLATFORM_UNIX
 
 	#include <sys/socket.h>
 	#include <netinet/in.h>
+	#include <netinet/ip.h>
 	#include <fcntl.h>
 
 #else
@@ -46,10 +49,17 @@ const int PacketSizeHack = 384;
 #include <assert.h>
 #include <vector>
 #include <map>
+#include <set>
 #include <stack>
 #include <list>
+#include <deque>
 #include <algorithm>
 #include <functional>
+#include <random>
+
+#include "TimerWheel.h"
+#include "CongestionControl.h"
+#include "Sha256.h"
 
 namespace net
 {
@@ -152,6 +162,128 @@ namespace net
 		unsigned short port;
 	};
 
+	// flat hash table from peer address to peer index
+	//  + open addressing with linear probing over one array of cells, a lookup usually touches a single cache line
+	//  + removing a cell pulls back the cells that probed past it, so there are no tombstones and probe runs stay short under churn
+	//  + doubles once half full
+
+	class AddressTable
+	{
+	public:
+
+		AddressTable( int capacity = 0 )
+		{
+			int size = 16;
+			while ( size < capacity * 2 )
+				size *= 2;
+			cells.resize( size );
+			count = 0;
+		}
+
+		// peer index stored for the address, -1 if there is none
+
+		int Find( const Address & address ) const
+		{
+			const unsigned int mask = (unsigned int) cells.size() - 1;
+			for ( unsigned int i = Hash( address ) & mask; ; i = ( i + 1 ) & mask )
+			{
+				if ( cells[i].peer < 0 )
+					return -1;
+				if ( cells[i].address == address )
+					return cells[i].peer;
+			}
+		}
+
+		void Insert( const Address & address, int peer )
+		{
+			assert( peer >= 0 );
+			assert( Find( address ) < 0 );
+			if ( ( count + 1 ) * 2 > (int) cells.size() )
+				Grow();
+			Place( address, peer );
+			count++;
+		}
+
+		bool Remove( const Address & address )
+		{
+			const unsigned int mask = (unsigned int) cells.size() - 1;
+			unsigned int hole = Hash( address ) & mask;
+			while ( cells[hole].peer >= 0 && cells[hole].address != address )
+				hole = ( hole + 1 ) & mask;
+			if ( cells[hole].peer < 0 )
+				return false;
+			for ( unsigned int i = ( hole + 1 ) & mask; cells[i].peer >= 0; i = ( i + 1 ) & mask )
+			{
+				// a cell whose home slot is not between the hole and itself would no longer be found past the hole
+				const unsigned int home = Hash( cells[i].address ) & mask;
+				if ( ( ( i - home ) & mask ) >= ( ( i - hole ) & mask ) )
+				{
+					cells[hole] = cells[i];
+					hole = i;
+				}
+			}
+			cells[hole].peer = -1;
+			count--;
+			return true;
+		}
+
+		void Clear()
+		{
+			for ( size_t i = 0; i < cells.size(); ++i )
+				cells[i].peer = -1;
+			count = 0;
+		}
+
+		int GetCount() const
+		{
+			return count;
+		}
+
+		// murmur3 finalizer over address and port, so consecutive ports of one host spread over the whole table
+
+		static unsigned int Hash( const Address & address )
+		{
+			unsigned long long key = ( (unsigned long long) address.GetAddress() << 16 ) | address.GetPort();
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdULL;
+			key ^= key >> 33;
+			key *= 0xc4ceb9fe1a85ec53ULL;
+			key ^= key >> 33;
+			return (unsigned int) key;
+		}
+
+	private:
+
+		void Place( const Address & address, int peer )
+		{
+			const unsigned int mask = (unsigned int) cells.size() - 1;
+			unsigned int i = Hash( address ) & mask;
+			while ( cells[i].peer >= 0 )
+				i = ( i + 1 ) & mask;
+			cells[i].address = address;
+			cells[i].peer = peer;
+		}
+
+		void Grow()
+		{
+			std::vector<Cell> old( cells.size() * 2 );
+			old.swap( cells );
+			for ( size_t i = 0; i < old.size(); ++i )
+				if ( old[i].peer >= 0 )
+					Place( old[i].address, old[i].peer );
+		}
+
+		struct Cell
+		{
+			Cell() : peer( -1 ) {}
+			Address address;
+			int peer;							// -1 for an empty cell
+		};
+
+		std::vector<Cell> cells;				// a power of two of them
+		int count;								// cells in use
+	};
+
 	// sockets
 
 	inline bool InitializeSockets()
@@ -237,6 +369,26 @@ namespace net
 				}
 
 			#endif
+
+			// set don't fragment, a datagram larger than the path takes is dropped
+			// rather than split, so datagrams above the base size can probe the path mtu
+
+			#if PLATFORM == PLATFORM_WINDOWS
+
+				DWORD dontFragment = 1;
+				setsockopt( socket, IPPROTO_IP, IP_DONTFRAGMENT, (const char*) &dontFragment, sizeof( dontFragment ) );
+
+			#elif defined( IP_MTU_DISCOVER )
+
+				int discover = IP_PMTUDISC_PROBE;
+				setsockopt( socket, IPPROTO_IP, IP_MTU_DISCOVER, &discover, sizeof( discover ) );
+
+			#elif defined( IP_DONTFRAG )
+
+				int dontFragment = 1;
+				setsockopt( socket, IPPROTO_IP, IP_DONTFRAG, &dontFragment, sizeof( dontFragment ) );
+
+			#endif
 		
 			return true;
 		}
@@ -258,7 +410,17 @@ namespace net
 		{
 			return socket != 0;
 		}
-	
+
+		// room in the kernel for datagrams that arrive between two reads. a server
+		// hearing from many peers at once needs more than the default
+
+		bool SetReceiveBufferSize( int bytes )
+		{
+			if ( socket == 0 )
+				return false;
+			return setsockopt( socket, SOL_SOCKET, SO_RCVBUF, (const char*) &bytes, sizeof( bytes ) ) == 0;
+		}
+
 		bool Send( const Address & destination, const void * data, int size )
 		{
 			assert( data );
@@ -313,7 +475,218 @@ namespace net
 		int socket;
 	};
 	
+	// stateless handshake cookies
+	//  + a cookie is the second it was made and a MAC over the peer's address, port and that second, keyed by a secret of the server
+	//  + the server keeps nothing per cookie: an echoed one is checked by computing its MAC again, and is good for Lifetime seconds
+	//  + only a peer that received the cookie at its own address can echo it, so a spoofed flood costs the server a hash per packet and no memory
+
+	class CookieJar
+	{
+	public:
+
+		enum { TimeSize = 4, MacSize = 16, CookieSize = TimeSize + MacSize };
+		enum { SecretSize = 32 };
+		enum { Lifetime = 10 };
+
+		CookieJar()
+		{
+			std::random_device random;
+			for ( int i = 0; i < SecretSize; ++i )
+				secret[i] = (unsigned char) random();
+		}
+
+		// now is the owner's clock in seconds, the same one Check is given
+
+		void Make( const Address & address, double now, unsigned char cookie[CookieSize] ) const
+		{
+			const unsigned int time = (unsigned int) now;
+			cookie[0] = (unsigned char) ( time >> 24 );
+			cookie[1] = (unsigned char) ( ( time >> 16 ) & 0xFF );
+			cookie[2] = (unsigned char) ( ( time >> 8 ) & 0xFF );
+			cookie[3] = (unsigned char) ( time & 0xFF );
+			Mac( address, cookie, cookie + TimeSize );
+		}
+
+		bool Check( const Address & address, double now, const unsigned char cookie[CookieSize] ) const
+		{
+			const unsigned int time = ( (unsigned int) cookie[0] << 24 ) | ( (unsigned int) cookie[1] << 16 ) |
+			                          ( (unsigned int) cookie[2] << 8 ) | cookie[3];
+			const unsigned int seconds = (unsigned int) now;
+			if ( time > seconds || seconds - time > Lifetime )
+				return false;
+			unsigned char mac[MacSize];
+			Mac( address, cookie, mac );
+			// every byte is compared, so the time taken says nothing about how much of a forgery was right
+			unsigned char difference = 0;
+			for ( int i = 0; i < MacSize; ++i )
+				difference |= mac[i] ^ cookie[TimeSize + i];
+			return difference == 0;
+		}
+
+	private:
+
+		void Mac( const Address & address, const unsigned char time[TimeSize], unsigned char mac[MacSize] ) const
+		{
+			unsigned char message[6 + TimeSize];
+			const unsigned int ip = address.GetAddress();
+			message[0] = (unsigned char) ( ip >> 24 );
+			message[1] = (unsigned char) ( ( ip >> 16 ) & 0xFF );
+			message[2] = (unsigned char) ( ( ip >> 8 ) & 0xFF );
+			message[3] = (unsigned char) ( ip & 0xFF );
+			message[4] = (unsigned char) ( address.GetPort() >> 8 );
+			message[5] = (unsigned char) ( address.GetPort() & 0xFF );
+			std::memcpy( message + 6, time, TimeSize );
+			unsigned char digest[udpft::Sha256Size];
+			udpft::HmacSha256( secret, SecretSize, message, sizeof( message ), digest );
+			std::memcpy( mac, digest, MacSize );
+		}
+
+		unsigned char secret[SecretSize];		// drawn when the server starts, cookies die with it
+	};
+
+	// handshake packets
+	//  + the complement of the protocol id goes where data packets have the protocol id, so neither passes for the other
+	//  + then the type, the connection id and a cookie or zeros. all of them are HandshakeSize, so a hello is as large as
+	//    the cookie it is answered with and a spoofed hello can't make the server send more than it received
+	//  + client: hello until it gets a cookie, then the cookie echoed until it is welcomed. server: a cookie for every hello,
+	//    and state for a peer only once it echoes a good one, which takes a round trip from its own address
+	//  + the welcome hands the client its connection id, see Connection
+
+	enum HandshakeType
+	{
+		HandshakeHello = 1,
+		HandshakeCookie,
+		HandshakeEcho,
+		HandshakeWelcome,
+		HandshakeChallenge,		// server: a cookie for a new address a peer's data came from
+		HandshakeResponse		// client: the challenge sent back, from wherever its packets now come from
+	};
+
+	const int HandshakeSize = 4 + 1 + 4 + CookieJar::CookieSize;
+	const float HandshakeInterval = 0.25f;		// seconds between the client's hellos or echoes, and the server's challenges to one peer
+
+	inline bool SendHandshake( Socket & socket, const Address & destination, unsigned int protocolId, int type,
+	                           unsigned int connectionId, const unsigned char * cookie )
+	{
+		unsigned char packet[HandshakeSize] = { 0 };
+		const unsigned int id = ~protocolId;
+		packet[0] = (unsigned char) ( id >> 24 );
+		packet[1] = (unsigned char) ( ( id >> 16 ) & 0xFF );
+		packet[2] = (unsigned char) ( ( id >> 8 ) & 0xFF );
+		packet[3] = (unsigned char) ( id & 0xFF );
+		packet[4] = (unsigned char) type;
+		packet[5] = (unsigned char) ( connectionId >> 24 );
+		packet[6] = (unsigned char) ( ( connectionId >> 16 ) & 0xFF );
+		packet[7] = (unsigned char) ( ( connectionId >> 8 ) & 0xFF );
+		packet[8] = (unsigned char) ( connectionId & 0xFF );
+		if ( cookie )
+			std::memcpy( packet + 9, cookie, CookieJar::CookieSize );
+		return socket.Send( destination, packet, HandshakeSize );
+	}
+
+	// the type of a handshake packet, 0 for any other datagram
+
+	inline int ReadHandshake( const unsigned char * packet, int size, unsigned int protocolId,
+	                          unsigned int * connectionId, const unsigned char ** cookie )
+	{
+		if ( size != HandshakeSize )
+			return 0;
+		const unsigned int id = ~protocolId;
+		if ( packet[0] != (unsigned char) ( id >> 24 ) ||
+			 packet[1] != (unsigned char) ( ( id >> 16 ) & 0xFF ) ||
+			 packet[2] != (unsigned char) ( ( id >> 8 ) & 0xFF ) ||
+			 packet[3] != (unsigned char) ( id & 0xFF ) )
+			return 0;
+		if ( packet[4] < HandshakeHello || packet[4] > HandshakeResponse )
+			return 0;
+		*connectionId = ( (unsigned int) packet[5] << 24 ) | ( (unsigned int) packet[6] << 16 ) |
+		                ( (unsigned int) packet[7] << 8 ) | packet[8];
+		*cookie = packet + 9;
+		return packet[4];
+	}
+
+	// a random connection id, never 0: that is the id of a handshake before the welcome
+
+	inline unsigned int NewConnectionId()
+	{
+		static std::mt19937 generator( std::random_device{}() );
+		unsigned int id = 0;
+		while ( id == 0 )
+			id = (unsigned int) generator();
+		return id;
+	}
+
+	// packet buffer with reserved headroom
+	//  + the payload is written once, Headroom bytes into the buffer
+	//  + on the way down each layer prepends its header in place, so no layer below the application copies the payload
+
+	class PacketBuffer
+	{
+	public:
+
+		enum { Headroom = 32 };		// connection (8) + reliability (12) + channel (5) + fragment (4) headers, rounded up
+
+		PacketBuffer()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			head = Headroom;
+			size = 0;
+		}
+
+		// where the payload goes. only valid until the first header is pushed
+
+		unsigned char * GetPayload()
+		{
+			assert( head == Headroom );
+			return buffer + Headroom;
+		}
+
+		int GetPayloadCapacity() const
+		{
+			return MaxPacketSize;
+		}
+
+		void SetPayloadSize( int bytes )
+		{
+			assert( head == Headroom );
+			assert( bytes >= 0 && bytes <= MaxPacketSize );
+			size = bytes;
+		}
+
+		unsigned char * PushHeader( int bytes )
+		{
+			assert( bytes <= head );
+			head -= bytes;
+			size += bytes;
+			return buffer + head;
+		}
+
+		const unsigned char * GetData() const
+		{
+			return buffer + head;
+		}
+
+		int GetSize() const
+		{
+			return size;
+		}
+
+	private:
+
+		int head;									// offset of the first header byte
+		int size;									// bytes from head to the end of the payload
+		unsigned char buffer[Headroom + MaxPacketSize];
+	};
+
 	// connection
+	//  + data packets start with the protocol id and the connection id the server handed out in its welcome
+	//  + the server takes a peer's packets on that id wherever they come from, so a NAT rebinding the peer
+	//    to a new port doesn't end the connection. replies keep going to the old address until the new one
+	//    echoes a challenge, so a spoofed source can't redirect them
 	
 	class Connection
 	{
@@ -332,6 +705,7 @@ namespace net
 			this->timeout = timeout;
 			mode = None;
 			running = false;
+			clock = 0.0;
 			ClearData();
 		}
 		
@@ -422,6 +796,16 @@ namespace net
 		virtual void Update( float deltaTime )
 		{
 			assert( running );
+			clock += deltaTime;
+			if ( state == Connecting )
+			{
+				handshakeAccumulator += deltaTime;
+				if ( handshakeAccumulator >= HandshakeInterval )
+				{
+					handshakeAccumulator = 0.0f;
+					SendHandshake( socket, address, protocolId, cookieReceived ? HandshakeEcho : HandshakeHello, 0, cookieReceived ? cookie : NULL );
+				}
+			}
 			timeoutAccumulator += deltaTime;
 			if ( timeoutAccumulator > timeout )
 			{
@@ -444,63 +828,195 @@ namespace net
 		}
 		
 		virtual bool SendPacket( const unsigned char data[], int size )
+		{
+			if ( size + 8 > MaxPacketSize )
+				return false;
+			PacketBuffer packet;
+      std::memcpy( packet.GetPayload(), data, size );
+			packet.SetPayloadSize( size );
+			return Connection::SendPacket( packet );
+		}
+
+		// zero copy send: the protocol and connection ids are written into the headroom in front of the payload
+
+		virtual bool SendPacket( PacketBuffer & packet )
 		{
 			assert( running );
-			if ( address.GetAddress() == 0 )
+			if ( address.GetAddress() == 0 || state != Connected )
 				return false;
-			unsigned char packet[PacketSizeHack +4];
-			packet[0] = (unsigned char) ( protocolId >> 24 );
-			packet[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
-			packet[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
-			packet[3] = (unsigned char) ( ( protocolId ) & 0xFF );
-      std::memcpy( &packet[4], data, size );
-			return socket.Send( address, packet, size + 4 );
+			if ( packet.GetSize() + 8 > MaxPacketSize )
+				return false;
+			unsigned char * header = packet.PushHeader( 8 );
+			header[0] = (unsigned char) ( protocolId >> 24 );
+			header[1] = (unsigned char) ( ( protocolId >> 16 ) & 0xFF );
+			header[2] = (unsigned char) ( ( protocolId >> 8 ) & 0xFF );
+			header[3] = (unsigned char) ( ( protocolId ) & 0xFF );
+			header[4] = (unsigned char) ( connectionId >> 24 );
+			header[5] = (unsigned char) ( ( connectionId >> 16 ) & 0xFF );
+			header[6] = (unsigned char) ( ( connectionId >> 8 ) & 0xFF );
+			header[7] = (unsigned char) ( connectionId & 0xFF );
+			return socket.Send( address, packet.GetData(), packet.GetSize() );
 		}
 		
 		virtual int ReceivePacket( unsigned char data[], int size )
 		{
-			assert( running );
-			unsigned char packet[PacketSizeHack +4];
-			Address sender;
-			int bytes_read = socket.Receive( sender, packet, size + 4 );
+			const unsigned char * payload = NULL;
+			int bytes_read = Connection::ReceivePacket( &payload );
 			if ( bytes_read == 0 )
 				return 0;
-			if ( bytes_read <= 4 )
-				return 0;
-			if ( packet[0] != (unsigned char) ( protocolId >> 24 ) || 
-				 packet[1] != (unsigned char) ( ( protocolId >> 16 ) & 0xFF ) ||
-				 packet[2] != (unsigned char) ( ( protocolId >> 8 ) & 0xFF ) ||
-				 packet[3] != (unsigned char) ( protocolId & 0xFF ) )
-				return 0;
-			if ( mode == Server && !IsConnected() )
-			{
-				printf( "server accepts connection from client %d.%d.%d.%d:%d\n", 
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
-				state = Connected;
-				address = sender;
-				OnConnect();
-			}
-			if ( sender == address )
+			if ( bytes_read > size )
+				bytes_read = size;
+			memcpy( data, payload, bytes_read );
+			return bytes_read;
+		}
+
+		// zero copy receive: data points at the payload inside the connection's receive buffer,
+		// valid until the next call to ReceivePacket
+
+		// reads past handshakes and datagrams that are not for this connection, returns 0 once the socket is drained
+
+		virtual int ReceivePacket( const unsigned char ** data )
+		{
+			assert( running );
+			unsigned char * packet = receiveBuffer;
+			while ( true )
 			{
-				if ( mode == Client && state == Connecting )
+				Address sender;
+				int bytes_read = socket.Receive( sender, packet, MaxPacketSize );
+				if ( bytes_read == 0 )
+					return 0;
+				unsigned int handshakeId = 0;
+				const unsigned char * handshakeCookie = NULL;
+				const int handshake = ReadHandshake( packet, bytes_read, protocolId, &handshakeId, &handshakeCookie );
+				if ( handshake )
+				{
+					ProcessHandshake( sender, handshake, handshakeId, handshakeCookie );
+					continue;
+				}
+				if ( bytes_read <= 8 )
+					continue;
+				if ( packet[0] != (unsigned char) ( protocolId >> 24 ) || 
+					 packet[1] != (unsigned char) ( ( protocolId >> 16 ) & 0xFF ) ||
+					 packet[2] != (unsigned char) ( ( protocolId >> 8 ) & 0xFF ) ||
+					 packet[3] != (unsigned char) ( protocolId & 0xFF ) )
+					continue;
+				const unsigned int id = ( (unsigned int) packet[4] << 24 ) | ( (unsigned int) packet[5] << 16 ) |
+				                        ( (unsigned int) packet[6] << 8 ) | packet[7];
+				// a listening server has no address yet, it only takes data once the handshake is done
+				if ( address.GetAddress() == 0 || id == 0 )
+					continue;
+				if ( mode == Client && state == Connecting && sender == address )
 				{
+					// the welcome was lost, the server's data says as much and carries the id it would have
 					printf( "client completes connection with server\n" );
+					connectionId = id;
 					state = Connected;
 					OnConnect();
 				}
+				if ( state != Connected || id != connectionId )
+					continue;
+				if ( sender != address )
+				{
+					// only a server follows its peer to a new address
+					if ( mode != Server )
+						continue;
+					Challenge( sender );
+				}
 				timeoutAccumulator = 0.0f;
-				memcpy( data, &packet[4], bytes_read - 4 );
-				return bytes_read - 4;
+				*data = &packet[8];
+				return bytes_read - 8;
 			}
-			return 0;
 		}
 		
 		int GetHeaderSize() const
 		{
-			return 4;
+			return 8;
+		}
+
+		// the id the server handed out, 0 until connected
+
+		unsigned int GetConnectionId() const
+		{
+			return connectionId;
+		}
+
+		const Address & GetAddress() const
+		{
+			return address;
 		}
 		
 	protected:
+
+		void ProcessHandshake( const Address & sender, int type, unsigned int id, const unsigned char * received )
+		{
+			if ( mode == Server )
+			{
+				const bool connected = IsConnected();
+				if ( type == HandshakeResponse )
+				{
+					// the peer got the challenge at its new address, that is where it is from now on
+					if ( connected && id == connectionId && sender != address && cookies.Check( sender, clock, received ) )
+					{
+						printf( "client moved to %d.%d.%d.%d:%d\n",
+							sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
+						address = sender;
+					}
+					return;
+				}
+				// one peer at a time, the others are not even handed a cookie
+				if ( connected && sender != address )
+					return;
+				if ( type == HandshakeHello || ( type == HandshakeEcho && !connected && !cookies.Check( sender, clock, received ) ) )
+				{
+					// a stale cookie is replaced, the client echoes the new one
+					unsigned char made[CookieJar::CookieSize];
+					cookies.Make( sender, clock, made );
+					SendHandshake( socket, sender, protocolId, HandshakeCookie, 0, made );
+				}
+				else if ( type == HandshakeEcho )
+				{
+					if ( !connected )
+					{
+						printf( "server accepts connection from client %d.%d.%d.%d:%d\n", 
+							sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
+						state = Connected;
+						address = sender;
+						connectionId = NewConnectionId();
+						timeoutAccumulator = 0.0f;
+						OnConnect();
+					}
+					SendHandshake( socket, sender, protocolId, HandshakeWelcome, connectionId, NULL );
+				}
+			}
+			else if ( mode == Client && state == Connected && sender == address )
+			{
+				// the server saw this connection's packets come from somewhere new, the answer goes out the same way
+				if ( type == HandshakeChallenge && id == connectionId )
+					SendHandshake( socket, address, protocolId, HandshakeResponse, connectionId, received );
+			}
+			else if ( mode == Client && state == Connecting && sender == address )
+			{
+				if ( type == HandshakeCookie )
+				{
+					// a new cookie is echoed at once, then again on the handshake interval until welcomed.
+					// the same one again is a server that is full, it waits for the interval
+					if ( cookieReceived && std::memcmp( cookie, received, CookieJar::CookieSize ) == 0 )
+						return;
+					std::memcpy( cookie, received, CookieJar::CookieSize );
+					cookieReceived = true;
+					handshakeAccumulator = 0.0f;
+					SendHandshake( socket, address, protocolId, HandshakeEcho, 0, cookie );
+				}
+				else if ( type == HandshakeWelcome && id != 0 )
+				{
+					printf( "client completes connection with server\n" );
+					connectionId = id;
+					state = Connected;
+					timeoutAccumulator = 0.0f;
+					OnConnect();
+				}
+			}
+		}
 		
 		virtual void OnStart()		{}
 		virtual void OnStop()		{}
@@ -508,12 +1024,28 @@ namespace net
 		virtual void OnDisconnect() {}
 			
 	private:
+
+		// a cookie for the new address, at most one per handshake interval however many packets come from it
+
+		void Challenge( const Address & sender )
+		{
+			if ( clock - lastChallenge < HandshakeInterval )
+				return;
+			lastChallenge = clock;
+			unsigned char made[CookieJar::CookieSize];
+			cookies.Make( sender, clock, made );
+			SendHandshake( socket, sender, protocolId, HandshakeChallenge, connectionId, made );
+		}
 		
 		void ClearData()
 		{
 			state = Disconnected;
 			timeoutAccumulator = 0.0f;
 			address = Address();
+			connectionId = 0;
+			handshakeAccumulator = HandshakeInterval;	// the first hello goes out with the next update
+			cookieReceived = false;
+			lastChallenge = -HandshakeInterval;
 		}
 	
 		enum State
@@ -534,6 +1066,14 @@ namespace net
 		Socket socket;
 		float timeoutAccumulator;
 		Address address;
+		unsigned int connectionId;				// handed out by the server in its welcome, 0 until then
+		unsigned char receiveBuffer[MaxPacketSize];		// last datagram received, ReceivePacket hands out views into it
+		double clock;							// seconds of updates since the connection was made, the time of its cookies
+		CookieJar cookies;						// server: hands out and checks the cookies of the handshake and the challenges
+		double lastChallenge;					// server: clock when the peer's new address was last challenged
+		float handshakeAccumulator;				// client: time since the last hello or echo
+		bool cookieReceived;					// client: the server has handed out a cookie, it is echoed instead of hello
+		unsigned char cookie[CookieJar::CookieSize];	// client: the cookie to echo
 	};
 	
 	// packet queue to store information about sent and received packets sorted in sequence order
@@ -542,8 +1082,14 @@ namespace net
 	struct PacketData
 	{
 		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
+		double time;					// time packet was sent or received (depending on context), see ReliabilitySystem
 		int size;						// packet size in bytes
+		// sent packets only: the delivery state when it was sent, see DeliverySample
+		double sent_time;
+		double first_sent_time;			// send time of the last packet acked by then
+		double delivered_time;			// time of the last ack by then
+		unsigned long long delivered;	// bytes acked by then
+		bool app_limited;
 	};
 
 	inline bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
@@ -617,7 +1163,20 @@ namespace net
 	// reliability system to support reliable connection
 	//  + manages sent, received, pending ack and acked packet queues
 	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+	//  + the ack of a packet yields a delivery sample for congestion control, see DeliverySample
+	//  + packets are stamped with the time they were sent or received, nothing is walked to age them.
+	//    the time is the system's own, advanced by Update, or that of a TimerWheel it shares with others
 	
+	// loss detection of the reliability system, a packet not acked yet is lost
+	//  + once one sent LossPacketThreshold or more after it is acked
+	//  + or once any later one is and it has been out LossTimeThreshold rtts, LossDelayMinimum seconds at least
+	//  + or, with none of the later ones acked, after 4 rtts: TailTimeoutMinimum seconds at least, rtt_maximum at most
+
+	const unsigned int LossPacketThreshold = 3;
+	const float LossTimeThreshold = 9.0f / 8.0f;
+	const float LossDelayMinimum = 0.05f;		// the rtt is measured in whole updates, and acks wait for the peer's
+	const float TailTimeoutMinimum = 0.25f;		// the peer acks with its next packet, that may be a keep alive
+
 	class ReliabilitySystem
 	{
 	public:
@@ -626,13 +1185,25 @@ namespace net
 		{
 			this->rtt_maximum = rtt_maximum;
 			this->max_sequence = max_sequence;
+			clock = NULL;
 			Reset();
 		}
+
+		// take the time from a wheel instead of the deltas passed to Update. the packets are stamped
+		// with its time as they come and go, between updates too. set before anything is sent
+
+		void SetClock( const TimerWheel * clock )
+		{
+			this->clock = clock;
+			delivery.time = Now();
+		}
 		
 		void Reset()
 		{
 			local_sequence = 0;
 			remote_sequence = 0;
+			largest_acked = 0;
+			any_acked = false;
 			sentQueue.clear();
 			receivedQueue.clear();
 			pendingAckQueue.clear();
@@ -641,10 +1212,10 @@ namespace net
 			recv_packets = 0;
 			lost_packets = 0;
 			acked_packets = 0;
-			sent_bandwidth = 0.0f;
-			acked_bandwidth = 0.0f;
 			rtt = 0.0f;
 			rtt_maximum = 1.0f;
+			delivery = DeliveryState();
+			delivery.time = Now();
 		}
 		
 		void PacketSent( int size )
@@ -657,12 +1228,27 @@ namespace net
 			}
 			assert( !sentQueue.exists( local_sequence ) );
 			assert( !pendingAckQueue.exists( local_sequence ) );
+			delivery.time = Now();
+			// nothing in flight, the intervals of the next samples start now
+			if ( pendingAckQueue.empty() )
+			{
+				delivery.first_sent_time = delivery.time;
+				delivery.delivered_time = delivery.time;
+			}
 			PacketData data;
 			data.sequence = local_sequence;
-			data.time = 0.0f;
+			data.time = delivery.time;
 			data.size = size;
+			data.sent_time = delivery.time;
+			data.first_sent_time = delivery.first_sent_time;
+			data.delivered_time = delivery.delivered_time;
+			data.delivered = delivery.delivered;
+			data.app_limited = delivery.app_limited_until > 0;
 			sentQueue.push_back( data );
+			while ( sentQueue.front().time < delivery.time - rtt_maximum )
+				sentQueue.pop_front();
 			pendingAckQueue.push_back( data );
+			delivery.in_flight += size;
 			sent_packets++;
 			local_sequence++;
 			if ( local_sequence > max_sequence )
@@ -674,13 +1260,18 @@ namespace net
 			recv_packets++;
 			if ( receivedQueue.exists( sequence ) )
 				return;
-			PacketData data;
+			PacketData data = PacketData();
 			data.sequence = sequence;
-			data.time = 0.0f;
+			data.time = Now();
 			data.size = size;
 			receivedQueue.push_back( data );
 			if ( sequence_more_recent( sequence, remote_sequence, max_sequence ) )
 				remote_sequence = sequence;
+			// only the last 33 are acked
+			const unsigned int latest_sequence = receivedQueue.back().sequence;
+			const unsigned int minimum_sequence = latest_sequence >= 34 ? ( latest_sequence - 34 ) : max_sequence - ( 34 - latest_sequence );
+			while ( receivedQueue.size() && !sequence_more_recent( receivedQueue.front().sequence, minimum_sequence, max_sequence ) )
+				receivedQueue.pop_front();
 		}
 
 		unsigned int GenerateAckBits()
@@ -690,15 +1281,45 @@ namespace net
 		
 		void ProcessAck( unsigned int ack, unsigned int ack_bits )
 		{
-			process_ack( ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence );
+			delivery.time = Now();
+			process_ack( ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence, delivery.time, &delivery );
+			while ( ackedQueue.size() && ackedQueue.front().time < delivery.time - rtt_maximum * 2 )
+				ackedQueue.pop_front();
+			// the newest packet the peer has, the ones before it that it doesn't are on their way to being lost
+			if ( !any_acked || sequence_more_recent( ack, largest_acked, max_sequence ) )
+				largest_acked = ack;
+			any_acked = true;
+		}
+
+		// the sender has run out of data to send. the packets sent until what is in flight now is
+		// acked go at the application's pace, their samples are marked app limited
+
+		void SetAppLimited()
+		{
+			delivery.app_limited_until = delivery.delivered + delivery.in_flight;
+			if ( delivery.app_limited_until == 0 )
+				delivery.app_limited_until = 1;
 		}
 				
+		// forgets the acks, losses and samples of the last update and finds the packets lost by now.
+		// with a clock the time is the clock's and deltaTime goes unused
+
 		void Update( float deltaTime )
 		{
 			acks.clear();
-			AdvanceQueueTime( deltaTime );
-			UpdateQueues();
-			UpdateStats();
+			lost.clear();
+			delivery.samples.clear();
+			if ( clock )
+				delivery.time = clock->GetTime();
+			else
+				delivery.time += deltaTime;
+			while ( pendingAckQueue.size() && GetLossTime() <= delivery.time )
+			{
+				lost.push_back( pendingAckQueue.front().sequence );
+				delivery.in_flight -= pendingAckQueue.front().size;
+				pendingAckQueue.pop_front();
+				lost_packets++;
+			}
 			#ifdef NET_UNIT_TEST
 			Validate();
 			#endif
@@ -753,10 +1374,24 @@ namespace net
 			return ack_bits;
 		}
 		
+		// what is known about delivery rate at one moment, packets copy it when sent to be compared with it when acked
+
+		struct DeliveryState
+		{
+			DeliveryState() : time( 0.0 ), first_sent_time( 0.0 ), delivered_time( 0.0 ), delivered( 0 ), app_limited_until( 0 ), in_flight( 0 ) {}
+			double time;							// seconds of updates
+			double first_sent_time;					// send time of the last packet acked
+			double delivered_time;					// time of the last ack
+			unsigned long long delivered;			// bytes acked
+			unsigned long long app_limited_until;	// delivered at which sending stops being app limited, 0 when it isn't
+			int in_flight;							// bytes sent, not yet acked nor given up on
+			std::vector<DeliverySample> samples;	// one per packet acked since the last update
+		};
+
 		static void process_ack( unsigned int ack, unsigned int ack_bits, 
 								 PacketQueue & pending_ack_queue, PacketQueue & acked_queue, 
 								 std::vector<unsigned int> & acks, unsigned int & acked_packets, 
-								 float & rtt, unsigned int max_sequence )
+								 float & rtt, unsigned int max_sequence, double time, DeliveryState * delivery = NULL )
 		{
 			if ( pending_ack_queue.empty() )
 				return;
@@ -779,7 +1414,9 @@ namespace net
 				
 				if ( acked )
 				{
-					rtt += ( itor->time - rtt ) * 0.1f;
+					rtt += ( (float) ( time - itor->time ) - rtt ) * 0.1f;
+					if ( delivery )
+						sample_delivery( *itor, *delivery );
 
 					acked_queue.insert_sorted( *itor, max_sequence );
 					acks.push_back( itor->sequence );
@@ -791,6 +1428,31 @@ namespace net
 			}
 		}
 		
+		// the rate is what was acked since the packet was sent over the longer of the time the packets acked
+		// in between took to send and to be acked, see DeliverySample. too short an interval gives no rate
+
+		static void sample_delivery( const PacketData & packet, DeliveryState & delivery )
+		{
+			delivery.delivered += packet.size;
+			delivery.delivered_time = delivery.time;
+			delivery.in_flight -= packet.size;
+			if ( delivery.app_limited_until > 0 && delivery.delivered > delivery.app_limited_until )
+				delivery.app_limited_until = 0;
+			if ( packet.sent_time > delivery.first_sent_time )
+				delivery.first_sent_time = packet.sent_time;
+			const double send_elapsed = packet.sent_time - packet.first_sent_time;
+			const double ack_elapsed = delivery.delivered_time - packet.delivered_time;
+			const double interval = send_elapsed > ack_elapsed ? send_elapsed : ack_elapsed;
+			DeliverySample sample;
+			sample.size = packet.size;
+			sample.rate = interval > 0.0 ? (float) ( ( delivery.delivered - packet.delivered ) / interval ) : 0.0f;
+			sample.rtt = (float) ( delivery.time - packet.time );
+			sample.delivered = delivery.delivered;
+			sample.prior_delivered = packet.delivered;
+			sample.app_limited = packet.app_limited;
+			delivery.samples.push_back( sample );
+		}
+		
 		// data accessors
 				
 		unsigned int GetLocalSequence() const
@@ -810,9 +1472,28 @@ namespace net
 				
  		void GetAcks( unsigned int ** acks, int & count )
 		{
-			*acks = &this->acks[0];
+			*acks = this->acks.data();
 			count = (int) this->acks.size();
 		}
+
+		void GetLost( unsigned int ** lost, int & count )
+		{
+			*lost = this->lost.data();
+			count = (int) this->lost.size();
+		}
+
+		// delivery samples of the packets acked since the last update, in the order of GetAcks
+
+		void GetDeliverySamples( const DeliverySample ** samples, int & count ) const
+		{
+			*samples = delivery.samples.data();
+			count = (int) delivery.samples.size();
+		}
+
+		int GetBytesInFlight() const
+		{
+			return delivery.in_flight;
+		}
 		
 		unsigned int GetSentPackets() const
 		{
@@ -834,87 +1515,76 @@ namespace net
 			return acked_packets;
 		}
 
+		// kbit/s sent over the last rtt_maximum, and acked of what was sent the rtt_maximum before that
+
 		float GetSentBandwidth() const
 		{
-			return sent_bandwidth;
+			const double now = Now();
+			int sent_bytes = 0;
+			for ( PacketQueue::const_iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor )
+			{
+				if ( itor->time >= now - rtt_maximum )
+					sent_bytes += itor->size;
+			}
+			return sent_bytes / rtt_maximum * ( 8 / 1000.0f );
 		}
 
 		float GetAckedBandwidth() const
 		{
-			return acked_bandwidth;
+			const double now = Now();
+			int acked_bytes = 0;
+			for ( PacketQueue::const_iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor )
+			{
+				if ( itor->time <= now - rtt_maximum && itor->time >= now - rtt_maximum * 2 )
+					acked_bytes += itor->size;
+			}
+			return acked_bytes / rtt_maximum * ( 8 / 1000.0f );
 		}
 
 		float GetRoundTripTime() const
 		{
 			return rtt;
 		}
-		
-		int GetHeaderSize() const
-		{
-			return 12;
-		}
-
-	protected:
-		
-		void AdvanceQueueTime( float deltaTime )
-		{
-			for ( PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++ )
-				itor->time += deltaTime;
-
-			for ( PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++ )
-				itor->time += deltaTime;
 
-			for ( PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++ )
-				itor->time += deltaTime;
+		// time the oldest packet not acked yet is given up on unless its ack comes first, negative with
+		// none in flight. the time it was sent when the packets acked since are past LossPacketThreshold.
+		// the queue is in send order: the oldest packets are the furthest behind the largest acked and
+		// have been out the longest, what is lost is always at its front
 
-			for ( PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++ )
-				itor->time += deltaTime;
-		}
-		
-		void UpdateQueues()
+		double GetLossTime() const
 		{
-			const float epsilon = 0.001f;
-
-			while ( sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon )
-				sentQueue.pop_front();
-
-			if ( receivedQueue.size() )
-			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? ( latest_sequence - 34 ) : max_sequence - ( 34 - latest_sequence );
-				while ( receivedQueue.size() && !sequence_more_recent( receivedQueue.front().sequence, minimum_sequence, max_sequence ) )
-					receivedQueue.pop_front();
-			}
-
-			while ( ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon )
-				ackedQueue.pop_front();
-
-			while ( pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon )
+			if ( pendingAckQueue.empty() )
+				return -1.0;
+			const PacketData & packet = pendingAckQueue.front();
+			const bool overtaken = any_acked && sequence_more_recent( largest_acked, packet.sequence, max_sequence );
+			if ( overtaken )
 			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
+				const unsigned int behind = largest_acked >= packet.sequence ? largest_acked - packet.sequence : largest_acked + ( max_sequence - packet.sequence ) + 1;
+				if ( behind >= LossPacketThreshold )
+					return packet.time;
+				float loss_delay = rtt * LossTimeThreshold;
+				if ( loss_delay < LossDelayMinimum )
+					loss_delay = LossDelayMinimum;
+				return packet.time + loss_delay;
 			}
+			float tail_timeout = rtt * 4;
+			if ( tail_timeout < TailTimeoutMinimum )
+				tail_timeout = TailTimeoutMinimum;
+			if ( tail_timeout > rtt_maximum )
+				tail_timeout = rtt_maximum;
+			return packet.time + tail_timeout;
 		}
 		
-		void UpdateStats()
+		int GetHeaderSize() const
 		{
-			int sent_bytes_per_second = 0;
-			for ( PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor )
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for ( PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor )
-			{
-				if ( itor->time >= rtt_maximum )
-				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
-				}
-			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * ( 8 / 1000.0f );
-			acked_bandwidth = acked_bytes_per_second * ( 8 / 1000.0f );
+			return 12;
+		}
+
+	protected:
+
+		double Now() const
+		{
+			return clock ? clock->GetTime() : delivery.time;
 		}
 		
 	private:
@@ -922,23 +1592,415 @@ namespace net
 		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
 		unsigned int local_sequence;		// local sequence number for most recently sent packet
 		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+		unsigned int largest_acked;			// most recent local sequence the remote end said it received
+		bool any_acked;						// largest_acked means something
 		
 		unsigned int sent_packets;			// total number of packets sent
 		unsigned int recv_packets;			// total number of packets received
 		unsigned int lost_packets;			// total number of packets lost
 		unsigned int acked_packets;			// total number of packets acked
 
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
 		float rtt;							// estimated round trip time
 		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
 
 		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+		std::vector<unsigned int> lost;		// packets given up on as lost during the last update. cleared each update!
 
 		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
+		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until found lost)
 		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
 		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
+
+		DeliveryState delivery;				// for the delivery samples. its samples are cleared each update!
+		const TimerWheel * clock;			// where the time comes from, NULL for the deltas passed to Update
+	};
+
+	// pooled send buffer used by the reliable mode of ReliableConnection
+	//  + payloads are copied into fixed size slots and keyed by the sequence of the packet carrying them
+	//  + slots are recycled through a free list, so steady state sending never touches the heap
+	//  + a retransmitted payload keeps its slot and is simply re-keyed to the new packet sequence,
+	//    the slot remembers the sequence it was first sent with
+	//  + a default constructed buffer has no slots, a sized one is assigned to it when it is first needed
+
+	class SendBuffer
+	{
+	public:
+
+		SendBuffer()
+		{
+			slot_size = 0;
+		}
+
+		SendBuffer( int slot_count, int slot_size )
+		{
+			this->slot_size = slot_size;
+			storage.resize( slot_count * slot_size );
+			sizes.resize( slot_count );
+			firsts.resize( slot_count );
+			tags.resize( slot_count );
+			Clear();
+		}
+
+		void Clear()
+		{
+			slots.clear();
+			free_slots.clear();
+			for ( int i = (int) sizes.size() - 1; i >= 0; --i )
+				free_slots.push_back( i );
+		}
+
+		bool Insert( unsigned int sequence, const unsigned char data[], int size, int tag = -1 )
+		{
+			assert( size >= 0 );
+			if ( size > slot_size || free_slots.empty() )
+				return false;
+			assert( slots.find( sequence ) == slots.end() );
+			const int slot = free_slots.back();
+			free_slots.pop_back();
+			std::memcpy( &storage[slot * slot_size], data, size );
+			sizes[slot] = size;
+			firsts[slot] = sequence;
+			tags[slot] = tag;
+			slots[sequence] = slot;
+			return true;
+		}
+
+		const unsigned char * Find( unsigned int sequence, int & size ) const
+		{
+			std::map<unsigned int, int>::const_iterator itor = slots.find( sequence );
+			if ( itor == slots.end() )
+				return NULL;
+			size = sizes[itor->second];
+			return &storage[itor->second * slot_size];
+		}
+
+		bool Move( unsigned int from, unsigned int to )
+		{
+			std::map<unsigned int, int>::iterator itor = slots.find( from );
+			if ( itor == slots.end() )
+				return false;
+			const int slot = itor->second;
+			slots.erase( itor );
+			slots[to] = slot;
+			return true;
+		}
+
+		// frees the slot of an acked payload, false if there was none. first gets the sequence
+		// the payload was inserted with, whatever it was moved to since, and tag the tag it was inserted with
+
+		bool Remove( unsigned int sequence, unsigned int * first = NULL, int * tag = NULL )
+		{
+			std::map<unsigned int, int>::iterator itor = slots.find( sequence );
+			if ( itor == slots.end() )
+				return false;
+			if ( first )
+				*first = firsts[itor->second];
+			if ( tag )
+				*tag = tags[itor->second];
+			free_slots.push_back( itor->second );
+			slots.erase( itor );
+			return true;
+		}
+
+		int GetPendingCount() const
+		{
+			return (int) slots.size();
+		}
+
+		bool IsFull() const
+		{
+			return free_slots.empty();
+		}
+
+		int GetSlotSize() const
+		{
+			return slot_size;
+		}
+
+		int GetSlotCount() const
+		{
+			return (int) sizes.size();
+		}
+
+	private:
+
+		int slot_size;							// maximum payload size per slot
+		std::vector<unsigned char> storage;		// slot_count * slot_size bytes, allocated once
+		std::vector<int> sizes;					// payload size stored in each slot
+		std::vector<unsigned int> firsts;		// sequence each slot's payload was first sent with
+		std::vector<int> tags;					// caller supplied tag of each slot, handed back on Remove
+		std::vector<int> free_slots;			// slots available for new payloads
+		std::map<unsigned int, int> slots;		// packet sequence -> slot holding its payload
+	};
+
+	// message channels multiplexed over one reliable connection, or over each of a server's peers
+	//  + each message carries a channel id and a message sequence owned by that channel
+	//  + reliable channels keep their payloads in the send buffer until acked, the unreliable channel never retransmits
+	//  + the ordered channel holds back messages until the gap before them is filled, the others deliver on arrival
+	//  + sequencing is per channel, so a missing message only ever stalls its own channel
+
+	enum ChannelType
+	{
+		ReliableOrdered,
+		ReliableUnordered,
+		Unreliable
+	};
+
+	// default channel layout set up by ReliableConnection and ReliableServer, more can be added with AddChannel
+
+	enum DefaultChannels
+	{
+		ControlChannel = 0,		// reliable ordered, for handshakes and other control messages
+		BulkChannel,			// reliable unordered, for bulk data
+		UnreliableChannel,		// unreliable sequenced, stale messages are dropped
+		DefaultChannelCount
+	};
+
+	class MessageChannel
+	{
+	public:
+
+		MessageChannel( ChannelType type = ReliableOrdered )
+		{
+			this->type = type;
+			Reset();
+		}
+
+		void Reset()
+		{
+			send_sequence = 0;
+			receive_sequence = 0;
+			received_any = false;
+			received.clear();
+			pending.clear();
+		}
+
+		ChannelType GetType() const
+		{
+			return type;
+		}
+
+		bool IsReliable() const
+		{
+			return type != Unreliable;
+		}
+
+		unsigned int NextSendSequence()
+		{
+			return send_sequence++;
+		}
+
+		// give back the sequence just taken by NextSendSequence when the message could not be sent
+
+		void RewindSendSequence()
+		{
+			send_sequence--;
+		}
+
+		// true when a message with this sequence has already been delivered or buffered
+
+		bool IsStale( unsigned int sequence ) const
+		{
+			switch ( type )
+			{
+			case Unreliable:
+				return received_any && !sequence_more_recent( sequence, receive_sequence, 0xFFFFFFFF );
+			case ReliableUnordered:
+				return sequence_more_recent( receive_sequence, sequence, 0xFFFFFFFF ) || received.count( sequence ) != 0;
+			case ReliableOrdered:
+			default:
+				return sequence_more_recent( receive_sequence, sequence, 0xFFFFFFFF ) || pending.count( sequence ) != 0;
+			}
+		}
+
+		// decide what to do with a message that just arrived on this channel.
+		// returns true when it should be delivered right away. out of order messages
+		// on the ordered channel are buffered and handed out later by PopPending.
+
+		bool Accept( unsigned int sequence, const unsigned char data[], int size )
+		{
+			if ( IsStale( sequence ) )
+				return false;
+			switch ( type )
+			{
+			case Unreliable:
+				received_any = true;
+				receive_sequence = sequence;
+				return true;
+
+			case ReliableUnordered:
+				if ( sequence != receive_sequence )
+				{
+					received.insert( sequence );
+					return true;
+				}
+				receive_sequence++;
+				while ( received.size() && *received.begin() == receive_sequence )
+				{
+					received.erase( received.begin() );
+					receive_sequence++;
+				}
+				return true;
+
+			case ReliableOrdered:
+			default:
+				if ( sequence == receive_sequence )
+				{
+					receive_sequence++;
+					return true;
+				}
+				pending[sequence].assign( data, data + size );
+				return false;
+			}
+		}
+
+		// next buffered message of the ordered channel, if the gap in front of it has been filled
+
+		bool PopPending( std::vector<unsigned char> & message )
+		{
+			std::map<unsigned int, std::vector<unsigned char> >::iterator itor = pending.find( receive_sequence );
+			if ( itor == pending.end() )
+				return false;
+			message.swap( itor->second );
+			pending.erase( itor );
+			receive_sequence++;
+			return true;
+		}
+
+	private:
+
+		ChannelType type;
+		unsigned int send_sequence;			// sequence for the next message sent on this channel
+		unsigned int receive_sequence;		// reliable: oldest message not delivered yet. unreliable: most recent message delivered
+		bool received_any;					// unreliable channel has delivered at least one message
+		std::set<unsigned int> received;	// unordered channel: messages delivered ahead of receive_sequence
+		std::map<unsigned int, std::vector<unsigned char> > pending;	// ordered channel: messages waiting for the gap in front of them to fill
+	};
+
+	// reassembly of fragmented messages
+	//  + a fixed number of slots, each one a region of a single arena. the arena is allocated whole when the first fragmented
+	//    message arrives and never grows, so SlotCount * max_fragments * fragment_size bytes is all reassembly ever holds
+	//  + a bitmap per slot records which fragments have arrived, so duplicates are dropped without touching the arena
+	//  + the sender keeps at most SlotCount fragmented messages in flight, so a reliable message always finds a slot.
+	//    a partial unreliable message is evicted when its slot is needed
+
+	class FragmentReassembler
+	{
+	public:
+
+		enum { SlotCount = 2 };
+
+		FragmentReassembler( int fragment_size, int max_fragments )
+		{
+			this->fragment_size = fragment_size;
+			this->max_fragments = max_fragments;
+			for ( int i = 0; i < SlotCount; ++i )
+				slots[i].bitmap.resize( ( max_fragments + 31 ) / 32 );
+			Reset();
+		}
+
+		void Reset()
+		{
+			for ( int i = 0; i < SlotCount; ++i )
+				slots[i].active = false;
+		}
+
+		// returns the slot holding the message once its last missing fragment arrives, -1 otherwise
+
+		int AddFragment( int channel, unsigned int sequence, int index, int count, const unsigned char data[], int size, bool reliable )
+		{
+			if ( count < 1 || count > max_fragments || index >= count )
+				return -1;
+			if ( size <= 0 || size > fragment_size || ( index < count - 1 && size != fragment_size ) )
+				return -1;
+			const int slot_index = FindSlot( channel, sequence );
+			if ( slot_index < 0 )
+				return -1;
+			Slot & slot = slots[slot_index];
+			if ( !slot.active || slot.channel != channel || slot.sequence != sequence )
+			{
+				if ( arena.empty() )
+					arena.resize( GetArenaSize() );
+				slot.active = true;
+				slot.reliable = reliable;
+				slot.channel = channel;
+				slot.sequence = sequence;
+				slot.fragment_count = count;
+				slot.received_count = 0;
+				slot.size = 0;
+				std::fill( slot.bitmap.begin(), slot.bitmap.begin() + ( count + 31 ) / 32, 0 );
+			}
+			if ( slot.fragment_count != count )
+				return -1;
+			const unsigned int bit = 1u << ( index & 31 );
+			if ( slot.bitmap[index >> 5] & bit )
+				return -1;
+			slot.bitmap[index >> 5] |= bit;
+			std::memcpy( &arena[GetOffset( slot_index ) + (size_t) index * fragment_size], data, size );
+			if ( index == count - 1 )
+				slot.size = index * fragment_size + size;
+			if ( ++slot.received_count < count )
+				return -1;
+			return slot_index;
+		}
+
+		const unsigned char * GetMessage( int slot, int & size ) const
+		{
+			assert( slot >= 0 && slot < SlotCount && slots[slot].active );
+			size = slots[slot].size;
+			return &arena[GetOffset( slot )];
+		}
+
+		void Release( int slot )
+		{
+			assert( slot >= 0 && slot < SlotCount );
+			slots[slot].active = false;
+		}
+
+		size_t GetArenaSize() const
+		{
+			return (size_t) SlotCount * max_fragments * fragment_size;
+		}
+
+	private:
+
+		int FindSlot( int channel, unsigned int sequence ) const
+		{
+			int free_slot = -1;
+			int unreliable_slot = -1;
+			for ( int i = 0; i < SlotCount; ++i )
+			{
+				if ( !slots[i].active )
+					free_slot = i;
+				else if ( slots[i].channel == channel && slots[i].sequence == sequence )
+					return i;
+				else if ( !slots[i].reliable )
+					unreliable_slot = i;
+			}
+			return free_slot >= 0 ? free_slot : unreliable_slot;
+		}
+
+		size_t GetOffset( int slot ) const
+		{
+			return (size_t) slot * max_fragments * fragment_size;
+		}
+
+		struct Slot
+		{
+			bool active;
+			bool reliable;
+			int channel;
+			unsigned int sequence;
+			int fragment_count;
+			int received_count;
+			int size;							// message size, known once the last fragment arrived
+			std::vector<unsigned int> bitmap;	// one bit per fragment received
+		};
+
+		int fragment_size;
+		int max_fragments;
+		Slot slots[SlotCount];
+		std::vector<unsigned char> arena;		// GetArenaSize() bytes, allocated with the first fragment
 	};
 
 	// connection with reliability (seq/ack)
@@ -948,8 +2010,15 @@ namespace net
 	public:
 		
 		ReliableConnection( unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF )
-			: Connection( protocolId, timeout ), reliabilitySystem( max_sequence )
-		{
+			: Connection( protocolId, timeout ), reliabilitySystem( max_sequence ), reassembler( FragmentSize, MaxFragments )
+		{
+			reliableMode = false;
+			fragmentsPerUpdate = 64;
+			nextFragmentJob = 0;
+			deliveredSlot = -1;
+			AddChannel( ReliableOrdered );		// ControlChannel
+			AddChannel( ReliableUnordered );	// BulkChannel
+			AddChannel( Unreliable );			// UnreliableChannel
 			ClearData();
 			#ifdef NET_UNIT_TEST
 			packet_loss_mask = 0;
@@ -966,33 +2035,47 @@ namespace net
 				
 		bool SendPacket( const unsigned char data[], int size )
 		{
-			#ifdef NET_UNIT_TEST
-			if ( reliabilitySystem.GetLocalSequence() & packet_loss_mask )
-			{
-				reliabilitySystem.PacketSent( size );
-				return true;
-			}
-			#endif
-			const int header = 12;
-			unsigned char packet[header+ PacketSizeHack];
-			unsigned int seq = reliabilitySystem.GetLocalSequence();
-			unsigned int ack = reliabilitySystem.GetRemoteSequence();
-			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
-			WriteHeader( packet, seq, ack, ack_bits );
-      std::memcpy( packet + header, data, size );
- 			if ( !Connection::SendPacket( packet, size + header ) )
+			if ( size > MaxPayloadSize )
 				return false;
-			reliabilitySystem.PacketSent( size );
-			return true;
+			PacketBuffer packet;
+      std::memcpy( packet.GetPayload(), data, size );
+			packet.SetPayloadSize( size );
+			return SendPayload( packet, reliableMode );
 		}	
+
+		bool SendPacket( PacketBuffer & packet )
+		{
+			return SendPayload( packet, reliableMode );
+		}
+
+		// in reliable mode, reliable false sends a payload that is not kept: its loss is the caller's to
+		// answer, as without the mode. for what is stale by the time it would be resent, or probes the path
+		
+		bool SendPacket( PacketBuffer & packet, bool reliable )
+		{
+			return SendPayload( packet, reliableMode && reliable );
+		}
 		
 		int ReceivePacket( unsigned char data[], int size )
 		{
 			const int header = 12;
 			if ( size <= header )
 				return false;
-			unsigned char packet[header+ PacketSizeHack];
-			int received_bytes = Connection::ReceivePacket( packet, size + header );
+			const unsigned char * payload = NULL;
+			int received_bytes = ReceivePacket( &payload );
+			if ( received_bytes == 0 )
+				return false;
+			if ( received_bytes > size )
+				received_bytes = size;
+      std::memcpy( data, payload, received_bytes );
+			return received_bytes;
+		}
+
+		int ReceivePacket( const unsigned char ** data )
+		{
+			const int header = 12;
+			const unsigned char * packet = NULL;
+			int received_bytes = Connection::ReceivePacket( &packet );
 			if ( received_bytes == 0 )
 				return false;
 			if ( received_bytes <= header )
@@ -1003,59 +2086,416 @@ namespace net
 			ReadHeader( packet, packet_sequence, packet_ack, packet_ack_bits );
 			reliabilitySystem.PacketReceived( packet_sequence, received_bytes - header );
 			reliabilitySystem.ProcessAck( packet_ack, packet_ack_bits );
-      std::memcpy( data, packet + header, received_bytes - header );
+			*data = packet + header;
 			return received_bytes - header;
 		}
 		
 		void Update( float deltaTime )
 		{
 			Connection::Update( deltaTime );
+			ReleaseAcked();
 			reliabilitySystem.Update( deltaTime );
+			RetransmitLost();
+			SendFragments();
 		}
-		
-		int GetHeaderSize() const
+
+		// reliable mode: payloads passed to SendPacket are kept until acked and resent when declared lost.
+		// delivery is at-least-once, a payload whose ack was lost may reach the receiver twice.
+		// the send buffer, MaxPendingPayloads of the largest payload, is allocated when the mode is first turned on
+
+		void SetReliableMode( bool enabled )
 		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+			if ( enabled && sendBuffer.GetSlotCount() == 0 )
+				sendBuffer = SendBuffer( MaxPendingPayloads, MaxPayloadSize );
+			if ( !enabled )
+				sendBuffer.Clear();
+			reliableMode = enabled;
 		}
-		
-		ReliabilitySystem & GetReliabilitySystem()
+
+		// the payloads acked and lost in the last Update, by the sequence SendPacket sent them with.
+		// a kept payload is never reported lost: it goes again under a new sequence, and is reported
+		// acked under its first one once a copy gets through. the reliability system has the acks
+		// and losses of the packets themselves, resent ones included, for the congestion control
+
+		void GetAckedPayloads( unsigned int ** sequences, int & count )
 		{
-			return reliabilitySystem;
+			*sequences = ackedPayloads.empty() ? NULL : &ackedPayloads[0];
+			count = (int) ackedPayloads.size();
 		}
 
-		// unit test controls
-		
-		#ifdef NET_UNIT_TEST
-		void SetPacketLossMask( unsigned int mask )
+		void GetLostPayloads( unsigned int ** sequences, int & count )
 		{
-			packet_loss_mask = mask;
+			*sequences = lostPayloads.empty() ? NULL : &lostPayloads[0];
+			count = (int) lostPayloads.size();
 		}
-		#endif
-		
-	protected:		
-		
-		void WriteInteger( unsigned char * data, unsigned int value )
+
+		bool IsReliableMode() const
 		{
-			data[0] = (unsigned char) ( value >> 24 );
-			data[1] = (unsigned char) ( ( value >> 16 ) & 0xFF );
-			data[2] = (unsigned char) ( ( value >> 8 ) & 0xFF );
-			data[3] = (unsigned char) ( value & 0xFF );
+			return reliableMode;
 		}
 
-		void WriteHeader( unsigned char * header, unsigned int sequence, unsigned int ack, unsigned int ack_bits )
+		int GetPendingPayloads() const
 		{
-			WriteInteger( header, sequence );
-			WriteInteger( header + 4, ack );
-			WriteInteger( header + 8, ack_bits );
+			return sendBuffer.GetPendingCount();
 		}
-		
-		void ReadInteger( const unsigned char * data, unsigned int & value )
+
+		// largest payload SendPacket takes. payloads above BasePayloadSize only get
+		// through a path that carries them, probe it before relying on them.
+
+		static int GetMaxPayloadSize()
 		{
- 			value = ( ( (unsigned int)data[0] << 24 ) | ( (unsigned int)data[1] << 16 ) | 
-				      ( (unsigned int)data[2] << 8 )  | ( (unsigned int)data[3] ) );				
+			return MaxPayloadSize;
 		}
-		
-		void ReadHeader( const unsigned char * header, unsigned int & sequence, unsigned int & ack, unsigned int & ack_bits )
+
+		// largest message SendChannelMessage takes, fragmented
+
+		static int GetMaxMessageSize()
+		{
+			return MaxMessageSize;
+		}
+
+		// largest message that goes in one packet, what the channel header leaves of a payload.
+		// the zero copy SendChannelMessage takes no more
+
+		static int GetMaxUnfragmentedSize()
+		{
+			return MaxPayloadSize - ChannelHeaderSize;
+		}
+
+		// message channels. SendChannelMessage/ReceiveChannelMessage replace SendPacket/ReceivePacket for a connection using them,
+		// the two styles must not be mixed on one connection. the messages of a reliable channel are kept and resent as in
+		// reliable mode, whether the mode is on or not: the send buffer is allocated with the first of them
+
+		int AddChannel( ChannelType type )
+		{
+			assert( (int) channels.size() < MaxChannels );
+			channels.push_back( MessageChannel( type ) );
+			return (int) channels.size() - 1;
+		}
+
+		int GetChannelCount() const
+		{
+			return (int) channels.size();
+		}
+
+		// a message that does not fit in a packet of the base size is split into fragments that take any path.
+		// fragments are queued and sent from Update, at most fragmentsPerUpdate per call and only while the send
+		// buffer has room for them. the message is copied, the caller's buffer is free when this returns
+
+		bool SendChannelMessage( int channel, const unsigned char data[], int size )
+		{
+			assert( channel >= 0 && channel < (int) channels.size() );
+			if ( size > MaxMessageSize )
+				return false;
+			MessageChannel & messageChannel = channels[channel];
+			if ( size > BasePayloadSize - ChannelHeaderSize )
+			{
+				if ( messageChannel.IsReliable() && sendBuffer.GetSlotCount() == 0 )
+					sendBuffer = SendBuffer( MaxPendingPayloads, MaxPayloadSize );
+				fragmentJobs.push_back( FragmentJob() );
+				FragmentJob & job = fragmentJobs.back();
+				job.id = nextFragmentJob++ & 0x7FFFFFFF;
+				job.channel = channel;
+				job.sequence = messageChannel.NextSendSequence();
+				job.fragment_count = ( size + FragmentSize - 1 ) / FragmentSize;
+				job.next_fragment = 0;
+				job.unacked = 0;
+				job.data.assign( data, data + size );
+				return true;
+			}
+			PacketBuffer packet;
+			std::memcpy( packet.GetPayload(), data, size );
+			packet.SetPayloadSize( size );
+			return SendChannelMessage( channel, packet );
+		}
+
+		// zero copy send of a message that fits in one packet. the channel header goes into the headroom,
+		// the buffer is used up by the call whether or not it succeeds.
+
+		bool SendChannelMessage( int channel, PacketBuffer & packet )
+		{
+			assert( channel >= 0 && channel < (int) channels.size() );
+			if ( packet.GetSize() > MaxPayloadSize - ChannelHeaderSize )
+				return false;
+			MessageChannel & messageChannel = channels[channel];
+			if ( messageChannel.IsReliable() && sendBuffer.GetSlotCount() == 0 )
+				sendBuffer = SendBuffer( MaxPendingPayloads, MaxPayloadSize );
+			unsigned char * header = packet.PushHeader( ChannelHeaderSize );
+			header[0] = (unsigned char) channel;
+			WriteInteger( header + 1, messageChannel.NextSendSequence() );
+			if ( !SendPayload( packet, messageChannel.IsReliable() ) )
+			{
+				messageChannel.RewindSendSequence();
+				return false;
+			}
+			return true;
+		}
+
+		// receive the next message on any channel. buffered messages of ordered channels are handed out first,
+		// then packets are read until one holds a message that can be delivered. the returned data points into
+		// connection owned memory and stays valid until the next call.
+
+		int ReceiveChannelMessage( int & channel, const unsigned char ** data )
+		{
+			if ( deliveredSlot >= 0 )
+			{
+				reassembler.Release( deliveredSlot );
+				deliveredSlot = -1;
+			}
+			for ( int i = 0; i < (int) channels.size(); ++i )
+			{
+				if ( channels[i].PopPending( deliveredMessage ) )
+				{
+					channel = i;
+					*data = deliveredMessage.data();
+					return (int) deliveredMessage.size();
+				}
+			}
+			while ( true )
+			{
+				const unsigned char * packet = NULL;
+				const int received_bytes = ReceivePacket( &packet );
+				if ( received_bytes == 0 )
+					return 0;
+				if ( received_bytes < ChannelHeaderSize )
+					continue;
+				const int id = packet[0] & ~FragmentFlag;
+				if ( id >= (int) channels.size() )
+					continue;
+				MessageChannel & messageChannel = channels[id];
+				unsigned int sequence = 0;
+				ReadInteger( packet + 1, sequence );
+				const unsigned char * message = packet + ChannelHeaderSize;
+				int bytes = received_bytes - ChannelHeaderSize;
+				int slot = -1;
+				if ( packet[0] & FragmentFlag )
+				{
+					if ( bytes <= FragmentHeaderSize || messageChannel.IsStale( sequence ) )
+						continue;
+					const int index = ( message[0] << 8 ) | message[1];
+					const int count = ( message[2] << 8 ) | message[3];
+					slot = reassembler.AddFragment( id, sequence, index, count, message + FragmentHeaderSize, bytes - FragmentHeaderSize, messageChannel.IsReliable() );
+					if ( slot < 0 )
+						continue;
+					message = reassembler.GetMessage( slot, bytes );
+				}
+				if ( !messageChannel.Accept( sequence, message, bytes ) )
+				{
+					if ( slot >= 0 )
+						reassembler.Release( slot );
+					continue;
+				}
+				deliveredSlot = slot;
+				channel = id;
+				*data = message;
+				return bytes;
+			}
+		}
+
+		void SetFragmentsPerUpdate( int fragments )
+		{
+			assert( fragments > 0 );
+			fragmentsPerUpdate = fragments;
+		}
+
+		// fragmented messages not yet sent in full, or not yet acked in full on a reliable channel
+
+		int GetQueuedMessages() const
+		{
+			return (int) fragmentJobs.size();
+		}
+
+		unsigned int GetRetransmittedPackets() const
+		{
+			return retransmitted_packets;
+		}
+		
+		int GetHeaderSize() const
+		{
+			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
+		}
+		
+		ReliabilitySystem & GetReliabilitySystem()
+		{
+			return reliabilitySystem;
+		}
+
+		// unit test controls
+		
+		#ifdef NET_UNIT_TEST
+		void SetPacketLossMask( unsigned int mask )
+		{
+			packet_loss_mask = mask;
+		}
+		#endif
+		
+	protected:		
+		
+		bool SendPayload( PacketBuffer & packet, bool retain, int tag = -1 )
+		{
+			const int size = packet.GetSize();
+			if ( size > MaxPayloadSize )
+				return false;
+			const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			if ( retain && !sendBuffer.Insert( sequence, packet.GetData(), size, tag ) )
+				return false;
+			#ifdef NET_UNIT_TEST
+			if ( reliabilitySystem.GetLocalSequence() & packet_loss_mask )
+			{
+				reliabilitySystem.PacketSent( size );
+				return true;
+			}
+			#endif
+ 			if ( !SendWithHeader( packet ) )
+			{
+				if ( retain )
+					sendBuffer.Remove( sequence );
+				return false;
+			}
+			reliabilitySystem.PacketSent( size );
+			return true;
+		}
+
+		bool SendWithHeader( PacketBuffer & packet )
+		{
+			const int header = 12;
+			unsigned int seq = reliabilitySystem.GetLocalSequence();
+			unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
+			WriteHeader( packet.PushHeader( header ), seq, ack, ack_bits );
+ 			return Connection::SendPacket( packet );
+		}
+
+		void ReleaseAcked()
+		{
+			ackedPayloads.clear();
+			unsigned int * acks = NULL;
+			int ack_count = 0;
+			reliabilitySystem.GetAcks( &acks, ack_count );
+			for ( int i = 0; i < ack_count; ++i )
+			{
+				unsigned int first = acks[i];
+				int tag = -1;
+				sendBuffer.Remove( acks[i], &first, &tag );
+				ackedPayloads.push_back( first );
+				if ( tag >= 0 )
+					FragmentAcked( tag );
+			}
+		}
+
+		void FragmentAcked( int job_id )
+		{
+			for ( std::list<FragmentJob>::iterator itor = fragmentJobs.begin(); itor != fragmentJobs.end(); ++itor )
+			{
+				if ( itor->id != job_id )
+					continue;
+				itor->unacked--;
+				if ( itor->unacked == 0 && itor->next_fragment == itor->fragment_count )
+					fragmentJobs.erase( itor );
+				return;
+			}
+		}
+
+		// send queued fragments, oldest message first. only the first FragmentReassembler::SlotCount messages
+		// may be in flight, a message leaves the queue once all of its fragments are sent and, if reliable, acked.
+
+		void SendFragments()
+		{
+			int budget = fragmentsPerUpdate;
+			int in_flight = 0;
+			std::list<FragmentJob>::iterator itor = fragmentJobs.begin();
+			while ( itor != fragmentJobs.end() && in_flight < FragmentReassembler::SlotCount && budget > 0 )
+			{
+				FragmentJob & job = *itor;
+				const bool reliable = channels[job.channel].IsReliable();
+				while ( budget > 0 && job.next_fragment < job.fragment_count )
+				{
+					if ( reliable && sendBuffer.IsFull() )
+						return;
+					const int offset = job.next_fragment * FragmentSize;
+					const int bytes = (int) job.data.size() - offset < FragmentSize ? (int) job.data.size() - offset : FragmentSize;
+					PacketBuffer packet;
+					std::memcpy( packet.GetPayload(), &job.data[offset], bytes );
+					packet.SetPayloadSize( bytes );
+					unsigned char * fragment_header = packet.PushHeader( FragmentHeaderSize );
+					fragment_header[0] = (unsigned char) ( job.next_fragment >> 8 );
+					fragment_header[1] = (unsigned char) ( job.next_fragment & 0xFF );
+					fragment_header[2] = (unsigned char) ( job.fragment_count >> 8 );
+					fragment_header[3] = (unsigned char) ( job.fragment_count & 0xFF );
+					unsigned char * channel_header = packet.PushHeader( ChannelHeaderSize );
+					channel_header[0] = (unsigned char) ( job.channel | FragmentFlag );
+					WriteInteger( channel_header + 1, job.sequence );
+					if ( !SendPayload( packet, reliable, job.id ) )
+						return;
+					if ( reliable )
+						job.unacked++;
+					job.next_fragment++;
+					budget--;
+				}
+				if ( job.next_fragment == job.fragment_count && job.unacked == 0 )
+				{
+					itor = fragmentJobs.erase( itor );
+					continue;
+				}
+				++itor;
+				in_flight++;
+			}
+		}
+
+		void RetransmitLost()
+		{
+			lostPayloads.clear();
+			unsigned int * lost = NULL;
+			int lost_count = 0;
+			reliabilitySystem.GetLost( &lost, lost_count );
+			for ( int i = 0; i < lost_count; ++i )
+			{
+				int size = 0;
+				const unsigned char * payload = sendBuffer.Find( lost[i], size );
+				if ( !payload )
+				{
+					lostPayloads.push_back( lost[i] );
+					continue;
+				}
+				// a failed send is still accounted as sent, so it is declared lost and retried again later
+				const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+				PacketBuffer packet;
+				std::memcpy( packet.GetPayload(), payload, size );
+				packet.SetPayloadSize( size );
+				#ifdef NET_UNIT_TEST
+				if ( !( sequence & packet_loss_mask ) )
+					SendWithHeader( packet );
+				#else
+				SendWithHeader( packet );
+				#endif
+				sendBuffer.Move( lost[i], sequence );
+				reliabilitySystem.PacketSent( size );
+				retransmitted_packets++;
+			}
+		}
+
+		void WriteInteger( unsigned char * data, unsigned int value )
+		{
+			data[0] = (unsigned char) ( value >> 24 );
+			data[1] = (unsigned char) ( ( value >> 16 ) & 0xFF );
+			data[2] = (unsigned char) ( ( value >> 8 ) & 0xFF );
+			data[3] = (unsigned char) ( value & 0xFF );
+		}
+
+		void WriteHeader( unsigned char * header, unsigned int sequence, unsigned int ack, unsigned int ack_bits )
+		{
+			WriteInteger( header, sequence );
+			WriteInteger( header + 4, ack );
+			WriteInteger( header + 8, ack_bits );
+		}
+		
+		void ReadInteger( const unsigned char * data, unsigned int & value )
+		{
+ 			value = ( ( (unsigned int)data[0] << 24 ) | ( (unsigned int)data[1] << 16 ) | 
+				      ( (unsigned int)data[2] << 8 )  | ( (unsigned int)data[3] ) );				
+		}
+		
+		void ReadHeader( const unsigned char * header, unsigned int & sequence, unsigned int & ack, unsigned int & ack_bits )
 		{
 			ReadInteger( header, sequence );
 			ReadInteger( header + 4, ack );
@@ -1077,13 +2517,664 @@ namespace net
 		void ClearData()
 		{
 			reliabilitySystem.Reset();
-		}
+			sendBuffer.Clear();
+			ackedPayloads.clear();
+			lostPayloads.clear();
+			retransmitted_packets = 0;
+			for ( int i = 0; i < (int) channels.size(); ++i )
+				channels[i].Reset();
+			fragmentJobs.clear();
+			reassembler.Reset();
+			deliveredSlot = -1;
+		}
+
+		enum { MaxPayloadSize = MaxPacketSize - 20 };	// what is left of a datagram after the connection and reliability headers
+		enum { BasePayloadSize = BasePacketSize - 20 };	// the same for a datagram of the base size
+		enum { MaxPendingPayloads = 256 };
+		enum { MaxChannels = 64 };
+		enum { ChannelHeaderSize = 5 };			// channel id + message sequence
+		enum { FragmentHeaderSize = 4 };		// fragment index + fragment count
+		enum { FragmentFlag = 0x80 };			// set in the channel id byte of a fragment
+		enum { FragmentSize = BasePayloadSize - ChannelHeaderSize - FragmentHeaderSize };	// fragments take any path
+		enum { MaxFragments = 4096 };
+		enum { MaxMessageSize = FragmentSize * MaxFragments };	// about 5.9 MB, the reassembly arena holds two of them
+
+		struct FragmentJob
+		{
+			int id;								// tag of the fragments in the send buffer
+			int channel;
+			unsigned int sequence;				// message sequence shared by all fragments
+			int fragment_count;
+			int next_fragment;					// next fragment to send
+			int unacked;						// reliable fragments sent but not acked yet
+			std::vector<unsigned char> data;
+		};
 
 		#ifdef NET_UNIT_TEST
 		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
 		#endif
 		
 		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		SendBuffer sendBuffer;					// payloads waiting for an ack (reliable mode only)
+		std::vector<unsigned int> ackedPayloads;	// acked in the last update, by first sequence
+		std::vector<unsigned int> lostPayloads;		// lost in the last update and not kept for resending
+		bool reliableMode;						// keep and retransmit payloads until they are acked
+		unsigned int retransmitted_packets;		// total number of payloads resent after being declared lost
+		std::vector<MessageChannel> channels;	// message channels, indexed by channel id
+		std::list<FragmentJob> fragmentJobs;	// fragmented messages waiting to be sent or acked, oldest first
+		int nextFragmentJob;					// id of the next fragmented message
+		int fragmentsPerUpdate;					// fragment send budget of one Update
+		FragmentReassembler reassembler;		// partially received fragmented messages
+		int deliveredSlot;						// reassembly slot handed out by the last ReceiveChannelMessage
+		std::vector<unsigned char> deliveredMessage;	// ordered channel message handed out by the last ReceiveChannelMessage
+	};
+
+	// server end of many reliable connections sharing one socket
+	//  + a peer is accepted once it echoes a handshake cookie, see CookieJar, and found again by its address in an AddressTable.
+	//    hellos and junk cost no memory, so a flood of them can't crowd out real peers
+	//  + a packet whose address isn't its peer's is looked up by its connection id, a rebinding keeps the peer and its index.
+	//    the peer's address only moves once the new one answers a challenge
+	//  + every peer has its own reliability system, the socket and the receive buffer are shared
+	//  + a peer's idle timeout is a timer on the server's TimerWheel, rearmed by each packet, so no peer is polled for it
+	//  + so is the time its oldest packet in flight is given up on. the reliability systems take their time from the wheel
+	//    and are updated for the peers heard from or due a loss only, a peer with nothing going on costs nothing per update
+	//  + peers are indices into a deque that only grows, reused through a free list once a peer has timed out
+	//  + a peer only goes away in Update, so an index handed out by ReceivePacket stays valid until then
+	//  + speaks the same packets as ReliableConnection, channel messages included. a peer's messages on reliable channels are kept
+	//    in a send buffer of its own, allocated with the first of them and small: they are control messages, the bulk comes from the peer
+	//  + fragmented messages are not: each peer would need a reassembly arena of its own, so a peer's fragments are dropped
+	//    and what it sends a server must fit one packet
+
+	class ReliableServer
+	{
+	public:
+
+		ReliableServer( unsigned int protocolId, float timeout, int maxPeers, unsigned int max_sequence = 0xFFFFFFFF )
+			: table( maxPeers )
+		{
+			assert( maxPeers > 0 );
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->maxPeers = maxPeers;
+			this->max_sequence = max_sequence;
+			running = false;
+			ordered_peer = -1;
+			ordered_channel = 0;
+			AddChannel( ReliableOrdered );		// ControlChannel
+			AddChannel( ReliableUnordered );	// BulkChannel
+			AddChannel( Unreliable );			// UnreliableChannel
+		}
+
+		~ReliableServer()
+		{
+			if ( IsRunning() )
+				Stop();
+		}
+
+		bool Start( int port )
+		{
+			assert( !running );
+			printf( "start server on port %d\n", port );
+			if ( !socket.Open( port ) )
+				return false;
+			socket.SetReceiveBufferSize( ReceiveBufferSize );
+			running = true;
+			return true;
+		}
+
+		void Stop()
+		{
+			assert( running );
+			printf( "stop server\n" );
+			table.Clear();
+			connections.clear();
+			peers.clear();
+			free_peers.clear();
+			disconnected.clear();
+			active.clear();
+			ordered_peer = -1;
+			socket.Close();
+			running = false;
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		// next packet from any peer. answers handshakes and reads past datagrams that are not ours
+		// or come from no peer, returns 0 once the socket is drained. data points into the
+		// server's receive buffer and stays valid until the next call.
+
+		int ReceivePacket( int & peer, const unsigned char ** data )
+		{
+			assert( running );
+			const int header = 20;
+			while ( true )
+			{
+				Address sender;
+				const int received_bytes = socket.Receive( sender, receiveBuffer, MaxPacketSize );
+				if ( received_bytes == 0 )
+					return 0;
+				unsigned int handshake_id = 0;
+				const unsigned char * cookie = NULL;
+				const int handshake = ReadHandshake( receiveBuffer, received_bytes, protocolId, &handshake_id, &cookie );
+				if ( handshake )
+				{
+					ProcessHandshake( sender, handshake, handshake_id, cookie );
+					continue;
+				}
+				if ( received_bytes <= header )
+					continue;
+				unsigned int packet_protocol = 0;
+				unsigned int packet_connection = 0;
+				ReadInteger( receiveBuffer, packet_protocol );
+				if ( packet_protocol != protocolId )
+					continue;
+				ReadInteger( receiveBuffer + 4, packet_connection );
+				peer = table.Find( sender );
+				if ( peer < 0 || peers[peer].connectionId != packet_connection )
+				{
+					// not from where the peer was, its NAT may have rebound it to a new port
+					peer = FindConnection( packet_connection );
+					if ( peer < 0 )
+						continue;
+					Challenge( peer, sender );
+				}
+				Peer & p = peers[peer];
+				unsigned int packet_sequence = 0;
+				unsigned int packet_ack = 0;
+				unsigned int packet_ack_bits = 0;
+				ReadInteger( receiveBuffer + 8, packet_sequence );
+				ReadInteger( receiveBuffer + 12, packet_ack );
+				ReadInteger( receiveBuffer + 16, packet_ack_bits );
+				timers.Arm( p.idleTimer, timeout );
+				List( peer );
+				p.reliabilitySystem.PacketReceived( packet_sequence, received_bytes - header );
+				p.reliabilitySystem.ProcessAck( packet_ack, packet_ack_bits );
+				ReleaseAcked( peer );
+				ArmLossTimer( peer );
+				*data = receiveBuffer + header;
+				return received_bytes - header;
+			}
+		}
+
+		// zero copy send to one peer, the reliability, connection and protocol headers go into the headroom
+
+		bool SendPacket( int peer, PacketBuffer & packet )
+		{
+			assert( running );
+			assert( IsConnected( peer ) );
+			Peer & p = peers[peer];
+			const int size = packet.GetSize();
+			if ( size + 20 > MaxPacketSize )
+				return false;
+			if ( !SendWithHeader( peer, packet ) )
+				return false;
+			p.reliabilitySystem.PacketSent( size );
+			if ( !p.lossTimer.IsArmed() )
+				ArmLossTimer( peer );
+			return true;
+		}
+
+		// message channels, the same layout for every peer. see ReliableConnection, the two styles must not be mixed
+		// with a peer either. more channels are added before the first peer comes
+
+		int AddChannel( ChannelType type )
+		{
+			assert( (int) layout.size() < MaxChannels );
+			assert( peers.empty() );
+			layout.push_back( type );
+			return (int) layout.size() - 1;
+		}
+
+		int GetChannelCount() const
+		{
+			return (int) layout.size();
+		}
+
+		// zero copy send of a message to one peer, the buffer is used up whether or not it succeeds.
+		// a message of a reliable channel is kept until acked and sent again when lost, it has to fit a
+		// datagram of the base size and fails while PeerPendingMessages of them are waiting for their acks
+
+		bool SendChannelMessage( int peer, int channel, PacketBuffer & packet )
+		{
+			assert( running );
+			assert( IsConnected( peer ) );
+			assert( channel >= 0 && channel < (int) layout.size() );
+			Peer & p = peers[peer];
+			if ( packet.GetSize() + ChannelHeaderSize + 20 > MaxPacketSize )
+				return false;
+			MessageChannel & messageChannel = p.channels[channel];
+			unsigned char * header = packet.PushHeader( ChannelHeaderSize );
+			header[0] = (unsigned char) channel;
+			WriteInteger( header + 1, messageChannel.NextSendSequence() );
+			const unsigned int sequence = p.reliabilitySystem.GetLocalSequence();
+			if ( messageChannel.IsReliable() )
+			{
+				if ( p.sendBuffer.GetSlotCount() == 0 )
+					p.sendBuffer = SendBuffer( PeerPendingMessages, BasePayloadSize );
+				if ( !p.sendBuffer.Insert( sequence, packet.GetData(), packet.GetSize() ) )
+				{
+					messageChannel.RewindSendSequence();
+					return false;
+				}
+			}
+			if ( !SendPacket( peer, packet ) )
+			{
+				p.sendBuffer.Remove( sequence );
+				messageChannel.RewindSendSequence();
+				return false;
+			}
+			return true;
+		}
+
+		// the next message from any peer. what waited on an ordered channel for the message handed out last
+		// goes first, then packets are read until one holds a message that can be delivered. data points into
+		// server owned memory and stays valid until the next call
+
+		int ReceiveChannelMessage( int & peer, int & channel, const unsigned char ** data )
+		{
+			if ( ordered_peer >= 0 )
+			{
+				if ( peers[ordered_peer].channels[ordered_channel].PopPending( deliveredMessage ) )
+				{
+					peer = ordered_peer;
+					channel = ordered_channel;
+					*data = deliveredMessage.data();
+					return (int) deliveredMessage.size();
+				}
+				ordered_peer = -1;
+			}
+			while ( true )
+			{
+				const unsigned char * packet = NULL;
+				const int received_bytes = ReceivePacket( peer, &packet );
+				if ( received_bytes == 0 )
+					return 0;
+				if ( received_bytes < ChannelHeaderSize )
+					continue;
+				const int id = packet[0];
+				if ( id >= (int) layout.size() )
+					continue;
+				MessageChannel & messageChannel = peers[peer].channels[id];
+				unsigned int sequence = 0;
+				ReadInteger( packet + 1, sequence );
+				const unsigned char * message = packet + ChannelHeaderSize;
+				const int bytes = received_bytes - ChannelHeaderSize;
+				if ( !messageChannel.Accept( sequence, message, bytes ) )
+					continue;
+				if ( messageChannel.GetType() == ReliableOrdered )
+				{
+					ordered_peer = peer;
+					ordered_channel = id;
+				}
+				channel = id;
+				*data = message;
+				return bytes;
+			}
+		}
+
+		// the payloads a peer had acked and lost since it was last listed, by the sequence SendPacket or
+		// SendChannelMessage sent them with. as for ReliableConnection, a kept message is never reported
+		// lost, it goes again and is reported acked under its first sequence once a copy gets through
+
+		void GetAckedPayloads( int peer, unsigned int ** sequences, int & count )
+		{
+			assert( IsConnected( peer ) );
+			std::vector<unsigned int> & acked = peers[peer].ackedPayloads;
+			*sequences = acked.empty() ? NULL : &acked[0];
+			count = (int) acked.size();
+		}
+
+		void GetLostPayloads( int peer, unsigned int ** sequences, int & count )
+		{
+			assert( IsConnected( peer ) );
+			std::vector<unsigned int> & lost = peers[peer].lostPayloads;
+			*sequences = lost.empty() ? NULL : &lost[0];
+			count = (int) lost.size();
+		}
+
+		// forgets the active peers, what they had was read. then advances the timers, which drops the peers
+		// that went silent and makes the ones with a packet due to be given up on active again.
+		// the peers dropped here are listed by GetDisconnected until the next call.
+
+		void Update( float deltaTime )
+		{
+			assert( running );
+			disconnected.clear();
+			for ( int i = 0; i < (int) active.size(); ++i )
+				peers[active[i]].listed = false;
+			active.clear();
+			timers.Advance( deltaTime );
+		}
+
+		// the peers with acks, losses and delivery samples to read in their reliability systems: the ones
+		// heard from since the last Update and the ones it found packets lost for. the others have none
+
+		void GetActive( int ** peers, int & count )
+		{
+			*peers = active.data();
+			count = (int) active.size();
+		}
+
+		// the wheel Update advances. timers of whatever else is kept per peer can go on it too
+
+		TimerWheel & GetTimers()
+		{
+			return timers;
+		}
+
+		void GetDisconnected( int ** peers, int & count )
+		{
+			*peers = disconnected.data();
+			count = (int) disconnected.size();
+		}
+
+		bool IsConnected( int peer ) const
+		{
+			return peer >= 0 && peer < (int) peers.size() && peers[peer].active;
+		}
+
+		// peer indices are below this
+		int GetMaxPeers() const
+		{
+			return maxPeers;
+		}
+
+		int GetPeerCount() const
+		{
+			return table.GetCount();
+		}
+
+		const Address & GetAddress( int peer ) const
+		{
+			assert( IsConnected( peer ) );
+			return peers[peer].address;
+		}
+
+		ReliabilitySystem & GetReliabilitySystem( int peer )
+		{
+			assert( IsConnected( peer ) );
+			return peers[peer].reliabilitySystem;
+		}
+
+		unsigned int GetConnectionId( int peer ) const
+		{
+			assert( IsConnected( peer ) );
+			return peers[peer].connectionId;
+		}
+
+		int GetHeaderSize() const
+		{
+			return 20;
+		}
+
+	private:
+
+		// a peer for a good echo, a fresh cookie for a hello or an echo that is stale, forged or finds the server full.
+		// an echo from a peer already in is its welcome getting lost, it is welcomed again.
+		// a response to a challenge moves its peer to the address it came from
+
+		void ProcessHandshake( const Address & sender, int type, unsigned int id, const unsigned char * cookie )
+		{
+			if ( type == HandshakeResponse )
+			{
+				const int peer = FindConnection( id );
+				if ( peer >= 0 && peers[peer].address != sender && cookies.Check( sender, timers.GetTime(), cookie ) )
+					Move( peer, sender );
+				return;
+			}
+			if ( type != HandshakeHello && type != HandshakeEcho )
+				return;
+			int peer = -1;
+			if ( type == HandshakeEcho )
+			{
+				peer = table.Find( sender );
+				if ( peer < 0 && cookies.Check( sender, timers.GetTime(), cookie ) )
+					peer = Accept( sender );
+			}
+			if ( peer >= 0 )
+			{
+				SendHandshake( socket, sender, protocolId, HandshakeWelcome, peers[peer].connectionId, NULL );
+				return;
+			}
+			unsigned char made[CookieJar::CookieSize];
+			cookies.Make( sender, timers.GetTime(), made );
+			SendHandshake( socket, sender, protocolId, HandshakeCookie, 0, made );
+		}
+
+		int FindConnection( unsigned int id ) const
+		{
+			std::map<unsigned int, int>::const_iterator itor = connections.find( id );
+			return itor != connections.end() ? itor->second : -1;
+		}
+
+		// a cookie for the address the peer's packets now come from, at most one per handshake interval
+
+		void Challenge( int peer, const Address & sender )
+		{
+			Peer & p = peers[peer];
+			if ( timers.GetTime() - p.lastChallenge < HandshakeInterval )
+				return;
+			p.lastChallenge = timers.GetTime();
+			unsigned char made[CookieJar::CookieSize];
+			cookies.Make( sender, timers.GetTime(), made );
+			SendHandshake( socket, sender, protocolId, HandshakeChallenge, p.connectionId, made );
+		}
+
+		// an address still held by another peer stays with it until that one times out
+
+		void Move( int peer, const Address & sender )
+		{
+			if ( table.Find( sender ) >= 0 )
+				return;
+			Peer & p = peers[peer];
+			printf( "client %d.%d.%d.%d:%d moved to %d.%d.%d.%d:%d\n",
+				p.address.GetA(), p.address.GetB(), p.address.GetC(), p.address.GetD(), p.address.GetPort(),
+				sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
+			table.Remove( p.address );
+			table.Insert( sender, peer );
+			p.address = sender;
+		}
+
+		int Accept( const Address & sender )
+		{
+			int peer = -1;
+			if ( !free_peers.empty() )
+			{
+				peer = free_peers.back();
+				free_peers.pop_back();
+			}
+			else if ( (int) peers.size() < maxPeers )
+			{
+				peers.emplace_back( max_sequence );
+				peer = (int) peers.size() - 1;
+				peers[peer].idleTimer.SetCallback( [this, peer] { Drop( peer ); } );
+				peers[peer].lossTimer.SetCallback( [this, peer] { List( peer ); } );
+				peers[peer].reliabilitySystem.SetClock( &timers );
+			}
+			else
+				return -1;
+			printf( "server accepts connection from client %d.%d.%d.%d:%d\n",
+				sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort() );
+			Peer & p = peers[peer];
+			p.active = true;
+			p.address = sender;
+			do
+				p.connectionId = NewConnectionId();
+			while ( FindConnection( p.connectionId ) >= 0 );
+			p.lastChallenge = -HandshakeInterval;
+			p.reliabilitySystem.Reset();
+			p.channels.assign( layout.begin(), layout.end() );
+			p.sendBuffer.Clear();
+			p.ackedPayloads.clear();
+			p.lostPayloads.clear();
+			p.released = 0;
+			timers.Arm( p.idleTimer, timeout );
+			table.Insert( sender, peer );
+			connections[p.connectionId] = peer;
+			return peer;
+		}
+
+		void Drop( int peer )
+		{
+			Peer & p = peers[peer];
+			printf( "client %d.%d.%d.%d:%d timed out\n",
+				p.address.GetA(), p.address.GetB(), p.address.GetC(), p.address.GetD(), p.address.GetPort() );
+			table.Remove( p.address );
+			connections.erase( p.connectionId );
+			timers.Cancel( p.lossTimer );
+			p.sendBuffer = SendBuffer();
+			if ( ordered_peer == peer )
+				ordered_peer = -1;
+			p.active = false;
+			free_peers.push_back( peer );
+			disconnected.push_back( peer );
+		}
+
+		// the first word from a peer since the last update. what its reliability system had then was read,
+		// it is updated to forget it and to find the packets lost by now
+
+		void List( int peer )
+		{
+			Peer & p = peers[peer];
+			if ( p.listed )
+				return;
+			p.listed = true;
+			active.push_back( peer );
+			p.reliabilitySystem.Update( 0.0f );
+			p.ackedPayloads.clear();
+			p.released = 0;
+			RetransmitLost( peer );
+			ArmLossTimer( peer );
+		}
+
+		// the payloads of the packets acked since the peer was listed go from its send buffer
+
+		void ReleaseAcked( int peer )
+		{
+			Peer & p = peers[peer];
+			unsigned int * acks = NULL;
+			int ack_count = 0;
+			p.reliabilitySystem.GetAcks( &acks, ack_count );
+			for ( ; p.released < ack_count; ++p.released )
+			{
+				unsigned int first = acks[p.released];
+				p.sendBuffer.Remove( acks[p.released], &first );
+				p.ackedPayloads.push_back( first );
+			}
+		}
+
+		void RetransmitLost( int peer )
+		{
+			Peer & p = peers[peer];
+			p.lostPayloads.clear();
+			unsigned int * lost = NULL;
+			int lost_count = 0;
+			p.reliabilitySystem.GetLost( &lost, lost_count );
+			for ( int i = 0; i < lost_count; ++i )
+			{
+				int size = 0;
+				const unsigned char * payload = p.sendBuffer.Find( lost[i], size );
+				if ( !payload )
+				{
+					p.lostPayloads.push_back( lost[i] );
+					continue;
+				}
+				// a failed send is still accounted as sent, so it is declared lost and retried again later
+				const unsigned int sequence = p.reliabilitySystem.GetLocalSequence();
+				PacketBuffer packet;
+				std::memcpy( packet.GetPayload(), payload, size );
+				packet.SetPayloadSize( size );
+				SendWithHeader( peer, packet );
+				p.sendBuffer.Move( lost[i], sequence );
+				p.reliabilitySystem.PacketSent( size );
+			}
+		}
+
+		// the reliability, connection and protocol headers go into the headroom
+
+		bool SendWithHeader( int peer, PacketBuffer & packet )
+		{
+			Peer & p = peers[peer];
+			unsigned char * header = packet.PushHeader( 12 );
+			WriteInteger( header, p.reliabilitySystem.GetLocalSequence() );
+			WriteInteger( header + 4, p.reliabilitySystem.GetRemoteSequence() );
+			WriteInteger( header + 8, p.reliabilitySystem.GenerateAckBits() );
+			header = packet.PushHeader( 8 );
+			WriteInteger( header, protocolId );
+			WriteInteger( header + 4, p.connectionId );
+			return socket.Send( p.address, packet.GetData(), packet.GetSize() );
+		}
+
+		void ArmLossTimer( int peer )
+		{
+			Peer & p = peers[peer];
+			const double loss_time = p.reliabilitySystem.GetLossTime();
+			if ( loss_time < 0.0 )
+				timers.Cancel( p.lossTimer );
+			else
+				timers.Arm( p.lossTimer, (float) ( loss_time - timers.GetTime() ) );
+		}
+
+		void WriteInteger( unsigned char * data, unsigned int value )
+		{
+			data[0] = (unsigned char) ( value >> 24 );
+			data[1] = (unsigned char) ( ( value >> 16 ) & 0xFF );
+			data[2] = (unsigned char) ( ( value >> 8 ) & 0xFF );
+			data[3] = (unsigned char) ( value & 0xFF );
+		}
+
+		void ReadInteger( const unsigned char * data, unsigned int & value )
+		{
+			value = ( ( (unsigned int)data[0] << 24 ) | ( (unsigned int)data[1] << 16 ) |
+				      ( (unsigned int)data[2] << 8 )  | ( (unsigned int)data[3] ) );
+		}
+
+		enum { ReceiveBufferSize = 4 * 1024 * 1024 };
+		enum { BasePayloadSize = BasePacketSize - 20 };
+		enum { PeerPendingMessages = 32 };
+		enum { MaxChannels = 64 };
+		enum { ChannelHeaderSize = 5 };			// channel id + message sequence
+
+		struct Peer
+		{
+			Peer( unsigned int max_sequence ) : active( false ), listed( false ), connectionId( 0 ), lastChallenge( 0.0 ), reliabilitySystem( max_sequence ), released( 0 ) {}
+			bool active;
+			bool listed;						// in the active list, see List
+			Address address;					// where replies go, the last address that answered a challenge
+			unsigned int connectionId;
+			double lastChallenge;				// server time the peer's new address was last challenged
+			Timer idleTimer;					// goes off once the peer has been silent for the timeout
+			Timer lossTimer;					// goes off when its oldest packet not acked yet is due to be given up on
+			ReliabilitySystem reliabilitySystem;
+			std::vector<MessageChannel> channels;	// the server's layout, indexed by channel id
+			SendBuffer sendBuffer;				// its reliable channel messages waiting for an ack, no slots before the first
+			std::vector<unsigned int> ackedPayloads;	// acked since it was listed, by first sequence
+			std::vector<unsigned int> lostPayloads;		// lost since it was listed and not kept for resending
+			int released;						// acks of its reliability system gone through ReleaseAcked
+		};
+
+		unsigned int protocolId;
+		float timeout;
+		int maxPeers;
+		unsigned int max_sequence;
+		bool running;
+		Socket socket;							// shared by all peers
+		AddressTable table;						// peer address -> index into peers
+		std::map<unsigned int, int> connections;	// connection id -> index into peers, for packets from a new address
+		TimerWheel timers;						// idle timeouts, and the timers shared through GetTimers. its time is the cookies'
+		CookieJar cookies;
+		std::deque<Peer> peers;					// grows at the back only, so references into it stay put
+		std::vector<int> free_peers;			// indices of timed out peers, taken before the array grows
+		std::vector<int> disconnected;			// peers timed out during the last update. cleared each update!
+		std::vector<int> active;				// peers heard from or due a loss since the last update. cleared each update!
+		std::vector<ChannelType> layout;		// every peer's channels
+		int ordered_peer;						// ordered channel the last message was handed out on, -1 for none,
+		int ordered_channel;					// what waited behind that message goes out next
+		std::vector<unsigned char> deliveredMessage;	// ordered channel message handed out by the last ReceiveChannelMessage
+		unsigned char receiveBuffer[MaxPacketSize];		// last datagram received, ReceivePacket hands out views into it
 	};
 }
 
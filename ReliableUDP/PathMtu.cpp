@@ -0,0 +1,113 @@
+#include "PathMtu.h"
+using namespace udpft;
+
+namespace
+{
+	// message sizes of the usual mtu plateaus: ethernet, fddi, 8000 and 9000 byte jumbo frames,
+	// each less 28 bytes of ip and udp, 20 bytes of connection and 5 of channel headers
+	const int Plateaus[] = { 1447, 4299, 7947, 8947 };
+}
+
+PathMtu::PathMtu()
+{
+	pathMtu = 0;
+}
+
+void PathMtu::Reset(int baseSize, int maxSize)
+{
+	pathMtu = baseSize;
+	probes.clear();
+	sequenceProbes.clear();
+	for (std::size_t i = 0; i < sizeof(Plateaus) / sizeof(Plateaus[0]); i++)
+	{
+		if (Plateaus[i] > baseSize && Plateaus[i] < maxSize)
+		{
+			Probe probe = { Plateaus[i], 0, 0, false };
+			probes.push_back(probe);
+		}
+	}
+	if (maxSize > baseSize)
+	{
+		Probe probe = { maxSize, 0, 0, false };
+		probes.push_back(probe);
+	}
+}
+
+int PathMtu::NextProbe()
+{
+	// the largest sizes first, a confirmed size makes the ones below it moot
+	for (int i = (int)probes.size() - 1; i >= 0; i--)
+	{
+		const Probe& probe = probes[i];
+		if (probe.size <= pathMtu) break;
+		if (!probe.acked && probe.attempts < MaxProbes)
+		{
+			return probe.size;
+		}
+	}
+	return 0;
+}
+
+void PathMtu::ProbeSent(unsigned int sequence, int size)
+{
+	for (std::size_t i = 0; i < probes.size(); i++)
+	{
+		if (probes[i].size != size) continue;
+		probes[i].attempts++;
+		probes[i].inFlight++;
+		sequenceProbes[sequence] = (int)i;
+		return;
+	}
+}
+
+void PathMtu::ProbeFailed(int size)
+{
+	for (std::size_t i = 0; i < probes.size(); i++)
+	{
+		if (probes[i].size == size) probes[i].attempts++;
+	}
+}
+
+void PathMtu::ProcessAcks(const unsigned int* sequences, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		std::map<unsigned int, int>::iterator itor = sequenceProbes.find(sequences[i]);
+		if (itor == sequenceProbes.end()) continue;
+		Probe& probe = probes[itor->second];
+		probe.inFlight--;
+		probe.acked = true;
+		if (probe.size > pathMtu) pathMtu = probe.size;
+		sequenceProbes.erase(itor);
+	}
+}
+
+void PathMtu::ProcessLost(const unsigned int* sequences, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		std::map<unsigned int, int>::iterator itor = sequenceProbes.find(sequences[i]);
+		if (itor == sequenceProbes.end()) continue;
+		probes[itor->second].inFlight--;
+		sequenceProbes.erase(itor);
+	}
+}
+
+/*
+* done once every size above the path mtu has used up its probes without an ack.
+*/
+bool PathMtu::IsComplete() const
+{
+	for (std::size_t i = 0; i < probes.size(); i++)
+	{
+		const Probe& probe = probes[i];
+		if (probe.size <= pathMtu) continue;
+		if (probe.attempts < MaxProbes || probe.inFlight > 0) return false;
+	}
+	return true;
+}
+
+int PathMtu::GetPathMtu() const
+{
+	return pathMtu;
+}
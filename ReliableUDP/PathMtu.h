@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <vector>
+
+namespace udpft
+{
+    /*
+    * packetization layer path mtu discovery, after DPLPMTUD (RFC 8899).
+    * probes padded to the common mtu plateaus between the base and the largest
+    * size go out together, MaxProbes of each. a size is confirmed once the
+    * transport acks one of its probes. the base size is taken to always get through.
+    */
+    class PathMtu
+    {
+    public:
+        enum { MaxProbes = 3 };
+
+        PathMtu();
+        void Reset(int baseSize, int maxSize);
+
+        int NextProbe();                        // size of the next probe to send, 0 when none is due
+        void ProbeSent(unsigned int sequence, int size);
+        void ProbeFailed(int size);             // the probe could not be sent at all
+        void ProcessAcks(const unsigned int* sequences, int count);
+        void ProcessLost(const unsigned int* sequences, int count);
+
+        bool IsComplete() const;
+        int GetPathMtu() const;                 // largest size confirmed so far
+
+    private:
+        struct Probe {
+            int size;
+            int attempts;   // sent or failed to send
+            int inFlight;
+            bool acked;
+        };
+
+        std::vector<Probe> probes;              // ascending sizes
+        std::map<unsigned int, int> sequenceProbes; // transport sequence -> probe
+        int pathMtu;
+    };
+}
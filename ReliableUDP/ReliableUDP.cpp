@@ -13,6 +13,7 @@
 #include "Net.h"
 
 #include "FileTeleporter.h"
+#include "StreamMux.h"
 
 using namespace std;
 using namespace net;
@@ -22,101 +23,244 @@ const int ServerPort = 30000;
 const int ClientPort = 30001;
 const int ProtocolId = 0x11223344;
 const float DeltaTime = 1.0f / 30.0f;
-const float SendRate = 1.0f / 30.0f;
 const float TimeOut = 10.0f;
 
 const float AckWaitTime = 2.0f;  // Time to wait for final acks
+const int MaxClients = 4096;     // uploads the server takes at once
+const int MaxWeight = 1000;      // of a stream on the command line
 
-class FlowControl
+// ----------------------------------------------
+
+/*
+* the channel for the message the transfers loaded last. chunks go reliable in any
+* order, the control messages reliable and in order, so neither waits behind the
+* other. acks, parity, symbols and probes are stale by the time they could be
+* resent, they go unreliable.
+*/
+int LoadedChannel(const StreamMux& ftp)
+{
+	if (ftp.IsLoadedReliable())
+		return BulkChannel;
+	if (ftp.IsLoadedControl())
+		return ControlChannel;
+	return UnreliableChannel;
+}
+
+// what the server keeps for one client: its transfers and its congestion control.
+// the reliability of its packets is kept by the ReliableServer
+struct Upload
 {
-public:
+	StreamMux ftp;
+	BbrCongestionControl congestion;
+	float sendBudget = 0.0f;
+	unsigned int lastSentPackets = 0;
+	unsigned int lastLostPackets = 0;
+	double lastUpdate = 0.0;	// server time its congestion control was updated up to
+	bool busy = false;			// in the server's busy list
+	int live = -1;				// index in the server's live list
+	Timer wake;					// the next look at an upload with nothing to send, for its keepalive
+};
 
-	FlowControl()
+/*
+* send to one client what its congestion control lets through: the pacing rate
+* fills the budget every frame, a full window or the budget running out stops it.
+* called as its packets arrive too, so an ack goes out before the next frame and
+* the transport acks, 33 sequences a packet, keep up with a sender paced faster
+* than the frame rate. the budget may go into debt by a packet, what is left of it
+* at the end of a frame is not saved up into a burst.
+* returns false once the transfers have nothing more to send.
+*/
+bool SendPaced(ReliableServer& server, int peer, Upload& upload)
+{
+	ReliabilitySystem& reliability = server.GetReliabilitySystem(peer);
+	while (upload.sendBudget > 0.0f && reliability.GetBytesInFlight() < upload.congestion.GetCongestionWindow())
 	{
-		printf("flow control initialized\n");
-		Reset();
+		PacketBuffer buffer;
+		int size = upload.ftp.LoadPacket(buffer.GetPayload());
+		if (size == 0)
+		{
+			// what goes out until now is acked is at the transfers' pace, not the path's
+			reliability.SetAppLimited();
+			return false;
+		}
+		buffer.SetPayloadSize(size);
+		unsigned int sequence = reliability.GetLocalSequence();
+		if (server.SendChannelMessage(peer, LoadedChannel(upload.ftp), buffer))
+		{
+			upload.ftp.OnPacketSent(sequence);
+		}
+		upload.sendBudget -= size + server.GetHeaderSize();
 	}
+	return true;
+}
 
-	void Reset()
+/*
+* receive uploads from any number of clients at once over the one server socket.
+* a client's transfers start with its first packet and are dropped when it times out.
+* the timers of all of them are on the server's one wheel.
+* a frame costs what the clients with something going on cost: the ones heard from,
+* due a loss, woken by a timer of their transfers or still with more to send. the
+* others are looked at once a keepalive interval, by a timer of their own.
+*/
+int RunServer()
+{
+	ReliableServer server(ProtocolId, TimeOut, MaxClients);
+	if (!server.Start(ServerPort))
 	{
-		mode = Bad;
-		penalty_time = 4.0f;
-		good_conditions_time = 0.0f;
-		penalty_reduction_accumulator = 0.0f;
+		printf("could not start server on port %d\n", ServerPort);
+		return 1;
 	}
+	MemoryBudget memory;	// for the files of all the uploads, past it they go to disk
+	vector<Upload*> uploads(server.GetMaxPeers(), nullptr);
+	vector<int> live;	// peers with an upload
+	vector<int> busy;	// peers whose upload is looked at this frame
+	vector<int> work;
+	float statsAccumulator = 0.0f;
 
-	void Update(float deltaTime, float rtt)
+	auto queue = [&](int peer)
+	{
+		if (uploads[peer] && !uploads[peer]->busy)
+		{
+			uploads[peer]->busy = true;
+			busy.push_back(peer);
+		}
+	};
+	auto remove = [&](int peer)
 	{
-		const float RTT_Threshold = 250.0f;
+		Upload* upload = uploads[peer];
+		live[upload->live] = live.back();
+		uploads[live.back()]->live = upload->live;
+		live.pop_back();
+		delete upload;
+		uploads[peer] = nullptr;
+	};
 
-		if (mode == Good)
+	while (true)
+	{
+		// timeouts of the clients, their losses and the timers of their transfers
+		server.Update(DeltaTime);
+		const double now = server.GetTimers().GetTime();
+
+		int* peers = NULL;
+		int peer_count = 0;
+		server.GetDisconnected(&peers, peer_count);
+		for (int i = 0; i < peer_count; i++)
 		{
-			if (rtt > RTT_Threshold)
-			{
-				printf("*** dropping to bad mode ***\n");
-				mode = Bad;
-				if (good_conditions_time < 10.0f && penalty_time < 60.0f)
-				{
-					penalty_time *= 2.0f;
-					if (penalty_time > 60.0f)
-						penalty_time = 60.0f;
-					printf("penalty time increased to %.1f\n", penalty_time);
-				}
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				return;
-			}
+			if (uploads[peers[i]])
+				remove(peers[i]);
+		}
 
-			good_conditions_time += deltaTime;
-			penalty_reduction_accumulator += deltaTime;
+		// packets of every client, handled as they arrive
 
-			if (penalty_reduction_accumulator > 10.0f && penalty_time > 1.0f)
+		int peer = -1;
+		int channel = 0;
+		const unsigned char* packet = NULL;
+		int bytes_read = 0;
+		while ((bytes_read = server.ReceiveChannelMessage(peer, channel, &packet)) > 0)
+		{
+			if (!uploads[peer])
 			{
-				penalty_time /= 2.0f;
-				if (penalty_time < 1.0f)
-					penalty_time = 1.0f;
-				printf("penalty time reduced to %.1f\n", penalty_time);
-				penalty_reduction_accumulator = 0.0f;
+				Upload* upload = new Upload();
+				uploads[peer] = upload;
+				upload->live = (int)live.size();
+				upload->lastUpdate = now;
+				live.push_back(peer);
+				upload->ftp.SetMaxPacketSize(ReliableConnection::GetMaxUnfragmentedSize());
+				upload->ftp.SetMemoryBudget(&memory);
+				// the transfers' timers go off as the server advances its wheel, no upload is polled for them
+				upload->ftp.SetTimerWheel(&server.GetTimers());
+				upload->ftp.SetWakeCallback([&queue, peer] { queue(peer); });
+				upload->wake.SetCallback([&queue, peer] { queue(peer); });
+				upload->ftp.Initialize(false);
 			}
+			uploads[peer]->ftp.ProcessPacket(packet, bytes_read);
+			SendPaced(server, peer, *uploads[peer]);
 		}
 
-		if (mode == Bad)
+		// messages carried by packets acked are delivered, their delivery samples feed
+		// the client's congestion control. the server sent the control messages found
+		// lost again, the loss of the rest is the transfers' to answer
+
+		server.GetActive(&peers, peer_count);
+		for (int i = 0; i < peer_count; i++)
 		{
-			if (rtt <= RTT_Threshold)
-				good_conditions_time += deltaTime;
-			else
-				good_conditions_time = 0.0f;
+			Upload* upload = uploads[peers[i]];
+			if (!upload) continue;
+			ReliabilitySystem& reliability = server.GetReliabilitySystem(peers[i]);
+			unsigned int* sequences = NULL;
+			int sequence_count = 0;
+			const DeliverySample* samples = NULL;
+			int sample_count = 0;
+			server.GetAckedPayloads(peers[i], &sequences, sequence_count);
+			upload->ftp.OnPacketsAcked(sequences, sequence_count);
+			reliability.GetDeliverySamples(&samples, sample_count);
+			upload->congestion.OnAcked(samples, sample_count, reliability.GetBytesInFlight());
+			server.GetLostPayloads(peers[i], &sequences, sequence_count);
+			upload->ftp.OnPacketsLost(sequences, sequence_count);
+			reliability.GetLost(&sequences, sequence_count);
+			upload->congestion.OnLost(sequence_count);
+			queue(peers[i]);
+		}
+
+		// each client is sent to at the pace its own congestion control sets
 
-			if (good_conditions_time > penalty_time)
+		work.swap(busy);
+		for (size_t i = 0; i < work.size(); i++)
+		{
+			Upload* upload = uploads[work[i]];
+			if (!upload || !upload->busy) continue;
+			upload->busy = false;
+			upload->congestion.Update((float)(now - upload->lastUpdate));
+			upload->lastUpdate = now;
+			upload->ftp.Update();
+			upload->sendBudget = min(upload->sendBudget, 0.0f) + upload->congestion.GetPacingRate() * DeltaTime;
+			const bool more = SendPaced(server, work[i], *upload);
+
+			if (upload->ftp.IsCracked())
 			{
-				printf("*** upgrading to good mode ***\n");
-				good_conditions_time = 0.0f;
-				penalty_reduction_accumulator = 0.0f;
-				mode = Good;
-				return;
+				// only this client's transfer is lost, the others go on
+				const Address& address = server.GetAddress(work[i]);
+				printf("File tramsmitter cracked for client %d.%d.%d.%d:%d\n",
+					address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+				remove(work[i]);
 			}
+			else if (more)
+				queue(work[i]);
+			else
+				server.GetTimers().Arm(upload->wake, (float)(KEEPALIVE_INTERVAL / 1000));
 		}
-	}
+		work.clear();
 
-	float GetSendRate()
-	{
-		return mode == Good ? 30.0f : 10.0f;
+		statsAccumulator += DeltaTime;
+		if (statsAccumulator >= 0.25f)
+		{
+			unsigned int sent_total = 0, acked_total = 0, lost_total = 0;
+			for (size_t i = 0; i < live.size(); i++)
+			{
+				Upload* upload = uploads[live[i]];
+				ReliabilitySystem& reliability = server.GetReliabilitySystem(live[i]);
+				unsigned int sent_packets = reliability.GetSentPackets();
+				unsigned int lost_packets = reliability.GetLostPackets();
+				if (sent_packets > upload->lastSentPackets && lost_packets >= upload->lastLostPackets)
+					upload->ftp.SetLossRate((double)(lost_packets - upload->lastLostPackets) / (double)(sent_packets - upload->lastSentPackets));
+				upload->lastSentPackets = sent_packets;
+				upload->lastLostPackets = lost_packets;
+				sent_total += sent_packets;
+				acked_total += reliability.GetAckedPackets();
+				lost_total += lost_packets;
+			}
+			if (server.GetPeerCount() > 0)
+			{
+				printf("%d clients, sent %u, acked %u, lost %u (%.1f%%)\n",
+					server.GetPeerCount(), sent_total, acked_total, lost_total,
+					sent_total > 0 ? (float)lost_total / (float)sent_total * 100.0f : 0.0f);
+			}
+			statsAccumulator = 0.0f;
+		}
+		net::wait(DeltaTime);
 	}
-
-
-private:
-
-	enum Mode
-	{
-		Good,
-		Bad
-	};
-
-	Mode mode;
-	float penalty_time;
-	float good_conditions_time;
-	float penalty_reduction_accumulator;
-};
+	return 0;
+}
 
 // ----------------------------------------------
 
@@ -132,7 +276,10 @@ int main(int argc, char* argv[])
 
 	Mode mode = Server;
 	Address address;
-	std::string filePath;
+	vector<std::string> filePaths;
+	vector<int> fileWeights;
+	TransferMode transferMode = ChunkTransfer;
+	bool compression = false;
 	// parse command line
 	if (argc >= 3)
 	{
@@ -150,15 +297,44 @@ int main(int argc, char* argv[])
 		else
 		{
 			printf("client mode usage:\n"
-				"%s <ip:port> [file] \n", argv[0]);
+				"%s <ip:port> <file or directory>[:weight]... [fountain] [compress]\n"
+				"a stream's weight, 1 to %d, is its share of the connection against the others, 1 by default\n",
+				argv[0], MaxWeight);
 			return 1;
 		}
 
-		filePath = argv[2];
-		if (!filesystem::exists(filePath) && std::filesystem::is_regular_file(filePath))
+		// every file or directory named goes as a stream of its own over the one connection
+		for (int i = 2; i < argc; i++)
+		{
+			if (strcmp(argv[i], "fountain") == 0)
+				transferMode = FountainTransfer;
+			else if (strcmp(argv[i], "compress") == 0)
+				compression = true;
+			else
+			{
+				// a trailing :weight, unless the whole argument names a file: ':' is allowed in names
+				string path = argv[i];
+				int weight = 1;
+				size_t colon = path.find_last_of(':');
+				if (colon != string::npos && colon + 1 < path.size() && !filesystem::exists(path)
+					&& path.find_first_not_of("0123456789", colon + 1) == string::npos)
+				{
+					long share = strtol(path.c_str() + colon + 1, NULL, 10);
+					weight = share < 1 ? 1 : share > MaxWeight ? MaxWeight : (int)share;
+					path.erase(colon);
+				}
+				filePaths.push_back(path);
+				fileWeights.push_back(weight);
+			}
+		}
+		for (size_t i = 0; i < filePaths.size(); i++)
+		{
+			// a directory goes with all its files in one session
+			if (!filesystem::is_regular_file(filePaths[i]) && !filesystem::is_directory(filePaths[i]))
 			{
-				printf("Specified file doesn't exist.\n");
+				printf("Specified file doesn't exist: %s\n", filePaths[i].c_str());
 				return 1;
+			}
 		}
 	}
 
@@ -170,30 +346,43 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	ReliableConnection connection(ProtocolId, TimeOut);
+	if (mode == Server)
+	{
+		int result = RunServer();
+		ShutdownSockets();
+		return result;
+	}
 
-	const int port = mode == Server ? ServerPort : ClientPort;
+	ReliableConnection connection(ProtocolId, TimeOut);
 
-	if (!connection.Start(port))
+	// another client on this host may have the port, any free one will do
+	if (!connection.Start(ClientPort) && !connection.Start(0))
 	{
-		printf("could not start connection on port %d\n", port);
+		printf("could not start connection on port %d\n", ClientPort);
 		return 1;
 	}
 
-	if (mode == Client)
-		connection.Connect(address);
-	else
-		connection.Listen();
+	connection.Connect(address);
 
 	bool connected = false;
-	float sendAccumulator = 0.0f;
+	float sendBudget = 0.0f;
 	float statsAccumulator = 0.0f;
+	unsigned int lastSentPackets = 0;
+	unsigned int lastLostPackets = 0;
+
+	// jumbo sized packets are what the window is counted in once the path carries them
+	BbrCongestionControl congestion(ReliableConnection::GetMaxPayloadSize() + connection.GetHeaderSize());
+	StreamMux ftp;
+	ftp.SetTransferMode(transferMode);
+	ftp.SetCompression(compression);
+	// jumbo sized chunks when the path carries them, the teleporters probe for it
+	ftp.SetMaxPacketSize(ReliableConnection::GetMaxUnfragmentedSize());
+	for (size_t i = 0; i < filePaths.size(); i++)
+	{
+		ftp.AddStream(filePaths[i], fileWeights[i]);
+	}
 
-	FlowControl flowControl;
-	FileTeleporter ftp;
-
-	bool isSender = (mode == Client);
-	if (!ftp.Initialize(filePath, isSender))
+	if (!ftp.Initialize(true))
 	{
 		return 1;
 	}
@@ -201,28 +390,14 @@ int main(int argc, char* argv[])
 
 	while (true)
 	{
-
-
-		if (connection.IsConnected())
-			flowControl.Update(DeltaTime, connection.GetReliabilitySystem().GetRoundTripTime() * 1000.0f);
-
-		const float sendRate = flowControl.GetSendRate();
-
 		// detect changes in connection state
 
-		if (mode == Server && connected && !connection.IsConnected())
-		{
-			flowControl.Reset();
-			printf("reset flow control\n");
-			connected = false;
-		}
-
 		if (!connected && connection.IsConnected())
 		{
 			printf("client connected to server\n");
 			connected = true;
 
-			if (!ftp.Initialize(filePath, isSender))
+			if (!ftp.Initialize(true))
 			{
 				return 1;
 			}
@@ -236,26 +411,52 @@ int main(int argc, char* argv[])
 
 		// send and receive packets
 
-		sendAccumulator += DeltaTime;
+		// paced by the congestion control: its rate fills the budget each frame, sending
+		// stops when the budget runs out or its window is in flight. the budget may go
+		// into debt by a packet, what is left of it is not saved up into a burst
+		sendBudget = min(sendBudget, 0.0f) + congestion.GetPacingRate() * DeltaTime;
+
+		// the connection's handshake goes first, nothing else is sent before it is done
+		if (!connection.IsConnected())
+			sendBudget = 0.0f;
 
-		// send packets at a fixed rate
-		while (sendAccumulator > 1.0f / sendRate)
+		ReliabilitySystem& reliability = connection.GetReliabilitySystem();
+		while (sendBudget > 0.0f && reliability.GetBytesInFlight() < congestion.GetCongestionWindow())
 		{
-			unsigned char packet[PacketSize];
-			ftp.LoadPacket(packet);
-			connection.SendPacket(packet, sizeof(packet));
-			sendAccumulator -= 1.0f / sendRate;
+			// the teleporters write their messages straight into the wire buffer,
+			// each connection layer then puts its header in the headroom in front of it
+			PacketBuffer packet;
+			int size = ftp.LoadPacket(packet.GetPayload());
+			if (size == 0)
+			{
+				// the transfers have nothing more for now, the samples of what is
+				// in flight until it is acked say how fast they were, not the path
+				reliability.SetAppLimited();
+				break;
+			}
+			// remember which transport sequence carried the message,
+			// its ack is what confirms a file chunk. the connection keeps
+			// the messages of the reliable channels and resends them when
+			// they are lost, its send buffer running full stops them until
+			// acks free it
+			packet.SetPayloadSize(size);
+			unsigned int sequence = reliability.GetLocalSequence();
+			if (!connection.SendChannelMessage(LoadedChannel(ftp), packet))
+				break;
+			ftp.OnPacketSent(sequence);
+			sendBudget -= size + connection.GetHeaderSize();
 		}
 
 		while (true) // receiving a packet
 		{
-			// in the server mode, receive packets of the file 
-			// invoke methods in the filetransmitter to save the file back to listening state after having verified the file
-			unsigned char packet[PacketSize];
-			int bytes_read = connection.ReceivePacket(packet, sizeof(packet));
+			// the server's acks and requests for the transfers, see RunServer for the receiving end
+			// the packet is a view into the connection's receive buffer, parsed in place
+			int channel = 0;
+			const unsigned char* packet = NULL;
+			int bytes_read = connection.ReceiveChannelMessage(channel, &packet);
 			if (bytes_read == 0)
 				break;
-			ftp.ProcessPacket(packet);
+			ftp.ProcessPacket(packet, bytes_read);
 		}
 
 
@@ -273,10 +474,31 @@ int main(int argc, char* argv[])
 		}
 #endif
 
-		// update connection
+		// tell the congestion control what the packets acked this frame say about the path
+
+		const DeliverySample* samples = NULL;
+		int sample_count = 0;
+		reliability.GetDeliverySamples(&samples, sample_count);
+		congestion.OnAcked(samples, sample_count, reliability.GetBytesInFlight());
+
+		// update connection, it resends the chunks and control messages of packets found lost
 
 		connection.Update(DeltaTime);
 
+		// messages carried by payloads acked are delivered, whichever copy got through.
+		// the loss of what the connection doesn't resend is the transfers' to answer
+
+		unsigned int* sequences = NULL;
+		int sequence_count = 0;
+		connection.GetAckedPayloads(&sequences, sequence_count);
+		ftp.OnPacketsAcked(sequences, sequence_count);
+		connection.GetLostPayloads(&sequences, sequence_count);
+		ftp.OnPacketsLost(sequences, sequence_count);
+
+		reliability.GetLost(&sequences, sequence_count);
+		congestion.OnLost(sequence_count);
+		congestion.Update(DeltaTime);
+
 		statsAccumulator += DeltaTime;
 
 		while (statsAccumulator >= 0.25f && connection.IsConnected())
@@ -290,31 +512,44 @@ int main(int argc, char* argv[])
 			float sent_bandwidth = connection.GetReliabilitySystem().GetSentBandwidth();
 			float acked_bandwidth = connection.GetReliabilitySystem().GetAckedBandwidth();
 
-			printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps\n",
+			printf("rtt %.1fms, sent %d, acked %d, lost %d (%.1f%%), sent bandwidth = %.1fkbps, acked bandwidth = %.1fkbps, "
+				"bottleneck %.1fkbps, min rtt %.1fms, pacing %.1fkbps, window %d\n",
 				rtt * 1000.0f, sent_packets, acked_packets, lost_packets,
 				sent_packets > 0.0f ? (float)lost_packets / (float)sent_packets * 100.0f : 0.0f,
-				sent_bandwidth, acked_bandwidth);
+				sent_bandwidth, acked_bandwidth, congestion.GetBandwidth() * 8 / 1000.0f, congestion.GetMinRtt() * 1000.0f,
+				congestion.GetPacingRate() * 8 / 1000.0f, congestion.GetCongestionWindow());
+
+			// parity per group follows the loss since the last stats
+			if (sent_packets > lastSentPackets && lost_packets >= lastLostPackets)
+				ftp.SetLossRate((double)(lost_packets - lastLostPackets) / (double)(sent_packets - lastSentPackets));
+			lastSentPackets = sent_packets;
+			lastLostPackets = lost_packets;
 
 			statsAccumulator -= 0.25f;
 		}
-		// process received message.
-		// update the file transfer
+		// received messages were handled as they arrived,
+		// update the file transfer timers
 
 		ftp.Update();
-		if (ftp.GetState() == CRACKED)
+		if (ftp.IsCracked())
 		{
 			printf("File tramsmitter cracked\n");
-			printf("%s\n", ftp.GetFileName().c_str());
-			printf("file size: %u bytes\n", ftp.GetFileSize());
-			printf("Original CRC claim: 0x%08X\n", ftp.GetFileCRC());
+			for (int i = 0; i < ftp.GetStreamCount(); i++)
+			{
+				const FileTeleporter& stream = ftp.GetStream(i);
+				if (stream.GetState() != CRACKED) continue;
+				printf("%s\n", stream.GetFileName().c_str());
+				printf("file size: %llu bytes\n", (unsigned long long)stream.GetFileSize());
+				printf("Original CRC claim: 0x%08X\n", stream.GetFileCRC());
+			}
 			return 1;
 		}
-		if (ftp.GetState() == CLOSED)
+		if (ftp.IsClosed())
 		{
 			// Calculate actual transfer time
 			auto endTime = chrono::high_resolution_clock::now();
 			float transferTime = chrono::duration<float>(endTime - startTime).count();
-			uint32_t fileSize = ftp.GetFileSize();
+			uint64_t fileSize = ftp.GetTotalSize();
 
 			// Calculate speed in Mbps (1 megabit = 1,000,000 bits)
 			float fileSizeBits = fileSize * 8.0f;
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace udpft
+{
+    const int Sha256Size = 32;
+
+    // SHA-256 (FIPS 180-4). the strong hash of delta blocks and the content
+    // hash files are known by in the receive cache.
+    void Sha256(const unsigned char* data, size_t length, unsigned char digest[Sha256Size]);
+
+    // HMAC-SHA256 (RFC 2104). the MAC of the server's handshake cookies.
+    void HmacSha256(const unsigned char* key, size_t keyLength,
+        const unsigned char* data, size_t length, unsigned char mac[Sha256Size]);
+}
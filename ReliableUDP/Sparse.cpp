@@ -0,0 +1,280 @@
+#include <cstring>
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define UDPFT_SSE2
+#endif
+#include "Sparse.h"
+using namespace udpft;
+
+namespace
+{
+	void WholeFile(uint64_t size, std::vector<sparse::Extent>& extents)
+	{
+		extents.clear();
+		if (size == 0) return;
+		sparse::Extent extent = { 0, size };
+		extents.push_back(extent);
+	}
+
+#if defined(_WIN32)
+	typedef HANDLE File;
+
+	bool WriteAt(File file, uint64_t offset, const char* data, size_t length)
+	{
+		LARGE_INTEGER position;
+		position.QuadPart = (LONGLONG)offset;
+		if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN)) return false;
+		while (length > 0)
+		{
+			DWORD piece = length > 0x40000000 ? 0x40000000 : (DWORD)length;
+			DWORD written = 0;
+			if (!WriteFile(file, data, piece, &written, NULL) || written == 0) return false;
+			data += written;
+			length -= written;
+		}
+		return true;
+	}
+#else
+	typedef int File;
+
+	bool WriteAt(File file, uint64_t offset, const char* data, size_t length)
+	{
+		while (length > 0)
+		{
+			ssize_t written = pwrite(file, data, length, (off_t)offset);
+			if (written < 0 && errno == EINTR) continue;
+			if (written <= 0) return false;
+			data += written;
+			offset += written;
+			length -= written;
+		}
+		return true;
+	}
+#endif
+
+	/*
+	* the runs of blocks with data in them, the zero blocks between are skipped
+	* and stay holes of the fresh file.
+	*/
+	bool WriteBlocks(File file, const char* data, size_t size)
+	{
+		size_t offset = 0;
+		while (offset < size)
+		{
+			size_t length = size - offset < sparse::BlockSize ? size - offset : sparse::BlockSize;
+			if (sparse::IsZero((const unsigned char*)data + offset, length))
+			{
+				offset += length;
+				continue;
+			}
+			size_t end = offset + length;
+			while (end < size)
+			{
+				size_t next = size - end < sparse::BlockSize ? size - end : sparse::BlockSize;
+				if (sparse::IsZero((const unsigned char*)data + end, next)) break;
+				end += next;
+			}
+			if (!WriteAt(file, offset, data + offset, end - offset)) return false;
+			offset = end;
+		}
+		return true;
+	}
+
+	// a linear map on the crc register, column i is the image of bit i
+	struct Gf2Matrix {
+		uint32_t columns[32];
+	};
+
+	uint32_t Times(const Gf2Matrix& matrix, uint32_t vector)
+	{
+		uint32_t sum = 0;
+		for (int i = 0; vector != 0; i++, vector >>= 1)
+		{
+			if (vector & 1) sum ^= matrix.columns[i];
+		}
+		return sum;
+	}
+
+	Gf2Matrix Square(const Gf2Matrix& matrix)
+	{
+		Gf2Matrix square;
+		for (int i = 0; i < 32; i++) square.columns[i] = Times(matrix, matrix.columns[i]);
+		return square;
+	}
+}
+
+/*
+* sixteen bytes to a compare, or eight without SSE2. data that isn't zero
+* usually gives itself away in the first few.
+*/
+bool sparse::IsZero(const unsigned char* data, size_t length)
+{
+	size_t i = 0;
+#ifdef UDPFT_SSE2
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 64 <= length; i += 64)
+	{
+		__m128i any = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)), _mm_loadu_si128((const __m128i*)(data + i + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)), _mm_loadu_si128((const __m128i*)(data + i + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, zero)) != 0xffff) return false;
+	}
+#endif
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		if (word != 0) return false;
+	}
+	for (; i < length; i++)
+	{
+		if (data[i] != 0) return false;
+	}
+	return true;
+}
+
+void sparse::DataExtents(const std::string& path, uint64_t size, std::vector<Extent>& extents)
+{
+	extents.clear();
+	if (size == 0) return;
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		WholeFile(size, extents);
+		return;
+	}
+	FILE_ALLOCATED_RANGE_BUFFER query;
+	query.FileOffset.QuadPart = 0;
+	query.Length.QuadPart = (LONGLONG)size;
+	FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+	for (;;)
+	{
+		DWORD bytes = 0;
+		BOOL done = DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query),
+			ranges, sizeof(ranges), &bytes, NULL);
+		if (!done && GetLastError() != ERROR_MORE_DATA)
+		{
+			WholeFile(size, extents);
+			break;
+		}
+		DWORD count = bytes / sizeof(ranges[0]);
+		for (DWORD i = 0; i < count; i++)
+		{
+			Extent extent = { (uint64_t)ranges[i].FileOffset.QuadPart, (uint64_t)ranges[i].Length.QuadPart };
+			extents.push_back(extent);
+		}
+		if (done || count == 0) break;
+		// more ranges than fit, ask again from the end of the last one
+		uint64_t end = extents.back().offset + extents.back().length;
+		query.FileOffset.QuadPart = (LONGLONG)end;
+		query.Length.QuadPart = (LONGLONG)(size - end);
+	}
+	CloseHandle(file);
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+	int file = open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		WholeFile(size, extents);
+		return;
+	}
+	off_t offset = 0;
+	while ((uint64_t)offset < size)
+	{
+		off_t data = lseek(file, offset, SEEK_DATA);
+		if (data < 0)
+		{
+			// ENXIO: nothing but a hole to the end. anything else: no help from the file system
+			if (errno != ENXIO) WholeFile(size, extents);
+			break;
+		}
+		off_t hole = lseek(file, data, SEEK_HOLE);
+		if (hole < 0 || (uint64_t)hole > size) hole = (off_t)size;
+		Extent extent = { (uint64_t)data, (uint64_t)(hole - data) };
+		extents.push_back(extent);
+		offset = hole;
+	}
+	close(file);
+#else
+	(void)path;
+	WholeFile(size, extents);
+#endif
+}
+
+/*
+* the file is made new, so the blocks never written are holes already:
+* there is nothing to punch, the size is set at the end.
+*/
+bool sparse::Write(const std::string& path, const char* data, size_t size)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	// ntfs only leaves holes in files marked sparse, elsewhere the holes fill with zeros
+	DWORD bytes = 0;
+	DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)size;
+	bool written = WriteBlocks(file, data, size)
+		&& SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	return CloseHandle(file) && written;
+#else
+	int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file < 0) return false;
+	bool written = WriteBlocks(file, data, size) && ftruncate(file, (off_t)size) == 0;
+	return close(file) == 0 && written;
+#endif
+}
+
+bool sparse::Create(const std::string& path, uint64_t size)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	DWORD bytes = 0;
+	DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+	LARGE_INTEGER end;
+	end.QuadPart = (LONGLONG)size;
+	bool sized = SetFilePointerEx(file, end, NULL, FILE_BEGIN) && SetEndOfFile(file);
+	return CloseHandle(file) && sized;
+#else
+	int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file < 0) return false;
+	bool sized = ftruncate(file, (off_t)size) == 0;
+	return close(file) == 0 && sized;
+#endif
+}
+
+/*
+* the register, unconditioned, goes through the map of one zero byte length times:
+* the map squared for each bit of length, as zlib's crc32_combine does it.
+*/
+uint32_t sparse::ZerosCrc(uint32_t crc, uint64_t length)
+{
+	// one zero byte is eight shifts of the reflected crc-32 register
+	Gf2Matrix map;
+	for (int i = 0; i < 32; i++)
+	{
+		uint32_t reg = 1u << i;
+		for (int bit = 0; bit < 8; bit++) reg = (reg >> 1) ^ (reg & 1 ? 0xEDB88320u : 0);
+		map.columns[i] = reg;
+	}
+	uint32_t reg = crc ^ 0xFFFFFFFFu;
+	for (; length != 0; length >>= 1)
+	{
+		if (length & 1) reg = Times(map, reg);
+		if (length > 1) map = Square(map);
+	}
+	return reg ^ 0xFFFFFFFFu;
+}
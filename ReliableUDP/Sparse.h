@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace udpft
+{
+    // holes of sparse files. the file system says where a file has data
+    // (SEEK_DATA/SEEK_HOLE, FSCTL_QUERY_ALLOCATED_RANGES on windows), what lies
+    // between reads as zeros without being stored.
+    namespace sparse
+    {
+        const size_t BlockSize = 4096;  // smallest hole written, a file system block
+
+        struct Extent {
+            uint64_t offset;
+            uint64_t length;
+        };
+
+        // true when every byte is zero
+        bool IsZero(const unsigned char* data, size_t length);
+
+        // the data extents of the file, in order. a file system that can't
+        // tell gives one extent for the whole file.
+        void DataExtents(const std::string& path, uint64_t size, std::vector<Extent>& extents);
+
+        // write the file leaving its zero blocks as holes, false on an error
+        bool Write(const std::string& path, const char* data, size_t size);
+
+        // make a new file of the size that is one hole, data written into it later
+        // leaves the rest a hole. false on an error
+        bool Create(const std::string& path, uint64_t size);
+
+        // the crc-32 of data whose crc-32 is crc followed by length zero bytes,
+        // without reading them: a hole of any size costs the same few steps
+        uint32_t ZerosCrc(uint32_t crc, uint64_t length);
+    }
+}
@@ -0,0 +1,265 @@
+#include "StreamMux.h"
+using namespace udpft;
+
+StreamMux::StreamMux()
+{
+	sender = false;
+	current = 0;
+	loadedStream = -1;
+	transferMode = ChunkTransfer;
+	compression = false;
+	maxPacketSize = PacketSize + StreamHeaderSize;
+	maxBufferedSize = DefaultMaxBufferedSize;
+	memoryBudget = NULL;
+	timers = NULL;
+}
+
+StreamMux::~StreamMux()
+{
+	clear();
+}
+
+void StreamMux::clear()
+{
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		delete streams[i].teleporter;
+	}
+	streams.clear();
+	sequenceStreams.clear();
+	current = 0;
+	loadedStream = -1;
+}
+
+FileTeleporter* StreamMux::newTeleporter()
+{
+	FileTeleporter* teleporter = new FileTeleporter();
+	teleporter->SetTransferMode(transferMode);
+	teleporter->SetCompression(compression);
+	teleporter->SetMaxPacketSize(maxPacketSize - StreamHeaderSize);
+	teleporter->SetMaxBufferedSize(maxBufferedSize);
+	teleporter->SetMemoryBudget(memoryBudget);
+	teleporter->SetTimerWheel(timers);
+	teleporter->SetWakeCallback(wake);
+	return teleporter;
+}
+
+void StreamMux::AddStream(const string& filePath, int weight)
+{
+	Stream stream = { (uint32_t)streams.size(), weight > 0 ? weight : 1, 0, filePath, newTeleporter() };
+	streams.push_back(stream);
+}
+
+void StreamMux::SetTransferMode(TransferMode mode)
+{
+	transferMode = mode;
+}
+
+void StreamMux::SetCompression(bool enabled)
+{
+	compression = enabled;
+}
+
+void StreamMux::SetMaxPacketSize(int size)
+{
+	maxPacketSize = size;
+}
+
+void StreamMux::SetMaxBufferedSize(uint64_t size)
+{
+	maxBufferedSize = size;
+}
+
+void StreamMux::SetMemoryBudget(MemoryBudget* budget)
+{
+	memoryBudget = budget;
+}
+
+void StreamMux::SetTimerWheel(net::TimerWheel* wheel)
+{
+	timers = wheel;
+}
+
+void StreamMux::SetWakeCallback(const std::function<void()>& callback)
+{
+	wake = callback;
+}
+
+bool StreamMux::Initialize(bool isSender)
+{
+	sender = isSender;
+	sequenceStreams.clear();
+	loadedStream = -1;
+	current = 0;
+	if (!sender)
+	{
+		clear();
+		return true;
+	}
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		// made again, the settings may have changed since the stream was added
+		delete streams[i].teleporter;
+		streams[i].teleporter = newTeleporter();
+		streams[i].deficit = 0;
+		if (!streams[i].teleporter->Initialize(streams[i].filePath, true)) return false;
+	}
+	return !streams.empty();
+}
+
+/*
+* the next message of the stream whose turn it is, with the stream id in front.
+* a stream with nothing to send loses what was left of its round, as a
+* queue that runs empty does in deficit round robin. a round gives every
+* stream at least one message, two rounds find any stream with one to send.
+*/
+int StreamMux::LoadPacket(unsigned char* packet)
+{
+	loadedStream = -1;
+	for (size_t turn = 0; turn <= 2 * streams.size() && !streams.empty(); turn++)
+	{
+		Stream& stream = streams[current];
+		if (stream.deficit > 0 && stream.teleporter->GetState() != CLOSED)
+		{
+			int size = stream.teleporter->LoadPacket(packet + StreamHeaderSize);
+			if (size > 0)
+			{
+				memcpy(packet, &stream.id, sizeof(stream.id));
+				stream.deficit -= size;
+				loadedStream = current;
+				return StreamHeaderSize + size;
+			}
+			stream.deficit = 0;
+		}
+		current = (current + 1) % (int)streams.size();
+		streams[current].deficit += streams[current].weight * maxPacketSize;
+	}
+	return 0;
+}
+
+void StreamMux::ProcessPacket(const unsigned char* packet, int size)
+{
+	if (size < StreamHeaderSize) return;
+	uint32_t id = ReadU32(packet);
+	int index = -1;
+	for (size_t i = 0; i < streams.size() && index < 0; i++)
+	{
+		if (streams[i].id == id) index = (int)i;
+	}
+	if (index < 0 && !sender && streams.size() < (size_t)MaxStreams)
+	{
+		// a new transfer, its receiver starts listening
+		Stream stream = { id, 1, 0, string(), newTeleporter() };
+		stream.teleporter->Initialize(DefaultFileName, false);
+		streams.push_back(stream);
+		index = (int)streams.size() - 1;
+	}
+	if (index < 0) return;
+	streams[index].teleporter->ProcessPacket(packet + StreamHeaderSize, size - StreamHeaderSize);
+}
+
+void StreamMux::Update()
+{
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		streams[i].teleporter->Update();
+	}
+}
+
+void StreamMux::OnPacketSent(unsigned int sequence)
+{
+	if (loadedStream < 0) return;
+	streams[loadedStream].teleporter->OnPacketSent(sequence);
+	sequenceStreams[sequence] = loadedStream;
+	loadedStream = -1;
+}
+
+bool StreamMux::IsLoadedReliable() const
+{
+	return loadedStream >= 0 && streams[loadedStream].teleporter->IsLoadedReliable();
+}
+
+bool StreamMux::IsLoadedControl() const
+{
+	return loadedStream >= 0 && streams[loadedStream].teleporter->IsLoadedControl();
+}
+
+void StreamMux::OnPacketsAcked(const unsigned int* sequences, int count)
+{
+	forward(sequences, count, true);
+}
+
+void StreamMux::OnPacketsLost(const unsigned int* sequences, int count)
+{
+	forward(sequences, count, false);
+}
+
+/*
+* hand each stream the acked or lost sequences of its own packets
+*/
+void StreamMux::forward(const unsigned int* sequences, int count, bool acked)
+{
+	vector<vector<unsigned int>> own(streams.size());
+	for (int i = 0; i < count; i++)
+	{
+		map<unsigned int, int>::iterator itor = sequenceStreams.find(sequences[i]);
+		if (itor == sequenceStreams.end()) continue;
+		own[itor->second].push_back(sequences[i]);
+		sequenceStreams.erase(itor);
+	}
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (own[i].empty()) continue;
+		if (acked)
+			streams[i].teleporter->OnPacketsAcked(own[i].data(), (int)own[i].size());
+		else
+			streams[i].teleporter->OnPacketsLost(own[i].data(), (int)own[i].size());
+	}
+}
+
+void StreamMux::SetLossRate(double rate)
+{
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		streams[i].teleporter->SetLossRate(rate);
+	}
+}
+
+int StreamMux::GetStreamCount() const
+{
+	return (int)streams.size();
+}
+
+const FileTeleporter& StreamMux::GetStream(int index) const
+{
+	return *streams[index].teleporter;
+}
+
+bool StreamMux::IsCracked() const
+{
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (streams[i].teleporter->GetState() == CRACKED) return true;
+	}
+	return false;
+}
+
+bool StreamMux::IsClosed() const
+{
+	if (!sender || streams.empty()) return false;
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		if (streams[i].teleporter->GetState() != CLOSED) return false;
+	}
+	return true;
+}
+
+uint64_t StreamMux::GetTotalSize() const
+{
+	uint64_t size = 0;
+	for (size_t i = 0; i < streams.size(); i++)
+	{
+		size += streams[i].teleporter->GetFileSize();
+	}
+	return size;
+}
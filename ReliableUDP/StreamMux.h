@@ -0,0 +1,89 @@
+#pragma once
+
+#include "FileTeleporter.h"
+
+namespace udpft
+{
+    const int StreamHeaderSize = sizeof(uint32_t); // the stream id goes in front of every message
+    const int MaxStreams = 64;                      // a receiver takes no more streams than this
+
+    /*
+    * several file transfers over one connection. every message carries the id of
+    * its stream, the streams take turns by deficit round robin: each round a stream
+    * may send weight times the largest message in bytes, what it goes over is taken
+    * from the next round. the connection's flow control paces the packets of all of
+    * them together, so parallel transfers share one congestion controller instead
+    * of fighting.
+    */
+    class StreamMux
+    {
+    public:
+
+        StreamMux();
+        ~StreamMux();
+        StreamMux(const StreamMux&) = delete;
+        StreamMux& operator=(const StreamMux&) = delete;
+
+        // for the sender, a stream per file, added before Initialize.
+        // weight is the stream's share of the packets against the others.
+        void AddStream(const string& filePath, int weight);
+
+        // for every stream, set before Initialize. see FileTeleporter.
+        void SetTransferMode(TransferMode mode);
+        void SetCompression(bool enabled);
+        void SetMaxPacketSize(int size); // of the whole message, the stream id included
+        void SetMaxBufferedSize(uint64_t size);
+        void SetMemoryBudget(MemoryBudget* budget);
+        void SetTimerWheel(net::TimerWheel* wheel);
+        void SetWakeCallback(const std::function<void()>& callback);
+
+        // start the transfers, or for a receiver wait for them: a stream
+        // comes into being with its first message.
+        bool Initialize(bool isSender);
+
+        int LoadPacket(unsigned char* packet); // up to the max packet size, returns the message length
+        void ProcessPacket(const unsigned char* packet, int size);
+        void Update();
+
+        // transport feedback, handed on to the stream that sent the packet
+        void OnPacketSent(unsigned int sequence);
+        void OnPacketsAcked(const unsigned int* sequences, int count);
+        void OnPacketsLost(const unsigned int* sequences, int count);
+        bool IsLoadedReliable() const; // of the last loaded packet, see FileTeleporter
+        bool IsLoadedControl() const;
+        void SetLossRate(double rate);
+
+        int GetStreamCount() const;
+        const FileTeleporter& GetStream(int index) const;
+        bool IsCracked() const;     // a transfer failed for good
+        bool IsClosed() const;      // for the sender, every file is across
+        uint64_t GetTotalSize() const;
+
+    private:
+
+        struct Stream {
+            uint32_t id;
+            int weight;
+            int deficit;            // bytes it may still send this round
+            string filePath;        // for the sender
+            FileTeleporter* teleporter;
+        };
+        vector<Stream> streams;
+        bool sender;
+        int current;                // stream whose turn it is
+        int loadedStream;           // stream of the last loaded packet, -1 for none
+        map<unsigned int, int> sequenceStreams; // transport sequence -> stream that sent it
+
+        TransferMode transferMode;
+        bool compression;
+        int maxPacketSize;
+        uint64_t maxBufferedSize;
+        MemoryBudget* memoryBudget;
+        net::TimerWheel* timers;    // shared by the teleporters, NULL for a wheel each
+        std::function<void()> wake; // handed to the teleporters
+
+        FileTeleporter* newTeleporter();
+        void clear();
+        void forward(const unsigned int* sequences, int count, bool acked);
+    };
+}
@@ -0,0 +1,243 @@
+/*
+	Hierarchical timing wheel for the connections of one process
+*/
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <assert.h>
+#include <cstddef>
+#include <functional>
+
+namespace net
+{
+	class TimerWheel;
+
+	// a deadline armed on a TimerWheel, its callback runs from the wheel's Advance once it is due
+	//  + the timer is an intrusive list node, arming and cancelling never allocate
+	//  + a timer cancels itself when destroyed, so its owner can go away with it armed
+
+	class Timer
+	{
+	public:
+
+		Timer()
+		{
+			wheel = NULL;
+			slot = NULL;
+			prev = NULL;
+			next = NULL;
+			expires = 0;
+		}
+
+		explicit Timer( const std::function<void()> & callback ) : Timer()
+		{
+			this->callback = callback;
+		}
+
+		~Timer()
+		{
+			Cancel();
+		}
+
+		Timer( const Timer & ) = delete;
+		Timer & operator = ( const Timer & ) = delete;
+
+		void SetCallback( const std::function<void()> & callback )
+		{
+			this->callback = callback;
+		}
+
+		bool IsArmed() const
+		{
+			return wheel != NULL;
+		}
+
+		inline void Cancel();
+
+	private:
+
+		friend class TimerWheel;
+
+		TimerWheel * wheel;					// wheel the timer is armed on, NULL when it is not
+		Timer ** slot;						// head of the list it is in
+		Timer * prev;
+		Timer * next;
+		unsigned long long expires;			// tick it is due at
+		std::function<void()> callback;
+	};
+
+	// hierarchical timing wheel
+	//  + Levels wheels of SlotCount slots each, a slot of level n spans SlotCount^n ticks
+	//  + a timer sits in the slot of the lowest level whose span reaches its deadline, so arm and cancel are O(1)
+	//  + each tick expires one slot of level 0. when level n wraps, the next slot of level n+1 is spread over the levels below
+	//  + advancing costs the timers that expire or move down plus a constant per tick, never a pass over every armed timer
+
+	class TimerWheel
+	{
+	public:
+
+		enum { SlotBits = 6 };
+		enum { SlotCount = 1 << SlotBits };
+		enum { Levels = 4 };					// 2^24 ticks, four and a half hours at the default resolution
+
+		TimerWheel( float resolution = 0.001f )
+		{
+			assert( resolution > 0.0f );
+			this->resolution = resolution;
+			now = 0;
+			accumulator = 0.0f;
+			count = 0;
+			for ( int level = 0; level < Levels; ++level )
+				for ( int slot = 0; slot < SlotCount; ++slot )
+					slots[level][slot] = NULL;
+		}
+
+		~TimerWheel()
+		{
+			for ( int level = 0; level < Levels; ++level )
+				for ( int slot = 0; slot < SlotCount; ++slot )
+					while ( slots[level][slot] )
+						Unlink( *slots[level][slot] );
+		}
+
+		TimerWheel( const TimerWheel & ) = delete;
+		TimerWheel & operator = ( const TimerWheel & ) = delete;
+
+		// (re)arm the timer to go off in the given number of seconds, at least one tick from now:
+		// a deadline already past goes off with the next tick. longer than the wheel spans is cut to what it spans
+
+		void Arm( Timer & timer, float seconds )
+		{
+			if ( timer.wheel )
+				timer.wheel->Unlink( timer );
+			const unsigned long long span = 1ULL << ( Levels * SlotBits );
+			const float scaled = seconds / resolution + 0.5f;
+			unsigned long long ticks = 1;
+			if ( scaled >= (float) ( span - 1 ) )
+				ticks = span - 1;
+			else if ( scaled >= 1.0f )
+				ticks = (unsigned long long) scaled;
+			timer.expires = now + ticks;
+			Link( timer );
+		}
+
+		void Cancel( Timer & timer )
+		{
+			if ( timer.wheel == this )
+				Unlink( timer );
+		}
+
+		// move time forward, the timers that come due go off in deadline order.
+		// a callback may arm or cancel any timer, itself included
+
+		void Advance( float seconds )
+		{
+			accumulator += seconds;
+			while ( accumulator >= resolution )
+			{
+				accumulator -= resolution;
+				Tick();
+			}
+		}
+
+		// seconds advanced so far, to the resolution of the wheel
+
+		double GetTime() const
+		{
+			return (double) now * resolution;
+		}
+
+		float GetResolution() const
+		{
+			return resolution;
+		}
+
+		int GetTimerCount() const
+		{
+			return count;
+		}
+
+	private:
+
+		void Tick()
+		{
+			now++;
+
+			// slots of the levels above that begin at this tick are spread down, the highest first
+			// so what it hands down can be spread again by the level below
+
+			int top = 0;
+			while ( top + 1 < Levels && ( now & ( ( 1ULL << ( ( top + 1 ) * SlotBits ) ) - 1 ) ) == 0 )
+				top++;
+			for ( int level = top; level >= 1; --level )
+			{
+				Timer * timer = slots[level][( now >> ( level * SlotBits ) ) & ( SlotCount - 1 )];
+				while ( timer )
+				{
+					Timer * next = timer->next;
+					Unlink( *timer );
+					Link( *timer );
+					timer = next;
+				}
+			}
+
+			Timer ** slot = &slots[0][now & ( SlotCount - 1 )];
+			while ( *slot )
+			{
+				Timer & timer = **slot;
+				assert( timer.expires == now );
+				Unlink( timer );
+				if ( timer.callback )
+					timer.callback();
+			}
+		}
+
+		void Link( Timer & timer )
+		{
+			assert( timer.expires >= now );
+			const unsigned long long delta = timer.expires - now;
+			int level = 0;
+			while ( level + 1 < Levels && delta >= ( 1ULL << ( ( level + 1 ) * SlotBits ) ) )
+				level++;
+			Timer ** head = &slots[level][( timer.expires >> ( level * SlotBits ) ) & ( SlotCount - 1 )];
+			timer.wheel = this;
+			timer.slot = head;
+			timer.prev = NULL;
+			timer.next = *head;
+			if ( *head )
+				( *head )->prev = &timer;
+			*head = &timer;
+			count++;
+		}
+
+		void Unlink( Timer & timer )
+		{
+			assert( timer.wheel == this );
+			if ( timer.prev )
+				timer.prev->next = timer.next;
+			else
+				*timer.slot = timer.next;
+			if ( timer.next )
+				timer.next->prev = timer.prev;
+			timer.wheel = NULL;
+			timer.slot = NULL;
+			timer.prev = NULL;
+			timer.next = NULL;
+			count--;
+		}
+
+		float resolution;						// seconds per tick
+		unsigned long long now;					// ticks advanced so far
+		float accumulator;						// seconds advanced but not ticked yet
+		int count;								// armed timers
+		Timer * slots[Levels][SlotCount];		// head of each slot's list of timers
+	};
+
+	inline void Timer::Cancel()
+	{
+		if ( wheel )
+			wheel->Cancel( *this );
+	}
+}
+
+#endif
@@ -1,16 +1,49 @@
 #include "pch.h"
+#include "Net.h"
 #include "FileTeleporter.h"
+#include "StreamMux.h"
 #include <fstream>
+#include <chrono>
+#include <map>
+#include <set>
 
 using namespace udpft;
 
-TEST(FileTeleporterTest, ConstructorTest) {
+// received files, journals and the cache index land in the working directory,
+// so each test that touches files runs in a directory of its own under the
+// system's temp directory and takes it with it when it ends
+class ScratchDirectoryTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        const ::testing::TestInfo* test = ::testing::UnitTest::GetInstance()->current_test_info();
+        home = std::filesystem::current_path();
+        scratch = std::filesystem::temp_directory_path() / (std::string("udpft-") + test->test_case_name() + "-" + test->name()
+            + "-" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+        std::filesystem::create_directories(scratch);
+        std::filesystem::current_path(scratch);
+    }
+
+    void TearDown() override {
+        std::filesystem::current_path(home);
+        std::error_code error;
+        std::filesystem::remove_all(scratch, error);
+    }
+
+    std::filesystem::path home;
+    std::filesystem::path scratch;
+};
+
+class FileTeleporterTest : public ScratchDirectoryTest {};
+class StreamMuxTest : public ScratchDirectoryTest {};
+class SparseTest : public ScratchDirectoryTest {};
+
+TEST_F(FileTeleporterTest, ConstructorTest) {
     FileTeleporter ft;
     EXPECT_EQ(ft.GetState(), CRACKED);
     EXPECT_EQ(ft.GetFileSize(), 0);
 }
 
-TEST(FileTeleporterTest, InitializeSender) {
+TEST_F(FileTeleporterTest, InitializeSender) {
 
     FileTeleporter ft;
     EXPECT_TRUE(ft.Initialize("E:\\GitRepo\\ReliableUDP\\x64\\Debug\\test.md", true)); 
@@ -19,13 +52,13 @@ TEST(FileTeleporterTest, InitializeSender) {
     EXPECT_GT(ft.GetFileSize(), 0);
 }
 
-TEST(FileTeleporterTest, InitializeReceiver) {
+TEST_F(FileTeleporterTest, InitializeReceiver) {
     FileTeleporter ft;
     EXPECT_TRUE(ft.Initialize("received.txt", false)); 
     EXPECT_EQ(ft.GetState(), LISTENING);
 }
 
-TEST(FileTeleporterTest, LoadPacketTest) {
+TEST_F(FileTeleporterTest, LoadPacketTest) {
     FileTeleporter ft;
     ft.Initialize("E:\\GitRepo\\ReliableUDP\\x64\\Debug\\test.md", true);
     unsigned char packet[PacketSize] = { 0 };
@@ -33,6 +66,1773 @@ TEST(FileTeleporterTest, LoadPacketTest) {
     EXPECT_NE(packet[0], 0);  
 }
 
+// writes a file of the given size under a source directory and returns its path.
+// received files land in the working directory, so the source must live elsewhere.
+static std::string WriteSourceFile(const std::string& name, size_t size) {
+    std::filesystem::create_directories("teleporter_source");
+    std::string path = (std::filesystem::path("teleporter_source") / name).string();
+    std::ofstream out(path, std::ios::binary);
+    for (size_t i = 0; i < size; ++i) {
+        out.put((char)(i * 31 + i / 977));
+    }
+    return path;
+}
+
+// the messages one side of a Teleport sent, by id, and the bytes they took
+struct Traffic {
+    std::map<uint32_t, int> messages;
+    size_t bytes = 0;
+
+    void Add(const unsigned char* packet, int size) {
+        if (size <= 0) return;
+        ++messages[MessageId(packet)];
+        bytes += size;
+    }
+
+    int Count(uint32_t id) const {
+        auto found = messages.find(id);
+        return found == messages.end() ? 0 : found->second;
+    }
+};
+
+// runs a sender and a receiver against each other without a network in between.
+// every packet arrives, so its transport ack is handed straight back to the sender.
+// returns the number of messages carrying chunks the sender sent.
+static int Teleport(FileTeleporter& sender, FileTeleporter& receiver, int ticks,
+    Traffic* sent = nullptr, Traffic* replied = nullptr) {
+    unsigned char packet[PacketSize];
+    unsigned int sequence = 0;
+    int chunks = 0;
+    for (int i = 0; i < ticks && sender.GetState() != CLOSED; ++i) {
+        int size = sender.LoadPacket(packet);
+        if (size > 0 && (MessageId(packet) == FCID || MessageId(packet) == ZCID)) ++chunks;
+        if (sent) sent->Add(packet, size);
+        sender.OnPacketSent(sequence);
+        sender.OnPacketsAcked(&sequence, 1);
+        ++sequence;
+        receiver.ProcessPacket(packet, size);
+        receiver.Update();
+        size = receiver.LoadPacket(packet);
+        if (replied) replied->Add(packet, size);
+        sender.ProcessPacket(packet, size);
+        sender.Update();
+    }
+    return chunks;
+}
+
+// one session of a file from its source to the working directory, run to the end,
+// with what each side put on the wire kept for the test to look at
+class FileTransferTest : public ScratchDirectoryTest {
+protected:
+    void Transfer(const std::string& path, int ticks = 200) {
+        sent = Traffic();
+        replied = Traffic();
+        ASSERT_TRUE(sender.Initialize(path, true));
+        ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+        Teleport(sender, receiver, ticks, &sent, &replied);
+        ASSERT_EQ(sender.GetState(), CLOSED);
+        EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    }
+
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    Traffic sent;
+    Traffic replied;
+};
+
+TEST_F(FileTeleporterTest, TransfersFileInProcess) {
+    std::string path = WriteSourceFile("teleported.bin", 3 * FileDataChunkSize + 17);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    Teleport(sender, receiver, 100);
+
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_EQ(receiver.GetFileName(), "teleported.bin");
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    EXPECT_EQ(std::filesystem::file_size("teleported.bin"), 3 * FileDataChunkSize + 17);
+}
+
+TEST_F(FileTeleporterTest, ResumesFromJournal) {
+    std::string path = WriteSourceFile("resumed.bin", 20 * FileDataChunkSize + 3);
+    {
+        // cut off after a few chunks, the receiver keeps them in a journal
+        FileTeleporter sender;
+        FileTeleporter receiver;
+        ASSERT_TRUE(sender.Initialize(path, true));
+        ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+        EXPECT_GT(Teleport(sender, receiver, 8), 0);
+        EXPECT_EQ(receiver.GetState(), RECEIVING);
+        ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+        EXPECT_TRUE(std::filesystem::exists("resumed.bin.journal"));
+    }
+
+    // a new session sends only what is missing
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    int chunks = Teleport(sender, receiver, 100);
+
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_LT(chunks, 20);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    EXPECT_EQ(std::filesystem::file_size("resumed.bin"), 20 * FileDataChunkSize + 3);
+    EXPECT_FALSE(std::filesystem::exists("resumed.bin.journal"));
+    EXPECT_FALSE(std::filesystem::exists("resumed.bin.part"));
+}
+
+TEST_F(FileTransferTest, DeltaSendsOnlyTheChange) {
+    const size_t size = 200 * FileDataChunkSize;
+    std::string path = WriteSourceFile("delta.bin", size);
+    std::vector<char> file(size);
+    std::ifstream(path, std::ios::binary).read(file.data(), size);
+    {
+        // the receiver's old copy: a few bytes changed, a few more cut out
+        std::vector<char> old(file);
+        old[1000] ^= 0x55;
+        old.erase(old.begin() + 150000, old.begin() + 150007);
+        std::ofstream("delta.bin", std::ios::binary).write(old.data(), old.size());
+    }
+    MemoryBudget budget;
+    receiver.SetMemoryBudget(&budget);
+    ASSERT_NO_FATAL_FAILURE(Transfer(path));
+
+    // the receiver's signatures come back, a delta of a few blocks goes out
+    EXPECT_GT(replied.Count(SGID), 0);
+    EXPECT_EQ(sent.Count(DLID), 1);
+    EXPECT_LT(sent.Count(FCID), 10);
+    EXPECT_LT(sent.bytes, size / 20);
+    EXPECT_EQ(receiver.GetFileSize(), size);
+    std::vector<char> received(size);
+    std::ifstream("delta.bin", std::ios::binary).read(received.data(), size);
+    EXPECT_TRUE(received == file);
+    // the old copy and the delta were held from the budget, all of it is back
+    EXPECT_EQ(budget.GetTaken(), 0u);
+}
+
+TEST_F(FileTeleporterTest, RefusesAnOverlongDelta) {
+    const size_t size = 50 * FileDataChunkSize;
+    std::string path = WriteSourceFile("overlong.bin", size);
+    {
+        std::vector<char> old(size);
+        std::ifstream(path, std::ios::binary).read(old.data(), size);
+        old[1000] ^= 0x55;
+        std::ofstream("overlong.bin", std::ios::binary).write(old.data(), old.size());
+    }
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+    bool announced = false;
+    for (int i = 0; i < 200 && !announced; ++i) {
+        int size = sender.LoadPacket(packet);
+        if (MessageId(packet) == DLID) {
+            // a delta far longer than any delta of the file could be
+            uint32_t deltaSize = 0xFFFFFFF0;
+            memcpy(packet + sizeof(uint32_t) + offsetof(DeltaHeader, deltaSize), &deltaSize, sizeof(deltaSize));
+            announced = true;
+        }
+        receiver.ProcessPacket(packet, size);
+        receiver.Update();
+        size = receiver.LoadPacket(packet);
+        sender.ProcessPacket(packet, size);
+        sender.Update();
+    }
+    ASSERT_TRUE(announced);
+    EXPECT_EQ(receiver.GetState(), CRACKED);
+}
+
+TEST_F(FileTransferTest, CompressesTextChunks) {
+    std::string path = WriteSourceFile("served.log", 0);
+    {
+        std::ofstream out(path, std::ios::binary);
+        for (int row = 0; out.tellp() < 100 * FileDataChunkSize; ++row) {
+            out << "2024-05-01 12:00:" << row % 60 << " INFO worker-" << row % 4 << " GET /api/items status=200\n";
+        }
+    }
+    sender.SetCompression(true);
+    ASSERT_NO_FATAL_FAILURE(Transfer(path));
+
+    // runs of chunks go out compressed, in a fraction of their size
+    EXPECT_GT(sent.Count(ZCID), 0);
+    EXPECT_LT(sent.Count(FCID) + sent.Count(ZCID), 40);
+    EXPECT_LT(sent.bytes, std::filesystem::file_size(path) / 4);
+    EXPECT_EQ(std::filesystem::file_size("served.log"), std::filesystem::file_size(path));
+}
+
+TEST_F(FileTransferTest, ElidesZeroAndRepeatedChunks) {
+    // ten chunks of data, twenty of zeros, then the ten again
+    std::string path = WriteSourceFile("image.bin", 10 * FileDataChunkSize);
+    std::vector<char> data(10 * FileDataChunkSize);
+    {
+        std::ifstream in(path, std::ios::binary);
+        in.read(data.data(), data.size());
+    }
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        std::vector<char> zeros(20 * FileDataChunkSize, 0);
+        out.write(zeros.data(), zeros.size());
+        out.write(data.data(), data.size());
+    }
+    ASSERT_NO_FATAL_FAILURE(Transfer(path));
+
+    // the first ten go as chunks, the zeros as one run and the repeats as another
+    EXPECT_EQ(sent.Count(FCID), 10);
+    EXPECT_EQ(sent.Count(ZRID), 1);
+    EXPECT_EQ(sent.Count(RPID), 1);
+    EXPECT_LT(sent.bytes, 11 * PacketSize);
+    EXPECT_EQ(std::filesystem::file_size("image.bin"), std::filesystem::file_size(path));
+}
+
+TEST_F(FileTransferTest, SkipsHolesOfSparseFile) {
+    // a hole of forty chunks, then five chunks of data
+    std::string path = WriteSourceFile("sparse.img", 0);
+    std::filesystem::resize_file(path, 40 * FileDataChunkSize);
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        for (int i = 0; i < 5 * FileDataChunkSize; ++i) out.put((char)(i % 251 + 1));
+    }
+    ASSERT_NO_FATAL_FAILURE(Transfer(path));
+
+    // only the data goes out, the hole is never read as chunks
+    EXPECT_EQ(sent.Count(FCID), 5);
+    EXPECT_LT(sent.bytes, 6 * PacketSize);
+    const uint64_t size = std::filesystem::file_size(path);
+    EXPECT_EQ(std::filesystem::file_size("sparse.img"), size);
+
+    // where the file system keeps holes, the received file has the hole in the same place
+    std::vector<sparse::Extent> source;
+    std::vector<sparse::Extent> received;
+    sparse::DataExtents(path, size, source);
+    sparse::DataExtents("sparse.img", size, received);
+    ASSERT_FALSE(source.empty());
+    ASSERT_FALSE(received.empty());
+    if (source.front().offset > 0) {
+        EXPECT_GE(received.front().offset, source.front().offset / sparse::BlockSize * sparse::BlockSize);
+    }
+}
+
+TEST_F(FileTransferTest, LinksFilesItHasAlready) {
+    std::string again = WriteSourceFile("artifact-copy.bin", 0);
+    std::string path = WriteSourceFile("artifact.bin", 30 * FileDataChunkSize + 9);
+    ASSERT_NO_FATAL_FAILURE(Transfer(path));
+    EXPECT_EQ(sent.Count(FCID), 31);
+    EXPECT_EQ(replied.Count(HVID), 0);
+
+    // the same contents again under another name: the metadata, the receiver's word that it has them, no chunks
+    std::filesystem::copy_file(path, again, std::filesystem::copy_options::overwrite_existing);
+    ASSERT_NO_FATAL_FAILURE(Transfer(again));
+    EXPECT_EQ(replied.Count(HVID), 1);
+    EXPECT_EQ(sent.Count(FCID) + sent.Count(ZCID) + sent.Count(RPID), 0);
+    EXPECT_LT(sent.bytes, (size_t)PacketSize);
+    EXPECT_EQ(std::filesystem::file_size("artifact-copy.bin"), 30 * FileDataChunkSize + 9);
+}
+
+TEST_F(FileTransferTest, TransfersDirectoryInOneSession) {
+    // two hundred small files in nested directories, and an empty one
+    std::filesystem::path source = std::filesystem::path("teleporter_source") / "tree";
+    for (int i = 0; i < 200; ++i) {
+        std::filesystem::path file = source / ("d" + std::to_string(i % 7)) / ("f" + std::to_string(i) + ".txt");
+        std::filesystem::create_directories(file.parent_path());
+        std::ofstream(file, std::ios::binary) << "file " << i << " of the tree\n";
+    }
+    std::filesystem::create_directories(source / "empty");
+    ASSERT_NO_FATAL_FAILURE(Transfer(source.string()));
+
+    // one metadata and one end for the lot, the small files packed into a few chunks
+    EXPECT_EQ(receiver.GetFileName(), "tree");
+    EXPECT_EQ(sent.Count(MDID), 1);
+    EXPECT_EQ(sent.Count(ENDID), 1);
+    EXPECT_LT(sent.Count(FCID) + sent.Count(ZCID), 20);
+    EXPECT_TRUE(std::filesystem::is_directory("tree/empty"));
+    for (int i = 0; i < 200; i += 37) {
+        std::ifstream file(std::filesystem::path("tree") / ("d" + std::to_string(i % 7)) / ("f" + std::to_string(i) + ".txt"));
+        std::string line;
+        std::getline(file, line);
+        EXPECT_EQ(line, "file " + std::to_string(i) + " of the tree");
+    }
+}
+
+TEST_F(StreamMuxTest, SharesOneConnectionByWeight) {
+    std::string heavy = WriteSourceFile("heavy.bin", 60 * FileDataChunkSize);
+    std::string light = WriteSourceFile("light.bin", 60 * FileDataChunkSize + 1);
+    StreamMux sender;
+    StreamMux receiver;
+    sender.AddStream(heavy, 3);
+    sender.AddStream(light, 1);
+    ASSERT_TRUE(sender.Initialize(true));
+    ASSERT_TRUE(receiver.Initialize(false));
+
+    // as Teleport, with the chunks counted per stream until the heavy one is done
+    unsigned char packet[StreamHeaderSize + PacketSize];
+    unsigned int sequence = 0;
+    int chunks[2] = { 0, 0 };
+    for (int i = 0; i < 400 && !sender.IsClosed(); ++i) {
+        int size = sender.LoadPacket(packet);
+        if (size > 0 && MessageId(packet + StreamHeaderSize) == FCID && sender.GetStream(0).GetState() != CLOSED) {
+            ++chunks[ReadU32(packet)];
+        }
+        sender.OnPacketSent(sequence);
+        sender.OnPacketsAcked(&sequence, 1);
+        ++sequence;
+        receiver.ProcessPacket(packet, size);
+        receiver.Update();
+        size = receiver.LoadPacket(packet);
+        sender.ProcessPacket(packet, size);
+        sender.Update();
+    }
+
+    EXPECT_TRUE(sender.IsClosed());
+    ASSERT_EQ(receiver.GetStreamCount(), 2);
+    EXPECT_EQ(chunks[0], 60);
+    EXPECT_NEAR(chunks[1], 20, 4);
+    EXPECT_EQ(std::filesystem::file_size("heavy.bin"), 60 * FileDataChunkSize);
+    EXPECT_EQ(std::filesystem::file_size("light.bin"), 60 * FileDataChunkSize + 1);
+}
+
+TEST_F(FileTeleporterTest, MessagesCarryTheirLength) {
+    std::string path = WriteSourceFile("short.bin", FileDataChunkSize + 5);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+
+    // nothing to say yet, only the id goes out
+    EXPECT_EQ(receiver.LoadPacket(packet), (int)sizeof(uint32_t));
+
+    int size = sender.LoadPacket(packet);
+    EXPECT_EQ(size, (int)(sizeof(uint32_t) + sizeof(FileMetadata)));
+    receiver.ProcessPacket(packet, size);
+    EXPECT_EQ(receiver.LoadPacket(packet), (int)(sizeof(uint32_t) + sizeof(TransferAccept)));
+    sender.ProcessPacket(packet, sizeof(uint32_t) + sizeof(TransferAccept));
+
+    // a full chunk, then the last one without zero padding, then one ack for both
+    size = sender.LoadPacket(packet);
+    EXPECT_EQ(size, PacketSize);
+    sender.OnPacketSent(0);
+    receiver.ProcessPacket(packet, size);
+    size = sender.LoadPacket(packet);
+    EXPECT_EQ(size, (int)(2 * sizeof(uint32_t)) + 5);
+    sender.OnPacketSent(1);
+    receiver.ProcessPacket(packet, size);
+    EXPECT_EQ(receiver.LoadPacket(packet), (int)sizeof(uint32_t));
+}
+
+TEST_F(FileTeleporterTest, RefusesMetadataItCannotHold) {
+    std::string path = WriteSourceFile("sized.bin", 3 * FileDataChunkSize + 11);
+    FileTeleporter sender;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    unsigned char metadata[PacketSize];
+    int size = sender.LoadPacket(metadata);
+    unsigned char packet[PacketSize];
+    uint32_t field = 0xFFFFFFFF;
+
+    // a chunk size past what our datagrams hold is cut down to it
+    FileTeleporter receiver;
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    memcpy(packet, metadata, size);
+    memcpy(packet + sizeof(uint32_t) + offsetof(FileMetadata, chunkSize), &field, sizeof(field));
+    receiver.ProcessPacket(packet, size);
+    EXPECT_EQ(receiver.GetState(), READY);
+
+    // a size past what the chunks can count fails the transfer before anything is sized by it
+    FileTeleporter refusing;
+    ASSERT_TRUE(refusing.Initialize(DefaultFileName, false));
+    memcpy(packet, metadata, size);
+    field = 0xFFFFFFFF;
+    memcpy(packet + sizeof(uint32_t) + offsetof(FileMetadata, fileSizeHigh), &field, sizeof(field));
+    refusing.ProcessPacket(packet, size);
+    EXPECT_EQ(refusing.GetState(), CRACKED);
+
+    // one past 4 GB is taken, into a partial file that is one hole until chunks come.
+    // the first receiver gives up the name for it
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    FileTeleporter spooling;
+    ASSERT_TRUE(spooling.Initialize(DefaultFileName, false));
+    memcpy(packet, metadata, size);
+    field = 1;
+    memcpy(packet + sizeof(uint32_t) + offsetof(FileMetadata, fileSizeHigh), &field, sizeof(field));
+    spooling.ProcessPacket(packet, size);
+    EXPECT_EQ(spooling.GetState(), READY);
+    EXPECT_EQ(spooling.GetFileSize(), (1ull << 32) + 3 * FileDataChunkSize + 11);
+    EXPECT_EQ(std::filesystem::file_size("sized.bin.part"), (1ull << 32) + 3 * FileDataChunkSize + 11);
+}
+
+TEST_F(FileTeleporterTest, RefusesNamesOutsideItsDirectory) {
+    std::string path = WriteSourceFile("named.bin", FileDataChunkSize);
+    FileTeleporter sender;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    unsigned char metadata[PacketSize];
+    int size = sender.LoadPacket(metadata);
+
+    const char* names[] = { "../named.bin", "sub/../../named.bin", "/tmp/named.bin", "." };
+    for (const char* name : names) {
+        unsigned char packet[PacketSize];
+        memcpy(packet, metadata, size);
+        char* field = (char*)packet + sizeof(uint32_t) + offsetof(FileMetadata, fileName);
+        memset(field, 0, MaxFileNameLength);
+        memcpy(field, name, strlen(name));
+        FileTeleporter receiver;
+        ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+        receiver.ProcessPacket(packet, size);
+        EXPECT_EQ(receiver.GetState(), CRACKED) << name;
+    }
+    EXPECT_TRUE(bundle::IsContained("sub/named.bin"));
+}
+
+TEST_F(FileTeleporterTest, ReceivesOneTransferOfANameAtATime) {
+    std::string path = WriteSourceFile("contended.bin", FileDataChunkSize);
+    FileTeleporter sender;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    unsigned char metadata[PacketSize];
+    int size = sender.LoadPacket(metadata);
+
+    FileTeleporter first;
+    FileTeleporter second;
+    ASSERT_TRUE(first.Initialize(DefaultFileName, false));
+    ASSERT_TRUE(second.Initialize(DefaultFileName, false));
+    first.ProcessPacket(metadata, size);
+    second.ProcessPacket(metadata, size);
+    EXPECT_EQ(first.GetState(), READY);
+    EXPECT_EQ(second.GetState(), LISTENING);
+
+    // the name is free again once the first is reset
+    ASSERT_TRUE(first.Initialize(DefaultFileName, false));
+    second.ProcessPacket(metadata, size);
+    EXPECT_EQ(second.GetState(), READY);
+}
+
+TEST_F(FileTeleporterTest, NegotiatesChunkSizeWithProbes) {
+    std::string path = WriteSourceFile("jumbo.bin", 5 * JumboChunkSize + 9);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    sender.SetMaxPacketSize(JumboPacketSize);
+    receiver.SetMaxPacketSize(4000);
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[JumboPacketSize];
+
+    // the path carries up to 7956 bytes, the receiver takes 4000
+    unsigned int sequence = 0;
+    int largestChunk = 0;
+    for (int i = 0; i < 200 && sender.GetState() != CLOSED; ++i) {
+        int size = sender.LoadPacket(packet);
+        sender.OnPacketSent(sequence);
+        if (size > 7956) {
+            sender.OnPacketsLost(&sequence, 1);
+        } else {
+            sender.OnPacketsAcked(&sequence, 1);
+            if (MessageId(packet) == FCID && size > largestChunk) largestChunk = size;
+            receiver.ProcessPacket(packet, size);
+        }
+        ++sequence;
+        receiver.Update();
+        size = receiver.LoadPacket(packet);
+        sender.ProcessPacket(packet, size);
+        sender.Update();
+    }
+
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_EQ(largestChunk, 4000);
+    EXPECT_EQ(receiver.GetChunkSize(), 4000 - (int)(2 * sizeof(uint32_t)));
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    EXPECT_EQ(std::filesystem::file_size("jumbo.bin"), 5 * JumboChunkSize + 9);
+}
+
+// feeds the receiver chunks of a file it was told about, in the given order
+static void ReceiveChunks(FileTeleporter& sender, FileTeleporter& receiver,
+    const std::vector<int>& order, std::vector<int>& ackSizes) {
+    unsigned char chunks[SendWindow][PacketSize];
+    int sizes[SendWindow];
+    for (int i = 0; i < SendWindow; ++i) {
+        sizes[i] = sender.LoadPacket(chunks[i]);
+        sender.OnPacketSent(i);
+    }
+    for (int index : order) {
+        unsigned char packet[PacketSize];
+        receiver.ProcessPacket(chunks[index], sizes[index]);
+        ackSizes.push_back(receiver.LoadPacket(packet));
+    }
+}
+
+TEST_F(FileTeleporterTest, AcksAreCoalesced) {
+    std::string path = WriteSourceFile("acked.bin", 80 * FileDataChunkSize);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // in order: one ack per AckEvery chunks. out of order and duplicates: at once
+    std::vector<int> ackSizes;
+    ReceiveChunks(sender, receiver, { 0, 1, 2, 3, 5, 4, 4 }, ackSizes);
+    const int ack = (int)sizeof(uint32_t);
+    std::vector<int> expected = { 0, 0, 0, ack, ack, ack, ack };
+    EXPECT_EQ(ackSizes, expected);
+
+    // nothing new, no ack
+    EXPECT_EQ(receiver.LoadPacket(packet), 0);
+}
+
+TEST_F(FileTeleporterTest, ChunksFollowTransportAcks) {
+    std::string path = WriteSourceFile("tracked.bin", 3 * FileDataChunkSize);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // chunks 0, 1, 2 go out in sequences 10, 11, 12
+    for (unsigned int sequence = 10; sequence < 13; ++sequence) {
+        sender.LoadPacket(packet);
+        EXPECT_EQ(MessageId(packet), FCID);
+        EXPECT_EQ(ChunkIndex(MessageContent(packet)), sequence - 10);
+        sender.OnPacketSent(sequence);
+    }
+    // all in flight, nothing to send
+    EXPECT_EQ(sender.LoadPacket(packet), 0);
+
+    // the packet with chunk 1 is lost, chunk 1 goes out again in 13
+    unsigned int lost = 11;
+    sender.OnPacketsLost(&lost, 1);
+    sender.LoadPacket(packet);
+    EXPECT_EQ(ChunkIndex(MessageContent(packet)), 1u);
+    sender.OnPacketSent(13);
+
+    // acks for the old sequence mean nothing, the others complete the file
+    unsigned int acks[] = { 10, 11, 12, 13 };
+    sender.OnPacketsAcked(acks, 2);
+    EXPECT_EQ(sender.LoadPacket(packet), 0);
+    sender.OnPacketsAcked(acks + 2, 2);
+    sender.LoadPacket(packet);
+    EXPECT_EQ(MessageId(packet), ENDID);
+}
+
+TEST_F(FileTeleporterTest, TakesBackChunksTheReceiverDropped) {
+    // two chunks of the same bytes, the second goes as a repeat of the first
+    std::string path = WriteSourceFile("dropped.bin", FileDataChunkSize);
+    {
+        std::vector<char> data(FileDataChunkSize);
+        std::ifstream in(path, std::ios::binary);
+        in.read(data.data(), data.size());
+        in.close();
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        out.write(data.data(), data.size());
+    }
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // chunk 0 is acked without the receiver ever storing it
+    unsigned int sequence = 10;
+    sender.LoadPacket(packet);
+    EXPECT_EQ(MessageId(packet), FCID);
+    sender.OnPacketSent(sequence);
+    sender.OnPacketsAcked(&sequence, 1);
+
+    // the repeat of it can't be made up, the ack of its packet comes with both taken back
+    int size = sender.LoadPacket(packet);
+    EXPECT_EQ(MessageId(packet), RPID);
+    sender.OnPacketSent(++sequence);
+    receiver.ProcessPacket(packet, size);
+    size = receiver.LoadPacket(packet);
+    EXPECT_EQ(MessageId(packet), ACKID);
+    EXPECT_EQ(size, (int)(sizeof(uint32_t) + 2 * sizeof(DroppedRun)));
+    sender.ProcessPacket(packet, size);
+    sender.OnPacketsAcked(&sequence, 1);
+
+    size = sender.LoadPacket(packet);
+    EXPECT_EQ(MessageId(packet), FCID);
+    EXPECT_EQ(ChunkIndex(MessageContent(packet)), 0u);
+    sender.OnPacketSent(++sequence);
+    receiver.ProcessPacket(packet, size);
+    Teleport(sender, receiver, 100);
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+}
+
+TEST_F(FileTeleporterTest, ResendsWhatTheEndFindsMissing) {
+    std::string path = WriteSourceFile("missing.bin", 2 * FileDataChunkSize + 7);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // chunk 0 is acked without a word from the receiver about it, the ENDID finds it missing
+    unsigned int sequence = 10;
+    sender.LoadPacket(packet);
+    sender.OnPacketSent(sequence);
+    sender.OnPacketsAcked(&sequence, 1);
+    Teleport(sender, receiver, 100);
+
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    EXPECT_EQ(std::filesystem::file_size("missing.bin"), 2 * FileDataChunkSize + 7);
+}
+
+TEST_F(FileTeleporterTest, StartsOverForAReceiverThatForgotTheTransfer) {
+    std::string path = WriteSourceFile("forgotten.bin", 3 * FileDataChunkSize + 5);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // the receiver restarts, the chunk that reaches it now is acked all the same
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned int sequence = 10;
+    int size = sender.LoadPacket(packet);
+    sender.OnPacketSent(sequence);
+    sender.OnPacketsAcked(&sequence, 1);
+    receiver.ProcessPacket(packet, size);
+    size = receiver.LoadPacket(packet);
+    EXPECT_EQ(MessageId(packet), LSID);
+    sender.ProcessPacket(packet, size);
+    EXPECT_EQ(sender.GetState(), WAVING);
+
+    Teleport(sender, receiver, 100);
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    EXPECT_EQ(std::filesystem::file_size("forgotten.bin"), 3 * FileDataChunkSize + 5);
+}
+
+TEST_F(FileTeleporterTest, ParityRebuildsLostChunk) {
+    std::string path = WriteSourceFile("parity.bin", 2 * FecGroupSize * FileDataChunkSize - 100);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    sender.SetLossRate(0.5);
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // chunk 3 and the last chunk never arrive, everything else does and is acked
+    unsigned int sequence = 0;
+    for (;;) {
+        int size = sender.LoadPacket(packet);
+        if (size == 0 || (MessageId(packet) != FCID && MessageId(packet) != PCID)) break;
+        sender.OnPacketSent(sequence);
+        uint32_t index = ChunkIndex(MessageContent(packet));
+        bool lost = MessageId(packet) == FCID && (index == 3 || index == 2 * FecGroupSize - 1);
+        if (!lost) {
+            receiver.ProcessPacket(packet, size);
+            sender.OnPacketsAcked(&sequence, 1);
+        }
+        ++sequence;
+    }
+
+    // no retransmission, the parity was enough
+    EXPECT_EQ(MessageId(packet), ENDID);
+    receiver.ProcessPacket(packet, sizeof(uint32_t) + sizeof(uint32_t));
+    EXPECT_EQ(receiver.GetState(), DISCONNECTING);
+    EXPECT_EQ(std::filesystem::file_size("parity.bin"), 2 * FecGroupSize * FileDataChunkSize - 100);
+}
+
+TEST_F(FileTeleporterTest, ParityRebuildsChunksOfASpooledFile) {
+    // a group of hole, then two groups of data: the file goes spooled from disk to disk
+    std::string path = WriteSourceFile("spooled.img", 0);
+    std::filesystem::resize_file(path, FecGroupSize * FileDataChunkSize);
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::app);
+        for (int i = 0; i < 2 * FecGroupSize * FileDataChunkSize - 100; ++i) out.put((char)(i % 253 + 1));
+    }
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    sender.SetLossRate(0.5);
+    unsigned char packet[PacketSize];
+    receiver.ProcessPacket(packet, sender.LoadPacket(packet));
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+
+    // a chunk of each data group never arrives, the parity read back from the files makes up for them
+    unsigned int sequence = 0;
+    for (;;) {
+        int size = sender.LoadPacket(packet);
+        if (size == 0 || MessageId(packet) == ENDID || MessageId(packet) == NOID) break;
+        sender.OnPacketSent(sequence);
+        uint32_t index = ChunkIndex(MessageContent(packet));
+        bool lost = MessageId(packet) == FCID && (index == FecGroupSize + 2 || index == 3 * FecGroupSize - 1);
+        if (!lost) {
+            receiver.ProcessPacket(packet, size);
+            sender.OnPacketsAcked(&sequence, 1);
+        }
+        ++sequence;
+    }
+    ASSERT_EQ(MessageId(packet), ENDID);
+    receiver.ProcessPacket(packet, sizeof(uint32_t) + sizeof(uint32_t));
+    EXPECT_EQ(receiver.GetState(), DISCONNECTING);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    const size_t size = std::filesystem::file_size(path);
+    ASSERT_EQ(std::filesystem::file_size("spooled.img"), size);
+    std::vector<char> sent(size);
+    std::vector<char> received(size);
+    std::ifstream(path, std::ios::binary).read(sent.data(), size);
+    std::ifstream("spooled.img", std::ios::binary).read(received.data(), size);
+    EXPECT_TRUE(sent == received);
+    EXPECT_FALSE(std::filesystem::exists("spooled.img.part"));
+}
+
+TEST_F(FileTeleporterTest, PutsControlMessagesApartFromChunks) {
+    std::string path = WriteSourceFile("control.bin", 3 * FecGroupSize * FileDataChunkSize);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+
+    // what each message that went either way was loaded as: 1 control, 2 chunks, 0 neither
+    std::map<uint32_t, std::set<int>> kinds;
+    unsigned char packet[PacketSize];
+    unsigned int sequence = 0;
+    for (int i = 0; i < 200 && sender.GetState() != CLOSED; ++i) {
+        int size = sender.LoadPacket(packet);
+        if (size > 0) kinds[MessageId(packet)].insert(sender.IsLoadedControl() + 2 * sender.IsLoadedReliable());
+        sender.OnPacketSent(sequence);
+        sender.OnPacketsAcked(&sequence, 1);
+        ++sequence;
+        receiver.ProcessPacket(packet, size);
+        receiver.Update();
+        size = receiver.LoadPacket(packet);
+        if (size > 0) kinds[MessageId(packet)].insert(receiver.IsLoadedControl() + 2 * receiver.IsLoadedReliable());
+        sender.ProcessPacket(packet, size);
+        sender.Update();
+    }
+    ASSERT_EQ(sender.GetState(), CLOSED);
+    for (uint32_t id : { MDID, OKID, ENDID, DISID }) {
+        EXPECT_EQ(kinds[id], std::set<int>({ 1 })) << id;
+    }
+    EXPECT_EQ(kinds[FCID], std::set<int>({ 2 }));
+    EXPECT_EQ(kinds[ACKID], std::set<int>({ 0 }));
+}
+
+TEST_F(FileTeleporterTest, SpoolsFilesPastTheMemoryLimit) {
+    std::string path = WriteSourceFile("large.bin", 40 * FileDataChunkSize + 9);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    sender.SetMaxBufferedSize(16 * FileDataChunkSize);
+    receiver.SetMaxBufferedSize(16 * FileDataChunkSize);
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+
+    // the chunks go to the partial file as they come, none of them held in memory
+    Teleport(sender, receiver, 10);
+    EXPECT_EQ(receiver.GetState(), RECEIVING);
+    EXPECT_TRUE(std::filesystem::exists("large.bin.part"));
+    Teleport(sender, receiver, 200);
+    EXPECT_EQ(sender.GetState(), CLOSED);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+    EXPECT_EQ(std::filesystem::file_size("large.bin"), 40 * FileDataChunkSize + 9);
+    EXPECT_FALSE(std::filesystem::exists("large.bin.part"));
+}
+
+TEST_F(FileTeleporterTest, RefusesWhatItWouldHaveToHoldPastTheLimit) {
+    // a fountain decodes in memory, the receiver will not take one past its limit
+    std::string path = WriteSourceFile("fountain.bin", 40 * FileDataChunkSize);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    sender.SetTransferMode(FountainTransfer);
+    receiver.SetMaxBufferedSize(16 * FileDataChunkSize);
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    Teleport(sender, receiver, 5);
+    EXPECT_EQ(receiver.GetState(), CRACKED);
+    EXPECT_FALSE(std::filesystem::exists("fountain.bin"));
+
+    // a bundle is packed and unpacked in memory, past the limit it is not sent at all
+    std::filesystem::path source = std::filesystem::path("teleporter_source") / "tree";
+    std::filesystem::create_directories(source);
+    std::ofstream(source / "big.bin", std::ios::binary) << std::string(20 * FileDataChunkSize, 'x');
+    FileTeleporter bundler;
+    bundler.SetMaxBufferedSize(16 * FileDataChunkSize);
+    EXPECT_FALSE(bundler.Initialize(source.string(), true));
+}
+
+TEST_F(FileTeleporterTest, ReceiversShareAMemoryBudget) {
+    MemoryBudget budget(50 * FileDataChunkSize);
+    const std::string paths[3] = {
+        WriteSourceFile("first.bin", 40 * FileDataChunkSize),
+        WriteSourceFile("second.bin", 40 * FileDataChunkSize + 5),
+        WriteSourceFile("third.bin", 20 * FileDataChunkSize + 7),
+    };
+    FileTeleporter senders[3];
+    FileTeleporter receivers[3];
+    senders[2].SetTransferMode(FountainTransfer);
+    for (int i = 0; i < 3; ++i) {
+        receivers[i].SetMemoryBudget(&budget);
+        ASSERT_TRUE(senders[i].Initialize(paths[i], true));
+        ASSERT_TRUE(receivers[i].Initialize(DefaultFileName, false));
+    }
+
+    // the first file is held in memory, the second finds it taken and goes to disk
+    Teleport(senders[0], receivers[0], 5);
+    EXPECT_EQ(budget.GetTaken(), 40u * FileDataChunkSize);
+    Teleport(senders[1], receivers[1], 5);
+    EXPECT_EQ(receivers[1].GetState(), RECEIVING);
+    EXPECT_TRUE(std::filesystem::exists("second.bin.part"));
+    EXPECT_EQ(budget.GetTaken(), 40u * FileDataChunkSize);
+
+    // a fountain is decoded in memory, it waits
+    Teleport(senders[2], receivers[2], 5);
+    EXPECT_EQ(receivers[2].GetState(), LISTENING);
+
+    // the first is written out and gives its memory back, the fountain takes it
+    for (int i = 0; i < 3; ++i) {
+        Teleport(senders[i], receivers[i], 300);
+        EXPECT_EQ(senders[i].GetState(), CLOSED);
+        EXPECT_EQ(receivers[i].GetFileCRC(), senders[i].GetFileCRC());
+        EXPECT_EQ(budget.GetTaken(), 0u);
+    }
+    EXPECT_EQ(std::filesystem::file_size("second.bin"), 40 * FileDataChunkSize + 5);
+}
+
+TEST(FecTest, RecoversAnyLostChunks) {
+    const size_t size = 64;
+    unsigned char data[FecGroupSize * size];
+    for (size_t i = 0; i < sizeof(data); ++i) {
+        data[i] = (unsigned char)(i * 7 + i / 13);
+    }
+    unsigned char parity[MaxParityChunks][size];
+    const unsigned char* parityRows[MaxParityChunks];
+    int rows[MaxParityChunks];
+    for (int row = 0; row < MaxParityChunks; ++row) {
+        fec::EncodeParity(row, data, sizeof(data), FecGroupSize, size, parity[row]);
+        parityRows[row] = parity[row];
+        rows[row] = row;
+    }
+    // row 0 is plain XOR
+    unsigned char xorParity = 0;
+    for (int column = 0; column < FecGroupSize; ++column) xorParity ^= data[column * size];
+    EXPECT_EQ(parity[0][0], xorParity);
+
+    // lose every set of up to MaxParityChunks chunks
+    for (int mask = 1; mask < (1 << FecGroupSize); ++mask) {
+        bool present[FecGroupSize];
+        int missing = 0;
+        unsigned char damaged[sizeof(data)];
+        memcpy(damaged, data, sizeof(data));
+        for (int column = 0; column < FecGroupSize; ++column) {
+            present[column] = !(mask & (1 << column));
+            if (!present[column]) {
+                memset(damaged + column * size, 0xAA, size);
+                missing++;
+            }
+        }
+        if (missing > MaxParityChunks) {
+            EXPECT_FALSE(fec::Recover(damaged, present, FecGroupSize, size, parityRows + 1, rows + 1, MaxParityChunks - 1));
+            continue;
+        }
+        // any of the parity rows will do, use the last ones
+        int first = MaxParityChunks - missing;
+        ASSERT_TRUE(fec::Recover(damaged, present, FecGroupSize, size, parityRows + first, rows + first, missing));
+        EXPECT_EQ(memcmp(damaged, data, sizeof(data)), 0) << "mask " << mask;
+    }
+}
+
+TEST_F(FileTeleporterTest, FountainStreamsThroughLoss) {
+    std::string path = WriteSourceFile("fountain.bin", 40 * FileDataChunkSize + 321);
+    FileTeleporter sender;
+    FileTeleporter receiver;
+    sender.SetTransferMode(FountainTransfer);
+    ASSERT_TRUE(sender.Initialize(path, true));
+    ASSERT_TRUE(receiver.Initialize(DefaultFileName, false));
+    unsigned char packet[PacketSize];
+
+    // every third packet is lost, nothing comes back until the receiver is done
+    int sent = 0;
+    while (receiver.GetState() != DISCONNECTING && sent < 1000) {
+        int size = sender.LoadPacket(packet);
+        if (sent++ % 3 != 1) receiver.ProcessPacket(packet, size);
+        if (receiver.GetState() != DISCONNECTING) {
+            EXPECT_LE(receiver.LoadPacket(packet), (int)sizeof(uint32_t));
+        }
+    }
+    EXPECT_EQ(receiver.GetState(), DISCONNECTING);
+    EXPECT_EQ(receiver.GetTransferMode(), FountainTransfer);
+    EXPECT_EQ(receiver.GetFileCRC(), sender.GetFileCRC());
+
+    // the DISID is the only feedback and ends the stream
+    sender.ProcessPacket(packet, receiver.LoadPacket(packet));
+    EXPECT_EQ(sender.GetState(), CLOSED);
+}
+
+TEST(DeltaTest, FindsShiftedBlocks) {
+    std::vector<unsigned char> basis(100000);
+    for (size_t i = 0; i < basis.size(); ++i) {
+        basis[i] = (unsigned char)(i * 7 + i / 251);
+    }
+    // bytes put in shift everything after them off the block grid
+    std::vector<unsigned char> target(basis);
+    target.insert(target.begin() + 50001, 10, 0xAB);
+    target[80000] ^= 0xFF;
+
+    const uint32_t blockSize = delta::BlockSize(target.size());
+    std::vector<delta::BlockSignature> signatures;
+    delta::Signatures(basis.data(), basis.size(), blockSize, signatures);
+    std::vector<char> encoded;
+    delta::Encode(target.data(), target.size(), blockSize, signatures, encoded);
+    EXPECT_LT(encoded.size(), 4 * blockSize);
+
+    std::vector<char> rebuilt;
+    ASSERT_TRUE(delta::Apply(basis.data(), basis.size(), blockSize,
+        (const unsigned char*)encoded.data(), encoded.size(), rebuilt));
+    ASSERT_EQ(rebuilt.size(), target.size());
+    EXPECT_EQ(memcmp(rebuilt.data(), target.data(), target.size()), 0);
+}
+
+TEST(LZTest, RoundTripsAndGivesUpOnNoise) {
+    std::string text;
+    while (text.size() < 8000) {
+        text += "2024-05-01 12:00:" + std::to_string(text.size() % 60) + " INFO request served\n";
+    }
+    std::vector<unsigned char> packed(text.size());
+    size_t size = lz::Compress((const unsigned char*)text.data(), text.size(), packed.data(), packed.size());
+    ASSERT_GT(size, 0u);
+    EXPECT_LT(size, text.size() / 4);
+    std::vector<unsigned char> unpacked(text.size());
+    ASSERT_TRUE(lz::Decompress(packed.data(), size, unpacked.data(), unpacked.size()));
+    EXPECT_EQ(memcmp(unpacked.data(), text.data(), text.size()), 0);
+    EXPECT_FALSE(lz::Decompress(packed.data(), size / 2, unpacked.data(), unpacked.size()));
+
+    // noise doesn't fit back in its own size
+    std::vector<unsigned char> noise(4000);
+    uint32_t x = 12345;
+    for (size_t i = 0; i < noise.size(); ++i) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        noise[i] = (unsigned char)x;
+    }
+    EXPECT_EQ(lz::Compress(noise.data(), noise.size(), packed.data(), noise.size()), 0u);
+}
+
+TEST_F(SparseTest, WritesZerosAsHoles) {
+    std::vector<char> data(10 * sparse::BlockSize, 0);
+    data[3] = 1;
+    data[8 * sparse::BlockSize + 5] = 2;
+    data[data.size() - 101] = 3;
+    ASSERT_TRUE(sparse::Write("holes.bin", data.data(), data.size() - 100));
+    ASSERT_EQ(std::filesystem::file_size("holes.bin"), data.size() - 100);
+    std::vector<char> back(data.size() - 100);
+    std::ifstream("holes.bin", std::ios::binary).read(back.data(), back.size());
+    EXPECT_EQ(memcmp(back.data(), data.data(), back.size()), 0);
+
+    // where the file system keeps holes, the blocks between are one
+    std::vector<sparse::Extent> extents;
+    sparse::DataExtents("holes.bin", back.size(), extents);
+    ASSERT_FALSE(extents.empty());
+    EXPECT_EQ(extents.front().offset, 0u);
+    EXPECT_EQ(extents.back().offset + extents.back().length, back.size());
+    EXPECT_FALSE(sparse::IsZero((const unsigned char*)data.data(), 64));
+    EXPECT_TRUE(sparse::IsZero((const unsigned char*)data.data() + 4, 1000));
+}
+
+TEST_F(SparseTest, CrcsHolesWithoutReadingThem) {
+    std::vector<char> data(3 * sparse::BlockSize + 5, 0);
+    for (size_t i = 0; i < 100; ++i) data[i] = (char)(i * 7 + 1);
+    const uint32_t head = CRC::Calculate(data.data(), 100, CRC::CRC_32());
+    EXPECT_EQ(sparse::ZerosCrc(head, data.size() - 100), CRC::Calculate(data.data(), data.size(), CRC::CRC_32()));
+    const std::vector<char> zeros(data.size(), 0);
+    EXPECT_EQ(sparse::ZerosCrc(0, zeros.size()), CRC::Calculate(zeros.data(), zeros.size(), CRC::CRC_32()));
+    EXPECT_EQ(sparse::ZerosCrc(head, 0), head);
+
+    // a file made one hole reads as zeros, however far in
+    ASSERT_TRUE(sparse::Create("hole.bin", 1ull << 33));
+    EXPECT_EQ(std::filesystem::file_size("hole.bin"), 1ull << 33);
+    std::ifstream hole("hole.bin", std::ios::binary);
+    hole.seekg((std::streamoff)(1ull << 32));
+    char back[16] = { 1 };
+    hole.read(back, sizeof(back));
+    EXPECT_TRUE(sparse::IsZero((const unsigned char*)back, sizeof(back)));
+}
+
+TEST(FountainTest, DecodesFromSlightlyMoreSymbolsThanChunks) {
+    const int chunks = 200;
+    const size_t size = 32;
+    std::vector<unsigned char> data(chunks * size - 5);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = (unsigned char)(i * 13 + i / 7);
+    }
+    LtCode code;
+    code.Reset(chunks);
+    LtDecoder decoder;
+    decoder.Reset(chunks, size);
+    std::vector<unsigned char> decoded(data.size(), 0);
+    std::vector<bool> known(chunks, false);
+
+    // only encoded symbols, none of the chunks as they are
+    unsigned char symbol[size];
+    uint32_t seed = chunks;
+    int received = 0;
+    while (decoder.GetKnownChunks() < chunks && received < 4 * chunks) {
+        code.Encode(seed++, data.data(), data.size(), size, symbol);
+        decoder.AddSymbol(seed - 1, symbol, decoded.data(), decoded.size(), known);
+        ++received;
+    }
+    EXPECT_EQ(decoder.GetKnownChunks(), chunks);
+    EXPECT_LT(received, 2 * chunks);
+    EXPECT_EQ(decoded, data);
+}
+
+TEST(SendBufferTest, RecyclesSlots) {
+    net::SendBuffer buffer(2, 16);
+    unsigned char payload[16] = { 1, 2, 3 };
+    EXPECT_TRUE(buffer.Insert(10, payload, 3));
+    EXPECT_TRUE(buffer.Insert(11, payload, 16));
+    EXPECT_TRUE(buffer.IsFull());
+    EXPECT_FALSE(buffer.Insert(12, payload, 3));
+
+    buffer.Remove(10);
+    EXPECT_TRUE(buffer.Insert(12, payload, 3));
+    EXPECT_FALSE(buffer.Insert(13, payload, 17));
+
+    int size = 0;
+    EXPECT_TRUE(buffer.Move(12, 20));
+    EXPECT_EQ(buffer.Find(12, size), nullptr);
+    const unsigned char* moved = buffer.Find(20, size);
+    ASSERT_NE(moved, nullptr);
+    EXPECT_EQ(size, 3);
+    EXPECT_EQ(moved[2], 3);
+}
+
+TEST(ReliabilitySystemTest, ReportsLostSequences) {
+    net::ReliabilitySystem rs;
+    rs.PacketSent(100);
+    rs.PacketSent(100);
+    rs.ProcessAck(1, 0);
+    rs.Update(2.0f);
+
+    unsigned int* lost = nullptr;
+    int lostCount = 0;
+    rs.GetLost(&lost, lostCount);
+    ASSERT_EQ(lostCount, 1);
+    EXPECT_EQ(lost[0], 0u);
+    EXPECT_EQ(rs.GetLostPackets(), 1u);
+}
+
+TEST(ReliabilitySystemTest, FindsLossLongBeforeTheMaximumRtt) {
+    net::ReliabilitySystem rs;
+    for (int i = 0; i < 5; ++i) rs.PacketSent(100);
+    unsigned int* lost = nullptr;
+    int lostCount = 0;
+
+    // 4 is acked with 3, 2 and 0: 1 is three behind, lost at once
+    rs.ProcessAck(4, 0xb);
+    rs.Update(0.01f);
+    rs.GetLost(&lost, lostCount);
+    ASSERT_EQ(lostCount, 1);
+    EXPECT_EQ(lost[0], 1u);
+
+    // 6 is acked without 5: 5 is lost once it is out for longer than the loss delay
+    rs.PacketSent(100);
+    rs.PacketSent(100);
+    rs.ProcessAck(6, 0);
+    rs.Update(0.01f);
+    rs.GetLost(&lost, lostCount);
+    EXPECT_EQ(lostCount, 0);
+    rs.Update(0.05f);
+    rs.GetLost(&lost, lostCount);
+    ASSERT_EQ(lostCount, 1);
+    EXPECT_EQ(lost[0], 5u);
+
+    // nothing after 7 is acked, it is lost after the tail timeout
+    rs.PacketSent(100);
+    rs.Update(0.2f);
+    rs.GetLost(&lost, lostCount);
+    EXPECT_EQ(lostCount, 0);
+    rs.Update(0.1f);
+    rs.GetLost(&lost, lostCount);
+    ASSERT_EQ(lostCount, 1);
+    EXPECT_EQ(lost[0], 7u);
+    EXPECT_EQ(rs.GetBytesInFlight(), 0);
+}
+
+TEST(ReliabilitySystemTest, SamplesDeliveryRate) {
+    net::ReliabilitySystem rs;
+    rs.PacketSent(1000);
+    rs.PacketSent(1000);
+    EXPECT_EQ(rs.GetBytesInFlight(), 2000);
+    rs.Update(0.1f);
+    rs.ProcessAck(0, 0);
+
+    const net::DeliverySample* samples = nullptr;
+    int count = 0;
+    rs.GetDeliverySamples(&samples, count);
+    ASSERT_EQ(count, 1);
+    EXPECT_EQ(samples[0].delivered, 1000u);
+    EXPECT_EQ(samples[0].prior_delivered, 0u);
+    EXPECT_NEAR(samples[0].rate, 10000.0f, 1.0f);
+    EXPECT_FALSE(samples[0].app_limited);
+    EXPECT_EQ(rs.GetBytesInFlight(), 1000);
+
+    // the sender runs out of data, what it sends next says nothing of the path
+    rs.SetAppLimited();
+    rs.PacketSent(1000);
+    rs.Update(0.1f);
+    rs.ProcessAck(2, 1);
+    rs.GetDeliverySamples(&samples, count);
+    ASSERT_EQ(count, 2);
+    EXPECT_FALSE(samples[0].app_limited);
+    EXPECT_EQ(samples[1].prior_delivered, 1000u);
+    EXPECT_TRUE(samples[1].app_limited);
+    EXPECT_EQ(rs.GetBytesInFlight(), 0);
+}
+
+TEST(CongestionControlTest, BbrFindsTheBottleneck) {
+    // a path of 1 MB/s and 50 ms, one 1000 byte packet acked every millisecond with a pipe full behind it
+    const float rate = 1000000.0f;
+    const float rtt = 0.05f;
+    const int bdp = (int)(rate * rtt);
+    net::BbrCongestionControl bbr(1000);
+    unsigned long long delivered = 0;
+    for (int i = 0; i < 3000; i++) {
+        net::DeliverySample sample = {};
+        sample.size = 1000;
+        sample.rate = rate;
+        sample.rtt = rtt;
+        sample.prior_delivered = delivered > (unsigned long long)bdp ? delivered - bdp : 0;
+        delivered += 1000;
+        sample.delivered = delivered;
+        bbr.OnAcked(&sample, 1, bdp);
+        bbr.Update(0.001f);
+    }
+    EXPECT_EQ(bbr.GetMode(), net::BbrCongestionControl::ProbeBandwidth);
+    EXPECT_NEAR(bbr.GetBandwidth(), rate, 1.0f);
+    EXPECT_NEAR(bbr.GetMinRtt(), rtt, 0.001f);
+    EXPECT_GE(bbr.GetPacingRate(), 0.75f * rate);
+    EXPECT_LE(bbr.GetPacingRate(), 1.25f * rate);
+    EXPECT_NEAR(bbr.GetCongestionWindow(), 2 * bdp, 2000);
+
+    // a round losing a fifth of its packets is a buffer overflowing, the window backs off
+    const int window = bbr.GetCongestionWindow();
+    for (int i = 0; i < 200; i++) {
+        net::DeliverySample sample = {};
+        sample.size = 1000;
+        sample.rate = rate;
+        sample.rtt = rtt;
+        sample.prior_delivered = delivered - bdp;
+        delivered += 1000;
+        sample.delivered = delivered;
+        bbr.OnAcked(&sample, 1, bdp);
+        if (i % 4 == 0) bbr.OnLost(1);
+        bbr.Update(0.001f);
+    }
+    EXPECT_LT(bbr.GetCongestionWindow(), window);
+}
+
+TEST(MessageChannelTest, OrderedChannelHoldsBackUntilGapFills) {
+    net::MessageChannel channel(net::ReliableOrdered);
+    unsigned char message[4] = { 7 };
+    std::vector<unsigned char> out;
+    EXPECT_FALSE(channel.Accept(1, message, 4));
+    EXPECT_FALSE(channel.PopPending(out));
+    EXPECT_TRUE(channel.Accept(0, message, 4));
+    ASSERT_TRUE(channel.PopPending(out));
+    EXPECT_EQ(out.size(), 4u);
+    EXPECT_EQ(out[0], 7);
+    EXPECT_FALSE(channel.Accept(1, message, 4));
+    EXPECT_FALSE(channel.PopPending(out));
+}
+
+TEST(MessageChannelTest, UnorderedChannelDropsDuplicates) {
+    net::MessageChannel channel(net::ReliableUnordered);
+    unsigned char message[4] = { 0 };
+    EXPECT_TRUE(channel.Accept(2, message, 4));
+    EXPECT_TRUE(channel.Accept(0, message, 4));
+    EXPECT_FALSE(channel.Accept(2, message, 4));
+    EXPECT_FALSE(channel.Accept(0, message, 4));
+    EXPECT_TRUE(channel.Accept(1, message, 4));
+    EXPECT_TRUE(channel.Accept(5000, message, 4));
+    EXPECT_TRUE(channel.IsStale(5000));
+    EXPECT_FALSE(channel.IsStale(4999));
+}
+
+TEST(MessageChannelTest, UnreliableChannelDropsStaleMessages) {
+    net::MessageChannel channel(net::Unreliable);
+    unsigned char message[4] = { 0 };
+    EXPECT_TRUE(channel.Accept(5, message, 4));
+    EXPECT_FALSE(channel.Accept(4, message, 4));
+    EXPECT_FALSE(channel.Accept(5, message, 4));
+    EXPECT_TRUE(channel.Accept(9, message, 4));
+}
+
+TEST(FragmentReassemblerTest, ReassemblesOutOfOrderFragments) {
+    net::FragmentReassembler reassembler(4, 8);
+    const unsigned char first[4] = { 1, 2, 3, 4 };
+    const unsigned char last[2] = { 5, 6 };
+    EXPECT_EQ(reassembler.AddFragment(1, 9, 1, 2, last, 2, true), -1);
+    EXPECT_EQ(reassembler.AddFragment(1, 9, 1, 2, last, 2, true), -1);
+    EXPECT_EQ(reassembler.AddFragment(1, 9, 0, 2, first, 3, true), -1);
+    const int slot = reassembler.AddFragment(1, 9, 0, 2, first, 4, true);
+    ASSERT_GE(slot, 0);
+
+    int size = 0;
+    const unsigned char* message = reassembler.GetMessage(slot, size);
+    ASSERT_EQ(size, 6);
+    EXPECT_EQ(message[3], 4);
+    EXPECT_EQ(message[5], 6);
+    reassembler.Release(slot);
+    EXPECT_EQ(reassembler.GetArenaSize(), 2u * 8 * 4);
+}
+
+TEST(FragmentReassemblerTest, EvictsUnreliableMessagesOnly) {
+    net::FragmentReassembler reassembler(4, 8);
+    const unsigned char fragment[4] = { 0 };
+    EXPECT_EQ(reassembler.AddFragment(0, 1, 0, 2, fragment, 4, true), -1);
+    EXPECT_EQ(reassembler.AddFragment(2, 1, 0, 2, fragment, 4, false), -1);
+    EXPECT_EQ(reassembler.AddFragment(1, 1, 0, 2, fragment, 4, true), -1);
+    EXPECT_EQ(reassembler.AddFragment(1, 2, 0, 2, fragment, 4, true), -1);
+    EXPECT_GE(reassembler.AddFragment(1, 1, 1, 2, fragment, 4, true), 0);
+    EXPECT_GE(reassembler.AddFragment(0, 1, 1, 2, fragment, 4, true), 0);
+}
+
+TEST(PacketBufferTest, HeadersArePushedInFrontOfPayload) {
+    net::PacketBuffer packet;
+    unsigned char* payload = packet.GetPayload();
+    payload[0] = 0xAB;
+    packet.SetPayloadSize(1);
+    packet.PushHeader(2)[0] = 0x01;
+    packet.PushHeader(4)[0] = 0x02;
+    EXPECT_EQ(packet.GetSize(), 7);
+    EXPECT_EQ(packet.GetData()[0], 0x02);
+    EXPECT_EQ(packet.GetData()[4], 0x01);
+    EXPECT_EQ(packet.GetData()[6], 0xAB);
+    EXPECT_EQ(packet.GetData() + 6, payload);
+}
+
+TEST(AddressTableTest, FindsPeersThroughChurn) {
+    net::AddressTable table;
+    for (int i = 0; i < 5000; i++)
+        table.Insert(net::Address(10, 0, (unsigned char)(i >> 8), (unsigned char)i, 30001), i);
+    EXPECT_EQ(table.GetCount(), 5000);
+    for (int i = 0; i < 5000; i += 2)
+        EXPECT_TRUE(table.Remove(net::Address(10, 0, (unsigned char)(i >> 8), (unsigned char)i, 30001)));
+    EXPECT_FALSE(table.Remove(net::Address(10, 0, 0, 0, 30001)));
+    EXPECT_EQ(table.GetCount(), 2500);
+    for (int i = 0; i < 5000; i++)
+    {
+        const int found = table.Find(net::Address(10, 0, (unsigned char)(i >> 8), (unsigned char)i, 30001));
+        ASSERT_EQ(found, i % 2 ? i : -1);
+    }
+    EXPECT_EQ(table.Find(net::Address(10, 0, 0, 1, 30002)), -1);
+}
+
+TEST(TimerWheelTest, FiresOnTimeAcrossLevels) {
+    net::TimerWheel wheel(0.001f);
+    std::vector<std::pair<int, double>> fired;
+    const float delays[5] = { 0.005f, 0.090f, 5.0f, 300.0f, 0.050f };
+    net::Timer timers[5];
+    for (int i = 0; i < 5; i++)
+    {
+        timers[i].SetCallback([&fired, &wheel, i] { fired.push_back(std::make_pair(i, wheel.GetTime())); });
+        wheel.Arm(timers[i], delays[i]);
+    }
+    wheel.Arm(timers[4], 0.010f);   // rearmed
+    timers[1].Cancel();
+    EXPECT_EQ(wheel.GetTimerCount(), 4);
+
+    for (int step = 0; step < 400 * 30; step++)
+        wheel.Advance(1.0f / 30.0f);
+    ASSERT_EQ(fired.size(), 4u);
+    EXPECT_EQ(fired[0].first, 0);
+    EXPECT_EQ(fired[1].first, 4);
+    EXPECT_EQ(fired[2].first, 2);
+    EXPECT_EQ(fired[3].first, 3);
+    EXPECT_NEAR(fired[0].second, 0.005, 0.0015);
+    EXPECT_NEAR(fired[2].second, 5.0, 0.002);
+    EXPECT_NEAR(fired[3].second, 300.0, 0.05);
+    EXPECT_EQ(wheel.GetTimerCount(), 0);
+}
+
+TEST(TimerWheelTest, FiresATimerArmedInThePast) {
+    net::TimerWheel wheel(0.001f);
+    wheel.Advance(1.0f);
+    int fired = 0;
+    net::Timer late, now;
+    late.SetCallback([&fired] { fired++; });
+    now.SetCallback([&fired] { fired++; });
+    wheel.Arm(late, -0.25f);
+    wheel.Arm(now, 0.0f);
+    EXPECT_EQ(wheel.GetTimerCount(), 2);
+    wheel.Advance(0.001f);
+    EXPECT_EQ(fired, 2);
+    EXPECT_EQ(wheel.GetTimerCount(), 0);
+}
+
+// runs the handshakes of the clients against the server over loopback,
+// a few rounds of hello, cookie, echo and welcome
+static void Handshake(net::ReliableServer& server, net::ReliableConnection** clients, int count) {
+    for (int round = 0; round < 8; round++)
+    {
+        for (int i = 0; i < count; i++)
+            clients[i]->Update(net::HandshakeInterval);
+        net::wait(0.01f);
+        int peer = -1;
+        const unsigned char* data = nullptr;
+        while (server.ReceivePacket(peer, &data) > 0) {}
+        net::wait(0.01f);
+        unsigned char packet[64];
+        for (int i = 0; i < count; i++)
+            while (clients[i]->ReceivePacket(packet, sizeof(packet)) > 0) {}
+    }
+}
+
+TEST(ReliableServerTest, ServesSeveralClientsOverOneSocket) {
+    ASSERT_TRUE(net::InitializeSockets());
+    net::ReliableServer server(0x11223344, 10.0f, 2);
+    ASSERT_TRUE(server.Start(30100));
+    net::ReliableConnection first(0x11223344, 10.0f), second(0x11223344, 10.0f), third(0x11223344, 10.0f);
+    net::ReliableConnection* clients[3] = { &first, &second, &third };
+    for (int i = 0; i < 3; i++)
+    {
+        ASSERT_TRUE(clients[i]->Start(30101 + i));
+        clients[i]->Connect(net::Address(127, 0, 0, 1, 30100));
+        unsigned char early[1] = { 0 };
+        EXPECT_FALSE(clients[i]->SendPacket(early, 1));
+    }
+    Handshake(server, clients, 2);
+    // the third client finds the server full
+    Handshake(server, clients, 3);
+    EXPECT_TRUE(first.IsConnected());
+    EXPECT_TRUE(second.IsConnected());
+    EXPECT_TRUE(third.IsConnecting());
+    EXPECT_EQ(server.GetPeerCount(), 2);
+
+    for (int i = 0; i < 2; i++)
+    {
+        unsigned char hello[1] = { (unsigned char)i };
+        EXPECT_TRUE(clients[i]->SendPacket(hello, 1));
+    }
+    net::wait(0.05f);
+    int seen[2] = { -1, -1 };
+    int peer = -1;
+    const unsigned char* data = nullptr;
+    int received = 0;
+    while (server.ReceivePacket(peer, &data) == 1)
+    {
+        ASSERT_LT(data[0], 2);
+        seen[data[0]] = peer;
+        received++;
+    }
+    EXPECT_EQ(received, 2);
+    ASSERT_NE(seen[0], seen[1]);
+    EXPECT_EQ(server.GetReliabilitySystem(seen[0]).GetRemoteSequence(), 0u);
+
+    for (int i = 0; i < 2; i++)
+    {
+        net::PacketBuffer reply;
+        reply.GetPayload()[0] = (unsigned char)(10 + i);
+        reply.SetPayloadSize(1);
+        EXPECT_TRUE(server.SendPacket(seen[i], reply));
+    }
+    net::wait(0.05f);
+    for (int i = 0; i < 2; i++)
+    {
+        unsigned char answer[16] = { 0 };
+        EXPECT_EQ(clients[i]->ReceivePacket(answer, sizeof(answer)), 1);
+        EXPECT_EQ(answer[0], 10 + i);
+    }
+
+    // a silent peer times out, its index is free for the next one.
+    // the third client's cookie went stale meanwhile, it is handed a new one
+    server.Update(11.0f);
+    int* dropped = nullptr;
+    int droppedCount = 0;
+    server.GetDisconnected(&dropped, droppedCount);
+    EXPECT_EQ(droppedCount, 2);
+    EXPECT_EQ(server.GetPeerCount(), 0);
+    Handshake(server, clients + 2, 1);
+    ASSERT_TRUE(third.IsConnected());
+    unsigned char again[1] = { 2 };
+    EXPECT_TRUE(third.SendPacket(again, 1));
+    net::wait(0.05f);
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 1);
+    EXPECT_EQ(data[0], 2);
+    EXPECT_TRUE(peer == seen[0] || peer == seen[1]);
+}
+
+TEST(ReliableServerTest, KeepsNoStateBeforeTheCookieComesBack) {
+    ASSERT_TRUE(net::InitializeSockets());
+    const unsigned int protocolId = 0x11223344;
+    net::ReliableServer server(protocolId, 10.0f, 16);
+    ASSERT_TRUE(server.Start(30110));
+    net::Socket attacker, bystander;
+    ASSERT_TRUE(attacker.Open(30111));
+    ASSERT_TRUE(bystander.Open(30112));
+    const net::Address serverAddress(127, 0, 0, 1, 30110);
+
+    // data with the right protocol id, a short hello and a forged echo
+    unsigned char junk[32] = { 0x11, 0x22, 0x33, 0x44, 1, 2, 3 };
+    for (int i = 0; i < 100; i++)
+        attacker.Send(serverAddress, junk, sizeof(junk));
+    unsigned char shortHello[8] = { 0xEE, 0xDD, 0xCC, 0xBB, net::HandshakeHello };
+    attacker.Send(serverAddress, shortHello, sizeof(shortHello));
+    unsigned char forged[net::CookieJar::CookieSize] = { 0 };
+    net::SendHandshake(attacker, serverAddress, protocolId, net::HandshakeEcho, 0, forged);
+    // a real cookie, but handed to the bystander's address
+    net::SendHandshake(bystander, serverAddress, protocolId, net::HandshakeHello, 0, NULL);
+    net::wait(0.05f);
+    int peer = -1;
+    const unsigned char* data = nullptr;
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 0);
+    EXPECT_EQ(server.GetPeerCount(), 0);
+
+    unsigned char packet[net::HandshakeSize + 1];
+    net::Address from;
+    unsigned int id = 0;
+    const unsigned char* cookie = nullptr;
+    int cookies = 0;
+    unsigned char bystanderCookie[net::CookieJar::CookieSize];
+    while (true)
+    {
+        int size = bystander.Receive(from, packet, sizeof(packet));
+        if (size == 0) break;
+        ASSERT_EQ(net::ReadHandshake(packet, size, protocolId, &id, &cookie), net::HandshakeCookie);
+        memcpy(bystanderCookie, cookie, sizeof(bystanderCookie));
+        cookies++;
+    }
+    ASSERT_EQ(cookies, 1);
+    // the attacker got a fresh cookie for its forgery and nothing for the short hello
+    int attackerReplies = 0;
+    while (attacker.Receive(from, packet, sizeof(packet)) > 0)
+        attackerReplies++;
+    EXPECT_EQ(attackerReplies, 1);
+
+    net::SendHandshake(attacker, serverAddress, protocolId, net::HandshakeEcho, 0, bystanderCookie);
+    net::wait(0.05f);
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 0);
+    EXPECT_EQ(server.GetPeerCount(), 0);
+
+    net::SendHandshake(bystander, serverAddress, protocolId, net::HandshakeEcho, 0, bystanderCookie);
+    net::wait(0.05f);
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 0);
+    EXPECT_EQ(server.GetPeerCount(), 1);
+    int size = bystander.Receive(from, packet, sizeof(packet));
+    EXPECT_EQ(net::ReadHandshake(packet, size, protocolId, &id, &cookie), net::HandshakeWelcome);
+    EXPECT_EQ(id, server.GetConnectionId(0));
+
+    // cookies go stale
+    net::CookieJar jar;
+    unsigned char made[net::CookieJar::CookieSize];
+    jar.Make(serverAddress, 100.0, made);
+    EXPECT_TRUE(jar.Check(serverAddress, 105.0, made));
+    EXPECT_FALSE(jar.Check(serverAddress, 100.0 + net::CookieJar::Lifetime + 1, made));
+    EXPECT_FALSE(jar.Check(net::Address(127, 0, 0, 1, 30111), 105.0, made));
+}
+
+static void WriteU32(unsigned char* data, unsigned int value) {
+    data[0] = (unsigned char)(value >> 24);
+    data[1] = (unsigned char)(value >> 16);
+    data[2] = (unsigned char)(value >> 8);
+    data[3] = (unsigned char)value;
+}
+
+TEST(ReliableServerTest, FollowsAPeerRebornOnANewPort) {
+    ASSERT_TRUE(net::InitializeSockets());
+    const unsigned int protocolId = 0x11223344;
+    net::ReliableServer server(protocolId, 10.0f, 4);
+    ASSERT_TRUE(server.Start(30120));
+    net::ReliableConnection client(protocolId, 10.0f);
+    ASSERT_TRUE(client.Start(30121));
+    client.Connect(net::Address(127, 0, 0, 1, 30120));
+    net::ReliableConnection* clients[1] = { &client };
+    Handshake(server, clients, 1);
+    ASSERT_TRUE(client.IsConnected());
+    ASSERT_EQ(server.GetPeerCount(), 1);
+    const unsigned int connectionId = client.GetConnectionId();
+    EXPECT_NE(connectionId, 0u);
+    EXPECT_EQ(server.GetConnectionId(0), connectionId);
+
+    // the client's NAT hands it a new port: the same connection id from another socket
+    net::Socket rebound, impostor;
+    ASSERT_TRUE(rebound.Open(30122));
+    ASSERT_TRUE(impostor.Open(30123));
+    const net::Address serverAddress(127, 0, 0, 1, 30120);
+    unsigned char packet[64] = { 0 };
+    WriteU32(packet, protocolId);
+    WriteU32(packet + 4, connectionId);
+    WriteU32(packet + 8, 0);
+    packet[20] = 42;
+    rebound.Send(serverAddress, packet, 21);
+    // a guessed id is dropped
+    WriteU32(packet + 4, connectionId + 1);
+    impostor.Send(serverAddress, packet, 21);
+    net::wait(0.05f);
+    int peer = -1;
+    const unsigned char* data = nullptr;
+    ASSERT_EQ(server.ReceivePacket(peer, &data), 1);
+    EXPECT_EQ(peer, 0);
+    EXPECT_EQ(data[0], 42);
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 0);
+    EXPECT_EQ(server.GetAddress(0).GetPort(), 30121);
+
+    // replies stay with the old address until the new one answers its challenge
+    net::wait(0.05f);
+    net::Address from;
+    unsigned char challenge[net::HandshakeSize + 1];
+    unsigned int id = 0;
+    const unsigned char* cookie = nullptr;
+    int size = rebound.Receive(from, challenge, sizeof(challenge));
+    ASSERT_EQ(net::ReadHandshake(challenge, size, protocolId, &id, &cookie), net::HandshakeChallenge);
+    EXPECT_EQ(id, connectionId);
+    EXPECT_EQ(impostor.Receive(from, packet, sizeof(packet)), 0);
+    // the cookie is good for the address it went to only
+    net::SendHandshake(impostor, serverAddress, protocolId, net::HandshakeResponse, connectionId, cookie);
+    net::wait(0.05f);
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 0);
+    EXPECT_EQ(server.GetAddress(0).GetPort(), 30121);
+    net::SendHandshake(rebound, serverAddress, protocolId, net::HandshakeResponse, connectionId, cookie);
+    net::wait(0.05f);
+    EXPECT_EQ(server.ReceivePacket(peer, &data), 0);
+    EXPECT_EQ(server.GetAddress(0).GetPort(), 30122);
+    EXPECT_EQ(server.GetPeerCount(), 1);
+
+    net::PacketBuffer reply;
+    reply.GetPayload()[0] = 7;
+    reply.SetPayloadSize(1);
+    EXPECT_TRUE(server.SendPacket(0, reply));
+    net::wait(0.05f);
+    size = rebound.Receive(from, packet, sizeof(packet));
+    ASSERT_EQ(size, server.GetHeaderSize() + 1);
+    EXPECT_EQ(packet[size - 1], 7);
+
+    // the client end answers a challenge from its server with the same cookie
+    unsigned char answer[16];
+    while (client.ReceivePacket(answer, sizeof(answer)) > 0) {}
+    unsigned char made[net::CookieJar::CookieSize];
+    for (int i = 0; i < net::CookieJar::CookieSize; i++) made[i] = (unsigned char)i;
+    net::Socket fakeServer;
+    ASSERT_TRUE(fakeServer.Open(30124));
+    net::ReliableConnection other(protocolId, 10.0f);
+    ASSERT_TRUE(other.Start(30125));
+    other.Connect(net::Address(127, 0, 0, 1, 30124));
+    const net::Address otherAddress(127, 0, 0, 1, 30125);
+    net::SendHandshake(fakeServer, otherAddress, protocolId, net::HandshakeWelcome, 77, NULL);
+    net::wait(0.05f);
+    other.ReceivePacket(answer, sizeof(answer));
+    ASSERT_TRUE(other.IsConnected());
+    EXPECT_EQ(other.GetConnectionId(), 77u);
+    net::SendHandshake(fakeServer, otherAddress, protocolId, net::HandshakeChallenge, 78, made);
+    net::SendHandshake(fakeServer, otherAddress, protocolId, net::HandshakeChallenge, 77, made);
+    net::wait(0.05f);
+    other.ReceivePacket(answer, sizeof(answer));
+    net::wait(0.05f);
+    size = fakeServer.Receive(from, challenge, sizeof(challenge));
+    ASSERT_EQ(net::ReadHandshake(challenge, size, protocolId, &id, &cookie), net::HandshakeResponse);
+    EXPECT_EQ(id, 77u);
+    EXPECT_EQ(memcmp(cookie, made, sizeof(made)), 0);
+    EXPECT_EQ(fakeServer.Receive(from, challenge, sizeof(challenge)), 0);
+}
+
+TEST(ReliableServerTest, ListsOnlyThePeersWithSomethingGoingOn) {
+    ASSERT_TRUE(net::InitializeSockets());
+    net::ReliableServer server(0x11223344, 10.0f, 4);
+    ASSERT_TRUE(server.Start(30130));
+    net::ReliableConnection first(0x11223344, 10.0f), second(0x11223344, 10.0f);
+    net::ReliableConnection* clients[2] = { &first, &second };
+    for (int i = 0; i < 2; i++)
+    {
+        ASSERT_TRUE(clients[i]->Start(30131 + i));
+        clients[i]->Connect(net::Address(127, 0, 0, 1, 30130));
+    }
+    Handshake(server, clients, 2);
+    ASSERT_EQ(server.GetPeerCount(), 2);
+    server.Update(0.0f);
+    int* active = nullptr;
+    int activeCount = 0;
+    server.GetActive(&active, activeCount);
+    EXPECT_EQ(activeCount, 0);
+
+    // the peers heard from are listed until the next update
+    for (int i = 0; i < 2; i++)
+    {
+        unsigned char hello[1] = { (unsigned char)i };
+        EXPECT_TRUE(clients[i]->SendPacket(hello, 1));
+    }
+    net::wait(0.05f);
+    int seen[2] = { -1, -1 };
+    int peer = -1;
+    const unsigned char* data = nullptr;
+    while (server.ReceivePacket(peer, &data) == 1)
+        seen[data[0]] = peer;
+    server.GetActive(&active, activeCount);
+    EXPECT_EQ(activeCount, 2);
+    server.Update(0.1f);
+    server.GetActive(&active, activeCount);
+    EXPECT_EQ(activeCount, 0);
+
+    // a packet the first never acks lists it again once it is given up on, the second stays quiet
+    net::PacketBuffer reply;
+    reply.GetPayload()[0] = 1;
+    reply.SetPayloadSize(1);
+    ASSERT_TRUE(server.SendPacket(seen[0], reply));
+    server.Update(0.1f);
+    server.GetActive(&active, activeCount);
+    EXPECT_EQ(activeCount, 0);
+    for (int step = 0; step < 3 && activeCount == 0; step++)
+    {
+        server.Update(0.1f);
+        server.GetActive(&active, activeCount);
+    }
+    ASSERT_EQ(activeCount, 1);
+    EXPECT_EQ(active[0], seen[0]);
+    unsigned int* lost = nullptr;
+    int lostCount = 0;
+    server.GetReliabilitySystem(seen[0]).GetLost(&lost, lostCount);
+    ASSERT_EQ(lostCount, 1);
+    EXPECT_EQ(lost[0], 0u);
+    server.Update(1.0f);
+    server.GetActive(&active, activeCount);
+    EXPECT_EQ(activeCount, 0);
+}
+
+TEST(ReliableServerTest, CarriesChannelMessagesBothWays) {
+    ASSERT_TRUE(net::InitializeSockets());
+    net::ReliableServer server(0x11223344, 10.0f, 2);
+    ASSERT_TRUE(server.Start(30140));
+    net::ReliableConnection client(0x11223344, 10.0f);
+    net::ReliableConnection* clients[1] = { &client };
+    ASSERT_TRUE(client.Start(30141));
+    client.Connect(net::Address(127, 0, 0, 1, 30140));
+    Handshake(server, clients, 1);
+    ASSERT_TRUE(client.IsConnected());
+
+    // a message on each of the default channels, each arrives on its own
+    for (int channel = 0; channel < net::DefaultChannelCount; channel++)
+    {
+        unsigned char message[1] = { (unsigned char)(channel + 1) };
+        EXPECT_TRUE(client.SendChannelMessage(channel, message, 1));
+    }
+    net::wait(0.05f);
+    int peer = -1;
+    int channel = -1;
+    const unsigned char* data = nullptr;
+    for (int i = 0; i < net::DefaultChannelCount; i++)
+    {
+        ASSERT_EQ(server.ReceiveChannelMessage(peer, channel, &data), 1);
+        EXPECT_EQ(data[0], channel + 1);
+    }
+    EXPECT_EQ(server.ReceiveChannelMessage(peer, channel, &data), 0);
+
+    // the client reads nothing for a while: the control message goes again, the unreliable one is given up on
+    server.Update(0.0f);
+    net::PacketBuffer control;
+    control.GetPayload()[0] = 9;
+    control.SetPayloadSize(1);
+    ASSERT_TRUE(server.SendChannelMessage(peer, net::ControlChannel, control));
+    net::PacketBuffer unreliable;
+    unreliable.GetPayload()[0] = 7;
+    unreliable.SetPayloadSize(1);
+    ASSERT_TRUE(server.SendChannelMessage(peer, net::UnreliableChannel, unreliable));
+    unsigned int* sequences = nullptr;
+    int count = 0;
+    for (int step = 0; step < 10 && count == 0; step++)
+    {
+        server.Update(0.1f);
+        server.GetLostPayloads(peer, &sequences, count);
+    }
+    ASSERT_EQ(count, 1);
+    EXPECT_EQ(sequences[0], 1u);
+
+    // the copy that went again is a duplicate to the client, dropped
+    net::wait(0.05f);
+    ASSERT_EQ(client.ReceiveChannelMessage(channel, &data), 1);
+    EXPECT_EQ(channel, net::ControlChannel);
+    EXPECT_EQ(data[0], 9);
+    ASSERT_EQ(client.ReceiveChannelMessage(channel, &data), 1);
+    EXPECT_EQ(channel, net::UnreliableChannel);
+    EXPECT_EQ(data[0], 7);
+    EXPECT_EQ(client.ReceiveChannelMessage(channel, &data), 0);
+
+    // the ack of the copy is the ack of the message, under the sequence it first went with
+    server.Update(0.0f);
+    unsigned char message[1] = { 4 };
+    EXPECT_TRUE(client.SendChannelMessage(net::BulkChannel, message, 1));
+    net::wait(0.05f);
+    ASSERT_EQ(server.ReceiveChannelMessage(peer, channel, &data), 1);
+    server.GetAckedPayloads(peer, &sequences, count);
+    ASSERT_EQ(count, 1);
+    EXPECT_EQ(sequences[0], 0u);
+}
+
+TEST(ReliableConnectionTest, ReassemblesMessagesOfSeveralMegabytes) {
+    ASSERT_TRUE(net::InitializeSockets());
+    net::ReliableConnection server(0x11223344, 10.0f), client(0x11223344, 10.0f);
+    ASSERT_TRUE(server.Start(30150));
+    ASSERT_TRUE(client.Start(30151));
+    server.Listen();
+    client.Connect(net::Address(127, 0, 0, 1, 30150));
+    const unsigned char* data = nullptr;
+    int channel = -1;
+    for (int round = 0; round < 8 && !client.IsConnected(); round++)
+    {
+        client.Update(net::HandshakeInterval);
+        net::wait(0.01f);
+        while (server.ReceiveChannelMessage(channel, &data) > 0) {}
+        net::wait(0.01f);
+        while (client.ReceiveChannelMessage(channel, &data) > 0) {}
+    }
+    ASSERT_TRUE(client.IsConnected());
+
+    // two large messages, more fragments than the send buffer holds: the server's acks make room for the rest
+    std::vector<unsigned char> first(3 << 20), second(net::ReliableConnection::GetMaxUnfragmentedSize() + 1);
+    for (size_t i = 0; i < first.size(); i++)
+        first[i] = (unsigned char)(i * 31 + (i >> 12));
+    for (size_t i = 0; i < second.size(); i++)
+        second[i] = (unsigned char)(i * 7);
+    EXPECT_FALSE(client.SendChannelMessage(net::ControlChannel, &first[0], net::ReliableConnection::GetMaxMessageSize() + 1));
+    ASSERT_TRUE(client.SendChannelMessage(net::ControlChannel, &first[0], (int)first.size()));
+    ASSERT_TRUE(client.SendChannelMessage(net::ControlChannel, &second[0], (int)second.size()));
+    EXPECT_EQ(client.GetQueuedMessages(), 2);
+    client.SetFragmentsPerUpdate(256);
+
+    std::vector<std::vector<unsigned char> > received;
+    for (int step = 0; step < 4000 && (received.size() < 2 || client.GetQueuedMessages() > 0); step++)
+    {
+        client.Update(0.01f);
+        server.Update(0.01f);
+        int bytes = 0;
+        while ((bytes = server.ReceiveChannelMessage(channel, &data)) > 0)
+        {
+            EXPECT_EQ(channel, net::ControlChannel);
+            received.push_back(std::vector<unsigned char>(data, data + bytes));
+        }
+        const unsigned char ack[1] = { 0 };
+        server.SendChannelMessage(net::UnreliableChannel, ack, 1);
+        while (client.ReceiveChannelMessage(channel, &data) > 0) {}
+    }
+    ASSERT_EQ(received.size(), 2u);
+    EXPECT_TRUE(received[0] == first);
+    EXPECT_TRUE(received[1] == second);
+    EXPECT_EQ(client.GetQueuedMessages(), 0);
+    EXPECT_EQ(client.GetPendingPayloads(), 0);
+}
+
+TEST(Sha256Test, HmacMatchesRfc4231) {
+    const char* key = "Jefe";
+    const char* data = "what do ya want for nothing?";
+    unsigned char mac[Sha256Size];
+    HmacSha256((const unsigned char*)key, strlen(key), (const unsigned char*)data, strlen(data), mac);
+    const unsigned char expected[Sha256Size] = {
+        0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+        0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43 };
+    EXPECT_EQ(memcmp(mac, expected, Sha256Size), 0);
+}
 
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);